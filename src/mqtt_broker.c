@@ -19,6 +19,11 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
  */
 
+/* accept4() is a GNU extension in glibc */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE
+#endif
+
 /* Include the autoconf generated config.h */
 #ifdef HAVE_CONFIG_H
     #include <config.h>
@@ -63,11 +68,16 @@ static void MqttBroker_ForceZero(void* mem, word32 len)
     #include <arpa/inet.h>
     #include <fcntl.h>
     #include <netinet/in.h>
+    #include <poll.h>
     #include <signal.h>
     #include <sys/select.h>
     #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <time.h>
     #include <unistd.h>
+    #ifdef WOLFMQTT_BROKER_EPOLL
+        #include <sys/epoll.h>
+    #endif
 #endif
 
 /* -------------------------------------------------------------------------- */
@@ -131,13 +141,20 @@ typedef char wolfmqtt_broker_time_t_must_be_unsigned[
  * lines (CR/LF) or hijack the operator terminal (ANSI ESC). The result is
  * returned from a small rotating pool of static buffers so several sanitized
  * arguments can appear in one log statement; the broker log path is single
- * threaded (as is PRINTF itself). Output is NUL-terminated and truncated to
- * fit. NULL src yields "(null)". */
+ * threaded (as is PRINTF itself), and each shard thread of a sharded broker
+ * gets its own pool. Output is NUL-terminated and truncated to fit. NULL src
+ * yields "(null)". */
 static const char* BrokerLog_Sanitize(const char* src)
 {
     static const char hex_digits[] = "0123456789abcdef";
+#ifdef WOLFMQTT_BROKER_SHARDS
+    static BROKER_THREAD_LOCAL char pool[BROKER_LOG_SAN_POOL]
+        [BROKER_LOG_SAN_SZ];
+    static BROKER_THREAD_LOCAL int pool_idx = 0;
+#else
     static char pool[BROKER_LOG_SAN_POOL][BROKER_LOG_SAN_SZ];
     static int pool_idx = 0;
+#endif
     char* dst = pool[pool_idx];
     word32 di = 0;
 
@@ -196,6 +213,11 @@ static void BrokerSubs_RemoveByClientId(MqttBroker* broker,
 static void BrokerSubs_RemoveClient(MqttBroker* broker, BrokerClient* bc);
 static void BrokerSubs_EndClientSession(MqttBroker* broker,
     BrokerClient* bc);
+static void* BrokerIdIndex_Next(MqttBroker* broker, byte kind,
+    const char* id, word32 len, word32* step);
+#ifndef WOLFMQTT_STATIC_MEMORY
+static void BrokerSub_SessDetach(BrokerSub** head);
+#endif
 
 /* Buffer size accessors - unify static/dynamic code paths */
 #ifdef WOLFMQTT_STATIC_MEMORY
@@ -224,10 +246,257 @@ static void BrokerSubs_EndClientSession(MqttBroker* broker,
     #define BrokerClient_ClearWill(bc)                  do {} while(0)
     #define BrokerClient_PublishWill(b, bc)             do {} while(0)
     #define BrokerPendingWill_Cancel(b, id)             do {} while(0)
-    #define BrokerPendingWill_Process(b)                (0)
     #define BrokerPendingWill_FreeAll(b)                do {} while(0)
 #endif
 
+/* -------------------------------------------------------------------------- */
+/* Timer wheel                                                                 */
+/* -------------------------------------------------------------------------- */
+#if BROKER_TIMER_BITS * BROKER_TIMER_LEVELS > 30
+    #error "BROKER_TIMER_BITS * BROKER_TIMER_LEVELS must not exceed 30"
+#endif
+
+static void BrokerTimerList_Init(BrokerTimerLink* head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void BrokerTimerList_Append(BrokerTimerLink* head,
+    BrokerTimerLink* link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+/* Move every entry of src to the tail of dst, leaving src empty. */
+static void BrokerTimerList_Splice(BrokerTimerLink* dst, BrokerTimerLink* src)
+{
+    if (src->next == src) {
+        return;
+    }
+    src->next->prev = dst->prev;
+    src->prev->next = dst;
+    dst->prev->next = src->next;
+    dst->prev = src->prev;
+    BrokerTimerList_Init(src);
+}
+
+static void BrokerTimer_Init(MqttBroker* broker)
+{
+    int lvl, i;
+
+    for (lvl = 0; lvl < BROKER_TIMER_LEVELS; lvl++) {
+        for (i = 0; i < BROKER_TIMER_SLOTS; i++) {
+            BrokerTimerList_Init(&broker->timers.slots[lvl][i]);
+        }
+    }
+    BrokerTimerList_Init(&broker->timers.due);
+    broker->timers.count = 0;
+    broker->timers.clock = WOLFMQTT_BROKER_GET_TIME_S();
+    broker->now = broker->timers.clock;
+}
+
+/* Link t into the slot its expiry falls in relative to the wheel clock.
+ * Level L holds deadlines less than SLOTS^(L+1) seconds away, indexed by
+ * bits [BITS*L, BITS*(L+1)) of the expiry, so a slot is only revisited when
+ * the clock reaches it. Anything at or before the clock goes on the due
+ * list for the next BrokerTimer_Advance. */
+static void BrokerTimer_Hash(BrokerTimerWheel* w, BrokerTimer* t)
+{
+    WOLFMQTT_BROKER_TIME_T when = t->expires;
+    WOLFMQTT_BROKER_TIME_T delta;
+    int lvl;
+
+    if (when <= w->clock) {
+        BrokerTimerList_Append(&w->due, &t->link);
+        return;
+    }
+    delta = when - w->clock;
+    for (lvl = 0; lvl < BROKER_TIMER_LEVELS - 1; lvl++) {
+        if (delta < ((WOLFMQTT_BROKER_TIME_T)1 <<
+                (BROKER_TIMER_BITS * (lvl + 1)))) {
+            break;
+        }
+    }
+    if (delta >= ((WOLFMQTT_BROKER_TIME_T)1 <<
+            (BROKER_TIMER_BITS * BROKER_TIMER_LEVELS))) {
+        /* Beyond the wheel's span: park in the farthest top-level slot and
+         * re-hash from there when it cascades. */
+        when = w->clock + ((WOLFMQTT_BROKER_TIME_T)1 <<
+            (BROKER_TIMER_BITS * BROKER_TIMER_LEVELS)) - 1;
+    }
+    BrokerTimerList_Append(&w->slots[lvl][(when >> (BROKER_TIMER_BITS * lvl)) &
+        BROKER_TIMER_MASK], &t->link);
+}
+
+static void BrokerTimer_Cancel(MqttBroker* broker, BrokerTimer* t)
+{
+    if (t == NULL || t->link.next == NULL) {
+        return;
+    }
+    t->link.prev->next = t->link.next;
+    t->link.next->prev = t->link.prev;
+    t->link.next = NULL;
+    t->link.prev = NULL;
+    if (broker != NULL && broker->timers.count > 0) {
+        broker->timers.count--;
+    }
+}
+
+/* (Re)arm t to fire for owner at absolute time expires. */
+static void BrokerTimer_Arm(MqttBroker* broker, BrokerTimer* t, byte kind,
+    void* owner, WOLFMQTT_BROKER_TIME_T expires)
+{
+    BrokerTimer_Cancel(broker, t);
+    t->kind = kind;
+    t->owner = owner;
+    t->expires = expires;
+    BrokerTimer_Hash(&broker->timers, t);
+    broker->timers.count++;
+}
+
+/* Re-arm a fired timer whose owner is not expired at broker->now although
+ * the wheel clock passed its deadline, i.e. the clock stepped back. It is
+ * checked again once the clock passes the wheel clock, without firing on
+ * every Step in between. */
+static void BrokerTimer_Defer(MqttBroker* broker, BrokerTimer* t)
+{
+    BrokerTimer_Arm(broker, t, t->kind, t->owner,
+        (t->expires > broker->timers.clock) ? t->expires :
+            broker->timers.clock + 1);
+}
+
+/* base + delta, saturated instead of wrapping. */
+static WOLFMQTT_BROKER_TIME_T BrokerTimer_After(WOLFMQTT_BROKER_TIME_T base,
+    WOLFMQTT_BROKER_TIME_T delta)
+{
+    WOLFMQTT_BROKER_TIME_T due = base + delta;
+    if (due < base) {
+        due = (WOLFMQTT_BROKER_TIME_T)~(WOLFMQTT_BROKER_TIME_T)0;
+    }
+    return due;
+}
+
+/* Arm the keep-alive deadline (1.5x Keep Alive past last_rx, MQTT spec
+ * 3.1.2.10), or the pre-CONNECT idle deadline until CONNECT is accepted. A
+ * connected client with Keep Alive 0 has none. last_rx moving forward does
+ * not re-arm; BrokerClient_CheckTimeouts re-evaluates when the timer fires. */
+static void BrokerClient_ArmTimeout(MqttBroker* broker, BrokerClient* bc)
+{
+    if (bc->keep_alive_sec > 0) {
+        BrokerTimer_Arm(broker, &bc->timeout_timer, BROKER_TIMER_CLIENT, bc,
+            BrokerTimer_After(bc->last_rx,
+                (WOLFMQTT_BROKER_TIME_T)(bc->keep_alive_sec * 3 / 2) + 1));
+    }
+    else if (!bc->connected) {
+        BrokerTimer_Arm(broker, &bc->timeout_timer, BROKER_TIMER_CLIENT, bc,
+            BrokerTimer_After(bc->last_rx,
+                (WOLFMQTT_BROKER_TIME_T)BROKER_CONNECT_TIMEOUT_SEC + 1));
+    }
+    else {
+        BrokerTimer_Cancel(broker, &bc->timeout_timer);
+    }
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Queue bc for the next Step. A client already queued keeps its place. */
+static void BrokerReady_Push(MqttBroker* broker, BrokerClient* bc)
+{
+    if (bc->on_ready || bc->unlinked) {
+        return;
+    }
+    bc->ready_next = NULL;
+    bc->ready_prev = broker->ready_tail;
+    if (broker->ready_tail != NULL) {
+        broker->ready_tail->ready_next = bc;
+    }
+    else {
+        broker->ready = bc;
+    }
+    broker->ready_tail = bc;
+    bc->ready_step = broker->ready_step;
+    bc->on_ready = 1;
+}
+
+static void BrokerReady_Remove(MqttBroker* broker, BrokerClient* bc)
+{
+    if (!bc->on_ready) {
+        return;
+    }
+    if (bc->ready_prev != NULL) {
+        bc->ready_prev->ready_next = bc->ready_next;
+    }
+    else {
+        broker->ready = bc->ready_next;
+    }
+    if (bc->ready_next != NULL) {
+        bc->ready_next->ready_prev = bc->ready_prev;
+    }
+    else {
+        broker->ready_tail = bc->ready_prev;
+    }
+    bc->ready_next = NULL;
+    bc->ready_prev = NULL;
+    bc->on_ready = 0;
+}
+
+static void BrokerClient_Requeue(BrokerClient* bc);
+
+/* Append to the client list. Step services clients in list order, so
+ * connections admitted in one accept burst are processed in the order they
+ * arrived, as with the static client table. */
+static void BrokerClient_Link(MqttBroker* broker, BrokerClient* bc)
+{
+    bc->next = NULL;
+    bc->prev = broker->clients_tail;
+    if (broker->clients_tail != NULL) {
+        broker->clients_tail->next = bc;
+    }
+    else {
+        broker->clients = bc;
+    }
+    broker->clients_tail = bc;
+}
+
+/* Take bc off the client list. Its next pointer is left intact: a walk that
+ * is positioned on bc (the Step loop, when a packet handler removes the
+ * client it is serving or the one after it) continues from there, skipping
+ * unlinked entries. BrokerClient_Free then parks the memory on clients_reap
+ * instead of releasing it. */
+static void BrokerClient_Unlink(MqttBroker* broker, BrokerClient* bc)
+{
+    if (bc->prev != NULL) {
+        bc->prev->next = bc->next;
+    }
+    else {
+        broker->clients = bc->next;
+    }
+    if (bc->next != NULL) {
+        bc->next->prev = bc->prev;
+    }
+    else {
+        broker->clients_tail = bc->prev;
+    }
+    bc->prev = NULL;
+    bc->unlinked = 1;
+    BrokerReady_Remove(broker, bc);
+}
+
+/* Release the clients removed since the last call. Runs where no client
+ * walk is in progress: the end of MqttBroker_Step and MqttBroker_Free. */
+static void BrokerClient_Reap(MqttBroker* broker)
+{
+    while (broker->clients_reap != NULL) {
+        BrokerClient* bc = broker->clients_reap;
+        broker->clients_reap = bc->prev;
+        WOLFMQTT_FREE(bc);
+    }
+}
+#endif
+
 #ifdef WOLFMQTT_BROKER_AUTH
 /* Constant-time buffer comparison for authentication.
  * Iterates exactly cmp_len times so loop duration is independent of
@@ -691,7 +960,10 @@ static int BrokerPosix_SetNonBlocking(BROKER_SOCKET_T fd)
     return MQTT_CODE_SUCCESS;
 }
 
-static int BrokerPosix_Listen(void* ctx, BROKER_SOCKET_T* sock,
+#ifndef WOLFMQTT_BROKER_IO_URING
+static
+#endif
+int BrokerPosix_Listen(void* ctx, BROKER_SOCKET_T* sock,
     word16 port, int backlog)
 {
     struct sockaddr_in addr;
@@ -705,6 +977,13 @@ static int BrokerPosix_Listen(void* ctx, BROKER_SOCKET_T* sock,
     }
 
     (void)setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#if defined(WOLFMQTT_BROKER_SHARDS) && defined(SO_REUSEPORT)
+    /* Every shard binds its own listener to the port; the kernel balances
+     * incoming connections across them. */
+    if (ctx != NULL && ((MqttBroker*)ctx)->shard != NULL) {
+        (void)setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
+#endif
 
     if (BrokerPosix_SetNonBlocking(fd) != MQTT_CODE_SUCCESS) {
         WBLOG_ERR((MqttBroker*)ctx, "broker: set nonblocking failed (%d)", errno);
@@ -741,17 +1020,27 @@ static int BrokerPosix_Accept(void* ctx, BROKER_SOCKET_T listen_sock,
 #endif
     (void)ctx;
 
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    /* One syscall instead of accept + two fcntl per connection, and no
+     * window where the descriptor is blocking or inheritable. */
+    do {
+        fd = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+#else
     fd = accept(listen_sock, NULL, NULL);
+#endif
     if (fd < 0) {
         if (errno == EWOULDBLOCK || errno == EAGAIN) {
             return MQTT_CODE_CONTINUE;
         }
         return MQTT_CODE_ERROR_NETWORK;
     }
+#if !defined(__linux__) || !defined(SOCK_NONBLOCK) || !defined(SOCK_CLOEXEC)
     if (BrokerPosix_SetNonBlocking(fd) != MQTT_CODE_SUCCESS) {
         close(fd);
         return MQTT_CODE_ERROR_SYSTEM;
     }
+#endif
 #ifdef SO_NOSIGPIPE
     /* macOS / BSDs: suppress SIGPIPE on writes to a peer-closed socket.
      * Without this (and without MSG_NOSIGNAL in send()), a client that
@@ -764,36 +1053,56 @@ static int BrokerPosix_Accept(void* ctx, BROKER_SOCKET_T listen_sock,
     return MQTT_CODE_SUCCESS;
 }
 
+/* Wait up to timeout_ms for sock to become readable/writable. poll() rather
+ * than select() so descriptors >= FD_SETSIZE are handled. Returns
+ * MQTT_CODE_SUCCESS when ready. */
+static int BrokerPosix_WaitSock(BROKER_SOCKET_T sock, short events,
+    int timeout_ms)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = sock;
+    pfd.events = events;
+    pfd.revents = 0;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    if (rc == 0) {
+        return MQTT_CODE_ERROR_TIMEOUT;
+    }
+    if (rc < 0) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
 static int BrokerPosix_Read(void* ctx, BROKER_SOCKET_T sock,
     byte* buf, int buf_len, int timeout_ms)
 {
-    fd_set rfds;
-    struct timeval tv;
     int rc;
 
     if (buf == NULL || buf_len <= 0) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
-    if (sock < 0 || sock >= FD_SETSIZE) {
+    if (sock < 0) {
         return MQTT_CODE_ERROR_NETWORK;
     }
 
-    FD_ZERO(&rfds);
-    FD_SET(sock, &rfds);
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-
-    rc = select(sock + 1, &rfds, NULL, NULL, &tv);
-    if (rc == 0) {
-        return MQTT_CODE_ERROR_TIMEOUT;
-    }
-    if (rc < 0) {
-        return MQTT_CODE_ERROR_NETWORK;
+    /* The socket is non-blocking, so a zero-timeout read (every read the
+     * broker's Step issues) goes straight to recv() and reports EAGAIN as
+     * MQTT_CODE_CONTINUE instead of paying for a readiness syscall first. */
+    if (timeout_ms > 0) {
+        rc = BrokerPosix_WaitSock(sock, POLLIN, timeout_ms);
+        if (rc != MQTT_CODE_SUCCESS) {
+            return rc;
+        }
     }
 
     rc = (int)recv(sock, buf, (size_t)buf_len, 0);
     if (rc <= 0) {
-        if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN ||
+                       errno == EINTR)) {
             return MQTT_CODE_CONTINUE;
         }
         WBLOG_ERR((MqttBroker*)ctx, "broker: recv error sock=%d rc=%d errno=%d",
@@ -806,28 +1115,22 @@ static int BrokerPosix_Read(void* ctx, BROKER_SOCKET_T sock,
 static int BrokerPosix_Write(void* ctx, BROKER_SOCKET_T sock,
     const byte* buf, int buf_len, int timeout_ms)
 {
-    fd_set wfds;
-    struct timeval tv;
     int rc;
 
     if (buf == NULL || buf_len <= 0) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
-    if (sock < 0 || sock >= FD_SETSIZE) {
+    if (sock < 0) {
         return MQTT_CODE_ERROR_NETWORK;
     }
 
-    FD_ZERO(&wfds);
-    FD_SET(sock, &wfds);
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-
-    rc = select(sock + 1, NULL, &wfds, NULL, &tv);
-    if (rc == 0) {
-        return MQTT_CODE_ERROR_TIMEOUT;
-    }
-    if (rc < 0) {
-        return MQTT_CODE_ERROR_NETWORK;
+    /* The broker's own write queue flushes with a zero timeout and keeps
+     * what a full socket refuses, so that send goes straight out. */
+    if (timeout_ms > 0) {
+        rc = BrokerPosix_WaitSock(sock, POLLOUT, timeout_ms);
+        if (rc != MQTT_CODE_SUCCESS) {
+            return rc;
+        }
     }
 
     /* MSG_NOSIGNAL (Linux/BSDs that define it) prevents SIGPIPE delivery when
@@ -851,6 +1154,58 @@ static int BrokerPosix_Write(void* ctx, BROKER_SOCKET_T sock,
     return rc;
 }
 
+/* Gather write for the per-client write queue: one sendmsg for everything
+ * queued, up to BROKER_WQ_IOV_MAX segments. */
+static int BrokerPosix_WriteV(void* ctx, BROKER_SOCKET_T sock,
+    const MqttBrokerIoVec* iov, int iov_cnt, int timeout_ms)
+{
+    struct iovec vec[BROKER_WQ_IOV_MAX];
+    struct msghdr msg;
+    int i;
+    int rc;
+
+    if (iov == NULL || iov_cnt <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (sock < 0) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    if (iov_cnt > BROKER_WQ_IOV_MAX) {
+        iov_cnt = BROKER_WQ_IOV_MAX;
+    }
+    for (i = 0; i < iov_cnt; i++) {
+        vec[i].iov_base = (void*)iov[i].buf;
+        vec[i].iov_len = (size_t)iov[i].len;
+    }
+
+    if (timeout_ms > 0) {
+        rc = BrokerPosix_WaitSock(sock, POLLOUT, timeout_ms);
+        if (rc != MQTT_CODE_SUCCESS) {
+            return rc;
+        }
+    }
+
+    XMEMSET(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iov_cnt;
+    /* SIGPIPE suppression as in BrokerPosix_Write */
+#ifdef MSG_NOSIGNAL
+    rc = (int)sendmsg(sock, &msg, MSG_NOSIGNAL);
+#else
+    rc = (int)sendmsg(sock, &msg, 0);
+#endif
+    if (rc <= 0) {
+        if (rc < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            return MQTT_CODE_CONTINUE;
+        }
+        WBLOG_ERR((MqttBroker*)ctx,
+            "broker: sendmsg error sock=%d rc=%d errno=%d",
+            (int)sock, rc, errno);
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    return rc;
+}
+
 static int BrokerPosix_Close(void* ctx, BROKER_SOCKET_T sock)
 {
     (void)ctx;
@@ -860,68 +1215,308 @@ static int BrokerPosix_Close(void* ctx, BROKER_SOCKET_T sock)
     return MQTT_CODE_SUCCESS;
 }
 
-int MqttBrokerNet_Init(MqttBrokerNet* net)
+/* Readiness backend. ctx is the owning MqttBroker, which holds the epoll
+ * instance or the select() registration table. */
+#ifdef WOLFMQTT_BROKER_EPOLL
+static int BrokerPosix_PollAdd(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
 {
-#ifdef SIGPIPE
-    struct sigaction sa;
-#endif
-    if (net == NULL) {
+    MqttBroker* broker = (MqttBroker*)ctx;
+    struct epoll_event ev;
+
+    if (broker == NULL || sock < 0) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
-#ifdef SIGPIPE
-    /* Backstop the per-send (MSG_NOSIGNAL) and per-socket (SO_NOSIGPIPE)
-     * suppression so a write to a peer-closed socket cannot terminate the
-     * process on platforms that define neither, or if the SO_NOSIGPIPE
-     * setsockopt in BrokerPosix_Accept fails. Only install the ignore when
-     * SIGPIPE is still at its default disposition, so we never clobber a
-     * SIGPIPE handler the embedding application has already chosen. The
-     * targeted mechanisms remain primary so send() still returns EPIPE for
-     * clean client teardown. */
-    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
-        sa.sa_handler = SIG_IGN;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = 0;
-        (void)sigaction(SIGPIPE, &sa, NULL);
+    if (broker->poll_fd < 0) {
+        broker->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (broker->poll_fd < 0) {
+            WBLOG_ERR(broker, "broker: epoll_create1 failed (%d)", errno);
+            return MQTT_CODE_ERROR_SYSTEM;
+        }
+    }
+    XMEMSET(&ev, 0, sizeof(ev));
+    ev.events = ((events & BROKER_NET_EV_READ) ? EPOLLIN : 0) |
+                ((events & BROKER_NET_EV_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = owner;
+    if (epoll_ctl(broker->poll_fd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        WBLOG_ERR(broker, "broker: epoll_ctl add sock=%d failed (%d)",
+            (int)sock, errno);
+        return MQTT_CODE_ERROR_SYSTEM;
     }
-#endif
-    XMEMSET(net, 0, sizeof(*net));
-    net->listen = BrokerPosix_Listen;
-    net->accept = BrokerPosix_Accept;
-    net->read   = BrokerPosix_Read;
-    net->write  = BrokerPosix_Write;
-    net->close  = BrokerPosix_Close;
-    net->ctx    = NULL;
     return MQTT_CODE_SUCCESS;
 }
 
+static int BrokerPosix_PollDel(void* ctx, BROKER_SOCKET_T sock)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
 
+    if (broker == NULL || sock < 0 || broker->poll_fd < 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    /* Non-NULL event argument for pre-2.6.9 kernels. */
+    {
+        struct epoll_event ev;
+        XMEMSET(&ev, 0, sizeof(ev));
+        (void)epoll_ctl(broker->poll_fd, EPOLL_CTL_DEL, sock, &ev);
+    }
+    return MQTT_CODE_SUCCESS;
+}
 
-#endif /* WOLFMQTT_WOLFIP / !WOLFMQTT_BROKER_CUSTOM_NET */
-
-/* -------------------------------------------------------------------------- */
-/* WebSocket server support (libwebsockets)                                    */
-/* -------------------------------------------------------------------------- */
-#ifdef ENABLE_MQTT_WEBSOCKET
-
-#include <libwebsockets.h>
-
-/* Compatibility for older libwebsockets versions (pre-4.1) */
-#ifndef LWS_PROTOCOL_LIST_TERM
-    #define LWS_PROTOCOL_LIST_TERM { NULL, NULL, 0, 0, 0, NULL, 0 }
-#endif
+static int BrokerPosix_PollMod(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    struct epoll_event ev;
 
-/* Forward declaration for the no-op connect callback (defined after WS section) */
-static int BrokerNetConnect(void* context, const char* host, word16 port,
-    int timeout_ms);
+    if (broker == NULL || sock < 0 || broker->poll_fd < 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    XMEMSET(&ev, 0, sizeof(ev));
+    ev.events = ((events & BROKER_NET_EV_READ) ? EPOLLIN : 0) |
+                ((events & BROKER_NET_EV_WRITE) ? EPOLLOUT : 0);
+    ev.data.ptr = owner;
+    if (epoll_ctl(broker->poll_fd, EPOLL_CTL_MOD, sock, &ev) < 0) {
+        WBLOG_ERR(broker, "broker: epoll_ctl mod sock=%d failed (%d)",
+            (int)sock, errno);
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    return MQTT_CODE_SUCCESS;
+}
 
-/* Forward declarations for WS-specific MqttNet callbacks */
-static int BrokerWsNetRead(void* context, byte* buf, int buf_len,
-    int timeout_ms);
-static int BrokerWsNetWrite(void* context, const byte* buf, int buf_len,
-    int timeout_ms);
-static int BrokerWsNetDisconnect(void* context);
+static int BrokerPosix_PollWait(void* ctx, MqttBrokerNetEvent* events,
+    int max_events, int timeout_ms)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    struct epoll_event evs[BROKER_POLL_MAX_EVENTS];
+    int rc;
+    int i;
 
-/* Forward declarations for client management used by lws callback */
+    if (broker == NULL || events == NULL || max_events <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (broker->poll_fd < 0) {
+        return 0;
+    }
+    if (max_events > BROKER_POLL_MAX_EVENTS) {
+        max_events = BROKER_POLL_MAX_EVENTS;
+    }
+    rc = epoll_wait(broker->poll_fd, evs, max_events, timeout_ms);
+    if (rc < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        WBLOG_ERR(broker, "broker: epoll_wait failed (%d)", errno);
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    for (i = 0; i < rc; i++) {
+        events[i].owner = evs[i].data.ptr;
+        events[i].events = 0;
+        /* Errors and hangups surface through the next read or write. */
+        if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            events[i].events |= BROKER_NET_EV_READ;
+        }
+        if (evs[i].events & EPOLLOUT) {
+            events[i].events |= BROKER_NET_EV_WRITE;
+        }
+    }
+    return rc;
+}
+
+static int BrokerPosix_PollFree(void* ctx)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker != NULL && broker->poll_fd >= 0) {
+        close(broker->poll_fd);
+        broker->poll_fd = -1;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+#else
+static int BrokerPosix_PollAdd(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker == NULL || sock < 0 || events == 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (sock >= FD_SETSIZE) {
+        /* select() cannot represent this descriptor. */
+        WBLOG_ERR(broker, "broker: sock=%d exceeds FD_SETSIZE", (int)sock);
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    broker->poll_ev[sock] = events;
+    broker->poll_owner[sock] = owner;
+    if (sock >= broker->poll_nfds) {
+        broker->poll_nfds = sock + 1;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerPosix_PollDel(void* ctx, BROKER_SOCKET_T sock)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker == NULL || sock < 0 || sock >= FD_SETSIZE) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    broker->poll_ev[sock] = 0;
+    broker->poll_owner[sock] = NULL;
+    while (broker->poll_nfds > 0 &&
+            broker->poll_ev[broker->poll_nfds - 1] == 0) {
+        broker->poll_nfds--;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerPosix_PollMod(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker == NULL || sock < 0 || sock >= FD_SETSIZE || events == 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    broker->poll_ev[sock] = events;
+    broker->poll_owner[sock] = owner;
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerPosix_PollWait(void* ctx, MqttBrokerNetEvent* events,
+    int max_events, int timeout_ms)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    fd_set rfds;
+    fd_set wfds;
+    struct timeval tv;
+    int fd;
+    int rc;
+    int n = 0;
+
+    if (broker == NULL || events == NULL || max_events <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    for (fd = 0; fd < broker->poll_nfds; fd++) {
+        if (broker->poll_ev[fd] & BROKER_NET_EV_READ) {
+            FD_SET(fd, &rfds);
+        }
+        if (broker->poll_ev[fd] & BROKER_NET_EV_WRITE) {
+            FD_SET(fd, &wfds);
+        }
+    }
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+    rc = select(broker->poll_nfds, &rfds, &wfds, NULL,
+        (timeout_ms < 0) ? NULL : &tv);
+    if (rc < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        WBLOG_ERR(broker, "broker: select failed (%d)", errno);
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    for (fd = 0; rc > 0 && fd < broker->poll_nfds && n < max_events; fd++) {
+        byte ev = 0;
+        if (FD_ISSET(fd, &rfds)) {
+            ev |= BROKER_NET_EV_READ;
+        }
+        if (FD_ISSET(fd, &wfds)) {
+            ev |= BROKER_NET_EV_WRITE;
+        }
+        if (ev != 0) {
+            events[n].owner = broker->poll_owner[fd];
+            events[n].events = ev;
+            n++;
+        }
+    }
+    return n;
+}
+
+static int BrokerPosix_PollFree(void* ctx)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker != NULL) {
+        XMEMSET(broker->poll_ev, 0, sizeof(broker->poll_ev));
+        XMEMSET(broker->poll_owner, 0, sizeof(broker->poll_owner));
+        broker->poll_nfds = 0;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+#endif /* WOLFMQTT_BROKER_EPOLL */
+
+int MqttBrokerNet_Init(MqttBrokerNet* net)
+{
+#ifdef SIGPIPE
+    struct sigaction sa;
+#endif
+    if (net == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#ifdef SIGPIPE
+    /* Backstop the per-send (MSG_NOSIGNAL) and per-socket (SO_NOSIGPIPE)
+     * suppression so a write to a peer-closed socket cannot terminate the
+     * process on platforms that define neither, or if the SO_NOSIGPIPE
+     * setsockopt in BrokerPosix_Accept fails. Only install the ignore when
+     * SIGPIPE is still at its default disposition, so we never clobber a
+     * SIGPIPE handler the embedding application has already chosen. The
+     * targeted mechanisms remain primary so send() still returns EPIPE for
+     * clean client teardown. */
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) {
+        sa.sa_handler = SIG_IGN;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = 0;
+        (void)sigaction(SIGPIPE, &sa, NULL);
+    }
+#endif
+    XMEMSET(net, 0, sizeof(*net));
+    net->listen = BrokerPosix_Listen;
+    net->accept = BrokerPosix_Accept;
+    net->read   = BrokerPosix_Read;
+    net->write  = BrokerPosix_Write;
+    net->close  = BrokerPosix_Close;
+    net->poll_add  = BrokerPosix_PollAdd;
+    net->poll_del  = BrokerPosix_PollDel;
+    net->poll_wait = BrokerPosix_PollWait;
+    net->poll_free = BrokerPosix_PollFree;
+    net->poll_mod  = BrokerPosix_PollMod;
+    net->writev = BrokerPosix_WriteV;
+    net->ctx    = NULL;
+    return MQTT_CODE_SUCCESS;
+}
+
+
+
+#endif /* WOLFMQTT_WOLFIP / !WOLFMQTT_BROKER_CUSTOM_NET */
+
+/* -------------------------------------------------------------------------- */
+/* WebSocket server support (libwebsockets)                                    */
+/* -------------------------------------------------------------------------- */
+#ifdef ENABLE_MQTT_WEBSOCKET
+
+#include <libwebsockets.h>
+
+/* Compatibility for older libwebsockets versions (pre-4.1) */
+#ifndef LWS_PROTOCOL_LIST_TERM
+    #define LWS_PROTOCOL_LIST_TERM { NULL, NULL, 0, 0, 0, NULL, 0 }
+#endif
+
+/* Forward declaration for the no-op connect callback (defined after WS section) */
+static int BrokerNetConnect(void* context, const char* host, word16 port,
+    int timeout_ms);
+
+/* Forward declarations for WS-specific MqttNet callbacks */
+static int BrokerWsNetRead(void* context, byte* buf, int buf_len,
+    int timeout_ms);
+static int BrokerWsNetWrite(void* context, const byte* buf, int buf_len,
+    int timeout_ms);
+static int BrokerWsNetDisconnect(void* context);
+
+/* Forward declarations for client management used by lws callback */
 static void BrokerSubs_OrphanClient(MqttBroker* broker, BrokerClient* bc);
 static void BrokerClient_Remove(MqttBroker* broker, BrokerClient* bc);
 #ifdef WOLFMQTT_BROKER_WILL
@@ -1018,7 +1613,7 @@ static BrokerClient* BrokerClient_AddWs(MqttBroker* broker, struct lws *wsi)
         bc->broker = broker;
         bc->protocol_level = 0;
         bc->keep_alive_sec = 0;
-        bc->last_rx = WOLFMQTT_BROKER_GET_TIME_S();
+        bc->last_rx = broker->now;
 
         /* Use WS-specific MqttNet callbacks instead of broker->net */
         bc->net.context = bc;
@@ -1042,9 +1637,10 @@ static BrokerClient* BrokerClient_AddWs(MqttBroker* broker, struct lws *wsi)
 
     if (rc == MQTT_CODE_SUCCESS) {
 #ifndef WOLFMQTT_STATIC_MEMORY
-        bc->next = broker->clients;
-        broker->clients = bc;
+        BrokerClient_Link(broker, bc);
+        BrokerClient_Requeue(bc);
 #endif
+        BrokerClient_ArmTimeout(broker, bc);
         WBLOG_INFO(broker, "broker: ws client added (wsi=%p)", (void*)wsi);
     }
     else if (bc != NULL) {
@@ -1434,238 +2030,949 @@ static void BrokerWs_Free(MqttBroker* broker)
 
 #endif /* ENABLE_MQTT_WEBSOCKET */
 
-/* BrokerNextPacketId forward declaration. The body lives in the broker
- * core section below. Used by both the WebSocket branch and the orphan
- * enqueue helpers earlier in the file, so the forward decl is hoisted
- * out of the ENABLE_MQTT_WEBSOCKET guard. */
-static word16 BrokerNextPacketId(MqttBroker* broker);
-
-/* -------------------------------------------------------------------------- */
-/* Per-client MqttNet callbacks (route through MqttBrokerNet)                  */
-/* -------------------------------------------------------------------------- */
-static int BrokerNetConnect(void* context, const char* host, word16 port,
-    int timeout_ms)
-{
-    /* Server side: connection already established via accept() */
-    (void)context;
-    (void)host;
-    (void)port;
-    (void)timeout_ms;
-    return MQTT_CODE_SUCCESS;
-}
-
-static int BrokerNetRead(void* context, byte* buf, int buf_len,
-    int timeout_ms)
-{
-    BrokerClient* bc = (BrokerClient*)context;
-    if (bc == NULL || bc->broker == NULL || buf == NULL || buf_len <= 0) {
-        return MQTT_CODE_ERROR_BAD_ARG;
-    }
-    return bc->broker->net.read(bc->broker->net.ctx, bc->sock,
-        buf, buf_len, timeout_ms);
-}
-
-static int BrokerNetWrite(void* context, const byte* buf, int buf_len,
-    int timeout_ms)
-{
-    BrokerClient* bc = (BrokerClient*)context;
-    if (bc == NULL || bc->broker == NULL || buf == NULL || buf_len <= 0) {
-        return MQTT_CODE_ERROR_BAD_ARG;
-    }
-    return bc->broker->net.write(bc->broker->net.ctx, bc->sock,
-        buf, buf_len, timeout_ms);
-}
-
-static int BrokerNetDisconnect(void* context)
+#ifdef WOLFMQTT_STATIC_MEMORY
+/* Next packet identifier from a client's or persistent session's own
+ * counter, skipping 0. Dynamic memory allocates them through the session's
+ * BrokerPacketIds table instead. */
+static word16 BrokerNextPacketId(word16* next_id)
 {
-    BrokerClient* bc = (BrokerClient*)context;
-    if (bc != NULL && bc->broker != NULL &&
-        bc->sock != BROKER_SOCKET_INVALID) {
-        WBLOG_INFO(bc->broker, "broker: disconnect sock=%d", (int)bc->sock);
-        bc->broker->net.close(bc->broker->net.ctx, bc->sock);
-        bc->sock = BROKER_SOCKET_INVALID;
+    word16 id = *next_id;
+    if (id == 0) {
+        id = 1; /* fresh counter, or wrapped */
     }
-    return MQTT_CODE_SUCCESS;
+    *next_id = (word16)(id + 1);
+    return id;
 }
+#endif
 
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
 /* -------------------------------------------------------------------------- */
-/* Client management                                                           */
-/* -------------------------------------------------------------------------- */
-/* -------------------------------------------------------------------------- */
-/* Inbound QoS 2 dedup state (per [MQTT-4.3.3])                                */
-/*                                                                             */
-/* Track packet IDs for which we've sent PUBREC and are waiting for PUBREL.    */
-/* A duplicate PUBLISH carrying the same packet ID gets PUBREC'd again but     */
-/* must NOT be re-delivered to subscribers. The state is per-client and is    */
-/* cleared on disconnect; surviving across reconnect would require the         */
-/* broader session-state work (see #485/#489/#494).                            */
-/*                                                                             */
-/* The entire QoS 2 inbound state and PUBREL/PUBREC/PUBCOMP handling is        */
-/* compiled out when WOLFMQTT_MAX_QOS < 2. Subscribe-grant capping and         */
-/* inbound-publish QoS rejection cover the corresponding wire paths.           */
+/* v5 Topic Aliases                                                            */
 /* -------------------------------------------------------------------------- */
+static word32 BrokerIdIndex_Hash(const char* id, word32 len);
 
-#if WOLFMQTT_MAX_QOS >= 2
-/* Returns 1 if packet_id is currently awaiting PUBREL, 0 otherwise. */
-static int BrokerInboundQos2_Contains(BrokerClient* bc, word16 packet_id)
-{
 #ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
+    #define BROKER_ALIAS_SET(a)     ((a)->topic[0] != '\0')
 #else
-    BrokerInboundQos2* cur;
+    #define BROKER_ALIAS_SET(a)     ((a)->topic != NULL)
 #endif
 
-    if (bc == NULL || packet_id == 0) {
-        return 0;
-    }
+static void BrokerTopicAlias_Unset(BrokerTopicAlias* a)
+{
 #ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_INBOUND_QOS2; i++) {
-        if (bc->qos2_pending[i] == packet_id) {
-            return 1;
-        }
-    }
+    a->topic[0] = '\0';
 #else
-    cur = bc->qos2_pending;
-    while (cur != NULL) {
-        if (cur->packet_id == packet_id) {
-            return 1;
-        }
-        cur = cur->next;
+    if (a->topic != NULL) {
+        BrokerSlab_Free(a->topic);
+        a->topic = NULL;
     }
 #endif
-    return 0;
 }
 
-/* Add packet_id to the awaiting-PUBREL set. Returns MQTT_CODE_SUCCESS on
- * success, MQTT_CODE_ERROR_OUT_OF_BUFFER if the per-client cap is reached,
- * or MQTT_CODE_ERROR_MEMORY if the underlying allocator fails. Idempotent:
- * a second add of an already-present packet_id is a no-op success. */
-static int BrokerInboundQos2_Add(BrokerClient* bc, word16 packet_id)
+/* Bind slot a to the len bytes at topic. On failure the slot is left
+ * unset, so it can never resolve to the topic it held before. */
+static int BrokerTopicAlias_Set(MqttBroker* broker, BrokerTopicAlias* a,
+    const char* topic, word32 len)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-#else
-    BrokerInboundQos2 *node;
-#endif
+    word32 h = BrokerIdIndex_Hash(topic, len);
 
-    if (bc == NULL || packet_id == 0) {
-        return MQTT_CODE_ERROR_BAD_ARG;
-    }
-    if (BrokerInboundQos2_Contains(bc, packet_id)) {
+    if (BROKER_ALIAS_SET(a) && a->hash == h &&
+            XSTRNCMP(a->topic, topic, len) == 0 && a->topic[len] == '\0') {
         return MQTT_CODE_SUCCESS;
     }
+    BrokerTopicAlias_Unset(a);
 #ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_INBOUND_QOS2; i++) {
-        if (bc->qos2_pending[i] == 0) {
-            bc->qos2_pending[i] = packet_id;
-            return MQTT_CODE_SUCCESS;
-        }
-    }
-    return MQTT_CODE_ERROR_OUT_OF_BUFFER;
-#else
-    /* Enforce the same per-client cap in dynamic-memory builds so a
-     * misbehaving client cannot grow the list to ~65 535 entries. */
-    if (bc->qos2_pending_count >= BROKER_MAX_INBOUND_QOS2) {
+    (void)broker;
+    if (len >= BROKER_MAX_TOPIC_LEN) {
         return MQTT_CODE_ERROR_OUT_OF_BUFFER;
     }
-    node = (BrokerInboundQos2*)WOLFMQTT_MALLOC(sizeof(*node));
-    if (node == NULL) {
+#else
+    a->topic = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        (size_t)len + 1);
+    if (a->topic == NULL) {
         return MQTT_CODE_ERROR_MEMORY;
     }
-    node->packet_id = packet_id;
-    node->next = bc->qos2_pending;
-    bc->qos2_pending = node;
-    bc->qos2_pending_count++;
-    return MQTT_CODE_SUCCESS;
 #endif
+    XMEMCPY(a->topic, topic, len);
+    a->topic[len] = '\0';
+    a->hash = h;
+    return MQTT_CODE_SUCCESS;
 }
 
-/* Remove packet_id from the awaiting-PUBREL set. No-op if not present. */
-static void BrokerInboundQos2_Remove(BrokerClient* bc, word16 packet_id)
+#ifndef WOLFMQTT_STATIC_MEMORY
+static void BrokerTopicAlias_Clear(BrokerClient* bc)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
     int i;
-#else
-    BrokerInboundQos2* prev = NULL;
-    BrokerInboundQos2* cur;
-#endif
 
-    if (bc == NULL || packet_id == 0) {
-        return;
+    for (i = 0; i < BROKER_TOPIC_ALIAS_MAX; i++) {
+        BrokerTopicAlias_Unset(&bc->alias_in[i]);
+        BrokerTopicAlias_Unset(&bc->alias_out[i]);
     }
-#ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_INBOUND_QOS2; i++) {
-        if (bc->qos2_pending[i] == packet_id) {
-            bc->qos2_pending[i] = 0;
-            return;
+}
+#endif
+
+/* Resolve an inbound Topic Alias [MQTT-3.3.2.3.4]: a PUBLISH with a topic
+ * binds the alias to it, one with an empty topic takes the topic the alias
+ * is bound to. The alias property is taken off pub->props so it is not
+ * forwarded. On error *reason is the v5 DISCONNECT reason. */
+static int BrokerTopicAlias_In(BrokerClient* bc, MqttPublish* pub,
+    byte* reason)
+{
+    MqttProp* prev = NULL;
+    MqttProp* prop;
+    BrokerTopicAlias* a;
+    int rc;
+
+    for (prop = pub->props; prop != NULL; prop = prop->next) {
+        if (prop->type == MQTT_PROP_TOPIC_ALIAS) {
+            break;
         }
+        prev = prop;
     }
-#else
-    cur = bc->qos2_pending;
-    while (cur != NULL) {
-        if (cur->packet_id == packet_id) {
-            if (prev == NULL) {
-                bc->qos2_pending = cur->next;
+    if (prop == NULL) {
+        return MQTT_CODE_SUCCESS;
+    }
+    /* 0 and values above the Topic Alias Maximum sent in CONNACK are
+     * invalid */
+    if (prop->data_short == 0 || prop->data_short > BROKER_TOPIC_ALIAS_MAX) {
+        *reason = MQTT_REASON_TOPIC_ALIAS_INVALID;
+        return MQTT_CODE_ERROR_MALFORMED_DATA;
+    }
+    a = &bc->alias_in[prop->data_short - 1];
+    if (pub->topic_name_len > 0) {
+        rc = BrokerTopicAlias_Set(bc->broker, a, pub->topic_name,
+            pub->topic_name_len);
+        if (rc != MQTT_CODE_SUCCESS) {
+            *reason = (rc == MQTT_CODE_ERROR_MEMORY) ?
+                MQTT_REASON_SERVER_BUSY : MQTT_REASON_TOPIC_NAME_INVALID;
+            return rc;
+        }
+    }
+    else if (!BROKER_ALIAS_SET(a)) {
+        /* Alias-only PUBLISH for an alias that was never bound */
+        *reason = MQTT_REASON_PROTOCOL_ERR;
+        return MQTT_CODE_ERROR_MALFORMED_DATA;
+    }
+    else {
+        pub->topic_name = a->topic;
+        pub->topic_name_len = (word16)XSTRLEN(a->topic);
+    }
+    if (prev == NULL) {
+        pub->props = prop->next;
+    }
+    else {
+        prev->next = prop->next;
+    }
+    prop->next = NULL;
+    (void)MqttProps_Free(prop);
+    return MQTT_CODE_SUCCESS;
+}
+
+static void BrokerTopicAlias_Prepend(MqttPublish* pub, MqttProp* alias,
+    int slot)
+{
+    XMEMSET(alias, 0, sizeof(*alias));
+    alias->type = MQTT_PROP_TOPIC_ALIAS;
+    alias->data_short = (word16)(slot + 1);
+    alias->next = pub->props;
+    pub->props = alias;
+}
+
+/* Give an outbound v5 PUBLISH a Topic Alias, using alias as the property
+ * (prepended to pub->props). When the topic already has an alias the topic
+ * is left off the packet. Otherwise a free slot, or the least recently used
+ * one, is unset and sent with the full topic; the caller passes the
+ * returned slot to BrokerTopicAlias_Commit once the packet is written, so a
+ * packet that may not have gone out never leaves a stale binding. Returns
+ * -1 when there is nothing to commit, including when the client takes no
+ * aliases. */
+static int BrokerTopicAlias_Out(BrokerClient* bc, MqttPublish* pub,
+    MqttProp* alias)
+{
+    BrokerTopicAlias* a;
+    word32 len;
+    word32 h;
+    int slot = -1;
+    int i;
+
+    if (bc->alias_out_max == 0 || pub->topic_name == NULL ||
+            pub->protocol_level < MQTT_CONNECT_PROTOCOL_LEVEL_5) {
+        return -1;
+    }
+    len = (word32)XSTRLEN(pub->topic_name);
+#ifdef WOLFMQTT_STATIC_MEMORY
+    if (len >= BROKER_MAX_TOPIC_LEN) {
+        return -1;
+    }
+#endif
+    h = BrokerIdIndex_Hash(pub->topic_name, len);
+    bc->alias_clock++;
+    for (i = 0; i < (int)bc->alias_out_max; i++) {
+        a = &bc->alias_out[i];
+        if (!BROKER_ALIAS_SET(a)) {
+            if (slot < 0 || BROKER_ALIAS_SET(&bc->alias_out[slot])) {
+                slot = i;
             }
-            else {
-                prev->next = cur->next;
+            continue;
+        }
+        if (a->hash == h && XSTRCMP(a->topic, pub->topic_name) == 0) {
+            a->used = bc->alias_clock;
+            pub->topic_name = "";
+            BrokerTopicAlias_Prepend(pub, alias, i);
+            return -1;
+        }
+        if (slot < 0 || (BROKER_ALIAS_SET(&bc->alias_out[slot]) &&
+                (word32)(bc->alias_clock - a->used) >
+                (word32)(bc->alias_clock - bc->alias_out[slot].used))) {
+            slot = i;
+        }
+    }
+    BrokerTopicAlias_Unset(&bc->alias_out[slot]);
+    BrokerTopicAlias_Prepend(pub, alias, slot);
+    return slot;
+}
+
+/* Record the binding sent by BrokerTopicAlias_Out. If the copy cannot be
+ * made the slot stays unset and the next send of topic carries it again. */
+static void BrokerTopicAlias_Commit(BrokerClient* bc, int slot,
+    const char* topic)
+{
+    if (slot >= 0 && BrokerTopicAlias_Set(bc->broker, &bc->alias_out[slot],
+            topic, (word32)XSTRLEN(topic)) == MQTT_CODE_SUCCESS) {
+        bc->alias_out[slot].used = bc->alias_clock;
+    }
+}
+#endif /* WOLFMQTT_BROKER_TOPIC_ALIAS */
+
+/* -------------------------------------------------------------------------- */
+/* Per-client write queue                                                      */
+/* -------------------------------------------------------------------------- */
+static int BrokerNetDisconnect(void* context);
+#ifdef WOLFMQTT_STATIC_MEMORY
+    #define BROKER_WQ_CAP(bc)           ((word32)BROKER_WQ_BUF_SZ)
+    #define BROKER_WQ_COPIED(bc, i)     1
+#else
+    #define BROKER_WQ_CAP(bc)           ((bc)->wq_cap)
+    #define BROKER_WQ_COPIED(bc, i)     ((bc)->wq_ref[i] == NULL)
+#endif
+
+/* Push bc on *head: MqttBroker.wq_dirty, or wq_stalled once blocked */
+static void BrokerWq_Link(BrokerClient** head, BrokerClient* bc)
+{
+    bc->wq_prev = NULL;
+    bc->wq_next = *head;
+    if (*head != NULL) {
+        (*head)->wq_prev = bc;
+    }
+    *head = bc;
+}
+
+static void BrokerWq_Unlink(BrokerClient* bc)
+{
+    if (bc->wq_prev != NULL) {
+        bc->wq_prev->wq_next = bc->wq_next;
+    }
+    else if (bc->broker->wq_dirty == bc) {
+        bc->broker->wq_dirty = bc->wq_next;
+    }
+    else if (bc->broker->wq_stalled == bc) {
+        bc->broker->wq_stalled = bc->wq_next;
+    }
+    if (bc->wq_next != NULL) {
+        bc->wq_next->wq_prev = bc->wq_prev;
+    }
+    bc->wq_next = NULL;
+    bc->wq_prev = NULL;
+}
+
+/* 1 when the readiness backend will report bc writable, so stalled output
+ * waits for that instead of being retried every Step. */
+static int BrokerWq_Polled(const BrokerClient* bc)
+{
+    return bc->poll_registered && bc->broker->net.poll_mod != NULL;
+}
+
+static void BrokerWq_PollMod(BrokerClient* bc, byte events)
+{
+    if (BrokerWq_Polled(bc)) {
+        (void)bc->broker->net.poll_mod(bc->broker->net.ctx, bc->sock,
+            events, bc);
+    }
+}
+
+/* Append a segment of len bytes at buf. The caller has reserved the slot. */
+static void BrokerWq_AddSeg(BrokerClient* bc, const byte* buf, int len)
+{
+    if (bc->wq_iov_cnt == 0 && !bc->wq_blocked) {
+        BrokerWq_Link(&bc->broker->wq_dirty, bc);
+    }
+    bc->wq_iov[bc->wq_iov_cnt].buf = buf;
+    bc->wq_iov[bc->wq_iov_cnt].len = len;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    bc->wq_ref[bc->wq_iov_cnt] = NULL;
+#endif
+    bc->wq_iov_cnt++;
+}
+
+/* Account for len bytes just written at wq_buf + wq_len. Consecutive
+ * packets share one segment. */
+static void BrokerWq_Commit(BrokerClient* bc, int len)
+{
+    int last = bc->wq_iov_cnt - 1;
+
+    if (last >= 0 && BROKER_WQ_COPIED(bc, last) &&
+            bc->wq_iov[last].buf + bc->wq_iov[last].len ==
+            bc->wq_buf + bc->wq_len) {
+        bc->wq_iov[last].len += len;
+    }
+    else {
+        BrokerWq_AddSeg(bc, bc->wq_buf + bc->wq_len, len);
+    }
+    bc->wq_len += (word32)len;
+}
+
+/* Drop the reference segment i holds on the message it was sent from. */
+static void BrokerWq_Release(BrokerClient* bc, int i)
+{
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerMsg* ref = bc->wq_ref[i];
+
+    if (ref != NULL) {
+        bc->wq_ref[i] = NULL;
+        BrokerMsg_Release(ref);
+    }
+#else
+    (void)bc;
+    (void)i;
+#endif
+}
+
+/* Drop the queue: release the pinned out_q entries, scrub the copied bytes
+ * and give back a buffer that grew while the client was stalled. */
+static void BrokerWq_Reset(BrokerClient* bc)
+{
+    int i;
+
+    for (i = 0; i < bc->wq_iov_cnt; i++) {
+        BrokerWq_Release(bc, i);
+    }
+    if (bc->wq_len > 0) {
+        BROKER_FORCE_ZERO(bc->wq_buf, bc->wq_len);
+    }
+    bc->wq_len = 0;
+    bc->wq_iov_cnt = 0;
+    bc->wq_blocked = 0;
+    BrokerWq_Unlink(bc);
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (bc->wq_cap > (word32)BROKER_WQ_BUF_SZ) {
+        byte* buf = (byte*)WOLFMQTT_MALLOC(BROKER_WQ_BUF_SZ);
+        if (buf != NULL) {
+            WOLFMQTT_FREE(bc->wq_buf);
+            bc->wq_buf = buf;
+            bc->wq_cap = BROKER_WQ_BUF_SZ;
+        }
+    }
+#endif
+}
+
+/* The socket took segments [0, sent) and would not take more. Keep the
+ * rest for later: copied bytes are moved to the front of wq_buf so the
+ * space behind them can be reused, and the client stops being read until
+ * the socket reports writable (see BrokerWq_Resume). */
+static void BrokerWq_Park(BrokerClient* bc, int sent)
+{
+    word32 off = 0;
+    int i;
+    int j = 0;
+
+    for (i = 0; i < sent; i++) {
+        BrokerWq_Release(bc, i);
+    }
+    for (i = sent; i < bc->wq_iov_cnt; i++) {
+        MqttBrokerIoVec seg = bc->wq_iov[i];
+        if (BROKER_WQ_COPIED(bc, i)) {
+            if (seg.buf != bc->wq_buf + off) {
+                XMEMMOVE(bc->wq_buf + off, seg.buf, (size_t)seg.len);
             }
-            WOLFMQTT_FREE(cur);
-            if (bc->qos2_pending_count > 0) {
-                bc->qos2_pending_count--;
+            if (j > 0 && BROKER_WQ_COPIED(bc, j - 1) &&
+                    bc->wq_iov[j - 1].buf + bc->wq_iov[j - 1].len ==
+                    bc->wq_buf + off) {
+                bc->wq_iov[j - 1].len += seg.len;
             }
             else {
-                /* This should never happen.
-                 * Count should never be negative. */
-                WBLOG_ERR(bc->broker,
-                    "broker: qos2_pending_count underflow");
+                bc->wq_iov[j].buf = bc->wq_buf + off;
+                bc->wq_iov[j].len = seg.len;
+            #ifndef WOLFMQTT_STATIC_MEMORY
+                bc->wq_ref[j] = NULL;
+            #endif
+                j++;
             }
-            return;
+            off += (word32)seg.len;
         }
-        prev = cur;
-        cur = cur->next;
+    #ifndef WOLFMQTT_STATIC_MEMORY
+        else {
+            bc->wq_iov[j] = seg;
+            bc->wq_ref[j] = bc->wq_ref[i];
+            if (j != i) {
+                bc->wq_ref[i] = NULL;
+            }
+            j++;
+        }
+    #endif
+    }
+    if (off < bc->wq_len) {
+        BROKER_FORCE_ZERO(bc->wq_buf + off, bc->wq_len - off);
     }
+    bc->wq_len = off;
+    bc->wq_iov_cnt = j;
+    if (!bc->wq_blocked) {
+        bc->wq_blocked = 1;
+        BrokerWq_Unlink(bc);
+        BrokerWq_Link(&bc->broker->wq_stalled, bc);
+        BrokerWq_PollMod(bc, BROKER_NET_EV_WRITE);
+    }
+}
+
+/* Output sent in the middle of a Step may acknowledge shadow writes made
+ * earlier in it, so the batch holding them is committed first, unless
+ * persist_commit_ms allows it to stay open a while longer. */
+static void BrokerPersist_OutputBarrier(MqttBroker* broker)
+{
+#ifdef WOLFMQTT_BROKER_PERSIST
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* A worker commits in the background; output never waits for it */
+    if (broker->persist_worker != NULL) {
+        return;
+    }
+    #endif
+    if (broker->persist_batch_open && broker->persist_commit_ms == 0) {
+        (void)BrokerPersist_BatchCommit(broker, BROKER_PERSIST_COMMIT_NOW);
+    }
+#else
+    (void)broker;
 #endif
 }
 
-/* Clear all entries (called on client free / disconnect). */
-static void BrokerInboundQos2_Clear(BrokerClient* bc)
+/* Hand everything queued for bc to the socket without waiting, with the
+ * backend's gather write when it has one. Returns MQTT_CODE_CONTINUE when
+ * the socket filled up and the rest was parked. Otherwise the queue is
+ * empty afterwards: a failed write is logged and left to the read path,
+ * which notices the dead connection on the next Step, as it does for a
+ * failed direct write. */
+static int BrokerWq_Flush(BrokerClient* bc)
 {
+    MqttBroker* broker = bc->broker;
+    MqttBrokerIoVec* iov = bc->wq_iov;
+    int cnt = bc->wq_iov_cnt;
+    int idx = 0;
+    int want;
+    int rc = MQTT_CODE_SUCCESS;
+
+    BrokerPersist_OutputBarrier(broker);
+
+    while (idx < cnt) {
+        if (bc->sock == BROKER_SOCKET_INVALID) {
+            rc = MQTT_CODE_ERROR_NETWORK;
+            break;
+        }
+        if (broker->net.writev != NULL) {
+            int i;
+            want = 0;
+            for (i = idx; i < cnt; i++) {
+                want += iov[i].len;
+            }
+            rc = broker->net.writev(broker->net.ctx, bc->sock, &iov[idx],
+                cnt - idx, 0);
+        }
+        else {
+            want = iov[idx].len;
+            rc = broker->net.write(broker->net.ctx, bc->sock, iov[idx].buf,
+                iov[idx].len, 0);
+        }
+        if (rc == MQTT_CODE_CONTINUE || rc == MQTT_CODE_ERROR_TIMEOUT) {
+            BrokerWq_Park(bc, idx);
+            return MQTT_CODE_CONTINUE;
+        }
+        if (rc <= 0) {
+            WBLOG_ERR(broker, "broker: flush failed sock=%d rc=%d",
+                (int)bc->sock, rc);
+            if (rc == 0) {
+                rc = MQTT_CODE_ERROR_NETWORK;
+            }
+            break;
+        }
+        /* Step over what was sent; a partly sent segment is trimmed in
+         * place so the next call resumes inside it. */
+        if (rc > want) {
+            rc = want;
+        }
+        want -= rc;
+        while (idx < cnt && rc >= iov[idx].len) {
+            rc -= iov[idx].len;
+            idx++;
+        }
+        if (idx < cnt) {
+            iov[idx].buf += rc;
+            iov[idx].len -= rc;
+        }
+        rc = MQTT_CODE_SUCCESS;
+        if (want > 0) {
+            /* A short write means the socket buffer is full */
+            BrokerWq_Park(bc, idx);
+            return MQTT_CODE_CONTINUE;
+        }
+    }
+    BrokerWq_Reset(bc);
+    return rc;
+}
+
 #ifndef WOLFMQTT_STATIC_MEMORY
-    BrokerInboundQos2* cur;
+/* Enlarge wq_buf to hold need bytes, for output piling up behind a stalled
+ * socket. Bounded by BROKER_WQ_MAX_SZ. */
+static int BrokerWq_Grow(BrokerClient* bc, word32 need)
+{
+    word32 cap = bc->wq_cap;
+    byte* buf;
+    int i;
+
+    if (need > (word32)BROKER_WQ_MAX_SZ) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    while (cap < need) {
+        cap *= 2;
+    }
+    if (cap > (word32)BROKER_WQ_MAX_SZ) {
+        cap = BROKER_WQ_MAX_SZ;
+    }
+    buf = (byte*)WOLFMQTT_MALLOC(cap);
+    if (buf == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    if (bc->wq_len > 0) {
+        XMEMCPY(buf, bc->wq_buf, bc->wq_len);
+        BROKER_FORCE_ZERO(bc->wq_buf, bc->wq_len);
+    }
+    for (i = 0; i < bc->wq_iov_cnt; i++) {
+        if (bc->wq_ref[i] == NULL) {
+            bc->wq_iov[i].buf = buf + (bc->wq_iov[i].buf - bc->wq_buf);
+        }
+    }
+    WOLFMQTT_FREE(bc->wq_buf);
+    bc->wq_buf = buf;
+    bc->wq_cap = cap;
+    return MQTT_CODE_SUCCESS;
+}
 #endif
 
-    if (bc == NULL) {
-        return;
+/* Make room for len more bytes in wq_buf and segs more segments, flushing
+ * what is queued when they would not fit. Returns MQTT_CODE_CONTINUE when
+ * the room cannot be made while the client's output is stalled. */
+static int BrokerWq_Reserve(BrokerClient* bc, int len, int segs)
+{
+    int rc;
+
+    if (bc->wq_len + (word32)len <= BROKER_WQ_CAP(bc) &&
+            bc->wq_iov_cnt + segs <= BROKER_WQ_IOV_MAX) {
+        return MQTT_CODE_SUCCESS;
     }
-#ifdef WOLFMQTT_STATIC_MEMORY
-    XMEMSET(bc->qos2_pending, 0, sizeof(bc->qos2_pending));
-#else
-    cur = bc->qos2_pending;
-    while (cur != NULL) {
-        BrokerInboundQos2* next = cur->next;
-        WOLFMQTT_FREE(cur);
-        cur = next;
+    if (!bc->wq_blocked && bc->wq_iov_cnt > 0) {
+        rc = BrokerWq_Flush(bc);
+        if (rc != MQTT_CODE_SUCCESS && rc != MQTT_CODE_CONTINUE) {
+            return rc;
+        }
+        if (bc->wq_len + (word32)len <= BROKER_WQ_CAP(bc) &&
+                bc->wq_iov_cnt + segs <= BROKER_WQ_IOV_MAX) {
+            return MQTT_CODE_SUCCESS;
+        }
+    }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (bc->wq_iov_cnt + segs <= BROKER_WQ_IOV_MAX &&
+            BrokerWq_Grow(bc, bc->wq_len + (word32)len) ==
+            MQTT_CODE_SUCCESS) {
+        return MQTT_CODE_SUCCESS;
     }
-    bc->qos2_pending = NULL;
-    bc->qos2_pending_count = 0;
 #endif
+    return MQTT_CODE_CONTINUE;
 }
 
-/* Returns 1 if the client holds any inbound QoS2 dedup state. */
-static int BrokerInboundQos2_HasPending(const BrokerClient* bc)
+/* MqttNet write for socket clients: copy the packet into the queue. The
+ * whole packet is always taken, so the MQTT layer never sees a partial
+ * write; a client whose stalled output would outgrow the queue is
+ * disconnected instead. */
+static int BrokerWq_Write(BrokerClient* bc, const byte* buf, int buf_len)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-    for (i = 0; i < BROKER_MAX_INBOUND_QOS2; i++) {
-        if (bc->qos2_pending[i] != 0) {
-            return 1;
+    int len = buf_len;
+    int rc;
+
+    if (bc->sock == BROKER_SOCKET_INVALID) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (len > BROKER_WQ_BUF_SZ && !bc->wq_blocked) {
+        /* Too large for wq_buf: send what the socket takes straight from
+         * buf, behind whatever is already queued, and queue the rest. */
+        rc = MQTT_CODE_SUCCESS;
+        if (bc->wq_iov_cnt > 0) {
+            rc = BrokerWq_Flush(bc);
+            if (rc != MQTT_CODE_SUCCESS && rc != MQTT_CODE_CONTINUE) {
+                return rc;
+            }
+        }
+        if (rc == MQTT_CODE_SUCCESS) {
+            BrokerPersist_OutputBarrier(bc->broker);
+            rc = bc->broker->net.write(bc->broker->net.ctx, bc->sock,
+                buf, len, 0);
+            if (rc == len) {
+                return buf_len;
+            }
+            if (rc == MQTT_CODE_CONTINUE || rc == MQTT_CODE_ERROR_TIMEOUT) {
+                rc = 0;
+            }
+            if (rc < 0) {
+                return rc;
+            }
+            buf += rc;
+            len -= rc;
         }
     }
-    return 0;
-#else
-    return (bc->qos2_pending_count > 0);
 #endif
+    rc = BrokerWq_Reserve(bc, len, 1);
+    if (rc != MQTT_CODE_SUCCESS) {
+        if (rc == MQTT_CODE_ERROR_NETWORK) {
+            return rc;
+        }
+        WBLOG_ERR(bc->broker,
+            "broker: write queue overflow sock=%d queued=%u len=%d",
+            (int)bc->sock, (unsigned)bc->wq_len, len);
+        (void)BrokerNetDisconnect(bc);
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    XMEMCPY(bc->wq_buf + bc->wq_len, buf, (size_t)len);
+    BrokerWq_Commit(bc, len);
+    if (len < buf_len && !bc->wq_blocked) {
+        /* The direct write above came up short: the socket is full */
+        BrokerWq_Park(bc, 0);
+    }
+    return buf_len;
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Index of the header template pub is sent with (see BrokerMsg.tmpl), or
+ * -1 when its header is particular to one subscriber and is not shared. */
+static int BrokerMsg_Tmpl(const MqttPublish* pub)
+{
+    int t = (pub->qos > MQTT_QOS_0) ? 1 : 0;
+#ifdef WOLFMQTT_V5
+    if (pub->protocol_level >= MQTT_CONNECT_PROTOCOL_LEVEL_5) {
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        /* A Topic Alias (BrokerTopicAlias_Out puts it first) is per
+         * connection */
+        if (pub->props != NULL &&
+                pub->props->type == MQTT_PROP_TOPIC_ALIAS) {
+            return -1;
+        }
+    #endif
+        t += 2;
+    }
+#endif
+    return t;
+}
+
+/* Set the flags and packet identifier of a header copied from a template.
+ * Templates of one variant differ only in these, so the remaining length
+ * and the topic are already right. */
+static void BrokerMsg_PatchHdr(byte* hdr, const MqttPublish* pub)
+{
+    int pos = 1;
+
+    hdr[0] = (byte)(MQTT_PACKET_TYPE_SET(MQTT_PACKET_TYPE_PUBLISH) |
+        MQTT_PACKET_FLAGS_SET_QOS(pub->qos) |
+        (pub->retain ? MQTT_PACKET_FLAG_RETAIN : 0) |
+        (pub->duplicate ? MQTT_PACKET_FLAG_DUPLICATE : 0));
+    if (pub->qos > MQTT_QOS_0) {
+        while (hdr[pos++] & 0x80) {
+        }
+        pos += MQTT_DATA_LEN_SIZE + (((int)hdr[pos] << 8) | hdr[pos + 1]);
+        hdr[pos] = (byte)(pub->packet_id >> 8);
+        hdr[pos + 1] = (byte)pub->packet_id;
+    }
+}
+
+/* Queue a forwarded PUBLISH without copying its payload: the header is
+ * put in wq_buf and the payload is queued in place from e's message,
+ * which the segment holds a reference to until it is sent. The header is
+ * copied from the message's template when one has been encoded, else
+ * encoded and kept as the template. Returns the packet length, the
+ * encoder's error, MQTT_CODE_CONTINUE when the client's output is stalled
+ * (e stays queued), or MQTT_CODE_ERROR_NETWORK when the connection cannot
+ * be written. */
+static int BrokerWq_PutPublish(BrokerClient* bc, MqttPublish* pub,
+    BrokerOutPub* e)
+{
+    BrokerMsg* msg = e->msg;
+    int t = BrokerMsg_Tmpl(pub);
+    int hdr_len;
+    int rc;
+
+    if (bc->sock == BROKER_SOCKET_INVALID) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    rc = BrokerWq_Reserve(bc, (t < 0) ? 0 : (int)msg->tmpl_len[t], 2);
+    if (rc == MQTT_CODE_SUCCESS && bc->wq_blocked) {
+        rc = MQTT_CODE_CONTINUE;
+    }
+    if (rc != MQTT_CODE_SUCCESS) {
+        return (rc == MQTT_CODE_CONTINUE) ? rc : MQTT_CODE_ERROR_NETWORK;
+    }
+    if (t >= 0 && msg->tmpl[t] != NULL) {
+        hdr_len = (int)msg->tmpl_len[t];
+        XMEMCPY(bc->wq_buf + bc->wq_len, msg->tmpl[t], (size_t)hdr_len);
+        BrokerMsg_PatchHdr(bc->wq_buf + bc->wq_len, pub);
+    }
+    else {
+        hdr_len = MqttEncode_Publish(bc->wq_buf + bc->wq_len,
+            (int)(bc->wq_cap - bc->wq_len), pub, 1);
+        if (hdr_len == MQTT_CODE_ERROR_OUT_OF_BUFFER && bc->wq_len > 0) {
+            rc = BrokerWq_Flush(bc);
+            if (rc != MQTT_CODE_SUCCESS) {
+                return (rc == MQTT_CODE_CONTINUE) ? rc :
+                    MQTT_CODE_ERROR_NETWORK;
+            }
+            hdr_len = MqttEncode_Publish(bc->wq_buf, (int)bc->wq_cap, pub,
+                1);
+        }
+        if (hdr_len <= 0) {
+            return (hdr_len < 0) ? hdr_len : MQTT_CODE_ERROR_OUT_OF_BUFFER;
+        }
+        /* Keep it for the next subscriber; without memory each send just
+         * encodes its own */
+        if (t >= 0) {
+            msg->tmpl[t] = (byte*)BrokerSlab_Alloc(bc->broker,
+                BROKER_SLAB_SIZED, (size_t)hdr_len);
+            if (msg->tmpl[t] != NULL) {
+                XMEMCPY(msg->tmpl[t], bc->wq_buf + bc->wq_len,
+                    (size_t)hdr_len);
+                msg->tmpl_len[t] = (word32)hdr_len;
+            }
+        }
+    }
+    BrokerWq_Commit(bc, hdr_len);
+    if (pub->total_len > 0) {
+        BrokerWq_AddSeg(bc, pub->buffer, (int)pub->total_len);
+        bc->wq_ref[bc->wq_iov_cnt - 1] = msg;
+        msg->refs++;
+    }
+    return hdr_len + (int)pub->total_len;
+}
+#endif /* !WOLFMQTT_STATIC_MEMORY */
+
+/* Called by the Step for a client whose output is stalled. Once the socket
+ * has taken all of it, reading resumes and 1 is returned. */
+static int BrokerWq_Resume(BrokerClient* bc)
+{
+    if (BrokerWq_Polled(bc) && bc->poll_ready == 0) {
+        return 0;
+    }
+    if (BrokerWq_Flush(bc) == MQTT_CODE_CONTINUE) {
+        bc->poll_ready = 0;
+        return 0;
+    }
+    bc->poll_ready &= (byte)~BROKER_NET_EV_WRITE;
+    BrokerWq_PollMod(bc, BROKER_NET_EV_READ);
+    return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Per-client MqttNet callbacks (route through MqttBrokerNet)                  */
+/* -------------------------------------------------------------------------- */
+static int BrokerNetConnect(void* context, const char* host, word16 port,
+    int timeout_ms)
+{
+    /* Server side: connection already established via accept() */
+    (void)context;
+    (void)host;
+    (void)port;
+    (void)timeout_ms;
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerNetRead(void* context, byte* buf, int buf_len,
+    int timeout_ms)
+{
+    BrokerClient* bc = (BrokerClient*)context;
+    if (bc == NULL || bc->broker == NULL || buf == NULL || buf_len <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    /* A blocking read (the TLS handshake) may be waiting for the answer to
+     * output still sitting in the queue, so send that first. */
+    if (timeout_ms > 0 && bc->wq_iov_cnt > 0 && !bc->wq_blocked) {
+        (void)BrokerWq_Flush(bc);
+    }
+    return bc->broker->net.read(bc->broker->net.ctx, bc->sock,
+        buf, buf_len, timeout_ms);
+}
+
+static int BrokerNetWrite(void* context, const byte* buf, int buf_len,
+    int timeout_ms)
+{
+    BrokerClient* bc = (BrokerClient*)context;
+    if (bc == NULL || bc->broker == NULL || buf == NULL || buf_len <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (bc->wq_buf == NULL) {
+        BrokerPersist_OutputBarrier(bc->broker);
+        return bc->broker->net.write(bc->broker->net.ctx, bc->sock,
+            buf, buf_len, timeout_ms);
+    }
+#endif
+    (void)timeout_ms;
+    return BrokerWq_Write(bc, buf, buf_len);
+}
+
+static int BrokerNetDisconnect(void* context)
+{
+    BrokerClient* bc = (BrokerClient*)context;
+    /* Queued output (a refused CONNACK, a DISCONNECT reason code) goes out
+     * ahead of the close, as far as the socket takes it without waiting. */
+    if (bc != NULL && bc->wq_iov_cnt > 0) {
+        if (!bc->wq_blocked) {
+            (void)BrokerWq_Flush(bc);
+        }
+        BrokerWq_Reset(bc);
+    }
+    if (bc != NULL && bc->broker != NULL &&
+        bc->sock != BROKER_SOCKET_INVALID) {
+        WBLOG_INFO(bc->broker, "broker: disconnect sock=%d", (int)bc->sock);
+        if (bc->poll_registered && bc->broker->net.poll_del != NULL) {
+            (void)bc->broker->net.poll_del(bc->broker->net.ctx, bc->sock);
+            bc->poll_registered = 0;
+        }
+        bc->broker->net.close(bc->broker->net.ctx, bc->sock);
+        bc->sock = BROKER_SOCKET_INVALID;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Client management                                                           */
+/* -------------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------- */
+/* Inbound QoS 2 dedup state (per [MQTT-4.3.3])                                */
+/*                                                                             */
+/* Track packet IDs for which we've sent PUBREC and are waiting for PUBREL.    */
+/* A duplicate PUBLISH carrying the same packet ID gets PUBREC'd again but     */
+/* must NOT be re-delivered to subscribers. The state is per-client and is    */
+/* cleared on disconnect; surviving across reconnect would require the         */
+/* broader session-state work (see #485/#489/#494).                            */
+/*                                                                             */
+/* The entire QoS 2 inbound state and PUBREL/PUBREC/PUBCOMP handling is        */
+/* compiled out when WOLFMQTT_MAX_QOS < 2. Subscribe-grant capping and         */
+/* inbound-publish QoS rejection cover the corresponding wire paths.           */
+/* -------------------------------------------------------------------------- */
+
+#if WOLFMQTT_MAX_QOS >= 2
+#define BROKER_QOS2_MASK ((word32)BROKER_INBOUND_QOS2_SLOTS - 1)
+
+/* Slot holding packet_id, or the empty slot ending its probe run. The set
+ * is never full (BROKER_INBOUND_QOS2_SLOTS > BROKER_MAX_INBOUND_QOS2), so
+ * the probe always terminates. */
+static word32 BrokerInboundQos2_Slot(const BrokerInboundQos2* set,
+    word16 packet_id)
+{
+    word32 i = (word32)packet_id & BROKER_QOS2_MASK;
+
+    while (set->slot[i] != 0 && set->slot[i] != packet_id) {
+        i = (i + 1) & BROKER_QOS2_MASK;
+    }
+    return i;
+}
+
+/* Returns 1 if packet_id is currently awaiting PUBREL, 0 otherwise. */
+static int BrokerInboundQos2_Contains(BrokerClient* bc, word16 packet_id)
+{
+    if (bc == NULL || packet_id == 0) {
+        return 0;
+    }
+    return (bc->qos2_pending.slot[BrokerInboundQos2_Slot(&bc->qos2_pending,
+        packet_id)] == packet_id);
+}
+
+/* Add packet_id to the awaiting-PUBREL set. Returns MQTT_CODE_SUCCESS on
+ * success or MQTT_CODE_ERROR_OUT_OF_BUFFER if the per-client cap is
+ * reached. Idempotent: a second add of an already-present packet_id is a
+ * no-op success. */
+static int BrokerInboundQos2_Add(BrokerClient* bc, word16 packet_id)
+{
+    word32 i;
+
+    if (bc == NULL || packet_id == 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    i = BrokerInboundQos2_Slot(&bc->qos2_pending, packet_id);
+    if (bc->qos2_pending.slot[i] == packet_id) {
+        return MQTT_CODE_SUCCESS;
+    }
+    /* The cap keeps a misbehaving client from filling the table (and
+     * lengthening every probe run) with up to 65 535 IDs. */
+    if (bc->qos2_pending.count >= BROKER_MAX_INBOUND_QOS2) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    bc->qos2_pending.slot[i] = packet_id;
+    bc->qos2_pending.count++;
+    return MQTT_CODE_SUCCESS;
+}
+
+/* Remove packet_id from the awaiting-PUBREL set. No-op if not present.
+ * Entries later in the probe run whose home slot is not between the hole
+ * and themselves move back into the hole, so lookups never need
+ * tombstones. */
+static void BrokerInboundQos2_Remove(BrokerClient* bc, word16 packet_id)
+{
+    BrokerInboundQos2* set;
+    word32 hole, i, home;
+
+    if (bc == NULL || packet_id == 0) {
+        return;
+    }
+    set = &bc->qos2_pending;
+    hole = BrokerInboundQos2_Slot(set, packet_id);
+    if (set->slot[hole] != packet_id) {
+        return;
+    }
+    set->slot[hole] = 0;
+    set->count--;
+    i = hole;
+    for (;;) {
+        i = (i + 1) & BROKER_QOS2_MASK;
+        if (set->slot[i] == 0) {
+            break;
+        }
+        home = (word32)set->slot[i] & BROKER_QOS2_MASK;
+        /* Stays put if home lies cyclically in (hole, i] */
+        if (((i - home) & BROKER_QOS2_MASK) <
+                ((i - hole) & BROKER_QOS2_MASK)) {
+            continue;
+        }
+        set->slot[hole] = set->slot[i];
+        set->slot[i] = 0;
+        hole = i;
+    }
+}
+
+/* Clear all entries (called on client free / disconnect). */
+static void BrokerInboundQos2_Clear(BrokerClient* bc)
+{
+    if (bc == NULL) {
+        return;
+    }
+    XMEMSET(&bc->qos2_pending, 0, sizeof(bc->qos2_pending));
+}
+
+/* Returns 1 if the client holds any inbound QoS2 dedup state. */
+static int BrokerInboundQos2_HasPending(const BrokerClient* bc)
+{
+    return (bc->qos2_pending.count > 0);
 }
 
 /* Move the old client's inbound QoS2 dedup state to the new client on a live
@@ -1686,16 +2993,8 @@ static int BrokerInboundQos2_Takeover(BrokerClient* new_bc, BrokerClient* old)
     if (!old_persists || !BrokerInboundQos2_HasPending(old)) {
         return 0;
     }
-#ifdef WOLFMQTT_STATIC_MEMORY
-    XMEMCPY(new_bc->qos2_pending, old->qos2_pending,
-        sizeof(new_bc->qos2_pending));
-    XMEMSET(old->qos2_pending, 0, sizeof(old->qos2_pending));
-#else
-    new_bc->qos2_pending       = old->qos2_pending;
-    new_bc->qos2_pending_count = old->qos2_pending_count;
-    old->qos2_pending          = NULL;
-    old->qos2_pending_count    = 0;
-#endif
+    new_bc->qos2_pending = old->qos2_pending;
+    BrokerInboundQos2_Clear(old);
     return 1;
 }
 #endif /* WOLFMQTT_MAX_QOS >= 2 */
@@ -1720,13 +3019,14 @@ static void BrokerProps_FreeClone(MqttProp* head);
 /* Returns NULL on OOM (never a partial list): a truncated v5 property
  * list would go out on the wire silently short, so any allocation
  * failure frees what was built and fails the whole clone. */
-static MqttProp* BrokerProps_Clone(const MqttProp* src)
+static MqttProp* BrokerProps_Clone(MqttBroker* broker, const MqttProp* src)
 {
     MqttProp* head = NULL;
     MqttProp* tail = NULL;
 
     for (; src != NULL; src = src->next) {
-        MqttProp* dst = (MqttProp*)WOLFMQTT_MALLOC(sizeof(MqttProp));
+        MqttProp* dst = (MqttProp*)BrokerSlab_Alloc(broker, BROKER_SLAB_PROP,
+            sizeof(MqttProp));
         if (dst == NULL) {
             BrokerProps_FreeClone(head);
             return NULL;
@@ -1743,7 +3043,8 @@ static MqttProp* BrokerProps_Clone(const MqttProp* src)
         dst->data_bin.len = 0;
         dst->data_bin.data = NULL;
         if (src->data_str.len > 0 && src->data_str.str != NULL) {
-            dst->data_str.str = (char*)WOLFMQTT_MALLOC(src->data_str.len);
+            dst->data_str.str = (char*)BrokerSlab_Alloc(broker,
+                BROKER_SLAB_SIZED, src->data_str.len);
             if (dst->data_str.str == NULL) {
                 BrokerProps_FreeClone(dst);
                 BrokerProps_FreeClone(head);
@@ -1753,7 +3054,8 @@ static MqttProp* BrokerProps_Clone(const MqttProp* src)
             dst->data_str.len = src->data_str.len;
         }
         if (src->data_str2.len > 0 && src->data_str2.str != NULL) {
-            dst->data_str2.str = (char*)WOLFMQTT_MALLOC(src->data_str2.len);
+            dst->data_str2.str = (char*)BrokerSlab_Alloc(broker,
+                BROKER_SLAB_SIZED, src->data_str2.len);
             if (dst->data_str2.str == NULL) {
                 BrokerProps_FreeClone(dst);
                 BrokerProps_FreeClone(head);
@@ -1764,7 +3066,8 @@ static MqttProp* BrokerProps_Clone(const MqttProp* src)
             dst->data_str2.len = src->data_str2.len;
         }
         if (src->data_bin.len > 0 && src->data_bin.data != NULL) {
-            dst->data_bin.data = (byte*)WOLFMQTT_MALLOC(src->data_bin.len);
+            dst->data_bin.data = (byte*)BrokerSlab_Alloc(broker,
+                BROKER_SLAB_SIZED, src->data_bin.len);
             if (dst->data_bin.data == NULL) {
                 BrokerProps_FreeClone(dst);
                 BrokerProps_FreeClone(head);
@@ -1781,174 +3084,512 @@ static MqttProp* BrokerProps_Clone(const MqttProp* src)
         else {
             tail->next = dst;
         }
-        tail = dst;
+        tail = dst;
+    }
+    return head;
+}
+
+/* Free a property list allocated by BrokerProps_Clone(). */
+static void BrokerProps_FreeClone(MqttProp* head)
+{
+    while (head != NULL) {
+        MqttProp* next = head->next;
+        /* Cloned Correlation Data / User Properties / Content Type can carry
+         * application secrets; scrub before free, matching the queue cleanup. */
+        if (head->data_str.str != NULL) {
+            BROKER_FORCE_ZERO(head->data_str.str, head->data_str.len);
+            BrokerSlab_Free(head->data_str.str);
+        }
+        if (head->data_str2.str != NULL) {
+            BROKER_FORCE_ZERO(head->data_str2.str, head->data_str2.len);
+            BrokerSlab_Free(head->data_str2.str);
+        }
+        if (head->data_bin.data != NULL) {
+            BROKER_FORCE_ZERO(head->data_bin.data, head->data_bin.len);
+            BrokerSlab_Free(head->data_bin.data);
+        }
+        BROKER_FORCE_ZERO(head, sizeof(*head));
+        BrokerSlab_Free(head);
+        head = next;
+    }
+}
+#endif /* WOLFMQTT_V5 */
+
+/* Topic and payload are copied into the same allocation as the header. */
+WOLFMQTT_LOCAL BrokerMsg* BrokerMsg_New(MqttBroker* broker,
+    const char* topic, word32 topic_len, const byte* payload,
+    word32 payload_len)
+{
+    BrokerMsg* msg;
+    byte* p;
+
+    if (topic == NULL) {
+        return NULL;
+    }
+    msg = (BrokerMsg*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        sizeof(BrokerMsg) + topic_len + 1 + payload_len);
+    if (msg == NULL) {
+        return NULL;
+    }
+    XMEMSET(msg, 0, sizeof(*msg));
+    msg->refs = 1;
+    p = (byte*)(msg + 1);
+    msg->topic = (char*)p;
+    XMEMCPY(p, topic, topic_len);
+    p[topic_len] = '\0';
+    p += topic_len + 1;
+    if (payload_len > 0 && payload != NULL) {
+        msg->payload = p;
+        XMEMCPY(p, payload, payload_len);
+        msg->payload_len = payload_len;
+    }
+    return msg;
+}
+
+WOLFMQTT_LOCAL void BrokerMsg_Release(BrokerMsg* msg)
+{
+    int t;
+
+    if (msg == NULL || --msg->refs > 0) {
+        return;
+    }
+#ifdef WOLFMQTT_V5
+    BrokerProps_FreeClone(msg->props);
+#endif
+    for (t = 0; t < BROKER_MSG_TMPL_CNT; t++) {
+        if (msg->tmpl[t] != NULL) {
+            BROKER_FORCE_ZERO(msg->tmpl[t], msg->tmpl_len[t]);
+            BrokerSlab_Free(msg->tmpl[t]);
+        }
+    }
+    BROKER_FORCE_ZERO(msg + 1, XSTRLEN(msg->topic) + 1 + msg->payload_len);
+    BrokerSlab_Free(msg);
+}
+
+/* Message for a PUBLISH about to be queued, with a copy of its v5
+ * properties. NULL on allocation failure: a PUBLISH silently missing its
+ * properties is never queued. */
+static BrokerMsg* BrokerMsg_NewPublish(MqttBroker* broker, const char* topic,
+    const byte* payload, word32 payload_len
+#ifdef WOLFMQTT_V5
+    , const MqttProp* src_props
+#endif
+    )
+{
+    BrokerMsg* msg;
+
+    if (topic == NULL) {
+        return NULL;
+    }
+    msg = BrokerMsg_New(broker, topic, (word32)XSTRLEN(topic), payload,
+        payload_len);
+#ifdef WOLFMQTT_V5
+    if (msg != NULL && src_props != NULL) {
+        msg->props = BrokerProps_Clone(broker, src_props);
+        if (msg->props == NULL) {
+            BrokerMsg_Release(msg);
+            msg = NULL;
+        }
+    }
+#endif
+    return msg;
+}
+
+/* The message a fan-out shares between its queue entries, created on first
+ * use so the PUBLISH is copied once however many subscribers it reaches.
+ * The fan-out releases *msg when it is done. NULL on allocation failure. */
+static BrokerMsg* BrokerMsg_Share(MqttBroker* broker, BrokerMsg** msg,
+    const char* topic, const byte* payload, word32 payload_len
+#ifdef WOLFMQTT_V5
+    , const MqttProp* src_props
+#endif
+    )
+{
+    if (*msg == NULL) {
+        *msg = BrokerMsg_NewPublish(broker, topic, payload, payload_len
+        #ifdef WOLFMQTT_V5
+            , src_props
+        #endif
+            );
+    }
+    return *msg;
+}
+
+/* The session's packet identifier table, allocated on first use. */
+static BrokerPacketIds* BrokerPacketIds_Get(MqttBroker* broker,
+    BrokerPacketIds** ids)
+{
+    if (*ids == NULL) {
+        *ids = (BrokerPacketIds*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+            sizeof(BrokerPacketIds));
+        if (*ids != NULL) {
+            XMEMSET(*ids, 0, sizeof(BrokerPacketIds));
+            (*ids)->next_id = 1;
+        }
     }
-    return head;
+    return *ids;
 }
 
-/* Free a property list allocated by BrokerProps_Clone(). */
-static void BrokerProps_FreeClone(MqttProp* head)
+/* Give e the session's next free packet identifier and index it. Fails with
+ * MQTT_CODE_ERROR_PACKET_ID when every slot holds an unfinished delivery,
+ * or MQTT_CODE_ERROR_MEMORY when the table cannot be allocated. */
+static int BrokerPacketIds_Assign(MqttBroker* broker, BrokerPacketIds** ids,
+    BrokerOutPub* e)
 {
-    while (head != NULL) {
-        MqttProp* next = head->next;
-        /* Cloned Correlation Data / User Properties / Content Type can carry
-         * application secrets; scrub before free, matching the queue cleanup. */
-        if (head->data_str.str != NULL) {
-            BROKER_FORCE_ZERO(head->data_str.str, head->data_str.len);
-            WOLFMQTT_FREE(head->data_str.str);
-        }
-        if (head->data_str2.str != NULL) {
-            BROKER_FORCE_ZERO(head->data_str2.str, head->data_str2.len);
-            WOLFMQTT_FREE(head->data_str2.str);
-        }
-        if (head->data_bin.data != NULL) {
-            BROKER_FORCE_ZERO(head->data_bin.data, head->data_bin.len);
-            WOLFMQTT_FREE(head->data_bin.data);
+    BrokerPacketIds* t = BrokerPacketIds_Get(broker, ids);
+    word16 id;
+
+    if (t == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    if (t->count >= BROKER_PACKET_ID_SLOTS) {
+        return MQTT_CODE_ERROR_PACKET_ID;
+    }
+    do {
+        id = t->next_id++;
+        if (t->next_id == 0) {
+            t->next_id = 1; /* wrap: skip 0 */
+        }
+    } while (t->slot[id % BROKER_PACKET_ID_SLOTS] != NULL);
+    e->packet_id = id;
+    t->slot[id % BROKER_PACKET_ID_SLOTS] = e;
+    t->count++;
+    return MQTT_CODE_SUCCESS;
+}
+
+/* Index e under the packet identifier it already carries */
+static int BrokerPacketIds_Add(MqttBroker* broker, BrokerPacketIds** ids,
+    BrokerOutPub* e)
+{
+    BrokerPacketIds* t = BrokerPacketIds_Get(broker, ids);
+    word16 id = e->packet_id;
+
+    if (t == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    if (id == 0 || t->slot[id % BROKER_PACKET_ID_SLOTS] != NULL) {
+        return MQTT_CODE_ERROR_PACKET_ID;
+    }
+    t->slot[id % BROKER_PACKET_ID_SLOTS] = e;
+    t->count++;
+    /* Hand out later identifiers after it, keeping them ascending */
+    if (id >= t->next_id) {
+        t->next_id = (word16)(id + 1);
+        if (t->next_id == 0) {
+            t->next_id = 1;
         }
-        BROKER_FORCE_ZERO(head, sizeof(*head));
-        WOLFMQTT_FREE(head);
-        head = next;
     }
+    return MQTT_CODE_SUCCESS;
 }
-#endif /* WOLFMQTT_V5 */
 
-/* Free a single queue entry (topic, payload, props, the entry itself). */
-static void BrokerOutPub_Free(BrokerOutPub* e)
+static BrokerOutPub* BrokerPacketIds_Find(const BrokerPacketIds* ids,
+    word16 packet_id)
 {
-    if (e == NULL) {
+    BrokerOutPub* e;
+
+    if (ids == NULL || packet_id == 0) {
+        return NULL;
+    }
+    e = ids->slot[packet_id % BROKER_PACKET_ID_SLOTS];
+    return (e != NULL && e->packet_id == packet_id) ? e : NULL;
+}
+
+static void BrokerPacketIds_Remove(BrokerPacketIds* ids,
+    const BrokerOutPub* e)
+{
+    word32 i;
+
+    if (ids == NULL || e->packet_id == 0) {
         return;
     }
-    if (e->topic != NULL) {
-        BROKER_FORCE_ZERO(e->topic, XSTRLEN(e->topic) + 1);
-        WOLFMQTT_FREE(e->topic);
-        e->topic = NULL;
+    i = e->packet_id % BROKER_PACKET_ID_SLOTS;
+    if (ids->slot[i] == e) {
+        ids->slot[i] = NULL;
+        ids->count--;
+    }
+}
+
+/* Make room for one more entry at q's tail. A full ring is rebuilt with
+ * its live entries packed from head on: in place when holes make up at
+ * least half of it, else into a ring twice the size. ids slots and the
+ * unsent cursor follow the moved entries. */
+static int BrokerOutQ_Reserve(MqttBroker* broker, BrokerOutQ* q,
+    BrokerPacketIds* ids)
+{
+    BrokerOutPub* ring = q->ring;
+    BrokerOutPub* e;
+    BrokerOutPub* d;
+    word32 cap = q->cap;
+    word32 live = 0;
+    word32 unsent;
+    word32 pos;
+    word32 w;
+
+    if (q->tail - q->head < cap) {
+        return MQTT_CODE_SUCCESS;
     }
-    if (e->payload != NULL) {
-        BROKER_FORCE_ZERO(e->payload, e->payload_len);
-        WOLFMQTT_FREE(e->payload);
-        e->payload = NULL;
+    for (pos = q->head; pos != q->tail; pos++) {
+        if (BROKER_OUTQ_AT(q, pos)->msg != NULL) {
+            live++;
+        }
     }
-#ifdef WOLFMQTT_V5
-    if (e->props != NULL) {
-        BrokerProps_FreeClone(e->props);
-        e->props = NULL;
+    if (cap == 0 || live * 2 > cap) {
+        cap = (cap == 0) ? BROKER_OUTQ_INIT_SLOTS : cap * 2;
+        ring = (BrokerOutPub*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+            (size_t)cap * sizeof(BrokerOutPub));
+        if (ring == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
     }
-#endif
-    WOLFMQTT_FREE(e);
+    /* Forward copy: the write position never passes the read position */
+    w = q->head;
+    unsent = q->tail;
+    for (pos = q->head; pos != q->tail; pos++) {
+        e = BROKER_OUTQ_AT(q, pos);
+        if (pos == q->unsent) {
+            unsent = w;
+        }
+        if (e->msg == NULL) {
+            continue;
+        }
+        d = &ring[w & (cap - 1)];
+        if (d != e) {
+            *d = *e;
+        }
+        if (d->packet_id != 0 && ids != NULL) {
+            ids->slot[d->packet_id % BROKER_PACKET_ID_SLOTS] = d;
+        }
+        w++;
+    }
+    if (q->unsent == q->tail) {
+        unsent = w;
+    }
+    if (ring != q->ring) {
+        BrokerSlab_Free(q->ring);
+        q->ring = ring;
+        q->cap = cap;
+    }
+    q->tail = w;
+    q->unsent = unsent;
+    return MQTT_CODE_SUCCESS;
 }
 
-/* Allocate a new entry holding a deep copy of topic + payload (+ props if
- * src_props is non-NULL). Returns NULL on allocation failure (caller
- * decides whether that means drop or close). Fields are zero-initialized;
- * caller fills qos / packet_id / etc. and links into out_q. */
-static BrokerOutPub* BrokerOutPub_Alloc(const char* topic,
-    const byte* payload, word32 payload_len
-#ifdef WOLFMQTT_V5
-    , const MqttProp* src_props
-#endif
-    )
+/* Add a QUEUED entry for msg at q's tail, giving a QoS 1/2 entry the
+ * session's next packet identifier. On success *out is the entry, which
+ * holds its own reference to msg; on failure q is unchanged. */
+static int BrokerOutQ_Push(MqttBroker* broker, BrokerOutQ* q,
+    BrokerPacketIds** ids, BrokerMsg* msg, MqttQoS qos, BrokerOutPub** out)
 {
     BrokerOutPub* e;
-    size_t topic_len;
+    int rc;
 
-    if (topic == NULL) {
-        return NULL;
+    if (msg == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
     }
-    topic_len = XSTRLEN(topic);
-
-    e = (BrokerOutPub*)WOLFMQTT_MALLOC(sizeof(BrokerOutPub));
-    if (e == NULL) {
-        return NULL;
+    rc = BrokerOutQ_Reserve(broker, q, *ids);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
     }
+    e = BROKER_OUTQ_AT(q, q->tail);
     XMEMSET(e, 0, sizeof(*e));
+    e->qos = qos;
+    if (qos > MQTT_QOS_0) {
+        rc = BrokerPacketIds_Assign(broker, ids, e);
+        if (rc != MQTT_CODE_SUCCESS) {
+            return rc;
+        }
+    }
+    e->msg = msg;
+    msg->refs++;
+    q->tail++;
+    *out = e;
+    return MQTT_CODE_SUCCESS;
+}
 
-    e->topic = (char*)WOLFMQTT_MALLOC(topic_len + 1);
-    if (e->topic == NULL) {
-        BrokerOutPub_Free(e);
-        return NULL;
+WOLFMQTT_LOCAL int BrokerOutQ_Insert(MqttBroker* broker, BrokerOutQ* q,
+    BrokerPacketIds** ids, const BrokerOutPub* e, word32 n,
+    BrokerOutPub** out)
+{
+    BrokerPacketIds* t = BrokerPacketIds_Get(broker, ids);
+    BrokerOutPub* d;
+    word32 span = q->tail - q->head;
+    word32 live = 0;
+    word32 pos;
+    int rc;
+
+    if (t == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    if (e->msg == NULL || n > span) {
+        return MQTT_CODE_ERROR_PACKET_ID;
+    }
+    if (e->packet_id == 0 ? t->count >= BROKER_PACKET_ID_SLOTS :
+            t->slot[e->packet_id % BROKER_PACKET_ID_SLOTS] != NULL) {
+        return MQTT_CODE_ERROR_PACKET_ID;
     }
-    XMEMCPY(e->topic, topic, topic_len);
-    e->topic[topic_len] = '\0';
+    /* A full ring is packed by Reserve, which moves the entries after any
+     * hole; n then becomes the count of live entries ahead of it */
+    if (span == q->cap) {
+        for (pos = q->head; pos != q->head + n; pos++) {
+            if (BROKER_OUTQ_AT(q, pos)->msg != NULL) {
+                live++;
+            }
+        }
+    }
+    rc = BrokerOutQ_Reserve(broker, q, t);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
+    }
+    if (q->tail - q->head != span) {
+        n = live;
+    }
+    for (pos = q->tail; pos != q->head + n; pos--) {
+        d = BROKER_OUTQ_AT(q, pos);
+        *d = *BROKER_OUTQ_AT(q, pos - 1);
+        if (d->msg != NULL && d->packet_id != 0) {
+            t->slot[d->packet_id % BROKER_PACKET_ID_SLOTS] = d;
+        }
+    }
+    d = BROKER_OUTQ_AT(q, pos);
+    *d = *e;
+    d->msg->refs++;
+    q->tail++;
+    q->unsent = q->head; /* drain rescans the rebuilt queue */
+    if (out != NULL) {
+        *out = d;
+    }
+    /* Neither can fail now: the table exists and the slot was checked */
+    if (e->packet_id == 0) {
+        return BrokerPacketIds_Assign(broker, ids, d);
+    }
+    return BrokerPacketIds_Add(broker, ids, d);
+}
 
-    if (payload_len > 0 && payload != NULL) {
-        e->payload = (byte*)WOLFMQTT_MALLOC(payload_len);
-        if (e->payload == NULL) {
-            BrokerOutPub_Free(e);
-            return NULL;
+/* Complete e: drop its packet identifier and message reference and leave
+ * a hole, then trim holes off both ends of the ring. An emptied ring that
+ * had grown is freed. The caller updates the queue counts. */
+static void BrokerOutQ_Remove(BrokerOutQ* q, BrokerPacketIds* ids,
+    BrokerOutPub* e)
+{
+    BrokerPacketIds_Remove(ids, e);
+    BrokerMsg_Release(e->msg);
+    e->msg = NULL;
+    while (q->head != q->tail && BROKER_OUTQ_AT(q, q->head)->msg == NULL) {
+        if (q->unsent == q->head) {
+            q->unsent++;
         }
-        XMEMCPY(e->payload, payload, payload_len);
-        e->payload_len = payload_len;
+        q->head++;
     }
-#ifdef WOLFMQTT_V5
-    if (src_props != NULL) {
-        e->props = BrokerProps_Clone(src_props);
-        if (e->props == NULL) {
-            /* Clone failed (OOM): drop the whole entry rather than
-             * queue a PUBLISH silently missing its v5 properties. */
-            BrokerOutPub_Free(e);
-            return NULL;
+    while (q->tail != q->head &&
+            BROKER_OUTQ_AT(q, q->tail - 1)->msg == NULL) {
+        if (q->unsent == q->tail) {
+            q->unsent--;
         }
+        q->tail--;
+    }
+    if (q->head == q->tail && q->cap > BROKER_OUTQ_INIT_SLOTS) {
+        BrokerSlab_Free(q->ring);
+        XMEMSET(q, 0, sizeof(*q));
     }
-#endif
-    return e;
 }
 
-/* Append e to the subscriber's out_q tail. Caller is responsible for
- * counting against any caps before allocation. */
-static void BrokerClient_EnqueueOutPub(BrokerClient* bc, BrokerOutPub* e)
+/* Drop every entry's message reference and free the ring. */
+static void BrokerOutQ_Free(BrokerOutQ* q)
 {
-    if (bc == NULL || e == NULL) {
-        return;
+    word32 pos;
+
+    for (pos = q->head; pos != q->tail; pos++) {
+        BrokerMsg_Release(BROKER_OUTQ_AT(q, pos)->msg);
     }
-    e->next = NULL;
-    if (bc->out_q_tail == NULL) {
-        bc->out_q_head = e;
-        bc->out_q_tail = e;
+    BrokerSlab_Free(q->ring);
+    XMEMSET(q, 0, sizeof(*q));
+}
+
+/* Nonzero when bc cannot take another out_q entry at this QoS: the queue
+ * is at BROKER_MAX_QUEUED_MSGS_PER_SUB, or a QoS 1/2 entry would find
+ * every packet identifier in use. */
+static int BrokerClient_OutQFull(const BrokerClient* bc, MqttQoS qos)
+{
+    return bc->out_q_count >= BROKER_MAX_QUEUED_MSGS_PER_SUB ||
+        (qos > MQTT_QOS_0 && bc->packet_ids != NULL &&
+         bc->packet_ids->count >= BROKER_PACKET_ID_SLOTS);
+}
+
+/* Queue msg for the subscriber at its out_q tail, giving a QoS 1/2 entry a
+ * packet identifier from the client's space. The entry takes its own
+ * reference to msg; a NULL msg (failed allocation) fails with
+ * MQTT_CODE_ERROR_MEMORY. Caller is responsible for counting against any
+ * caps first. */
+static int BrokerClient_EnqueueOutPub(BrokerClient* bc, BrokerMsg* msg,
+    MqttQoS qos, byte retain)
+{
+    BrokerOutPub* e;
+    int rc;
+
+    if (bc == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
     }
-    else {
-        bc->out_q_tail->next = e;
-        bc->out_q_tail = e;
+    rc = BrokerOutQ_Push(bc->broker, &bc->out_q, &bc->packet_ids, msg, qos,
+        &e);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
     }
+    e->retain = retain;
+    e->state = BROKER_OUTQ_QUEUED;
+    e->protocol_level = bc->protocol_level;
     bc->out_q_count++;
+    return MQTT_CODE_SUCCESS;
 }
 
-/* Walk out_q and free every entry. Called from BrokerClient_Free. */
+/* Free out_q and every entry. Called from BrokerClient_Free. */
 static void BrokerClient_FreeOutQueue(BrokerClient* bc)
 {
-    BrokerOutPub* cur;
-
     if (bc == NULL) {
         return;
     }
-    cur = bc->out_q_head;
-    while (cur != NULL) {
-        BrokerOutPub* next = cur->next;
-        BrokerOutPub_Free(cur);
-        cur = next;
-    }
-    bc->out_q_head = NULL;
-    bc->out_q_tail = NULL;
+    BrokerOutQ_Free(&bc->out_q);
     bc->out_q_count = 0;
     bc->out_q_inflight = 0;
+    BrokerSlab_Free(bc->packet_ids);
+    bc->packet_ids = NULL;
+}
+
+/* Remove the entry from out_q; decrement inflight if it was counted. */
+static void BrokerClient_RemoveOutPub(BrokerClient* bc, BrokerOutPub* e)
+{
+    if (bc == NULL || e == NULL) {
+        return;
+    }
+    if (e->state == BROKER_OUTQ_PUBLISH_SENT ||
+        e->state == BROKER_OUTQ_PUBREL_SENT) {
+        if (bc->out_q_inflight > 0) {
+            bc->out_q_inflight--;
+        }
+    }
+    bc->out_q_count--;
+    BrokerOutQ_Remove(&bc->out_q, bc->packet_ids, e);
 }
 
 /* Send as many QUEUED entries from out_q as the inflight cap allows.
  *
- * Ordering: walks from out_q_head, never reorders. Already-sent entries
- * (state != QUEUED) are stepped over - their PUBLISH already hit the
- * wire in publish order. The cap stops the drain at the first QUEUED
+ * Ordering: walks from the unsent cursor, never reorders. Entries before
+ * it already hit the wire in publish order; already-sent entries after it
+ * (only after a session resume resets the cursor) are stepped over. The
+ * cap stops the drain at the first QUEUED
  * QoS>0 entry that would exceed BROKER_MAX_INFLIGHT_PER_SUB (or the v5
  * client's Receive Maximum, whichever is smaller). [MQTT-4.6.0-3] is
  * preserved: even a QUEUED QoS 0 behind a capped QoS>0 stays put. */
 static void BrokerClient_DrainOutQueue(BrokerClient* bc)
 {
+    BrokerOutQ* q;
     BrokerOutPub* cur;
-    BrokerOutPub* prev;
     int effective_cap;
 
-    if (bc == NULL || bc->out_q_head == NULL || bc->connack_pending_len != 0) {
+    if (bc == NULL || bc->out_q_count == 0 || bc->connack_pending_len != 0 ||
+            bc->wq_blocked) {
         return;
     }
+    q = &bc->out_q;
 
     effective_cap = BROKER_MAX_INFLIGHT_PER_SUB;
     if (bc->client_receive_max != 0 &&
@@ -1956,12 +3597,24 @@ static void BrokerClient_DrainOutQueue(BrokerClient* bc)
         effective_cap = (int)bc->client_receive_max;
     }
 
-    prev = NULL;
-    cur = bc->out_q_head;
-    while (cur != NULL) {
+    while (q->unsent != q->tail) {
         MqttPublish out_pub;
         int enc_rc;
+        int in_wq;
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        MqttProp alias;
+        int alias_slot;
+    #endif
 
+        cur = BROKER_OUTQ_AT(q, q->unsent);
+        if (cur->msg == NULL) {
+            q->unsent++;
+            continue;
+        }
+        if (bc->wq_blocked) {
+            /* Output stalled: the rest waits here until it is sent */
+            break;
+        }
         if (cur->state != BROKER_OUTQ_QUEUED) {
 #if WOLFMQTT_MAX_QOS >= 2
             /* A QoS 2 entry restored to PUBREL_SENT by BrokerOrphan_Reclaim
@@ -1993,8 +3646,7 @@ static void BrokerClient_DrainOutQueue(BrokerClient* bc)
                 }
             }
 #endif
-            prev = cur;
-            cur = cur->next;
+            q->unsent++;
             continue;
         }
         if (cur->qos > MQTT_QOS_0 && bc->out_q_inflight >= effective_cap) {
@@ -2004,7 +3656,7 @@ static void BrokerClient_DrainOutQueue(BrokerClient* bc)
         }
 
         XMEMSET(&out_pub, 0, sizeof(out_pub));
-        out_pub.topic_name = cur->topic;
+        out_pub.topic_name = cur->msg->topic;
         out_pub.qos        = cur->qos;
         out_pub.packet_id  = cur->packet_id;
         out_pub.retain     = cur->retain;
@@ -2013,54 +3665,62 @@ static void BrokerClient_DrainOutQueue(BrokerClient* bc)
          * entry was previously in PUBLISH_SENT and got reset to
          * QUEUED here for retransmit. */
         out_pub.duplicate  = cur->retransmit_dup;
-        out_pub.buffer     = cur->payload;
-        out_pub.total_len  = cur->payload_len;
+        out_pub.buffer     = cur->msg->payload;
+        out_pub.total_len  = cur->msg->payload_len;
     #ifdef WOLFMQTT_V5
         out_pub.protocol_level = cur->protocol_level;
-        out_pub.props = cur->props;
+        out_pub.props = cur->msg->props;
+    #endif
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        alias_slot = BrokerTopicAlias_Out(bc, &out_pub, &alias);
     #endif
 
-        enc_rc = MqttEncode_Publish(bc->tx_buf, BROKER_CLIENT_TX_SZ(bc),
-                    &out_pub, 0);
+        /* A plaintext socket client gets the header in its write queue and
+         * the payload sent straight from the entry. TLS has to encrypt the
+         * whole packet, so it is still staged in tx_buf. */
+        in_wq = (bc->wq_buf != NULL && !(MqttClient_Flags(&bc->client, 0, 0)
+            & MQTT_CLIENT_FLAG_IS_TLS));
+        if (in_wq) {
+            enc_rc = BrokerWq_PutPublish(bc, &out_pub, cur);
+            if (enc_rc == MQTT_CODE_CONTINUE) {
+                break;
+            }
+            if (enc_rc == MQTT_CODE_ERROR_NETWORK) {
+                WBLOG_ERR(bc->broker,
+                    "broker: drain write failed sock=%d topic=%s rc=%d",
+                    (int)bc->sock, BrokerLog_Sanitize(cur->msg->topic), enc_rc);
+                return;
+            }
+        }
+        else {
+            enc_rc = MqttEncode_Publish(bc->tx_buf, BROKER_CLIENT_TX_SZ(bc),
+                        &out_pub, 0);
+        }
         if (enc_rc <= 0) {
             WBLOG_ERR(bc->broker,
                 "broker: drain encode failed sock=%d topic=%s rc=%d",
-                (int)bc->sock, BrokerLog_Sanitize(cur->topic), enc_rc);
+                (int)bc->sock, BrokerLog_Sanitize(cur->msg->topic), enc_rc);
             /* Encode length is unknown on failure, so scrub the whole buffer
              * in case a partial payload was written. */
             BROKER_FORCE_ZERO(bc->tx_buf, BROKER_CLIENT_TX_SZ(bc));
             /* Drop just this entry and continue. Encoding failure for
              * a single message is not fatal to the connection. */
-            if (prev == NULL) {
-                bc->out_q_head = cur->next;
-            }
-            else {
-                prev->next = cur->next;
-            }
-            if (bc->out_q_tail == cur) {
-                bc->out_q_tail = prev;
-            }
-            bc->out_q_count--;
-            {
-                BrokerOutPub* free_me = cur;
-                cur = cur->next;
-            #ifdef WOLFMQTT_BROKER_PERSIST
-                /* If this entry was previously shadow-written (orphan
-                 * path), drop the disk record now so a future restart
-                 * cannot replay an undeliverable message. Idempotent
-                 * for entries that were never persisted (QoS 0, or
-                 * not-yet-orphaned). */
-                if (free_me->qos > MQTT_QOS_0 &&
-                        BROKER_STR_VALID(bc->client_id)) {
-                    (void)BrokerPersist_DelOutPub(bc->broker,
-                        bc->client_id, free_me->packet_id);
-                }
-            #endif
-                BrokerOutPub_Free(free_me);
+            q->unsent++;
+        #ifdef WOLFMQTT_BROKER_PERSIST
+            /* If this entry was previously shadow-written (orphan
+             * path), drop the disk record now so a future restart
+             * cannot replay an undeliverable message. Idempotent
+             * for entries that were never persisted (QoS 0, or
+             * not-yet-orphaned). */
+            if (cur->qos > MQTT_QOS_0 && BROKER_STR_VALID(bc->client_id)) {
+                (void)BrokerPersist_DelOutPub(bc->broker, bc->client_id,
+                    cur->packet_id);
             }
+        #endif
+            BrokerClient_RemoveOutPub(bc, cur);
             continue;
         }
-        {
+        if (!in_wq) {
             int wr_rc;
             wr_rc = MqttPacket_Write(&bc->client, bc->tx_buf, enc_rc);
             /* Scrub the forwarded PUBLISH (which may carry a replayed will or
@@ -2081,113 +3741,66 @@ static void BrokerClient_DrainOutQueue(BrokerClient* bc)
                  * stop the drain here. */
                 WBLOG_ERR(bc->broker,
                     "broker: drain write failed sock=%d topic=%s rc=%d",
-                    (int)bc->sock, BrokerLog_Sanitize(cur->topic), wr_rc);
+                    (int)bc->sock, BrokerLog_Sanitize(cur->msg->topic), wr_rc);
                 return;
             }
         }
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        BrokerTopicAlias_Commit(bc, alias_slot, cur->msg->topic);
+    #endif
         WBLOG_DBG(bc->broker,
             "broker: drain send sock=%d topic=%s qos=%d packet_id=%u dup=%d",
-            (int)bc->sock, BrokerLog_Sanitize(cur->topic), (int)cur->qos,
+            (int)bc->sock, BrokerLog_Sanitize(cur->msg->topic), (int)cur->qos,
             (unsigned)cur->packet_id, (int)cur->retransmit_dup);
         cur->retransmit_dup = 0;
+        q->unsent++;
 
         if (cur->qos == MQTT_QOS_0) {
-            BrokerOutPub* free_me = cur;
-            if (prev == NULL) {
-                bc->out_q_head = cur->next;
-            }
-            else {
-                prev->next = cur->next;
-            }
-            if (bc->out_q_tail == cur) {
-                bc->out_q_tail = prev;
-            }
-            bc->out_q_count--;
-            cur = cur->next;
-            BrokerOutPub_Free(free_me);
-            /* prev unchanged */
+            BrokerClient_RemoveOutPub(bc, cur);
         }
         else {
             cur->state = BROKER_OUTQ_PUBLISH_SENT;
             bc->out_q_inflight++;
-            prev = cur;
-            cur = cur->next;
         }
     }
 }
 
 /* Locate the queue entry that matches packet_id and is awaiting an ack
  * in the given expected_state. Returns NULL if no match (e.g., spurious
- * ack, or our state has already moved on). On match returns the entry
- * (still linked) and sets *out_prev to the predecessor (or NULL when
- * the match is at head) so the caller can unlink in O(1). */
+ * ack, or our state has already moved on). The entry is found through
+ * the client's packet identifier table, not by walking out_q. */
 static BrokerOutPub* BrokerClient_FindOutPub(BrokerClient* bc,
-    word16 packet_id, byte expected_state, BrokerOutPub** out_prev)
+    word16 packet_id, byte expected_state)
 {
-    BrokerOutPub* prev = NULL;
-    BrokerOutPub* cur;
+    BrokerOutPub* e;
 
-    if (bc == NULL || packet_id == 0) {
+    if (bc == NULL) {
         return NULL;
     }
-    cur = bc->out_q_head;
-    while (cur != NULL) {
-        if (cur->packet_id == packet_id && cur->state == expected_state) {
-            if (out_prev != NULL) {
-                *out_prev = prev;
-            }
-            return cur;
-        }
-        prev = cur;
-        cur = cur->next;
+    e = BrokerPacketIds_Find(bc->packet_ids, packet_id);
+    if (e == NULL || e->state != expected_state) {
+        return NULL;
     }
-    return NULL;
+    return e;
 }
 
-/* Unlink and free the entry; decrement inflight if it was counted. */
-static void BrokerClient_UnlinkOutPub(BrokerClient* bc, BrokerOutPub* prev,
-    BrokerOutPub* e)
-{
-    if (bc == NULL || e == NULL) {
-        return;
-    }
-    if (prev == NULL) {
-        bc->out_q_head = e->next;
-    }
-    else {
-        prev->next = e->next;
-    }
-    if (bc->out_q_tail == e) {
-        bc->out_q_tail = prev;
-    }
-    bc->out_q_count--;
-    if (e->state == BROKER_OUTQ_PUBLISH_SENT ||
-        e->state == BROKER_OUTQ_PUBREL_SENT) {
-        if (bc->out_q_inflight > 0) {
-            bc->out_q_inflight--;
-        }
-    }
-    BrokerOutPub_Free(e);
-}
 
 /* PUBACK from subscriber - completes a QoS 1 delivery. */
 static void BrokerClient_OnPubAck(BrokerClient* bc, word16 packet_id)
 {
-    BrokerOutPub* prev = NULL;
     BrokerOutPub* e;
 
     if (bc == NULL) {
         return;
     }
-    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBLISH_SENT,
-            &prev);
+    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBLISH_SENT);
     if (e == NULL) {
         WBLOG_DBG(bc->broker,
             "broker: spurious PUBACK sock=%d packet_id=%u",
             (int)bc->sock, (unsigned)packet_id);
         return;
     }
-    BrokerClient_UnlinkOutPub(bc, prev, e);
+    BrokerClient_RemoveOutPub(bc, e);
 #ifdef WOLFMQTT_BROKER_PERSIST
     /* Defense in depth: in normal flow the orphan-reclaim path already
      * wiped this client's disk records, but if the entry was ever
@@ -2209,14 +3822,12 @@ static void BrokerClient_OnPubAck(BrokerClient* bc, word16 packet_id)
  * idempotent for buggy peers. */
 static int BrokerClient_OnPubRec(BrokerClient* bc, word16 packet_id)
 {
-    BrokerOutPub* prev = NULL;
     BrokerOutPub* e;
 
     if (bc == NULL) {
         return 0;
     }
-    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBLISH_SENT,
-            &prev);
+    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBLISH_SENT);
     if (e == NULL) {
         WBLOG_DBG(bc->broker,
             "broker: spurious PUBREC sock=%d packet_id=%u",
@@ -2234,18 +3845,16 @@ static int BrokerClient_OnPubRec(BrokerClient* bc, word16 packet_id)
  * sender MUST NOT follow it with PUBREL (MQTT 5.0 section 4.3.3). */
 static void BrokerClient_OnPubReject(BrokerClient* bc, word16 packet_id)
 {
-    BrokerOutPub* prev = NULL;
     BrokerOutPub* e;
 
     if (bc == NULL) {
         return;
     }
-    e = BrokerClient_FindOutPub(bc, packet_id,
-        BROKER_OUTQ_PUBLISH_SENT, &prev);
+    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBLISH_SENT);
     if (e == NULL || e->qos != MQTT_QOS_2) {
         return;
     }
-    BrokerClient_UnlinkOutPub(bc, prev, e);
+    BrokerClient_RemoveOutPub(bc, e);
 #ifdef WOLFMQTT_BROKER_PERSIST
     if (BROKER_STR_VALID(bc->client_id)) {
         (void)BrokerPersist_DelOutPub(bc->broker, bc->client_id, packet_id);
@@ -2258,21 +3867,19 @@ static void BrokerClient_OnPubReject(BrokerClient* bc, word16 packet_id)
 /* PUBCOMP from subscriber - completes a QoS 2 delivery. */
 static void BrokerClient_OnPubComp(BrokerClient* bc, word16 packet_id)
 {
-    BrokerOutPub* prev = NULL;
     BrokerOutPub* e;
 
     if (bc == NULL) {
         return;
     }
-    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBREL_SENT,
-            &prev);
+    e = BrokerClient_FindOutPub(bc, packet_id, BROKER_OUTQ_PUBREL_SENT);
     if (e == NULL) {
         WBLOG_DBG(bc->broker,
             "broker: spurious PUBCOMP sock=%d packet_id=%u",
             (int)bc->sock, (unsigned)packet_id);
         return;
     }
-    BrokerClient_UnlinkOutPub(bc, prev, e);
+    BrokerClient_RemoveOutPub(bc, e);
 #ifdef WOLFMQTT_BROKER_PERSIST
     /* See BrokerClient_OnPubAck: defense-in-depth disk record purge. */
     if (BROKER_STR_VALID(bc->client_id)) {
@@ -2284,16 +3891,67 @@ static void BrokerClient_OnPubComp(BrokerClient* bc, word16 packet_id)
 #endif /* WOLFMQTT_MAX_QOS >= 2 */
 #endif /* !WOLFMQTT_STATIC_MEMORY */
 
+/* Wipe the read-ahead bytes the packet reader has already consumed. Called
+ * once CONNECT is done with, since its credentials may have been buffered
+ * there on their way into rx_buf. */
+static void BrokerClient_ScrubReadAhead(BrokerClient* bc)
+{
+    if (bc->client.rd_buf != NULL && bc->client.rd_pos > 0) {
+        BROKER_FORCE_ZERO(bc->client.rd_buf, (word32)bc->client.rd_pos);
+    }
+}
+
+#ifdef WOLFMQTT_BROKER_PERSIST
+/* MqttBroker.persist_held: clients with held acks, so a commit only
+ * visits them. Linked by BrokerHeldAck_Hold, unlinked once the last ack
+ * is sent or the client is freed. */
+static void BrokerHeldAck_Link(MqttBroker* broker, BrokerClient* bc)
+{
+    bc->held_prev = NULL;
+    bc->held_next = broker->persist_held;
+    if (broker->persist_held != NULL) {
+        broker->persist_held->held_prev = bc;
+    }
+    broker->persist_held = bc;
+}
+
+static void BrokerHeldAck_Unlink(MqttBroker* broker, BrokerClient* bc)
+{
+    if (bc->held_prev != NULL) {
+        bc->held_prev->held_next = bc->held_next;
+    }
+    else if (broker->persist_held == bc) {
+        broker->persist_held = bc->held_next;
+    }
+    if (bc->held_next != NULL) {
+        bc->held_next->held_prev = bc->held_prev;
+    }
+    bc->held_next = NULL;
+    bc->held_prev = NULL;
+}
+#endif
+
 static void BrokerClient_Free(BrokerClient* bc)
 {
     if (bc == NULL) {
         return;
     }
+    if (bc->broker != NULL) {
+        BrokerIdIndex_Del(bc->broker, BROKER_ID_CLIENT, bc);
+    #ifdef WOLFMQTT_BROKER_PERSIST
+        BrokerHeldAck_Unlink(bc->broker, bc);
+    #endif
+    }
+    BrokerTimer_Cancel(bc->broker, &bc->timeout_timer);
 #if WOLFMQTT_MAX_QOS >= 2
     BrokerInboundQos2_Clear(bc);
 #endif
 #ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerSub_SessDetach(&bc->subs);
     BrokerClient_FreeOutQueue(bc);
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+    BrokerTopicAlias_Clear(bc);
+#endif
 #endif
 
 #ifdef ENABLE_MQTT_WEBSOCKET
@@ -2355,7 +4013,23 @@ static void BrokerClient_Free(BrokerClient* bc)
         BROKER_FORCE_ZERO(bc->rx_buf, bc->rx_buf_len);
         WOLFMQTT_FREE(bc->rx_buf);
     }
-    WOLFMQTT_FREE(bc);
+    if (bc->rd_buf) {
+        BROKER_FORCE_ZERO(bc->rd_buf, BROKER_READ_AHEAD_SZ);
+        WOLFMQTT_FREE(bc->rd_buf);
+    }
+    if (bc->wq_buf) {
+        /* Flushed and scrubbed by BrokerNetDisconnect above */
+        WOLFMQTT_FREE(bc->wq_buf);
+    }
+    if (bc->unlinked) {
+        /* A client walk may still be positioned on bc; everything it owns
+         * is released, the node itself goes at BrokerClient_Reap. */
+        bc->prev = bc->broker->clients_reap;
+        bc->broker->clients_reap = bc;
+    }
+    else {
+        WOLFMQTT_FREE(bc);
+    }
 #endif
 }
 
@@ -2396,6 +4070,21 @@ static BrokerClient* BrokerClient_Add(MqttBroker* broker,
         if (bc->tx_buf == NULL || bc->rx_buf == NULL) {
             rc = MQTT_CODE_ERROR_MEMORY;
         }
+    #if BROKER_READ_AHEAD_SZ > 0
+        if (rc == MQTT_CODE_SUCCESS) {
+            bc->rd_buf = (byte*)WOLFMQTT_MALLOC(BROKER_READ_AHEAD_SZ);
+            if (bc->rd_buf == NULL) {
+                rc = MQTT_CODE_ERROR_MEMORY;
+            }
+        }
+    #endif
+        if (rc == MQTT_CODE_SUCCESS) {
+            bc->wq_buf = (byte*)WOLFMQTT_MALLOC(BROKER_WQ_BUF_SZ);
+            bc->wq_cap = BROKER_WQ_BUF_SZ;
+            if (bc->wq_buf == NULL) {
+                rc = MQTT_CODE_ERROR_MEMORY;
+            }
+        }
     }
 #endif
 
@@ -2404,7 +4093,7 @@ static BrokerClient* BrokerClient_Add(MqttBroker* broker,
         bc->broker = broker;
         bc->protocol_level = 0;
         bc->keep_alive_sec = 0;
-        bc->last_rx = WOLFMQTT_BROKER_GET_TIME_S();
+        bc->last_rx = broker->now;
 
         bc->net.context = bc;
         bc->net.connect = BrokerNetConnect;
@@ -2415,6 +4104,12 @@ static BrokerClient* BrokerClient_Add(MqttBroker* broker,
         rc = MqttClient_Init(&bc->client, &bc->net, NULL,
                 bc->tx_buf, BROKER_CLIENT_TX_SZ(bc),
                 bc->rx_buf, BROKER_CLIENT_RX_SZ(bc), BROKER_TIMEOUT_MS);
+    #if BROKER_READ_AHEAD_SZ > 0
+        if (rc == MQTT_CODE_SUCCESS) {
+            rc = MqttClient_SetReadAhead(&bc->client, bc->rd_buf,
+                BROKER_READ_AHEAD_SZ);
+        }
+    #endif
         if (rc != MQTT_CODE_SUCCESS) {
             WBLOG_ERR(broker, "broker: client init failed rc=%d", rc);
         }
@@ -2448,12 +4143,24 @@ static BrokerClient* BrokerClient_Add(MqttBroker* broker,
     (void)is_tls;
 #endif
 
+    if (rc == MQTT_CODE_SUCCESS && broker->net.poll_add != NULL) {
+        rc = broker->net.poll_add(broker->net.ctx, sock, BROKER_NET_EV_READ,
+            bc);
+        if (rc == MQTT_CODE_SUCCESS) {
+            bc->poll_registered = 1;
+        }
+        else {
+            WBLOG_ERR(broker, "broker: poll register failed sock=%d rc=%d",
+                (int)sock, rc);
+        }
+    }
+
     if (rc == MQTT_CODE_SUCCESS) {
 #ifndef WOLFMQTT_STATIC_MEMORY
-        /* Prepend to linked list */
-        bc->next = broker->clients;
-        broker->clients = bc;
+        BrokerClient_Link(broker, bc);
+        BrokerClient_Requeue(bc);
 #endif
+        BrokerClient_ArmTimeout(broker, bc);
     }
     else if (bc != NULL) {
         BrokerClient_Free(bc);
@@ -2465,46 +4172,570 @@ static BrokerClient* BrokerClient_Add(MqttBroker* broker,
 
 static void BrokerClient_Remove(MqttBroker* broker, BrokerClient* bc)
 {
+    if (broker == NULL || bc == NULL) {
+        return;
+    }
+
 #ifndef WOLFMQTT_STATIC_MEMORY
-    BrokerClient* cur;
-    BrokerClient* prev = NULL;
-    int found = 0;
+    /* A re-entrant close callback (e.g. WebSocket LWS_CALLBACK_CLOSED during
+     * a takeover fan-out) can have already removed bc. Its node stays
+     * allocated until BrokerClient_Reap, so the flag is safe to test and
+     * freeing again here is avoided. */
+    if (bc->unlinked) {
+        return;
+    }
+    BrokerClient_Unlink(broker, bc);
+#endif
+    BrokerClient_Free(bc);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Subscription management                                                     */
+/* -------------------------------------------------------------------------- */
+
+/* Forward declaration - used by the topic tree's loose list, retained
+ * delivery, will publish, and PUBLISH handler */
+static int BrokerTopicMatch(const char* filter, const char* topic);
+
+/* Topic tree (see BrokerSubTree). Filter levels are split on '/', so an
+ * empty level ("a//b", "/a") is a node like any other. */
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+    /* Initial hash table size; it doubles as nodes are added */
+    #define BROKER_SUB_TREE_BUCKETS_MIN 64
 #endif
 
-    if (broker == NULL || bc == NULL) {
-        return;
+static word16 BrokerSubTree_LevelLen(const char* level)
+{
+    word16 len = 0;
+    while (level[len] != '\0' && level[len] != '/') {
+        len++;
+    }
+    return len;
+}
+
+/* FNV-1a over the parent's address and the level text. Also keys the
+ * retained topic tree. */
+static word32 BrokerSubTree_Key(const void* parent,
+    const char* level, word16 len)
+{
+    word32 h = 2166136261u;
+    word32 p = (word32)(size_t)parent;
+    word16 i;
+
+    for (i = 0; i < 4; i++) {
+        h ^= (p & 0xFF);
+        h *= 16777619u;
+        p >>= 8;
+    }
+    for (i = 0; i < len; i++) {
+        h ^= (byte)level[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static word32 BrokerSubTree_BucketCnt(const BrokerSubTree* t)
+{
+#ifdef WOLFMQTT_STATIC_MEMORY
+    (void)t;
+    return BROKER_MAX_SUB_NODES;
+#else
+    return t->bucket_cnt;
+#endif
+}
+
+/* Exact child of parent for level, or NULL */
+static BrokerSubNode* BrokerSubTree_Child(BrokerSubTree* t,
+    const BrokerSubNode* parent, const char* level, word16 len, word32 key)
+{
+    BrokerSubNode* n;
+    word32 cnt = BrokerSubTree_BucketCnt(t);
+
+    if (cnt == 0) {
+        return NULL;
+    }
+    for (n = t->buckets[key % cnt]; n != NULL; n = n->bucket_next) {
+        if (n->key == key && n->parent == parent && n->level_len == len &&
+                XMEMCMP(n->level, level, len) == 0) {
+            return n;
+        }
     }
+    return NULL;
+}
 
 #ifndef WOLFMQTT_STATIC_MEMORY
-    cur = broker->clients;
-    while (cur) {
-        if (cur == bc) {
-            if (prev) {
-                prev->next = cur->next;
+/* Make room for one more node: the frontier must hold every node plus the
+ * root, and the hash table is kept at one node per bucket or fewer. Only a
+ * failed frontier allocation is fatal; a full table just chains longer. */
+static int BrokerSubTree_Reserve(BrokerSubTree* t)
+{
+    word32 need = t->node_cnt + 2;
+
+    if (t->frontier_cap < need) {
+        word32 cap = (t->frontier_cap == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->frontier_cap * 2;
+        BrokerSubNode** f = (BrokerSubNode**)WOLFMQTT_MALLOC(
+            cap * sizeof(BrokerSubNode*));
+        if (f == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        if (t->frontier != NULL) {
+            WOLFMQTT_FREE(t->frontier);
+        }
+        t->frontier = f;
+        t->frontier_cap = cap;
+    }
+    if (t->node_cnt + 1 > t->bucket_cnt) {
+        word32 cnt = (t->bucket_cnt == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->bucket_cnt * 2;
+        BrokerSubNode** b = (BrokerSubNode**)WOLFMQTT_MALLOC(
+            cnt * sizeof(BrokerSubNode*));
+        if (b != NULL) {
+            word32 i;
+            XMEMSET(b, 0, cnt * sizeof(BrokerSubNode*));
+            for (i = 0; i < t->bucket_cnt; i++) {
+                while (t->buckets[i] != NULL) {
+                    BrokerSubNode* n = t->buckets[i];
+                    t->buckets[i] = n->bucket_next;
+                    n->bucket_next = b[n->key % cnt];
+                    b[n->key % cnt] = n;
+                }
             }
-            else {
-                broker->clients = cur->next;
+            if (t->buckets != NULL) {
+                WOLFMQTT_FREE(t->buckets);
             }
-            found = 1;
+            t->buckets = b;
+            t->bucket_cnt = cnt;
+        }
+        else if (t->bucket_cnt == 0) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+    }
+    return MQTT_CODE_SUCCESS;
+}
+#endif
+
+/* Create the child of parent for one filter level. A '+' or '#' level
+ * becomes the parent's wildcard child; any other level is hashed. */
+static BrokerSubNode* BrokerSubTree_NewNode(BrokerSubTree* t,
+    BrokerSubNode* parent, const char* level, word16 len, word32 key)
+{
+    BrokerSubNode* n = NULL;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    int i;
+
+    if (len >= BROKER_MAX_SUB_LEVEL_LEN) {
+        return NULL;
+    }
+    for (i = 0; i < BROKER_MAX_SUB_NODES; i++) {
+        if (!t->nodes[i].in_use) {
+            n = &t->nodes[i];
             break;
         }
-        prev = cur;
-        cur = cur->next;
     }
-    /* Only free when bc was actually unlinked. A re-entrant close callback
-     * (e.g. WebSocket LWS_CALLBACK_CLOSED during a takeover fan-out) can have
-     * already removed and freed bc; freeing again here would double-free. */
-    if (found) {
-        BrokerClient_Free(bc);
+    if (n == NULL) {
+        return NULL;
     }
+    XMEMSET(n, 0, sizeof(*n));
+    n->in_use = 1;
+    XMEMCPY(n->level, level, len);
 #else
-    BrokerClient_Free(bc);
+    if (BrokerSubTree_Reserve(t) != MQTT_CODE_SUCCESS) {
+        return NULL;
+    }
+    n = (BrokerSubNode*)WOLFMQTT_MALLOC(sizeof(BrokerSubNode) + len + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+    XMEMSET(n, 0, sizeof(*n));
+    n->level = (char*)(n + 1);
+    XMEMCPY(n->level, level, len);
+    n->level[len] = '\0';
+    t->node_cnt++;
 #endif
+    n->parent = parent;
+    n->level_len = len;
+    n->key = key;
+    if (len == 1 && level[0] == '+') {
+        parent->plus = n;
+    }
+    else if (len == 1 && level[0] == '#') {
+        parent->pound = n;
+    }
+    else {
+        word32 b = key % BrokerSubTree_BucketCnt(t);
+        n->bucket_next = t->buckets[b];
+        t->buckets[b] = n;
+    }
+    parent->children++;
+    return n;
 }
 
-/* -------------------------------------------------------------------------- */
-/* Subscription management                                                     */
-/* -------------------------------------------------------------------------- */
+/* Free n and every ancestor left without subscriptions or children */
+static void BrokerSubTree_Prune(BrokerSubTree* t, BrokerSubNode* n)
+{
+    while (n != &t->root && n->subs == NULL && n->children == 0) {
+        BrokerSubNode* parent = n->parent;
+        if (parent->plus == n) {
+            parent->plus = NULL;
+        }
+        else if (parent->pound == n) {
+            parent->pound = NULL;
+        }
+        else {
+            BrokerSubNode** pp =
+                &t->buckets[n->key % BrokerSubTree_BucketCnt(t)];
+            while (*pp != n) {
+                pp = &(*pp)->bucket_next;
+            }
+            *pp = n->bucket_next;
+        }
+        parent->children--;
+#ifdef WOLFMQTT_STATIC_MEMORY
+        BROKER_FORCE_ZERO(n, sizeof(*n));
+#else
+        BROKER_FORCE_ZERO(n, sizeof(*n) + n->level_len + 1);
+        WOLFMQTT_FREE(n);
+        t->node_cnt--;
+#endif
+        n = parent;
+    }
+}
+
+WOLFMQTT_LOCAL void BrokerSubTree_Insert(MqttBroker* broker, BrokerSub* sub)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+    BrokerSubNode* n = &t->root;
+    const char* level = sub->filter;
+
+    for (;;) {
+        word16 len = BrokerSubTree_LevelLen(level);
+        word32 key = BrokerSubTree_Key(n, level, len);
+        BrokerSubNode* child;
+
+        if (len == 1 && level[0] == '+') {
+            child = n->plus;
+        }
+        else if (len == 1 && level[0] == '#') {
+            child = n->pound;
+        }
+        else {
+            child = BrokerSubTree_Child(t, n, level, len, key);
+        }
+        if (child == NULL) {
+            child = BrokerSubTree_NewNode(t, n, level, len, key);
+        }
+        if (child == NULL) {
+            /* Out of nodes: undo the part of the path made for this
+             * filter and match it by scanning instead */
+            BrokerSubTree_Prune(t, n);
+            sub->node = NULL;
+            sub->node_prev = NULL;
+            sub->node_next = t->loose;
+            if (t->loose != NULL) {
+                t->loose->node_prev = sub;
+            }
+            t->loose = sub;
+            WBLOG_INFO(broker, "broker: sub tree full, filter=%s scanned",
+                BrokerLog_Sanitize(sub->filter));
+            return;
+        }
+        n = child;
+        if (level[len] == '\0') {
+            break;
+        }
+        level += len + 1;
+    }
+    sub->node = n;
+    sub->node_prev = NULL;
+    sub->node_next = n->subs;
+    if (n->subs != NULL) {
+        n->subs->node_prev = sub;
+    }
+    n->subs = sub;
+}
+
+static void BrokerSubTree_Remove(MqttBroker* broker, BrokerSub* sub)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+    BrokerSub** head;
+
+    if (sub->node != NULL) {
+        head = &sub->node->subs;
+    }
+    else if (sub->node_prev != NULL || t->loose == sub) {
+        head = &t->loose;
+    }
+    else {
+        return; /* never inserted */
+    }
+    if (sub->node_prev != NULL) {
+        sub->node_prev->node_next = sub->node_next;
+    }
+    else {
+        *head = sub->node_next;
+    }
+    if (sub->node_next != NULL) {
+        sub->node_next->node_prev = sub->node_prev;
+    }
+    if (sub->node != NULL) {
+        BrokerSubTree_Prune(t, sub->node);
+    }
+    sub->node = NULL;
+    sub->node_next = NULL;
+    sub->node_prev = NULL;
+}
+
+/* Append one subscription to the match list. The list only runs out in
+ * static memory with nested fan-outs, or when the heap does. */
+static void BrokerSubTree_Collect(MqttBroker* broker, BrokerSub* sub)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    if (t->match_len >= (word32)(sizeof(t->match) / sizeof(t->match[0]))) {
+#else
+    if (t->match_len >= t->match_cap) {
+        word32 cap = (t->match_cap == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->match_cap * 2;
+        BrokerSub** m = (BrokerSub**)WOLFMQTT_MALLOC(cap * sizeof(BrokerSub*));
+        if (m != NULL) {
+            if (t->match != NULL) {
+                XMEMCPY(m, t->match, t->match_len * sizeof(BrokerSub*));
+                WOLFMQTT_FREE(t->match);
+            }
+            t->match = m;
+            t->match_cap = cap;
+        }
+    }
+    if (t->match_len >= t->match_cap) {
+#endif
+        WBLOG_ERR(broker, "broker: sub match list full, filter=%s skipped",
+            BrokerLog_Sanitize(sub->filter));
+        return;
+    }
+    t->match[t->match_len++] = sub;
+}
+
+static void BrokerSubTree_CollectNode(MqttBroker* broker,
+    const BrokerSubNode* n)
+{
+    BrokerSub* sub;
+    for (sub = n->subs; sub != NULL; sub = sub->node_next) {
+        BrokerSubTree_Collect(broker, sub);
+    }
+}
+
+/* Collect the subscriptions of every tree node matching topic */
+static void BrokerSubTree_Walk(MqttBroker* broker, const char* topic)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+    word32 head = 0;
+    word32 tail = 0;
+    word32 next;
+    word32 i;
+    const char* level = topic;
+
+    /* frontier[head..tail) holds the nodes matching the topic up to the
+     * current level. Each level's nodes are distinct from the previous
+     * level's, so the whole walk fits in one frontier array. */
+    t->frontier[tail++] = &t->root;
+    for (;;) {
+        word16 len = BrokerSubTree_LevelLen(level);
+        next = tail;
+        for (i = head; i < tail; i++) {
+            BrokerSubNode* n = t->frontier[i];
+            BrokerSubNode* child;
+#ifdef WOLFMQTT_BROKER_WILDCARDS
+            /* [MQTT-4.7.2] Wildcard filters must not match $-prefixed
+             * topics at the first level */
+            if (n != &t->root || topic[0] != '$') {
+                if (n->pound != NULL) {
+                    BrokerSubTree_CollectNode(broker, n->pound);
+                }
+                if (n->plus != NULL) {
+                    t->frontier[next++] = n->plus;
+                }
+            }
+#endif
+            child = BrokerSubTree_Child(t, n, level, len,
+                BrokerSubTree_Key(n, level, len));
+            if (child != NULL) {
+                t->frontier[next++] = child;
+            }
+        }
+        head = tail;
+        tail = next;
+        if (head == tail || level[len] == '\0') {
+            break;
+        }
+        level += len + 1;
+    }
+    for (i = head; i < tail; i++) {
+        BrokerSubTree_CollectNode(broker, t->frontier[i]);
+#ifdef WOLFMQTT_BROKER_WILDCARDS
+        /* [MQTT-4.7.1.2] 'topic/#' also matches 'topic' itself */
+        if (t->frontier[i]->pound != NULL) {
+            BrokerSubTree_CollectNode(broker, t->frontier[i]->pound);
+        }
+#endif
+    }
+}
+
+/* Collect every subscription whose filter matches topic. They are
+ * broker->sub_tree.match[base..*end), where base is the return value; the
+ * caller hands base back to BrokerSubTree_MatchDone once it has delivered.
+ * Subscriptions released in between stay readable until then: a static
+ * slot reads as free, a dynamic one has no client, client_id or filter. */
+static word32 BrokerSubTree_Match(MqttBroker* broker, const char* topic,
+    word32* end)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+    word32 base = t->match_len;
+    BrokerSub* sub;
+
+    t->walk++;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (t->frontier != NULL) /* no node was ever added */
+#endif
+    {
+        BrokerSubTree_Walk(broker, topic);
+    }
+    for (sub = t->loose; sub != NULL; sub = sub->node_next) {
+        if (BrokerTopicMatch(sub->filter, topic)) {
+            BrokerSubTree_Collect(broker, sub);
+        }
+    }
+    *end = t->match_len;
+    return base;
+}
+
+static void BrokerSubTree_MatchDone(MqttBroker* broker, word32 base)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+
+    t->match_len = base;
+    t->walk--;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (t->walk == 0) {
+        while (t->reap != NULL) {
+            BrokerSub* sub = t->reap;
+            t->reap = sub->node_next;
+            BrokerSlab_Free(sub);
+        }
+    }
+#endif
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Session chains (BrokerSub.sess_head): the subs of one session, kept on
+ * its live client or its orphan carrier so they can be listed without a
+ * walk of broker->subs. */
+WOLFMQTT_LOCAL void BrokerSub_SessLink(BrokerSub** head, BrokerSub* sub)
+{
+    sub->sess_prev = NULL;
+    sub->sess_next = *head;
+    if (*head != NULL) {
+        (*head)->sess_prev = sub;
+    }
+    *head = sub;
+    sub->sess_head = head;
+}
+
+static void BrokerSub_SessUnlink(BrokerSub* sub)
+{
+    if (sub->sess_prev != NULL) {
+        sub->sess_prev->sess_next = sub->sess_next;
+    }
+    else if (sub->sess_head != NULL && *sub->sess_head == sub) {
+        *sub->sess_head = sub->sess_next;
+    }
+    if (sub->sess_next != NULL) {
+        sub->sess_next->sess_prev = sub->sess_prev;
+    }
+    sub->sess_next = NULL;
+    sub->sess_prev = NULL;
+    sub->sess_head = NULL;
+}
+
+/* Move the whole chain at *from to the front of the one at *to */
+static void BrokerSub_SessMove(BrokerSub** to, BrokerSub** from)
+{
+    BrokerSub* sub;
+    BrokerSub* tail = NULL;
+
+    if (*from == NULL) {
+        return;
+    }
+    for (sub = *from; sub != NULL; sub = sub->sess_next) {
+        sub->sess_head = to;
+        tail = sub;
+    }
+    tail->sess_next = *to;
+    if (*to != NULL) {
+        (*to)->sess_prev = tail;
+    }
+    *to = *from;
+    *from = NULL;
+}
+
+/* Take every sub off the chain at *head, whose owner is going away */
+static void BrokerSub_SessDetach(BrokerSub** head)
+{
+    while (*head != NULL) {
+        BrokerSub_SessUnlink(*head);
+    }
+}
+#endif
+
+/* Drop a subscription from the index and release it. Dynamic callers have
+ * already unlinked it from broker->subs; while a fan-out is walking its
+ * match list the node itself is kept until BrokerSubTree_MatchDone. */
+static void BrokerSub_Release(MqttBroker* broker, BrokerSub* sub)
+{
+    BrokerSubTree_Remove(broker, sub);
+#ifdef WOLFMQTT_STATIC_MEMORY
+    XMEMSET(sub, 0, sizeof(BrokerSub));
+#else
+    BrokerSub_SessUnlink(sub);
+    if (sub->filter != NULL) {
+        BROKER_FORCE_ZERO(sub->filter, XSTRLEN(sub->filter) + 1);
+        BrokerSlab_Free(sub->filter);
+        sub->filter = NULL;
+    }
+    if (sub->client_id != NULL) {
+        BROKER_FORCE_ZERO(sub->client_id, XSTRLEN(sub->client_id) + 1);
+        BrokerSlab_Free(sub->client_id);
+        sub->client_id = NULL;
+    }
+    sub->client = NULL;
+    if (broker->sub_tree.walk > 0) {
+        sub->node_next = broker->sub_tree.reap;
+        broker->sub_tree.reap = sub;
+    }
+    else {
+        BrokerSlab_Free(sub);
+    }
+#endif
+}
+
+/* Release the tree's own storage once every subscription is gone */
+static void BrokerSubTree_Free(MqttBroker* broker)
+{
+    BrokerSubTree* t = &broker->sub_tree;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (t->buckets != NULL) {
+        WOLFMQTT_FREE(t->buckets);
+    }
+    if (t->frontier != NULL) {
+        WOLFMQTT_FREE(t->frontier);
+    }
+    if (t->match != NULL) {
+        WOLFMQTT_FREE(t->match);
+    }
+#endif
+    BROKER_FORCE_ZERO(t, sizeof(*t));
+}
 
 /* Orphan subscriptions for session persistence (clean_session=0).
  * Sets client pointer to NULL but keeps the subscription for reconnect. */
@@ -2520,27 +4751,40 @@ static void BrokerClient_Remove(MqttBroker* broker, BrokerClient* bc)
 static BrokerStaticOrphanSession* BrokerStaticOrphan_Find(MqttBroker* broker,
     const char* client_id)
 {
-    int i;
-
     if (broker == NULL || !BROKER_STR_VALID(client_id)) {
         return NULL;
     }
-    for (i = 0; i < BROKER_MAX_STATIC_ORPHAN_SESSIONS; i++) {
-        BrokerStaticOrphanSession* orphan = &broker->static_orphans[i];
-        if (orphan->in_use && XSTRCMP(orphan->client_id, client_id) == 0) {
-            return orphan;
-        }
-    }
-    return NULL;
+    return (BrokerStaticOrphanSession*)BrokerIdIndex_Find(broker,
+        BROKER_ID_ORPHAN, client_id, (word32)XSTRLEN(client_id), NULL);
 }
 
-static void BrokerStaticOrphan_Clear(BrokerStaticOrphanSession* orphan)
+static void BrokerStaticOrphan_Clear(MqttBroker* broker,
+    BrokerStaticOrphanSession* orphan)
 {
     if (orphan != NULL) {
+        if (orphan->in_use) {
+            BrokerIdIndex_Del(broker, BROKER_ID_ORPHAN, orphan);
+        }
+        BrokerTimer_Cancel(broker, &orphan->expiry_timer);
         BROKER_FORCE_ZERO(orphan, sizeof(*orphan));
     }
 }
 
+WOLFMQTT_LOCAL void BrokerStaticOrphan_ArmExpiry(MqttBroker* broker,
+    BrokerStaticOrphanSession* orphan)
+{
+    if (broker == NULL || orphan == NULL || !orphan->in_use) {
+        return;
+    }
+    if (orphan->session_expiry_sec == 0xFFFFFFFFu) {
+        BrokerTimer_Cancel(broker, &orphan->expiry_timer);
+        return;
+    }
+    BrokerTimer_Arm(broker, &orphan->expiry_timer, BROKER_TIMER_ORPHAN,
+        orphan, BrokerTimer_After(orphan->orphan_since,
+            (WOLFMQTT_BROKER_TIME_T)orphan->session_expiry_sec));
+}
+
 WOLFMQTT_LOCAL void BrokerStaticOrphan_DropFull(MqttBroker* broker,
     BrokerStaticOrphanSession* orphan)
 {
@@ -2553,7 +4797,7 @@ WOLFMQTT_LOCAL void BrokerStaticOrphan_DropFull(MqttBroker* broker,
     (void)BrokerPersist_DelSession(broker, orphan->client_id);
     (void)BrokerPersist_DelOutQueue(broker, orphan->client_id);
 #endif
-    BrokerStaticOrphan_Clear(orphan);
+    BrokerStaticOrphan_Clear(broker, orphan);
 }
 
 static void BrokerStaticOrphan_RemoveAt(BrokerStaticOrphanSession* orphan,
@@ -2600,25 +4844,17 @@ static void BrokerStaticOrphan_SaveInboundQos2(
 {
     if (orphan != NULL && bc != NULL &&
             BrokerInboundQos2_HasPending(bc)) {
-        XMEMCPY(orphan->qos2_pending, bc->qos2_pending,
-            sizeof(orphan->qos2_pending));
-        XMEMSET(bc->qos2_pending, 0, sizeof(bc->qos2_pending));
+        orphan->qos2_pending = bc->qos2_pending;
+        BrokerInboundQos2_Clear(bc);
     }
 }
 
 static void BrokerStaticOrphan_ReclaimInboundQos2(
     BrokerStaticOrphanSession* orphan, BrokerClient* bc)
 {
-    int i;
-
-    if (orphan != NULL && bc != NULL) {
-        for (i = 0; i < BROKER_MAX_INBOUND_QOS2; i++) {
-            if (orphan->qos2_pending[i] != 0 &&
-                    BrokerInboundQos2_Add(bc,
-                        orphan->qos2_pending[i]) == MQTT_CODE_SUCCESS) {
-                orphan->qos2_pending[i] = 0;
-            }
-        }
+    if (orphan != NULL && bc != NULL && orphan->qos2_pending.count > 0) {
+        bc->qos2_pending = orphan->qos2_pending;
+        XMEMSET(&orphan->qos2_pending, 0, sizeof(orphan->qos2_pending));
     }
 }
 #endif
@@ -2662,40 +4898,43 @@ static int BrokerStaticOrphan_IsExpired(BrokerStaticOrphanSession* orphan,
 static int BrokerStaticOrphan_HasLiveClient(MqttBroker* broker,
     const char* client_id)
 {
-    int i;
+    BrokerClient* bc;
+    word32 step = 0;
 
     if (broker == NULL || !BROKER_STR_VALID(client_id)) {
         return 0;
     }
-    for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
-        BrokerClient* bc = &broker->clients[i];
-        if (bc->in_use && bc->connected &&
-                BROKER_STR_VALID(bc->client_id) &&
-                XSTRCMP(bc->client_id, client_id) == 0) {
+    while ((bc = (BrokerClient*)BrokerIdIndex_Next(broker, BROKER_ID_CLIENT,
+            client_id, (word32)XSTRLEN(client_id), &step)) != NULL) {
+        if (bc->connected) {
             return 1;
         }
     }
     return 0;
 }
 
-static void BrokerStaticOrphan_Sweep(MqttBroker* broker,
-    WOLFMQTT_BROKER_TIME_T now)
+/* Session Expiry timer callback. Queued messages whose own Message Expiry
+ * elapsed are pruned here and on every enqueue. */
+static void BrokerStaticOrphan_OnExpiry(MqttBroker* broker,
+    BrokerStaticOrphanSession* orphan)
 {
-    int i;
-
-    for (i = 0; i < BROKER_MAX_STATIC_ORPHAN_SESSIONS; i++) {
-        BrokerStaticOrphanSession* orphan = &broker->static_orphans[i];
-        BrokerStaticOrphan_RemoveExpiredQueued(orphan, now);
-        if (BrokerStaticOrphan_IsExpired(orphan, now)) {
-            /* A carrier can survive reconnect while a nonblocking write is
-             * pending. The session is live again in that state; expiry only
-             * applies while it is disconnected. */
-            if (BrokerStaticOrphan_HasLiveClient(broker, orphan->client_id)) {
-                continue;
-            }
-            BrokerStaticOrphan_DropFull(broker, orphan);
-        }
+    BrokerStaticOrphan_RemoveExpiredQueued(orphan, broker->now);
+    if (orphan->session_expiry_sec == 0xFFFFFFFFu) {
+        return;
+    }
+    if (!BrokerStaticOrphan_IsExpired(orphan, broker->now)) {
+        BrokerTimer_Defer(broker, &orphan->expiry_timer);
+        return;
     }
+    /* A carrier can survive reconnect while a nonblocking write is pending.
+     * The session is live again in that state; expiry only applies while it
+     * is disconnected, and the close that ends it re-arms the timer. */
+    if (BrokerStaticOrphan_HasLiveClient(broker, orphan->client_id)) {
+        return;
+    }
+    WBLOG_INFO(broker, "broker: orphan session expired client_id=%s",
+        BrokerLog_Sanitize(orphan->client_id));
+    BrokerStaticOrphan_DropFull(broker, orphan);
 }
 
 static BrokerStaticOrphanSession* BrokerStaticOrphan_Take(MqttBroker* broker,
@@ -2713,12 +4952,12 @@ static BrokerStaticOrphanSession* BrokerStaticOrphan_Take(MqttBroker* broker,
         return NULL;
     }
 
-    now = WOLFMQTT_BROKER_GET_TIME_S();
-    BrokerStaticOrphan_Sweep(broker, now);
+    /* Sessions that expired by now were dropped by this Step's timer pass,
+     * so a match is live state. CONNECT uses this result for Session Present
+     * [MQTT-3.2.2-2]. */
+    now = broker->now;
     free_slot = BrokerStaticOrphan_Find(broker, bc->client_id);
     if (free_slot != NULL && reused != NULL) {
-        /* Report reuse only after the expiry sweep. CONNECT uses this result
-         * for Session Present [MQTT-3.2.2-2]. */
         *reused = 1;
     }
     if (free_slot == NULL) {
@@ -2739,6 +4978,8 @@ static BrokerStaticOrphanSession* BrokerStaticOrphan_Take(MqttBroker* broker,
         free_slot->in_use = 1;
         BROKER_STORE_STR(free_slot->client_id, bc->client_id,
             XSTRLEN(bc->client_id), BROKER_MAX_CLIENT_ID_LEN);
+        /* Cannot fail: BROKER_ID_INDEX_SZ has room for every slot */
+        (void)BrokerIdIndex_Add(broker, BROKER_ID_ORPHAN, free_slot);
     }
     else {
         /* Delivery state belongs to the old socket. Replay any PUBLISH that
@@ -2748,6 +4989,7 @@ static BrokerStaticOrphanSession* BrokerStaticOrphan_Take(MqttBroker* broker,
     free_slot->protocol_level = bc->protocol_level;
     free_slot->session_expiry_sec = bc->session_expiry_sec;
     free_slot->orphan_since = now;
+    BrokerStaticOrphan_ArmExpiry(broker, free_slot);
     return free_slot;
 }
 
@@ -2808,7 +5050,7 @@ static int BrokerStaticOrphan_Enqueue(MqttBroker* broker,
         return MQTT_CODE_ERROR_OUT_OF_BUFFER;
     }
 
-    now = WOLFMQTT_BROKER_GET_TIME_S();
+    now = broker->now;
     BrokerStaticOrphan_RemoveExpiredQueued(orphan, now);
     if (orphan->out_q_count >= BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB) {
         return MQTT_CODE_ERROR_OUT_OF_BUFFER;
@@ -2847,7 +5089,7 @@ static int BrokerStaticOrphan_Enqueue(MqttBroker* broker,
     candidate_id = packet_id;
     do {
         if (candidate_id == 0) {
-            candidate_id = BrokerNextPacketId(broker);
+            candidate_id = BrokerNextPacketId(&orphan->next_packet_id);
         }
         id_in_use = 0;
         for (i = 0; i < orphan->out_q_count; i++) {
@@ -2880,7 +5122,8 @@ static void BrokerStaticClient_Close(MqttBroker* broker, BrokerClient* bc)
          * the carrier was first reserved [MQTT-3.1.2.11.2]. */
         orphan->protocol_level = bc->protocol_level;
         orphan->session_expiry_sec = bc->session_expiry_sec;
-        orphan->orphan_since = WOLFMQTT_BROKER_GET_TIME_S();
+        orphan->orphan_since = broker->now;
+        BrokerStaticOrphan_ArmExpiry(broker, orphan);
 #ifdef WOLFMQTT_BROKER_PERSIST
         if (orphan->session_expiry_sec != 0) {
             (void)BrokerPersist_PutOrphanSession(broker,
@@ -2889,10 +5132,7 @@ static void BrokerStaticClient_Close(MqttBroker* broker, BrokerClient* bc)
         }
 #endif
     }
-    if (bc->sock != BROKER_SOCKET_INVALID) {
-        broker->net.close(broker->net.ctx, bc->sock);
-        bc->sock = BROKER_SOCKET_INVALID;
-    }
+    (void)BrokerNetDisconnect(bc);
 #ifdef ENABLE_MQTT_WEBSOCKET
     if (bc->ws_ctx != NULL) {
         BrokerWsCtx* ws = (BrokerWsCtx*)bc->ws_ctx;
@@ -2959,7 +5199,7 @@ static void BrokerStaticOrphan_Drain(MqttBroker* broker, BrokerClient* bc)
 
     if (broker == NULL || bc == NULL || !bc->connected ||
             !BrokerStaticClient_TransportActive(bc) ||
-            bc->client.write.pos != 0 ||
+            bc->client.write.pos != 0 || bc->wq_blocked ||
             !BROKER_STR_VALID(bc->client_id)) {
         return;
     }
@@ -3015,9 +5255,17 @@ static void BrokerStaticOrphan_Drain(MqttBroker* broker, BrokerClient* bc)
         int prop_rc = 0;
         byte wire_has_expiry = 0;
         word32 wire_expiry_sec = 0;
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        MqttProp alias;
+        int alias_slot;
 #endif
         WOLFMQTT_BROKER_TIME_T now;
 
+        if (bc->wq_blocked) {
+            /* Output stalled: resumed by the Step once it is sent */
+            break;
+        }
         for (i = 0; i < orphan->out_q_count; i++) {
             if (orphan->out_q[i].state == BROKER_OUTQ_QUEUED) {
                 entry = &orphan->out_q[i];
@@ -3028,7 +5276,7 @@ static void BrokerStaticOrphan_Drain(MqttBroker* broker, BrokerClient* bc)
             /* All queued PUBLISHes are awaiting their QoS handshake. */
             break;
         }
-        now = WOLFMQTT_BROKER_GET_TIME_S();
+        now = broker->now;
         if (!entry->was_sent && entry->has_expiry &&
                 now >= entry->enq_time &&
                 now - entry->enq_time >= entry->expiry_sec) {
@@ -3096,9 +5344,17 @@ static void BrokerStaticOrphan_Drain(MqttBroker* broker, BrokerClient* bc)
                 wire_expiry_sec = expiry_prop->data_int;
             }
         }
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        alias_slot = BrokerTopicAlias_Out(bc, &pub, &alias);
 #endif
         enc_rc = MqttEncode_Publish(bc->tx_buf,
             BROKER_CLIENT_TX_SZ(bc), &pub, 0);
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        if (pub.props == &alias) {
+            pub.props = alias.next;
+        }
+#endif
 #ifdef WOLFMQTT_V5
         if (pub.props != NULL) {
             (void)MqttProps_Free(pub.props);
@@ -3132,6 +5388,9 @@ static void BrokerStaticOrphan_Drain(MqttBroker* broker, BrokerClient* bc)
             BrokerStaticClient_Close(broker, bc);
             return;
         }
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        BrokerTopicAlias_Commit(bc, alias_slot, entry->topic);
+#endif
         BROKER_FORCE_ZERO(bc->tx_buf, enc_rc);
         entry->state = BROKER_OUTQ_PUBLISH_SENT;
 #ifdef WOLFMQTT_V5
@@ -3274,51 +5533,32 @@ static void BrokerStaticOrphan_OnPubComp(MqttBroker* broker, BrokerClient* bc,
 static BrokerOrphanSession* BrokerOrphan_Find(MqttBroker* broker,
     const char* client_id)
 {
-    BrokerOrphanSession* cur;
     if (broker == NULL || client_id == NULL) {
         return NULL;
     }
-    for (cur = broker->orphan_sessions; cur != NULL; cur = cur->next) {
-        if (cur->client_id != NULL &&
-                XSTRCMP(cur->client_id, client_id) == 0) {
-            return cur;
-        }
-    }
-    return NULL;
+    return (BrokerOrphanSession*)BrokerIdIndex_Find(broker, BROKER_ID_ORPHAN,
+        client_id, (word32)XSTRLEN(client_id), NULL);
 }
 
 /* Free everything an orphan owns (queue entries + client_id) but do
  * NOT unlink from broker->orphan_sessions; the caller does that. */
 static void BrokerOrphan_FreeContents(BrokerOrphanSession* o)
 {
-    BrokerOutPub* cur;
     if (o == NULL) {
         return;
     }
-    cur = o->out_q_head;
-    while (cur != NULL) {
-        BrokerOutPub* next = cur->next;
-        BrokerOutPub_Free(cur);
-        cur = next;
-    }
-    o->out_q_head = NULL;
-    o->out_q_tail = NULL;
+    BrokerOutQ_Free(&o->out_q);
     o->out_q_count = 0;
     o->out_q_inflight = 0;
+    BrokerSlab_Free(o->packet_ids);
+    o->packet_ids = NULL;
+    /* Subs still bound by client_id alone outlive the carrier */
+    BrokerSub_SessDetach(&o->subs);
 #if WOLFMQTT_MAX_QOS >= 2
-    {
-        BrokerInboundQos2* q2cur = o->qos2_pending;
-        while (q2cur != NULL) {
-            BrokerInboundQos2* q2next = q2cur->next;
-            WOLFMQTT_FREE(q2cur);
-            q2cur = q2next;
-        }
-        o->qos2_pending = NULL;
-        o->qos2_pending_count = 0;
-    }
+    XMEMSET(&o->qos2_pending, 0, sizeof(o->qos2_pending));
 #endif
     if (o->client_id != NULL) {
-        WOLFMQTT_FREE(o->client_id);
+        BrokerSlab_Free(o->client_id);
         o->client_id = NULL;
     }
 }
@@ -3340,8 +5580,10 @@ static void BrokerOrphan_Remove(MqttBroker* broker, BrokerOrphanSession* o)
             broker->orphan_session_count--;
         }
     }
+    BrokerIdIndex_Del(broker, BROKER_ID_ORPHAN, o);
+    BrokerTimer_Cancel(broker, &o->expiry_timer);
     BrokerOrphan_FreeContents(o);
-    WOLFMQTT_FREE(o);
+    BrokerSlab_Free(o);
 }
 
 /* Drop the oldest orphan (smallest orphan_since) and its subs+persist.
@@ -3409,14 +5651,7 @@ WOLFMQTT_LOCAL void BrokerOrphan_DropFull(MqttBroker* broker,
                 else {
                     broker->subs = next;
                 }
-                if (sp->filter) {
-                    BROKER_FORCE_ZERO(sp->filter, XSTRLEN(sp->filter) + 1);
-                    WOLFMQTT_FREE(sp->filter);
-                }
-                if (sp->client_id) {
-                    WOLFMQTT_FREE(sp->client_id);
-                }
-                WOLFMQTT_FREE(sp);
+                BrokerSub_Release(broker, sp);
             }
             else {
                 prev = sp;
@@ -3428,9 +5663,10 @@ WOLFMQTT_LOCAL void BrokerOrphan_DropFull(MqttBroker* broker,
 }
 
 /* Allocate or recycle an orphan slot, then transfer the persistent
- * state of bc into it. Subs already point at NULL (caller handled);
- * the out_q on bc is unlinked from bc before this returns so
- * BrokerClient_Free does not free it. */
+ * state of bc into it, including the chain of its subs. The caller
+ * points the subs at NULL once this succeeds; the out_q on bc is
+ * unlinked from bc before this returns so BrokerClient_Free does not
+ * free it. */
 static BrokerOrphanSession* BrokerOrphan_Take(MqttBroker* broker,
     BrokerClient* bc)
 {
@@ -3463,50 +5699,56 @@ static BrokerOrphanSession* BrokerOrphan_Take(MqttBroker* broker,
         }
     }
 
-    o = (BrokerOrphanSession*)WOLFMQTT_MALLOC(sizeof(*o));
+    o = (BrokerOrphanSession*)BrokerSlab_Alloc(broker, BROKER_SLAB_ORPHAN,
+        sizeof(*o));
     if (o == NULL) {
         return NULL;
     }
     XMEMSET(o, 0, sizeof(*o));
     cid_len = XSTRLEN(bc->client_id);
-    o->client_id = (char*)WOLFMQTT_MALLOC(cid_len + 1);
+    o->client_id = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        cid_len + 1);
     if (o->client_id == NULL) {
-        WOLFMQTT_FREE(o);
+        BrokerSlab_Free(o);
         return NULL;
     }
     XMEMCPY(o->client_id, bc->client_id, cid_len);
     o->client_id[cid_len] = '\0';
+    if (BrokerIdIndex_Add(broker, BROKER_ID_ORPHAN, o) != MQTT_CODE_SUCCESS) {
+        BrokerSlab_Free(o->client_id);
+        BrokerSlab_Free(o);
+        return NULL;
+    }
 
     o->protocol_level = bc->protocol_level;
     o->session_expiry_sec = bc->session_expiry_sec;
-    o->orphan_since = WOLFMQTT_BROKER_GET_TIME_S();
+    o->orphan_since = broker->now;
 
     /* Move out_q ownership. bc->out_q_* must be cleared so
      * BrokerClient_FreeOutQueue (called from BrokerClient_Free)
      * doesn't double-free. */
-    o->out_q_head     = bc->out_q_head;
-    o->out_q_tail     = bc->out_q_tail;
+    o->out_q          = bc->out_q;
     o->out_q_count    = bc->out_q_count;
     o->out_q_inflight = bc->out_q_inflight;
-    bc->out_q_head    = NULL;
-    bc->out_q_tail    = NULL;
+    o->packet_ids     = bc->packet_ids;
+    XMEMSET(&bc->out_q, 0, sizeof(bc->out_q));
     bc->out_q_count   = 0;
     bc->out_q_inflight = 0;
+    bc->packet_ids    = NULL;
+    BrokerSub_SessMove(&o->subs, &bc->subs);
 
 #if WOLFMQTT_MAX_QOS >= 2
     /* Move QoS 2 dedup state too, so a retransmit after reconnect is
-     * still recognized instead of re-fanned-out. Same move-not-copy
-     * pattern as out_q above. */
-    o->qos2_pending       = bc->qos2_pending;
-    o->qos2_pending_count = bc->qos2_pending_count;
-    bc->qos2_pending       = NULL;
-    bc->qos2_pending_count = 0;
+     * still recognized instead of re-fanned-out. */
+    o->qos2_pending = bc->qos2_pending;
+    BrokerInboundQos2_Clear(bc);
 #endif
 
     /* Link at head; orphan_session_count tracks size. */
     o->next = broker->orphan_sessions;
     broker->orphan_sessions = o;
     broker->orphan_session_count++;
+    BrokerOrphan_ArmExpiry(broker, o);
     WBLOG_INFO(broker,
         "broker: orphan session created client_id=%s queued=%d",
         BrokerLog_Sanitize(o->client_id), o->out_q_count);
@@ -3522,8 +5764,10 @@ static BrokerOrphanSession* BrokerOrphan_Take(MqttBroker* broker,
      * the queue) are skipped by PutOutPub. */
     {
         BrokerOutPub* cur;
-        for (cur = o->out_q_head; cur != NULL; cur = cur->next) {
-            if (cur->qos > MQTT_QOS_0) {
+        word32 pos;
+        for (pos = o->out_q.head; pos != o->out_q.tail; pos++) {
+            cur = BROKER_OUTQ_AT(&o->out_q, pos);
+            if (cur->msg != NULL && cur->qos > MQTT_QOS_0) {
                 (void)BrokerPersist_PutOutPub(broker, o->client_id, cur);
             }
         }
@@ -3548,23 +5792,21 @@ static int BrokerOrphan_Reclaim(MqttBroker* broker, BrokerClient* new_bc)
     }
     /* Move queue ownership back. The new bc's own out_q is expected
      * to be empty at this point (fresh BrokerClient post-CONNECT). */
-    new_bc->out_q_head     = o->out_q_head;
-    new_bc->out_q_tail     = o->out_q_tail;
+    new_bc->out_q          = o->out_q;
     new_bc->out_q_count    = o->out_q_count;
     new_bc->out_q_inflight = 0;
-    o->out_q_head = NULL;
-    o->out_q_tail = NULL;
+    new_bc->packet_ids     = o->packet_ids;
+    XMEMSET(&o->out_q, 0, sizeof(o->out_q));
     o->out_q_count = 0;
     o->out_q_inflight = 0;
+    o->packet_ids = NULL;
     if (new_bc->session_expiry_sec == 0xFFFFFFFFu) {
         new_bc->session_expiry_sec = o->session_expiry_sec;
     }
 #if WOLFMQTT_MAX_QOS >= 2
     /* Move QoS 2 dedup state back before any new PUBLISH is processed. */
-    new_bc->qos2_pending       = o->qos2_pending;
-    new_bc->qos2_pending_count = o->qos2_pending_count;
-    o->qos2_pending       = NULL;
-    o->qos2_pending_count = 0;
+    new_bc->qos2_pending = o->qos2_pending;
+    XMEMSET(&o->qos2_pending, 0, sizeof(o->qos2_pending));
 #endif
     /* MQTT-4.4.0-1: any message that was previously in-flight on the old
      * session is re-sent on resume. PUBLISH_SENT -> QUEUED with
@@ -3572,11 +5814,18 @@ static int BrokerOrphan_Reclaim(MqttBroker* broker, BrokerClient* new_bc)
      * PUBREL_SENT stays PUBREL_SENT but is also flagged retransmit_dup so
      * the drain re-sends a fresh PUBREL (same packet_id; PUBREL carries no
      * DUP flag) - the subscriber will not re-send PUBREC, so the broker
-     * must drive the PUBREL/PUBCOMP completion itself. */
+     * must drive the PUBREL/PUBCOMP completion itself. The drain cursor
+     * goes back to the head so the next drain visits both. */
     {
-        BrokerOutPub* e = new_bc->out_q_head;
+        BrokerOutPub* e;
+        word32 pos;
         int retx = 0;
-        while (e != NULL) {
+        new_bc->out_q.unsent = new_bc->out_q.head;
+        for (pos = new_bc->out_q.head; pos != new_bc->out_q.tail; pos++) {
+            e = BROKER_OUTQ_AT(&new_bc->out_q, pos);
+            if (e->msg == NULL) {
+                continue;
+            }
             if (e->state == BROKER_OUTQ_PUBLISH_SENT) {
                 e->state = BROKER_OUTQ_QUEUED;
                 e->retransmit_dup = 1;
@@ -3591,7 +5840,6 @@ static int BrokerOrphan_Reclaim(MqttBroker* broker, BrokerClient* new_bc)
                 e->retransmit_dup = 1;
                 new_bc->out_q_inflight++;
             }
-            e = e->next;
         }
         if (retx > 0) {
             WBLOG_INFO(broker,
@@ -3616,31 +5864,23 @@ static int BrokerOrphan_Reclaim(MqttBroker* broker, BrokerClient* new_bc)
 
 /* Enqueue a fan-out target onto an orphan session's queue. Called from
  * BrokerHandle_Publish when sub->client is NULL but an orphan with the
- * matching client_id exists. QoS 0 is dropped per spec; only persistent
- * messages live in the offline queue. */
+ * matching client_id exists; the entry shares the fan-out's msg (NULL
+ * when it could not be allocated). QoS 0 is dropped per spec; only
+ * persistent messages live in the offline queue. */
 static void BrokerOrphan_Enqueue(MqttBroker* broker, BrokerOrphanSession* o,
-    const char* topic, const byte* payload, word32 payload_len,
-    MqttQoS qos, byte retain
-#ifdef WOLFMQTT_V5
-    , const MqttProp* src_props
-#endif
-    )
+    BrokerMsg* msg, MqttQoS qos, byte retain)
 {
     BrokerOutPub* e;
-    if (broker == NULL || o == NULL || topic == NULL ||
-            qos == MQTT_QOS_0) {
+    if (broker == NULL || o == NULL || qos == MQTT_QOS_0) {
         return;
     }
     /* Drop-oldest eviction when the per-session offline queue is full. */
     while (o->out_q_count >= BROKER_MAX_OFFLINE_MSGS_PER_SUB) {
-        BrokerOutPub* head = o->out_q_head;
-        if (head == NULL) {
+        BrokerOutPub* head;
+        if (o->out_q.head == o->out_q.tail) {
             break;
         }
-        o->out_q_head = head->next;
-        if (o->out_q_tail == head) {
-            o->out_q_tail = NULL;
-        }
+        head = BROKER_OUTQ_AT(&o->out_q, o->out_q.head);
         if (o->out_q_count > 0) {
             o->out_q_count--;
         }
@@ -3657,35 +5897,21 @@ static void BrokerOrphan_Enqueue(MqttBroker* broker, BrokerOrphanSession* o,
                 head->packet_id);
         }
     #endif
-        BrokerOutPub_Free(head);
+        BrokerOutQ_Remove(&o->out_q, o->packet_ids, head);
     }
 
-    e = BrokerOutPub_Alloc(topic, payload, payload_len
-#ifdef WOLFMQTT_V5
-        , src_props
-#endif
-        );
-    if (e == NULL) {
+    if (BrokerOutQ_Push(broker, &o->out_q, &o->packet_ids, msg, qos, &e) !=
+            MQTT_CODE_SUCCESS) {
         WBLOG_ERR(broker,
             "broker: orphan enqueue alloc failed client_id=%s",
             BrokerLog_Sanitize(
                 BROKER_STR_VALID(o->client_id) ? o->client_id : "(null)"));
         return;
     }
-    e->qos = qos;
-    e->packet_id = BrokerNextPacketId(broker);
     e->retain = retain;
     e->state = BROKER_OUTQ_QUEUED;
-    e->enq_time = WOLFMQTT_BROKER_GET_TIME_S();
+    e->enq_time = broker->now;
     e->protocol_level = o->protocol_level;
-    e->next = NULL;
-    if (o->out_q_tail != NULL) {
-        o->out_q_tail->next = e;
-    }
-    else {
-        o->out_q_head = e;
-    }
-    o->out_q_tail = e;
     o->out_q_count++;
 #ifdef WOLFMQTT_BROKER_PERSIST
     (void)BrokerPersist_PutOutPub(broker, o->client_id, e);
@@ -3694,7 +5920,7 @@ static void BrokerOrphan_Enqueue(MqttBroker* broker, BrokerOrphanSession* o,
         "broker: orphan enqueue client_id=%s topic=%s qos=%d count=%d",
         BrokerLog_Sanitize(
             BROKER_STR_VALID(o->client_id) ? o->client_id : "(null)"),
-        BrokerLog_Sanitize(topic), (int)qos, o->out_q_count);
+        BrokerLog_Sanitize(msg->topic), (int)qos, o->out_q_count);
 }
 
 /* Free every orphan (used by MqttBroker_Free and by wipe paths). */
@@ -3707,45 +5933,53 @@ static void BrokerOrphan_FreeAll(MqttBroker* broker)
     cur = broker->orphan_sessions;
     while (cur != NULL) {
         BrokerOrphanSession* next = cur->next;
+        BrokerIdIndex_Del(broker, BROKER_ID_ORPHAN, cur);
+        BrokerTimer_Cancel(broker, &cur->expiry_timer);
         BrokerOrphan_FreeContents(cur);
-        WOLFMQTT_FREE(cur);
+        BrokerSlab_Free(cur);
         cur = next;
     }
     broker->orphan_sessions = NULL;
     broker->orphan_session_count = 0;
 }
 
-/* Drop orphan sessions whose finite Session Expiry has elapsed. */
-static void BrokerOrphan_ExpireSweep(MqttBroker* broker)
+WOLFMQTT_LOCAL void BrokerOrphan_ArmExpiry(MqttBroker* broker,
+    BrokerOrphanSession* o)
 {
-    BrokerOrphanSession* cur;
-    WOLFMQTT_BROKER_TIME_T now;
-    int dropped;
-    if (broker == NULL) {
+    if (broker == NULL || o == NULL) {
         return;
     }
-    now = WOLFMQTT_BROKER_GET_TIME_S();
-    /* Re-scan from head after each removal; DropFull mutates the list. */
-    do {
-        dropped = 0;
-        for (cur = broker->orphan_sessions; cur != NULL; cur = cur->next) {
-            /* Compare in WOLFMQTT_BROKER_TIME_T (may be wider than word32)
-             * rather than narrowing the elapsed delta down to compare
-             * against session_expiry_sec. */
-            if (cur->session_expiry_sec != 0xFFFFFFFFu &&
-                    now >= cur->orphan_since &&
-                    (now - cur->orphan_since) >=
-                        (WOLFMQTT_BROKER_TIME_T)cur->session_expiry_sec) {
-                WBLOG_INFO(broker,
-                    "broker: orphan session expired client_id=%s",
-                    BrokerLog_Sanitize(BROKER_STR_VALID(cur->client_id)
-                        ? cur->client_id : "(null)"));
-                BrokerOrphan_DropFull(broker, cur);
-                dropped = 1;
-                break;
-            }
-        }
-    } while (dropped);
+    if (o->session_expiry_sec == 0xFFFFFFFFu) {
+        BrokerTimer_Cancel(broker, &o->expiry_timer);
+        return;
+    }
+    BrokerTimer_Arm(broker, &o->expiry_timer, BROKER_TIMER_ORPHAN, o,
+        BrokerTimer_After(o->orphan_since,
+            (WOLFMQTT_BROKER_TIME_T)o->session_expiry_sec));
+}
+
+/* Session Expiry timer callback: drop the orphan once its finite Session
+ * Expiry has elapsed. */
+static void BrokerOrphan_OnExpiry(MqttBroker* broker, BrokerOrphanSession* o)
+{
+    WOLFMQTT_BROKER_TIME_T now = broker->now;
+
+    if (o->session_expiry_sec == 0xFFFFFFFFu) {
+        return;
+    }
+    /* Compare in WOLFMQTT_BROKER_TIME_T (may be wider than word32) rather
+     * than narrowing the elapsed delta down to compare against
+     * session_expiry_sec. now >= orphan_since guards a backward clock
+     * step, which must not expire the session early. */
+    if (now < o->orphan_since || (now - o->orphan_since) <
+            (WOLFMQTT_BROKER_TIME_T)o->session_expiry_sec) {
+        BrokerTimer_Defer(broker, &o->expiry_timer);
+        return;
+    }
+    WBLOG_INFO(broker, "broker: orphan session expired client_id=%s",
+        BrokerLog_Sanitize(BROKER_STR_VALID(o->client_id)
+            ? o->client_id : "(null)"));
+    BrokerOrphan_DropFull(broker, o);
 }
 #endif /* !WOLFMQTT_STATIC_MEMORY */
 
@@ -3791,7 +6025,8 @@ static void BrokerSubs_OrphanClient(MqttBroker* broker, BrokerClient* bc)
             BrokerStaticOrphan_SaveInboundQos2(static_orphan, bc);
 #endif
             static_orphan->session_expiry_sec = bc->session_expiry_sec;
-            static_orphan->orphan_since = WOLFMQTT_BROKER_GET_TIME_S();
+            static_orphan->orphan_since = broker->now;
+            BrokerStaticOrphan_ArmExpiry(broker, static_orphan);
 #ifdef WOLFMQTT_BROKER_PERSIST
             (void)BrokerPersist_PutOrphanSession(broker,
                 static_orphan->client_id, static_orphan->protocol_level,
@@ -3881,7 +6116,7 @@ static void BrokerSubs_RemoveClient(MqttBroker* broker, BrokerClient* bc)
 #ifdef WOLFMQTT_STATIC_MEMORY
     for (i = 0; i < BROKER_MAX_SUBS; i++) {
         if (broker->subs[i].in_use && broker->subs[i].client == bc) {
-            XMEMSET(&broker->subs[i], 0, sizeof(BrokerSub));
+            BrokerSub_Release(broker, &broker->subs[i]);
         }
     }
 #else
@@ -3894,14 +6129,7 @@ static void BrokerSubs_RemoveClient(MqttBroker* broker, BrokerClient* bc)
             else {
                 broker->subs = next;
             }
-            if (cur->filter) {
-                BROKER_FORCE_ZERO(cur->filter, XSTRLEN(cur->filter) + 1);
-                WOLFMQTT_FREE(cur->filter);
-            }
-            if (cur->client_id) {
-                WOLFMQTT_FREE(cur->client_id);
-            }
-            WOLFMQTT_FREE(cur);
+            BrokerSub_Release(broker, cur);
         }
         else {
             prev = cur;
@@ -4015,13 +6243,15 @@ static int BrokerSubs_Add(MqttBroker* broker, BrokerClient* bc,
         sub->filter[filter_len] = '\0';
     }
 #else
-    sub = (BrokerSub*)WOLFMQTT_MALLOC(sizeof(BrokerSub));
+    sub = (BrokerSub*)BrokerSlab_Alloc(broker, BROKER_SLAB_SUB,
+        sizeof(BrokerSub));
     if (sub == NULL) {
         rc = MQTT_CODE_ERROR_MEMORY;
     }
     if (rc == MQTT_CODE_SUCCESS) {
         XMEMSET(sub, 0, sizeof(*sub));
-        sub->filter = (char*)WOLFMQTT_MALLOC(filter_len + 1);
+        sub->filter = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+            (size_t)filter_len + 1);
         if (sub->filter == NULL) {
             rc = MQTT_CODE_ERROR_MEMORY;
         }
@@ -4033,112 +6263,449 @@ static int BrokerSubs_Add(MqttBroker* broker, BrokerClient* bc,
         broker->subs = sub;
     }
     else if (sub != NULL) {
-        WOLFMQTT_FREE(sub);
+        BrokerSlab_Free(sub);
+    }
+#endif
+
+    if (rc == MQTT_CODE_SUCCESS) {
+        sub->client = bc;
+        sub->qos = qos;
+        /* Store client_id for session persistence */
+#ifdef WOLFMQTT_STATIC_MEMORY
+        if (BROKER_STR_VALID(bc->client_id)) {
+            int id_len = (int)XSTRLEN(bc->client_id);
+            if (id_len >= BROKER_MAX_CLIENT_ID_LEN) {
+                id_len = BROKER_MAX_CLIENT_ID_LEN - 1;
+            }
+            XMEMCPY(sub->client_id, bc->client_id, (size_t)id_len);
+            sub->client_id[id_len] = '\0';
+        }
+#else
+        if (BROKER_STR_VALID(bc->client_id)) {
+            int id_len = (int)XSTRLEN(bc->client_id);
+            sub->client_id = (char*)BrokerSlab_Alloc(broker,
+                BROKER_SLAB_SIZED, (size_t)id_len + 1);
+            if (sub->client_id != NULL) {
+                XMEMCPY(sub->client_id, bc->client_id, (size_t)id_len + 1);
+            }
+        }
+        BrokerSub_SessLink(&bc->subs, sub);
+#endif
+        BrokerSubTree_Insert(broker, sub);
+        bc->sub_count++;
+        WBLOG_INFO(broker, "broker: sub add sock=%d filter=%s qos=%d",
+            (int)bc->sock, BrokerLog_Sanitize(sub->filter), qos);
+        /* 1 = newly created (vs. 0 = updated), for Retain Handling = 1. */
+        return 1;
+    }
+    return rc;
+}
+
+static void BrokerSubs_Remove(MqttBroker* broker, BrokerClient* bc,
+    const char* filter, word16 filter_len)
+{
+#ifdef WOLFMQTT_STATIC_MEMORY
+    int i;
+#else
+    BrokerSub *cur;
+    BrokerSub *prev = NULL;
+#endif
+
+#ifdef WOLFMQTT_STATIC_MEMORY
+    for (i = 0; i < BROKER_MAX_SUBS; i++) {
+        BrokerSub* s = &broker->subs[i];
+        if (s->in_use && s->client == bc &&
+            s->filter[0] != '\0' &&
+            (word16)XSTRLEN(s->filter) == filter_len &&
+            XMEMCMP(s->filter, filter, filter_len) == 0) {
+            WBLOG_INFO(broker, "broker: sub remove sock=%d filter=%s",
+                (int)bc->sock, BrokerLog_Sanitize(s->filter));
+            BrokerSub_Release(broker, s);
+            if (bc->sub_count > 0) {
+                bc->sub_count--;
+            }
+            return;
+        }
+    }
+#else
+    cur = broker->subs;
+    while (cur) {
+        BrokerSub* next = cur->next;
+        if (cur->client == bc &&
+            cur->filter != NULL &&
+            (word16)XSTRLEN(cur->filter) == filter_len &&
+            XMEMCMP(cur->filter, filter, filter_len) == 0) {
+            if (prev) {
+                prev->next = next;
+            }
+            else {
+                broker->subs = next;
+            }
+            WBLOG_INFO(broker, "broker: sub remove sock=%d filter=%s",
+                (int)bc->sock, BrokerLog_Sanitize(cur->filter));
+            BrokerSub_Release(broker, cur);
+            if (bc->sub_count > 0) {
+                bc->sub_count--;
+            }
+            return;
+        }
+        prev = cur;
+        cur = next;
+    }
+#endif
+}
+
+/* -------------------------------------------------------------------------- */
+/* Client ID index                                                             */
+/* -------------------------------------------------------------------------- */
+#ifndef WOLFMQTT_STATIC_MEMORY
+    /* Initial slot count; it doubles at half full */
+    #define BROKER_ID_INDEX_MIN 64
+#endif
+
+static const char* BrokerIdIndex_Id(byte kind, const void* obj)
+{
+    if (kind == BROKER_ID_CLIENT) {
+        return ((const BrokerClient*)obj)->client_id;
+    }
+#if defined(WOLFMQTT_BROKER_PERSIST) && !defined(WOLFMQTT_STATIC_MEMORY)
+    if (kind == BROKER_ID_SUBS_LOG) {
+        return ((const BrokerSubsLog*)obj)->client_id;
+    }
+#endif
+#ifdef WOLFMQTT_STATIC_MEMORY
+    return ((const BrokerStaticOrphanSession*)obj)->client_id;
+#else
+    return ((const BrokerOrphanSession*)obj)->client_id;
+#endif
+}
+
+/* FNV-1a */
+static word32 BrokerIdIndex_Hash(const char* id, word32 len)
+{
+    word32 h = 2166136261u;
+    word32 i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (byte)id[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static word32 BrokerIdIndex_Cap(const BrokerIdIndex* x)
+{
+#ifdef WOLFMQTT_STATIC_MEMORY
+    (void)x;
+    return BROKER_ID_INDEX_SZ;
+#else
+    return x->cap;
+#endif
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+static int BrokerIdIndex_Grow(BrokerIdIndex* x)
+{
+    word32 cap = (x->cap == 0) ? BROKER_ID_INDEX_MIN : x->cap * 2;
+    BrokerIdEntry* slots;
+    word32 i, j;
+
+    slots = (BrokerIdEntry*)WOLFMQTT_MALLOC(cap * sizeof(BrokerIdEntry));
+    if (slots == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    XMEMSET(slots, 0, cap * sizeof(BrokerIdEntry));
+    for (i = 0; i < x->cap; i++) {
+        if (x->slots[i].obj != NULL) {
+            j = x->slots[i].hash % cap;
+            while (slots[j].obj != NULL) {
+                j = (j + 1) % cap;
+            }
+            slots[j] = x->slots[i];
+        }
+    }
+    if (x->slots != NULL) {
+        WOLFMQTT_FREE(x->slots);
+    }
+    x->slots = slots;
+    x->cap = cap;
+    return MQTT_CODE_SUCCESS;
+}
+#endif
+
+WOLFMQTT_LOCAL int BrokerIdIndex_Add(MqttBroker* broker, byte kind,
+    void* obj)
+{
+    BrokerIdIndex* x = &broker->ids;
+    const char* id = BrokerIdIndex_Id(kind, obj);
+    word32 cap, h, i;
+
+    if (!BROKER_STR_VALID(id)) {
+        return MQTT_CODE_ERROR_BAD_ARG;
     }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    /* A failed grow is only fatal once no empty slot would be left */
+    if ((x->count + 1) * 2 > x->cap) {
+        (void)BrokerIdIndex_Grow(x);
+    }
+#endif
+    cap = BrokerIdIndex_Cap(x);
+    if (x->count + 1 >= cap) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    h = BrokerIdIndex_Hash(id, (word32)XSTRLEN(id));
+    i = h % cap;
+    while (x->slots[i].obj != NULL) {
+        i = (i + 1) % cap;
+    }
+    x->slots[i].obj = obj;
+    x->slots[i].hash = h;
+    x->slots[i].kind = kind;
+    x->count++;
+    return MQTT_CODE_SUCCESS;
+}
+
+/* Remove obj's entry, if it has one. Must run while obj still holds the
+ * ID it was added with. */
+WOLFMQTT_LOCAL void BrokerIdIndex_Del(MqttBroker* broker, byte kind,
+    void* obj)
+{
+    BrokerIdIndex* x = &broker->ids;
+    const char* id = BrokerIdIndex_Id(kind, obj);
+    word32 cap, i, j, home;
+
+    if (x->count == 0 || !BROKER_STR_VALID(id)) {
+        return;
+    }
+    cap = BrokerIdIndex_Cap(x);
+    i = BrokerIdIndex_Hash(id, (word32)XSTRLEN(id)) % cap;
+    while (x->slots[i].obj != obj) {
+        if (x->slots[i].obj == NULL) {
+            return;
+        }
+        i = (i + 1) % cap;
+    }
+    /* Close the gap: pull back each later entry of the probe run whose
+     * home slot does not lie cyclically in (i, j], so every remaining
+     * entry stays reachable from its home without tombstones. */
+    j = i;
+    for (;;) {
+        j = (j + 1) % cap;
+        if (x->slots[j].obj == NULL) {
+            break;
+        }
+        home = x->slots[j].hash % cap;
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            x->slots[i] = x->slots[j];
+            i = j;
+        }
+    }
+    XMEMSET(&x->slots[i], 0, sizeof(x->slots[i]));
+    x->count--;
+}
+
+/* Next object of kind whose ID is id[0..len), continuing from probe *step
+ * (0 to start). NULL once the probe run ends. */
+static void* BrokerIdIndex_Next(MqttBroker* broker, byte kind,
+    const char* id, word32 len, word32* step)
+{
+    BrokerIdIndex* x = &broker->ids;
+    word32 cap, h, home;
+
+    if (x->count == 0 || id == NULL || len == 0) {
+        return NULL;
+    }
+    cap = BrokerIdIndex_Cap(x);
+    h = BrokerIdIndex_Hash(id, len);
+    home = h % cap;
+    while (*step < cap) {
+        BrokerIdEntry* e = &x->slots[(home + *step) % cap];
+        if (e->obj == NULL) {
+            break;
+        }
+        (*step)++;
+        if (e->hash == h && e->kind == kind) {
+            const char* eid = BrokerIdIndex_Id(kind, e->obj);
+            if (XSTRNCMP(eid, id, len) == 0 && eid[len] == '\0') {
+                return e->obj;
+            }
+        }
+    }
+    return NULL;
+}
+
+WOLFMQTT_LOCAL void* BrokerIdIndex_Find(MqttBroker* broker, byte kind,
+    const char* id, word32 len, const void* exclude)
+{
+    word32 step = 0;
+    void* obj;
+
+    do {
+        obj = BrokerIdIndex_Next(broker, kind, id, len, &step);
+    } while (obj != NULL && obj == exclude);
+    return obj;
+}
+
+static void BrokerIdIndex_Free(MqttBroker* broker)
+{
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (broker->ids.slots != NULL) {
+        WOLFMQTT_FREE(broker->ids.slots);
+    }
+#endif
+    XMEMSET(&broker->ids, 0, sizeof(broker->ids));
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* -------------------------------------------------------------------------- */
+/* Slab allocator                                                              */
+/* -------------------------------------------------------------------------- */
+/* Block sizes are kept a multiple of the header so every header in a chunk
+ * stays aligned */
+#define BROKER_SLAB_ROUND(sz) \
+    (((sz) + sizeof(BrokerSlabHdr) - 1) & ~(sizeof(BrokerSlabHdr) - 1))
+
+static void BrokerSlab_Init(MqttBroker* broker)
+{
+    BrokerSlabPool* p = broker->slab.pools;
+    int c;
+
+    p[BROKER_SLAB_SUB].block_sz = (word32)BROKER_SLAB_ROUND(sizeof(BrokerSub));
+    p[BROKER_SLAB_ORPHAN].block_sz =
+        (word32)BROKER_SLAB_ROUND(sizeof(BrokerOrphanSession));
+#ifdef WOLFMQTT_V5
+    p[BROKER_SLAB_PROP].block_sz = (word32)BROKER_SLAB_ROUND(sizeof(MqttProp));
+#endif
+    for (c = BROKER_SLAB_32; c < BROKER_SLAB_LARGE; c++) {
+        p[c].block_sz = (word32)32 << (c - BROKER_SLAB_32);
+    }
+}
+
+#ifndef WOLFMQTT_BROKER_NO_SLAB
+/* Carve a new chunk into pool's free list */
+static int BrokerSlab_Grow(MqttBroker* broker, BrokerSlabPool* pool)
+{
+    size_t stride = sizeof(BrokerSlabHdr) + pool->block_sz;
+    size_t n = (BROKER_SLAB_CHUNK_SZ - sizeof(BrokerSlabHdr)) / stride;
+    BrokerSlabHdr* chunk;
+    byte* b;
+
+    if (n == 0) {
+        n = 1;
+    }
+    chunk = (BrokerSlabHdr*)BROKER_SLAB_MALLOC(sizeof(BrokerSlabHdr) +
+        n * stride);
+    if (chunk == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    chunk->next = broker->slab.chunks;
+    broker->slab.chunks = chunk;
+    pool->chunks++;
+    for (b = (byte*)(chunk + 1); n > 0; n--, b += stride) {
+        BrokerSlabHdr* h = (BrokerSlabHdr*)b;
+        h->next = pool->free_list;
+        pool->free_list = h;
+        pool->free++;
+    }
+    return MQTT_CODE_SUCCESS;
+}
 #endif
 
-    if (rc == MQTT_CODE_SUCCESS) {
-        sub->client = bc;
-        sub->qos = qos;
-        /* Store client_id for session persistence */
-#ifdef WOLFMQTT_STATIC_MEMORY
-        if (BROKER_STR_VALID(bc->client_id)) {
-            int id_len = (int)XSTRLEN(bc->client_id);
-            if (id_len >= BROKER_MAX_CLIENT_ID_LEN) {
-                id_len = BROKER_MAX_CLIENT_ID_LEN - 1;
+WOLFMQTT_LOCAL void* BrokerSlab_Alloc(MqttBroker* broker, int cls,
+    size_t size)
+{
+    BrokerSlabPool* pool = NULL;
+    BrokerSlabHdr* h;
+
+    if (broker != NULL) {
+        if (cls < 0 || cls >= BROKER_SLAB_CLASS_CNT ||
+                size > broker->slab.pools[cls].block_sz) {
+            for (cls = BROKER_SLAB_32; cls < BROKER_SLAB_LARGE; cls++) {
+                if (size <= broker->slab.pools[cls].block_sz) {
+                    break;
+                }
             }
-            XMEMCPY(sub->client_id, bc->client_id, (size_t)id_len);
-            sub->client_id[id_len] = '\0';
         }
-#else
-        if (BROKER_STR_VALID(bc->client_id)) {
-            int id_len = (int)XSTRLEN(bc->client_id);
-            sub->client_id = (char*)WOLFMQTT_MALLOC((size_t)id_len + 1);
-            if (sub->client_id != NULL) {
-                XMEMCPY(sub->client_id, bc->client_id, (size_t)id_len + 1);
-            }
+        pool = &broker->slab.pools[cls];
+    }
+#ifndef WOLFMQTT_BROKER_NO_SLAB
+    if (pool != NULL && pool->block_sz > 0) {
+        if (pool->free_list == NULL &&
+                BrokerSlab_Grow(broker, pool) != MQTT_CODE_SUCCESS) {
+            return NULL;
         }
+        h = pool->free_list;
+        pool->free_list = h->next;
+        pool->free--;
+        h->pool = pool;
+        pool->in_use++;
+        return h + 1;
+    }
 #endif
-        bc->sub_count++;
-        WBLOG_INFO(broker, "broker: sub add sock=%d filter=%s qos=%d",
-            (int)bc->sock, BrokerLog_Sanitize(sub->filter), qos);
-        /* 1 = newly created (vs. 0 = updated), for Retain Handling = 1. */
-        return 1;
+    h = (BrokerSlabHdr*)BROKER_SLAB_MALLOC(sizeof(BrokerSlabHdr) + size);
+    if (h == NULL) {
+        return NULL;
     }
-    return rc;
+    h->pool = pool;
+    if (pool != NULL) {
+        pool->in_use++;
+    }
+    return h + 1;
 }
 
-static void BrokerSubs_Remove(MqttBroker* broker, BrokerClient* bc,
-    const char* filter, word16 filter_len)
+WOLFMQTT_LOCAL void BrokerSlab_Free(void* p)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-#else
-    BrokerSub *cur;
-    BrokerSub *prev = NULL;
-#endif
+    BrokerSlabHdr* h;
+    BrokerSlabPool* pool;
 
-#ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_SUBS; i++) {
-        BrokerSub* s = &broker->subs[i];
-        if (s->in_use && s->client == bc &&
-            s->filter[0] != '\0' &&
-            (word16)XSTRLEN(s->filter) == filter_len &&
-            XMEMCMP(s->filter, filter, filter_len) == 0) {
-            WBLOG_INFO(broker, "broker: sub remove sock=%d filter=%s",
-                (int)bc->sock, BrokerLog_Sanitize(s->filter));
-            XMEMSET(s, 0, sizeof(BrokerSub));
-            if (bc->sub_count > 0) {
-                bc->sub_count--;
-            }
-            return;
-        }
+    if (p == NULL) {
+        return;
     }
-#else
-    cur = broker->subs;
-    while (cur) {
-        BrokerSub* next = cur->next;
-        if (cur->client == bc &&
-            cur->filter != NULL &&
-            (word16)XSTRLEN(cur->filter) == filter_len &&
-            XMEMCMP(cur->filter, filter, filter_len) == 0) {
-            if (prev) {
-                prev->next = next;
-            }
-            else {
-                broker->subs = next;
-            }
-            WBLOG_INFO(broker, "broker: sub remove sock=%d filter=%s",
-                (int)bc->sock, BrokerLog_Sanitize(cur->filter));
-            BROKER_FORCE_ZERO(cur->filter, XSTRLEN(cur->filter) + 1);
-            WOLFMQTT_FREE(cur->filter);
-            if (cur->client_id) {
-                WOLFMQTT_FREE(cur->client_id);
-            }
-            WOLFMQTT_FREE(cur);
-            if (bc->sub_count > 0) {
-                bc->sub_count--;
-            }
-            return;
-        }
-        prev = cur;
-        cur = next;
+    h = (BrokerSlabHdr*)p - 1;
+    pool = h->pool;
+    if (pool != NULL) {
+        pool->in_use--;
+    }
+#ifndef WOLFMQTT_BROKER_NO_SLAB
+    if (pool != NULL && pool->block_sz > 0) {
+        h->next = pool->free_list;
+        pool->free_list = h;
+        pool->free++;
+        return;
     }
 #endif
+    BROKER_SLAB_FREE(h);
 }
 
-/* -------------------------------------------------------------------------- */
-/* Packet ID generation                                                        */
-/* -------------------------------------------------------------------------- */
-static word16 BrokerNextPacketId(MqttBroker* broker)
+/* Return every chunk to the backing allocator. Nothing may still be
+ * allocated from the slab. */
+static void BrokerSlab_FreeAll(MqttBroker* broker)
 {
-    word16 id = broker->next_packet_id;
-    broker->next_packet_id++;
-    if (broker->next_packet_id == 0) {
-        broker->next_packet_id = 1; /* wrap: skip 0 */
+    while (broker->slab.chunks != NULL) {
+        BrokerSlabHdr* chunk = broker->slab.chunks;
+        broker->slab.chunks = chunk->next;
+        BROKER_SLAB_FREE(chunk);
     }
-    return id;
+    XMEMSET(&broker->slab, 0, sizeof(broker->slab));
+}
+
+int MqttBroker_SlabStats(MqttBroker* broker, int cls,
+    MqttBrokerSlabStats* stats)
+{
+    const BrokerSlabPool* pool;
+
+    if (broker == NULL || stats == NULL || cls < 0 ||
+            cls >= BROKER_SLAB_CLASS_CNT) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    pool = &broker->slab.pools[cls];
+    stats->block_sz = pool->block_sz;
+    stats->in_use = pool->in_use;
+    stats->free = pool->free;
+    stats->chunks = pool->chunks;
+    return MQTT_CODE_SUCCESS;
 }
+#endif /* !WOLFMQTT_STATIC_MEMORY */
 
 /* -------------------------------------------------------------------------- */
 /* Client lookup by ID                                                         */
@@ -4146,35 +6713,11 @@ static word16 BrokerNextPacketId(MqttBroker* broker)
 static BrokerClient* BrokerClient_FindByClientId(MqttBroker* broker,
     const char* client_id, BrokerClient* exclude)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-#else
-    BrokerClient* bc;
-#endif
-
     if (broker == NULL || client_id == NULL || client_id[0] == '\0') {
         return NULL;
     }
-#ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
-        BrokerClient* bc = &broker->clients[i];
-        if (!bc->in_use) continue;
-        if (bc != exclude && BROKER_STR_VALID(bc->client_id) &&
-            XSTRCMP(bc->client_id, client_id) == 0) {
-            return bc;
-        }
-    }
-#else
-    bc = broker->clients;
-    while (bc) {
-        if (bc != exclude && BROKER_STR_VALID(bc->client_id) &&
-            XSTRCMP(bc->client_id, client_id) == 0) {
-            return bc;
-        }
-        bc = bc->next;
-    }
-#endif
-    return NULL;
+    return (BrokerClient*)BrokerIdIndex_Find(broker, BROKER_ID_CLIENT,
+        client_id, (word32)XSTRLEN(client_id), exclude);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -4201,13 +6744,13 @@ static void BrokerSubs_RemoveByClientId(MqttBroker* broker,
         if (s->client != NULL &&
             s->client->client_id[0] != '\0' &&
             XSTRCMP(s->client->client_id, client_id) == 0) {
-            XMEMSET(s, 0, sizeof(BrokerSub));
+            BrokerSub_Release(broker, s);
         }
         /* Check orphaned subs (stored client_id) */
         else if (s->client == NULL &&
             BROKER_STR_VALID(s->client_id) &&
             XSTRCMP(s->client_id, client_id) == 0) {
-            XMEMSET(s, 0, sizeof(BrokerSub));
+            BrokerSub_Release(broker, s);
         }
     }
 #else
@@ -4233,14 +6776,7 @@ static void BrokerSubs_RemoveByClientId(MqttBroker* broker,
             else {
                 broker->subs = next;
             }
-            if (cur->filter) {
-                BROKER_FORCE_ZERO(cur->filter, XSTRLEN(cur->filter) + 1);
-                WOLFMQTT_FREE(cur->filter);
-            }
-            if (cur->client_id) {
-                WOLFMQTT_FREE(cur->client_id);
-            }
-            WOLFMQTT_FREE(cur);
+            BrokerSub_Release(broker, cur);
         }
         else {
             prev = cur;
@@ -4284,100 +6820,516 @@ static int BrokerSubs_ReassociateClient(MqttBroker* broker,
             s->client = new_bc;
             count++;
         }
-    }
-#else
-    s = broker->subs;
-    while (s) {
-        /* Check orphaned subs (client=NULL, client_id stored in sub) */
-        if (s->client == NULL && BROKER_STR_VALID(s->client_id) &&
-            XSTRCMP(s->client_id, client_id) == 0) {
-            s->client = new_bc;
-            count++;
+    }
+#else
+    s = broker->subs;
+    while (s) {
+        int move = 0;
+        /* Check orphaned subs (client=NULL, client_id stored in sub) */
+        if (s->client == NULL && BROKER_STR_VALID(s->client_id) &&
+            XSTRCMP(s->client_id, client_id) == 0) {
+            move = 1;
+        }
+        /* Check subs with active client (takeover scenario) */
+        else if (s->client != NULL && BROKER_STR_VALID(s->client->client_id) &&
+            XSTRCMP(s->client->client_id, client_id) == 0) {
+            move = 1;
+        }
+        if (move) {
+            s->client = new_bc;
+            BrokerSub_SessUnlink(s);
+            BrokerSub_SessLink(&new_bc->subs, s);
+            count++;
+        }
+        s = s->next;
+    }
+#endif
+    if (count > 0) {
+        /* The new client now owns these subs; reflect them in its cap count
+         * so a reconnect cannot be used to exceed BROKER_MAX_SUBS_PER_CLIENT. */
+        new_bc->sub_count += count;
+        WBLOG_INFO(broker, "broker: reassociated %d subs for client_id=%s",
+            count, BrokerLog_Sanitize(client_id));
+    }
+    return count;
+}
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* -------------------------------------------------------------------------- */
+/* Cross-shard messages                                                        */
+/* -------------------------------------------------------------------------- */
+/* Topic and payload are copied into the same allocation as the header. A
+ * NULL payload with a non-zero length reserves the space for the caller to
+ * fill. The caller holds the only reference until the message is sent. */
+static BrokerShardMsg* BrokerShardMsg_New(byte kind, const char* topic,
+    const byte* payload, word32 payload_len)
+{
+    word32 topic_len = (topic != NULL) ? (word32)XSTRLEN(topic) + 1 : 0;
+    BrokerShardMsg* msg;
+    byte* p;
+
+    msg = (BrokerShardMsg*)WOLFMQTT_MALLOC(sizeof(BrokerShardMsg) +
+        topic_len + payload_len);
+    if (msg == NULL) {
+        return NULL;
+    }
+    XMEMSET(msg, 0, sizeof(*msg));
+    msg->refs = 1;
+    msg->kind = kind;
+    msg->sock = BROKER_SOCKET_INVALID;
+    p = (byte*)(msg + 1);
+    if (topic != NULL) {
+        msg->topic = (char*)p;
+        XMEMCPY(p, topic, topic_len);
+        p += topic_len;
+    }
+    if (payload_len > 0) {
+        msg->payload = p;
+        if (payload != NULL) {
+            XMEMCPY(p, payload, payload_len);
+        }
+    }
+    msg->payload_len = payload_len;
+    return msg;
+}
+
+WOLFMQTT_LOCAL void BrokerShardMsg_Release(BrokerShardMsg* msg)
+{
+    if (msg == NULL || BROKER_ATOMIC_ADD(&msg->refs, -1) != 0) {
+        return;
+    }
+#ifdef WOLFMQTT_V5
+    BrokerProps_FreeClone(msg->props);
+#endif
+    BROKER_FORCE_ZERO(msg + 1, ((msg->topic != NULL) ?
+        XSTRLEN(msg->topic) + 1 : 0) + msg->payload_len);
+    WOLFMQTT_FREE(msg);
+}
+#endif /* WOLFMQTT_BROKER_SHARDS */
+
+/* -------------------------------------------------------------------------- */
+/* Retained message management                                                 */
+/* -------------------------------------------------------------------------- */
+#ifdef WOLFMQTT_BROKER_RETAINED
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Retained topic tree (see BrokerRetainedTree). Levels are split and
+ * hashed as in the subscription tree. */
+
+/* Exact child of parent for level, or NULL */
+static BrokerRetainedNode* BrokerRetainedTree_Child(BrokerRetainedTree* t,
+    const BrokerRetainedNode* parent, const char* level, word16 len)
+{
+    BrokerRetainedNode* n;
+    word32 key;
+
+    if (t->bucket_cnt == 0) {
+        return NULL;
+    }
+    key = BrokerSubTree_Key(parent, level, len);
+    for (n = t->buckets[key % t->bucket_cnt]; n != NULL;
+            n = n->bucket_next) {
+        if (n->key == key && n->parent == parent && n->level_len == len &&
+                XMEMCMP(n->level, level, len) == 0) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/* Make room for one more node, as BrokerSubTree_Reserve does */
+static int BrokerRetainedTree_Reserve(BrokerRetainedTree* t)
+{
+    word32 need = t->node_cnt + 2;
+
+    if (t->frontier_cap < need) {
+        word32 cap = (t->frontier_cap == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->frontier_cap * 2;
+        BrokerRetainedNode** f = (BrokerRetainedNode**)WOLFMQTT_MALLOC(
+            cap * sizeof(BrokerRetainedNode*));
+        if (f == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        if (t->frontier != NULL) {
+            WOLFMQTT_FREE(t->frontier);
+        }
+        t->frontier = f;
+        t->frontier_cap = cap;
+    }
+    if (t->node_cnt + 1 > t->bucket_cnt) {
+        word32 cnt = (t->bucket_cnt == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->bucket_cnt * 2;
+        BrokerRetainedNode** b = (BrokerRetainedNode**)WOLFMQTT_MALLOC(
+            cnt * sizeof(BrokerRetainedNode*));
+        if (b != NULL) {
+            word32 i;
+            XMEMSET(b, 0, cnt * sizeof(BrokerRetainedNode*));
+            for (i = 0; i < t->bucket_cnt; i++) {
+                while (t->buckets[i] != NULL) {
+                    BrokerRetainedNode* n = t->buckets[i];
+                    t->buckets[i] = n->bucket_next;
+                    n->bucket_next = b[n->key % cnt];
+                    b[n->key % cnt] = n;
+                }
+            }
+            if (t->buckets != NULL) {
+                WOLFMQTT_FREE(t->buckets);
+            }
+            t->buckets = b;
+            t->bucket_cnt = cnt;
+        }
+        else if (t->bucket_cnt == 0) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+static BrokerRetainedNode* BrokerRetainedTree_NewNode(BrokerRetainedTree* t,
+    BrokerRetainedNode* parent, const char* level, word16 len)
+{
+    BrokerRetainedNode* n;
+    word32 b;
+
+    if (BrokerRetainedTree_Reserve(t) != MQTT_CODE_SUCCESS) {
+        return NULL;
+    }
+    n = (BrokerRetainedNode*)WOLFMQTT_MALLOC(sizeof(BrokerRetainedNode) +
+        len + 1);
+    if (n == NULL) {
+        return NULL;
+    }
+    XMEMSET(n, 0, sizeof(*n));
+    n->level = (char*)(n + 1);
+    XMEMCPY(n->level, level, len);
+    n->level[len] = '\0';
+    n->level_len = len;
+    n->parent = parent;
+    n->key = BrokerSubTree_Key(parent, level, len);
+    b = n->key % t->bucket_cnt;
+    n->bucket_next = t->buckets[b];
+    t->buckets[b] = n;
+    n->sibling_next = parent->child;
+    if (parent->child != NULL) {
+        parent->child->sibling_prev = n;
+    }
+    parent->child = n;
+    t->node_cnt++;
+    return n;
+}
+
+/* Free n and every ancestor left without a message or children */
+static void BrokerRetainedTree_Prune(BrokerRetainedTree* t,
+    BrokerRetainedNode* n)
+{
+    while (n != &t->root && n->msg == NULL && n->child == NULL) {
+        BrokerRetainedNode* parent = n->parent;
+        BrokerRetainedNode** pp = &t->buckets[n->key % t->bucket_cnt];
+
+        while (*pp != n) {
+            pp = &(*pp)->bucket_next;
+        }
+        *pp = n->bucket_next;
+        if (n->sibling_prev != NULL) {
+            n->sibling_prev->sibling_next = n->sibling_next;
+        }
+        else {
+            parent->child = n->sibling_next;
+        }
+        if (n->sibling_next != NULL) {
+            n->sibling_next->sibling_prev = n->sibling_prev;
+        }
+        BROKER_FORCE_ZERO(n, sizeof(*n) + n->level_len + 1);
+        WOLFMQTT_FREE(n);
+        t->node_cnt--;
+        n = parent;
+    }
+}
+
+/* Node spelling topic, or NULL */
+static BrokerRetainedNode* BrokerRetainedTree_Find(BrokerRetainedTree* t,
+    const char* topic)
+{
+    BrokerRetainedNode* n = &t->root;
+    const char* level = topic;
+
+    for (;;) {
+        word16 len = BrokerSubTree_LevelLen(level);
+        n = BrokerRetainedTree_Child(t, n, level, len);
+        if (n == NULL || level[len] == '\0') {
+            return n;
+        }
+        level += len + 1;
+    }
+}
+
+static int BrokerRetainedTree_Insert(BrokerRetainedTree* t,
+    BrokerRetainedMsg* rm)
+{
+    BrokerRetainedNode* n = &t->root;
+    const char* level = rm->topic;
+
+    for (;;) {
+        word16 len = BrokerSubTree_LevelLen(level);
+        BrokerRetainedNode* child =
+            BrokerRetainedTree_Child(t, n, level, len);
+        if (child == NULL) {
+            child = BrokerRetainedTree_NewNode(t, n, level, len);
+        }
+        if (child == NULL) {
+            BrokerRetainedTree_Prune(t, n);
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        n = child;
+        if (level[len] == '\0') {
+            break;
+        }
+        level += len + 1;
+    }
+    if (n->msg != NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG; /* topic already stored */
+    }
+    n->msg = rm;
+    rm->node = n;
+    return MQTT_CODE_SUCCESS;
+}
+
+static void BrokerRetainedTree_Collect(MqttBroker* broker,
+    BrokerRetainedMsg* rm)
+{
+    BrokerRetainedTree* t = &broker->retained_tree;
+
+    if (rm->pending_delete) {
+        return;
+    }
+    if (t->match_len >= t->match_cap) {
+        word32 cap = (t->match_cap == 0) ? BROKER_SUB_TREE_BUCKETS_MIN :
+            t->match_cap * 2;
+        BrokerRetainedMsg** m = (BrokerRetainedMsg**)WOLFMQTT_MALLOC(
+            cap * sizeof(BrokerRetainedMsg*));
+        if (m == NULL) {
+            WBLOG_ERR(broker, "broker: retained match list full, topic=%s "
+                "skipped", BrokerLog_Sanitize(rm->topic));
+            return;
+        }
+        if (t->match != NULL) {
+            XMEMCPY(m, t->match, t->match_len * sizeof(BrokerRetainedMsg*));
+            WOLFMQTT_FREE(t->match);
+        }
+        t->match = m;
+        t->match_cap = cap;
+    }
+    t->match[t->match_len++] = rm;
+}
+
+#ifdef WOLFMQTT_BROKER_WILDCARDS
+/* Collect top and everything below it, walking the sibling and parent
+ * links instead of recursing */
+static void BrokerRetainedTree_CollectAll(MqttBroker* broker,
+    BrokerRetainedNode* top)
+{
+    BrokerRetainedNode* n = top;
+
+    for (;;) {
+        if (n->msg != NULL) {
+            BrokerRetainedTree_Collect(broker, n->msg);
+        }
+        if (n->child != NULL) {
+            n = n->child;
+            continue;
+        }
+        while (n != top && n->sibling_next == NULL) {
+            n = n->parent;
+        }
+        if (n == top) {
+            break;
+        }
+        n = n->sibling_next;
+    }
+}
+
+/* [MQTT-4.7.2] Wildcards at the first level skip $-prefixed topics */
+static int BrokerRetainedTree_Hidden(const BrokerRetainedTree* t,
+    const BrokerRetainedNode* n)
+{
+    return n->parent == &t->root && n->level_len > 0 && n->level[0] == '$';
+}
+#endif
+
+/* Collect the retained messages whose topic matches filter. They are
+ * broker->retained_tree.match[base..*end), where base is the return value;
+ * the caller resets match_len to base once it has delivered. */
+static word32 BrokerRetainedTree_Match(MqttBroker* broker,
+    const char* filter, word32* end)
+{
+    BrokerRetainedTree* t = &broker->retained_tree;
+    word32 base = t->match_len;
+    word32 head = 0;
+    word32 tail = 0;
+    word32 next;
+    word32 i;
+    const char* level = filter;
+
+    *end = base;
+    if (t->frontier == NULL) { /* no node was ever added */
+        return base;
+    }
+    /* frontier[head..tail) holds the nodes matching the filter up to the
+     * current level; as in BrokerSubTree_Walk they fit in one array. */
+    t->frontier[tail++] = &t->root;
+    for (;;) {
+        word16 len = BrokerSubTree_LevelLen(level);
+        next = tail;
+        for (i = head; i < tail; i++) {
+            BrokerRetainedNode* n = t->frontier[i];
+            BrokerRetainedNode* c;
+#ifdef WOLFMQTT_BROKER_WILDCARDS
+            if (len == 1 && level[0] == '#') {
+                /* [MQTT-4.7.1.2] 'a/#' also matches 'a' itself */
+                if (n->msg != NULL) {
+                    BrokerRetainedTree_Collect(broker, n->msg);
+                }
+                for (c = n->child; c != NULL; c = c->sibling_next) {
+                    if (!BrokerRetainedTree_Hidden(t, c)) {
+                        BrokerRetainedTree_CollectAll(broker, c);
+                    }
+                }
+                continue;
+            }
+            if (len == 1 && level[0] == '+') {
+                for (c = n->child; c != NULL; c = c->sibling_next) {
+                    if (!BrokerRetainedTree_Hidden(t, c)) {
+                        t->frontier[next++] = c;
+                    }
+                }
+                continue;
+            }
+#endif
+            c = BrokerRetainedTree_Child(t, n, level, len);
+            if (c != NULL) {
+                t->frontier[next++] = c;
+            }
+        }
+        head = tail;
+        tail = next;
+        if (head == tail || level[len] == '\0') {
+            break;
         }
-        /* Check subs with active client (takeover scenario) */
-        else if (s->client != NULL && BROKER_STR_VALID(s->client->client_id) &&
-            XSTRCMP(s->client->client_id, client_id) == 0) {
-            s->client = new_bc;
-            count++;
+        level += len + 1;
+    }
+    for (i = head; i < tail; i++) {
+        if (t->frontier[i]->msg != NULL) {
+            BrokerRetainedTree_Collect(broker, t->frontier[i]->msg);
         }
-        s = s->next;
     }
-#endif
-    if (count > 0) {
-        /* The new client now owns these subs; reflect them in its cap count
-         * so a reconnect cannot be used to exceed BROKER_MAX_SUBS_PER_CLIENT. */
-        new_bc->sub_count += count;
-        WBLOG_INFO(broker, "broker: reassociated %d subs for client_id=%s",
-            count, BrokerLog_Sanitize(client_id));
+    *end = t->match_len;
+    return base;
+}
+
+/* Unlink and free one message now; callers make sure no delivery holds
+ * it (retained_delivering == 0, or from the reap list). */
+static void BrokerRetained_Free(MqttBroker* broker, BrokerRetainedMsg* rm)
+{
+    if (rm->prev != NULL) {
+        rm->prev->next = rm->next;
+    }
+    else {
+        broker->retained = rm->next;
+    }
+    if (rm->next != NULL) {
+        rm->next->prev = rm->prev;
+    }
+    if (rm->node != NULL) {
+        rm->node->msg = NULL;
+        BrokerRetainedTree_Prune(&broker->retained_tree, rm->node);
+    }
+    BrokerTimer_Cancel(broker, &rm->expiry_timer);
+    if (rm->topic != NULL) {
+        BROKER_FORCE_ZERO(rm->topic, XSTRLEN(rm->topic) + 1);
+        WOLFMQTT_FREE(rm->topic);
+    }
+    if (rm->payload != NULL) {
+        BROKER_FORCE_ZERO(rm->payload, rm->payload_len);
+        WOLFMQTT_FREE(rm->payload);
+    }
+    WOLFMQTT_FREE(rm);
+    if (broker->retained_count > 0) {
+        broker->retained_count--;
     }
-    return count;
 }
 
-/* -------------------------------------------------------------------------- */
-/* Retained message management                                                 */
-/* -------------------------------------------------------------------------- */
-#ifdef WOLFMQTT_BROKER_RETAINED
-/* Free retained messages whose v5 Message Expiry Interval has elapsed so they
- * stop occupying a slot / the retained_count cap. Delivery also reaps expired
- * entries, but a publisher can hit the cap with only-expired entries before any
- * subscription triggers that path. */
-static void BrokerRetained_ReapExpired(MqttBroker* broker,
-    WOLFMQTT_BROKER_TIME_T now)
+/* Free rm, or while a delivery may hold it mark it and free it once the
+ * outermost delivery is done. Storing the topic again before then clears
+ * pending_delete and keeps the message. */
+static void BrokerRetained_Drop(MqttBroker* broker, BrokerRetainedMsg* rm)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-    for (i = 0; i < BROKER_MAX_RETAINED; i++) {
-        BrokerRetainedMsg* rm = &broker->retained[i];
-        /* now >= store_time guards the unsigned subtraction so a backward
-         * clock step reads as "not expired" instead of wrapping huge. */
-        if (rm->in_use && rm->expiry_sec > 0 &&
-            now >= rm->store_time &&
-            (now - rm->store_time) >= rm->expiry_sec) {
-            WBLOG_DBG(broker, "broker: retained expired topic=%s",
-                BrokerLog_Sanitize(rm->topic));
-            BROKER_FORCE_ZERO(rm, sizeof(BrokerRetainedMsg));
+    if (broker->retained_delivering == 0) {
+        BrokerRetained_Free(broker, rm);
+        return;
+    }
+    rm->pending_delete = 1;
+    if (!rm->on_reap) {
+        rm->on_reap = 1;
+        rm->reap_next = broker->retained_tree.reap;
+        broker->retained_tree.reap = rm;
+    }
+}
+
+WOLFMQTT_LOCAL int BrokerRetained_Link(MqttBroker* broker,
+    BrokerRetainedMsg* rm)
+{
+    int rc = BrokerRetainedTree_Insert(&broker->retained_tree, rm);
+
+    if (rc == MQTT_CODE_SUCCESS) {
+        rm->prev = NULL;
+        rm->next = broker->retained;
+        if (broker->retained != NULL) {
+            broker->retained->prev = rm;
         }
+        broker->retained = rm;
+        broker->retained_count++;
     }
-#else
-    BrokerRetainedMsg* cur;
-    BrokerRetainedMsg* prev = NULL;
+    return rc;
+}
+#endif /* !WOLFMQTT_STATIC_MEMORY */
 
-    /* A delivery loop may hold node pointers; defer to its post-loop reap. */
-    if (broker->retained_delivering > 0) {
+WOLFMQTT_LOCAL void BrokerRetained_ArmExpiry(MqttBroker* broker,
+    BrokerRetainedMsg* rm)
+{
+    if (broker == NULL || rm == NULL) {
         return;
     }
-    cur = broker->retained;
-    while (cur != NULL) {
-        BrokerRetainedMsg* next = cur->next;
-        if (cur->expiry_sec > 0 &&
-            now >= cur->store_time &&
-            (now - cur->store_time) >= cur->expiry_sec) {
-            WBLOG_DBG(broker, "broker: retained expired topic=%s",
-                BrokerLog_Sanitize(cur->topic));
-            if (prev != NULL) {
-                prev->next = next;
-            }
-            else {
-                broker->retained = next;
-            }
-            if (cur->topic != NULL) {
-                BROKER_FORCE_ZERO(cur->topic, XSTRLEN(cur->topic) + 1);
-                WOLFMQTT_FREE(cur->topic);
-            }
-            if (cur->payload != NULL) {
-                BROKER_FORCE_ZERO(cur->payload, cur->payload_len);
-                WOLFMQTT_FREE(cur->payload);
-            }
-            WOLFMQTT_FREE(cur);
-            if (broker->retained_count > 0) {
-                broker->retained_count--;
-            }
-        }
-        else {
-            prev = cur;
-        }
-        cur = next;
+    if (rm->expiry_sec == 0) {
+        BrokerTimer_Cancel(broker, &rm->expiry_timer);
+        return;
+    }
+    BrokerTimer_Arm(broker, &rm->expiry_timer, BROKER_TIMER_RETAINED, rm,
+        BrokerTimer_After(rm->store_time,
+            (WOLFMQTT_BROKER_TIME_T)rm->expiry_sec));
+}
+
+/* Message Expiry timer callback: free the retained message so it stops
+ * occupying a slot / the retained_count cap. */
+static void BrokerRetained_OnExpiry(MqttBroker* broker, BrokerRetainedMsg* rm)
+{
+    WOLFMQTT_BROKER_TIME_T now = broker->now;
+
+    /* now >= store_time guards the unsigned subtraction so a backward clock
+     * step reads as "not expired" instead of wrapping huge. A delivery loop
+     * may hold node pointers; retry on the next tick. */
+    if (now < rm->store_time || (now - rm->store_time) < rm->expiry_sec
+#ifndef WOLFMQTT_STATIC_MEMORY
+            || broker->retained_delivering > 0
+#endif
+            ) {
+        BrokerTimer_Defer(broker, &rm->expiry_timer);
+        return;
     }
+    WBLOG_DBG(broker, "broker: retained expired topic=%s",
+        BrokerLog_Sanitize(rm->topic));
+#ifdef WOLFMQTT_STATIC_MEMORY
+    BROKER_FORCE_ZERO(rm, sizeof(BrokerRetainedMsg));
+#else
+    BrokerRetained_Free(broker, rm);
 #endif
 }
 
@@ -4389,7 +7341,7 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
 #else
     byte is_new = 0;
     byte* new_payload = NULL;
-    BrokerRetainedMsg* cur;
+    BrokerRetainedNode* node;
 #endif
     BrokerRetainedMsg* msg = NULL;
     int rc = MQTT_CODE_SUCCESS;
@@ -4398,13 +7350,6 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
         return MQTT_CODE_ERROR_BAD_ARG;
     }
 
-    /* Drop expired entries first so they do not hold the cap against a new
-     * retained message. */
-    BrokerRetained_ReapExpired(broker, WOLFMQTT_BROKER_GET_TIME_S());
-#ifndef WOLFMQTT_STATIC_MEMORY
-    cur = broker->retained;
-#endif
-
 #ifdef WOLFMQTT_STATIC_MEMORY
     /* Look for existing retained msg on this topic */
     for (i = 0; i < BROKER_MAX_RETAINED; i++) {
@@ -4435,6 +7380,7 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
             rc = MQTT_CODE_ERROR_OUT_OF_BUFFER;
         }
         if (rc == MQTT_CODE_SUCCESS) {
+            BrokerTimer_Cancel(broker, &msg->expiry_timer);
             XMEMSET(msg, 0, sizeof(*msg));
             msg->in_use = 1;
             XMEMCPY(msg->topic, topic, (size_t)tlen);
@@ -4446,15 +7392,12 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
         }
     }
 #else
-    while (cur) {
-        if (cur->topic != NULL && XSTRCMP(cur->topic, topic) == 0) {
-            msg = cur;
-            /* Re-publishing this topic cancels a deferred delete, otherwise a
-             * later delivery would reap the freshly stored message. */
-            msg->pending_delete = 0;
-            break;
-        }
-        cur = cur->next;
+    node = BrokerRetainedTree_Find(&broker->retained_tree, topic);
+    if (node != NULL && node->msg != NULL) {
+        msg = node->msg;
+        /* Re-publishing this topic cancels a deferred delete, otherwise a
+         * later delivery would reap the freshly stored message. */
+        msg->pending_delete = 0;
     }
     if (msg == NULL) {
         /* Allocate new node + topic */
@@ -4498,19 +7441,21 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
             XMEMCPY(new_payload, payload, payload_len);
         }
     }
+    if (rc == MQTT_CODE_SUCCESS && is_new) {
+        rc = BrokerRetained_Link(broker, msg);
+    }
     if (rc == MQTT_CODE_SUCCESS) {
         if (!is_new && msg->payload != NULL) {
             WOLFMQTT_FREE(msg->payload);
         }
         msg->payload = new_payload;
         msg->payload_len = payload_len;
-        if (is_new) {
-            msg->next = broker->retained;
-            broker->retained = msg;
-            broker->retained_count++;
-        }
     }
     else if (is_new && msg != NULL) {
+        if (new_payload != NULL) {
+            BROKER_FORCE_ZERO(new_payload, payload_len);
+            WOLFMQTT_FREE(new_payload);
+        }
         if (msg->topic) {
             WOLFMQTT_FREE(msg->topic);
         }
@@ -4519,9 +7464,10 @@ static int BrokerRetained_Store(MqttBroker* broker, const char* topic,
 #endif
 
     if (rc == MQTT_CODE_SUCCESS) {
-        msg->store_time = WOLFMQTT_BROKER_GET_TIME_S();
+        msg->store_time = broker->now;
         msg->expiry_sec = expiry_sec;
         msg->qos = qos;
+        BrokerRetained_ArmExpiry(broker, msg);
         WBLOG_DBG(broker, "broker: retained store topic=%s len=%u qos=%d "
             "expiry=%u",
             BrokerLog_Sanitize(topic), (unsigned)payload_len, (int)qos,
@@ -4538,8 +7484,7 @@ static void BrokerRetained_Delete(MqttBroker* broker, const char* topic)
 #ifdef WOLFMQTT_STATIC_MEMORY
     int i;
 #else
-    BrokerRetainedMsg* cur;
-    BrokerRetainedMsg* prev = NULL;
+    BrokerRetainedNode* node;
 #endif
     int found = 0;
 
@@ -4552,48 +7497,21 @@ static void BrokerRetained_Delete(MqttBroker* broker, const char* topic)
             XSTRCMP(broker->retained[i].topic, topic) == 0) {
             WBLOG_DBG(broker, "broker: retained delete topic=%s",
                 BrokerLog_Sanitize(topic));
+            BrokerTimer_Cancel(broker, &broker->retained[i].expiry_timer);
             BROKER_FORCE_ZERO(&broker->retained[i], sizeof(BrokerRetainedMsg));
             found = 1;
             break;
         }
     }
 #else
-    cur = broker->retained;
-    while (cur) {
-        BrokerRetainedMsg* next = cur->next;
-        if (cur->topic != NULL && XSTRCMP(cur->topic, topic) == 0) {
-            WBLOG_DBG(broker, "broker: retained delete topic=%s",
-                BrokerLog_Sanitize(topic));
-            if (broker->retained_delivering > 0) {
-                /* A delivery loop is iterating this list (possibly re-entered
-                 * via a WebSocket fan-out). Freeing now would invalidate that
-                 * loop's saved next pointer; flag for deferred reap
-                 * by the delivery loop instead. */
-                cur->pending_delete = 1;
-                found = 1;
-                break;
-            }
-            if (prev) {
-                prev->next = next;
-            }
-            else {
-                broker->retained = next;
-            }
-            BROKER_FORCE_ZERO(cur->topic, XSTRLEN(cur->topic) + 1);
-            WOLFMQTT_FREE(cur->topic);
-            if (cur->payload) {
-                BROKER_FORCE_ZERO(cur->payload, cur->payload_len);
-                WOLFMQTT_FREE(cur->payload);
-            }
-            WOLFMQTT_FREE(cur);
-            if (broker->retained_count > 0) {
-                broker->retained_count--;
-            }
-            found = 1;
-            break;
-        }
-        prev = cur;
-        cur = next;
+    node = BrokerRetainedTree_Find(&broker->retained_tree, topic);
+    if (node != NULL && node->msg != NULL) {
+        WBLOG_DBG(broker, "broker: retained delete topic=%s",
+            BrokerLog_Sanitize(topic));
+        /* A delivery (possibly re-entered via a WebSocket fan-out) may
+         * hold the message in its match list; Drop defers the free. */
+        BrokerRetained_Drop(broker, node->msg);
+        found = 1;
     }
 #endif
 
@@ -4611,36 +7529,95 @@ static void BrokerRetained_FreeAll(MqttBroker* broker)
 #ifdef WOLFMQTT_STATIC_MEMORY
     int i;
 #else
-    BrokerRetainedMsg *cur = broker->retained;
+    BrokerRetainedTree* t = &broker->retained_tree;
 #endif
 
 #ifdef WOLFMQTT_STATIC_MEMORY
     for (i = 0; i < BROKER_MAX_RETAINED; i++) {
+        BrokerTimer_Cancel(broker, &broker->retained[i].expiry_timer);
         BROKER_FORCE_ZERO(&broker->retained[i], sizeof(BrokerRetainedMsg));
     }
 #else
-    while (cur) {
-        BrokerRetainedMsg* next = cur->next;
-        if (cur->topic) {
-            BROKER_FORCE_ZERO(cur->topic, XSTRLEN(cur->topic) + 1);
-            WOLFMQTT_FREE(cur->topic);
+    /* Freeing each message prunes its tree path, so only the tree's own
+     * arrays are left afterwards */
+    while (broker->retained != NULL) {
+        BrokerRetained_Free(broker, broker->retained);
+    }
+    if (t->buckets != NULL) {
+        WOLFMQTT_FREE(t->buckets);
+    }
+    if (t->frontier != NULL) {
+        WOLFMQTT_FREE(t->frontier);
+    }
+    if (t->match != NULL) {
+        WOLFMQTT_FREE(t->match);
+    }
+    XMEMSET(t, 0, sizeof(*t));
+    broker->retained_count = 0;
+#endif
+}
+
+/* Store a retained message, or delete the topic's one for an empty payload,
+ * on this broker only. */
+static int BrokerRetained_Apply(MqttBroker* broker, const char* topic,
+    const byte* payload, word32 payload_len, MqttQoS qos, word32 expiry_sec)
+{
+    if (payload_len == 0) {
+        BrokerRetained_Delete(broker, topic);
+        return MQTT_CODE_SUCCESS;
+    }
+    return BrokerRetained_Store(broker, topic, payload, payload_len, qos,
+        expiry_sec);
+}
+
+/* Apply a retained update from a PUBLISH or Will. In a sharded broker every
+ * shard keeps a replica; updates to one topic are serialized through the
+ * shard owning it, which applies them and replicates them in that order.
+ * An update relayed to a remote owner reports success here - a store
+ * failure there is logged by the owner. */
+static int BrokerRetained_Update(MqttBroker* broker, const char* topic,
+    const byte* payload, word32 payload_len, MqttQoS qos, word32 expiry_sec)
+{
+#ifdef WOLFMQTT_BROKER_SHARDS
+    BrokerShard* shard = broker->shard;
+    BrokerShardMsg* msg;
+    int owner;
+    int rc = MQTT_CODE_SUCCESS;
+
+    if (shard != NULL) {
+        owner = BrokerShard_Owner(shard, topic, (word32)XSTRLEN(topic));
+        if (owner == shard->index) {
+            rc = BrokerRetained_Apply(broker, topic, payload, payload_len,
+                qos, expiry_sec);
+            if (rc != MQTT_CODE_SUCCESS) {
+                return rc;
+            }
         }
-        if (cur->payload) {
-            BROKER_FORCE_ZERO(cur->payload, cur->payload_len);
-            WOLFMQTT_FREE(cur->payload);
+        msg = BrokerShardMsg_New(BROKER_SHARD_MSG_RETAIN, topic, payload,
+            payload_len);
+        if (msg == NULL) {
+            WBLOG_ERR(broker, "broker: retained relay alloc failed topic=%s",
+                BrokerLog_Sanitize(topic));
+            return (owner == shard->index) ? MQTT_CODE_SUCCESS :
+                MQTT_CODE_ERROR_MEMORY;
         }
-        WOLFMQTT_FREE(cur);
-        cur = next;
+        msg->qos = qos;
+        msg->expiry_sec = expiry_sec;
+        if (owner == shard->index) {
+            (void)BrokerShard_Broadcast(shard, msg, 0);
+        }
+        else {
+            rc = BrokerShard_Send(shard, owner, msg, BROKER_SHARD_F_RELAY);
+        }
+        BrokerShardMsg_Release(msg);
+        return rc;
     }
-    broker->retained = NULL;
-    broker->retained_count = 0;
 #endif
+    return BrokerRetained_Apply(broker, topic, payload, payload_len, qos,
+        expiry_sec);
 }
 #endif /* WOLFMQTT_BROKER_RETAINED */
 
-/* Forward declaration - used by retained delivery, will publish, and PUBLISH handler */
-static int BrokerTopicMatch(const char* filter, const char* topic);
-
 /* -------------------------------------------------------------------------- */
 /* LWT (Last Will and Testament) helpers                                       */
 /* -------------------------------------------------------------------------- */
@@ -4688,7 +7665,7 @@ static int BrokerPendingWill_Add(MqttBroker* broker, BrokerClient* bc)
 #endif
 
     BrokerPendingWill* pw = NULL;
-    WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
+    WOLFMQTT_BROKER_TIME_T now = broker->now;
     int rc = MQTT_CODE_SUCCESS;
 
 #ifdef WOLFMQTT_STATIC_MEMORY
@@ -4819,6 +7796,8 @@ static int BrokerPendingWill_Add(MqttBroker* broker, BrokerClient* bc)
         else {
             pw->publish_time = now + (WOLFMQTT_BROKER_TIME_T)delay_sec;
         }
+        BrokerTimer_Arm(broker, &pw->publish_timer, BROKER_TIMER_WILL, pw,
+            pw->publish_time);
         WBLOG_DBG(broker, "broker: will deferred sock=%d client_id=%s delay=%u",
             (int)bc->sock, BrokerLog_Sanitize(bc->client_id),
             (unsigned)delay_sec);
@@ -4846,6 +7825,8 @@ static void BrokerPendingWill_Cancel(MqttBroker* broker,
             XSTRCMP(broker->pending_wills[i].client_id, client_id) == 0) {
             WBLOG_DBG(broker, "broker: will cancelled client_id=%s",
                 BrokerLog_Sanitize(client_id));
+            BrokerTimer_Cancel(broker,
+                &broker->pending_wills[i].publish_timer);
             BROKER_FORCE_ZERO(&broker->pending_wills[i],
                 sizeof(BrokerPendingWill));
             return;
@@ -4865,6 +7846,7 @@ static void BrokerPendingWill_Cancel(MqttBroker* broker,
             else {
                 broker->pending_wills = next;
             }
+            BrokerTimer_Cancel(broker, &pw->publish_timer);
             WOLFMQTT_FREE(pw->client_id);
             if (pw->topic) {
                 BROKER_FORCE_ZERO(pw->topic, XSTRLEN(pw->topic) + 1);
@@ -4885,7 +7867,9 @@ static void BrokerPendingWill_Cancel(MqttBroker* broker,
 
 static void BrokerPendingWill_FreeAll(MqttBroker* broker)
 {
-#ifndef WOLFMQTT_STATIC_MEMORY
+#ifdef WOLFMQTT_STATIC_MEMORY
+    int i;
+#else
     BrokerPendingWill* pw;
 #endif
 
@@ -4893,11 +7877,15 @@ static void BrokerPendingWill_FreeAll(MqttBroker* broker)
         return;
     }
 #ifdef WOLFMQTT_STATIC_MEMORY
+    for (i = 0; i < BROKER_MAX_PENDING_WILLS; i++) {
+        BrokerTimer_Cancel(broker, &broker->pending_wills[i].publish_timer);
+    }
     BROKER_FORCE_ZERO(broker->pending_wills, sizeof(broker->pending_wills));
 #else
     pw = broker->pending_wills;
     while (pw) {
         BrokerPendingWill* next = pw->next;
+        BrokerTimer_Cancel(broker, &pw->publish_timer);
         if (pw->client_id) WOLFMQTT_FREE(pw->client_id);
         if (pw->topic) {
             BROKER_FORCE_ZERO(pw->topic, XSTRLEN(pw->topic) + 1);
@@ -4918,89 +7906,44 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
     const char* topic, const byte* payload, word16 payload_len,
     MqttQoS qos, byte retain);
 
-/* Process pending wills - publish any that have expired their delay */
-static int BrokerPendingWill_Process(MqttBroker* broker)
+/* Will Delay timer callback. In dynamic mode pw is unlinked before the
+ * fan-out, which may re-enter BrokerPendingWill_Add (a WebSocket close) and
+ * prepend to the list. */
+static void BrokerPendingWill_OnDelay(MqttBroker* broker,
+    BrokerPendingWill* pw)
 {
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-#else
-    BrokerPendingWill* pw;
-    BrokerPendingWill* prev = NULL;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerPendingWill** pp;
 #endif
-    int activity = 0;
-    WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
-
-    if (broker == NULL) {
-        return 0;
-    }
 
+    WBLOG_DBG(broker, "broker: LWT deferred publish client_id=%s topic=%s "
+        "len=%u", BrokerLog_Sanitize(pw->client_id),
+        BrokerLog_Sanitize(pw->topic), (unsigned)pw->payload_len);
 #ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_PENDING_WILLS; i++) {
-        BrokerPendingWill* pw = &broker->pending_wills[i];
-        if (!pw->in_use) {
-            continue;
-        }
-        if (now >= pw->publish_time) {
-            WBLOG_DBG(broker, "broker: LWT deferred publish client_id=%s topic=%s "
-                "len=%u", BrokerLog_Sanitize(pw->client_id),
-                BrokerLog_Sanitize(pw->topic),
-                (unsigned)pw->payload_len);
-            BrokerClient_PublishWillImmediate(broker, pw->topic,
-                pw->payload, pw->payload_len, pw->qos, pw->retain);
-            BROKER_FORCE_ZERO(pw, sizeof(BrokerPendingWill));
-            activity = 1;
-        }
-    }
+    BrokerClient_PublishWillImmediate(broker, pw->topic,
+        pw->payload, pw->payload_len, pw->qos, pw->retain);
+    BROKER_FORCE_ZERO(pw, sizeof(BrokerPendingWill));
 #else
-    pw = broker->pending_wills;
-    while (pw) {
-        BrokerPendingWill* next = pw->next;
-        if (now >= pw->publish_time) {
-            WBLOG_DBG(broker, "broker: LWT deferred publish client_id=%s topic=%s "
-                "len=%u", BrokerLog_Sanitize(pw->client_id),
-                BrokerLog_Sanitize(pw->topic),
-                (unsigned)pw->payload_len);
-            BrokerClient_PublishWillImmediate(broker, pw->topic,
-                pw->payload, pw->payload_len, pw->qos, pw->retain);
-            if (prev) {
-                prev->next = next;
-            }
-            else if (broker->pending_wills == pw) {
-                broker->pending_wills = next;
-            }
-            else {
-                /* The fan-out above re-entered BrokerPendingWill_Add (a WS
-                 * close), prepending a node, so pw is no longer the head.
-                 * Unlink pw via its real predecessor instead of clobbering the
-                 * new head with the stale saved next. */
-                BrokerPendingWill* p = broker->pending_wills;
-                while (p != NULL && p->next != pw) {
-                    p = p->next;
-                }
-                if (p != NULL) {
-                    p->next = next;
-                }
-            }
-            if (pw->client_id) WOLFMQTT_FREE(pw->client_id);
-            if (pw->topic) {
-                BROKER_FORCE_ZERO(pw->topic, XSTRLEN(pw->topic) + 1);
-                WOLFMQTT_FREE(pw->topic);
-            }
-            if (pw->payload) {
-                BROKER_FORCE_ZERO(pw->payload, pw->payload_len);
-                WOLFMQTT_FREE(pw->payload);
-            }
-            WOLFMQTT_FREE(pw);
-            activity = 1;
-        }
-        else {
-            prev = pw;
-        }
-        pw = next;
+    pp = &broker->pending_wills;
+    while (*pp != NULL && *pp != pw) {
+        pp = &(*pp)->next;
+    }
+    if (*pp == pw) {
+        *pp = pw->next;
+    }
+    BrokerClient_PublishWillImmediate(broker, pw->topic,
+        pw->payload, pw->payload_len, pw->qos, pw->retain);
+    if (pw->client_id) WOLFMQTT_FREE(pw->client_id);
+    if (pw->topic) {
+        BROKER_FORCE_ZERO(pw->topic, XSTRLEN(pw->topic) + 1);
+        WOLFMQTT_FREE(pw->topic);
+    }
+    if (pw->payload) {
+        BROKER_FORCE_ZERO(pw->payload, pw->payload_len);
+        WOLFMQTT_FREE(pw->payload);
     }
+    WOLFMQTT_FREE(pw);
 #endif
-
-    return activity;
 }
 #endif /* WOLFMQTT_BROKER_WILL */
 
@@ -5036,18 +7979,18 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
     int i;
 #else
     BrokerRetainedMsg* rm;
-    BrokerRetainedMsg* rm_prev = NULL;
+    word32 base, end, m;
 #endif
 
     if (broker == NULL || bc == NULL || filter == NULL) {
         return;
     }
-    now = WOLFMQTT_BROKER_GET_TIME_S();
+    now = broker->now;
 
 #ifndef WOLFMQTT_STATIC_MEMORY
     /* Mark a delivery in progress so a re-entrant BrokerRetained_Delete (via a
      * WebSocket fan-out close) defers its free instead of invalidating the
-     * loop's saved next pointer. */
+     * messages collected in the match list. */
     broker->retained_delivering++;
 #endif
 
@@ -5063,6 +8006,7 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
             (now - rm->store_time) >= rm->expiry_sec) {
             WBLOG_DBG(broker, "broker: retained expired topic=%s",
                 BrokerLog_Sanitize(rm->topic));
+            BrokerTimer_Cancel(broker, &rm->expiry_timer);
             BROKER_FORCE_ZERO(rm, sizeof(BrokerRetainedMsg));
             continue;
         }
@@ -5070,6 +8014,10 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
             MqttPublish out_pub;
             MqttQoS eff_qos = (rm->qos < sub_qos) ? rm->qos : sub_qos;
             int enc_rc, wr_rc;
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+            MqttProp alias;
+            int alias_slot;
+#endif
 
             if (eff_qos >= MQTT_QOS_1) {
                 BrokerStaticOrphanSession* orphan =
@@ -5132,10 +8080,13 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
             out_pub.buffer = (rm->payload_len > 0) ? rm->payload : NULL;
             out_pub.total_len = rm->payload_len;
             if (eff_qos >= MQTT_QOS_1) {
-                out_pub.packet_id = BrokerNextPacketId(broker);
+                out_pub.packet_id = BrokerNextPacketId(&bc->next_packet_id);
             }
 #ifdef WOLFMQTT_V5
             out_pub.protocol_level = bc->protocol_level;
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+            alias_slot = BrokerTopicAlias_Out(bc, &out_pub, &alias);
 #endif
             enc_rc = MqttEncode_Publish(bc->tx_buf,
                 BROKER_CLIENT_TX_SZ(bc), &out_pub, 0);
@@ -5145,6 +8096,11 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
                     BrokerLog_Sanitize(rm->topic),
                     (unsigned)rm->payload_len, (int)eff_qos);
                 wr_rc = MqttPacket_Write(&bc->client, bc->tx_buf, enc_rc);
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                if (wr_rc == enc_rc) {
+                    BrokerTopicAlias_Commit(bc, alias_slot, rm->topic);
+                }
+#endif
                 /* Scrub after a completed write and after a hard failure - both
                  * leave bc->tx_buf idle. Skip only the in-progress case: in
                  * non-blocking / TLS-async mode MqttPacket_Write returns
@@ -5160,89 +8116,58 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
         }
     }
 #else
-    rm = broker->retained;
-    while (rm) {
-        BrokerRetainedMsg* rm_next = rm->next;
-        /* Reap deferred-delete and expired nodes. Freeing is only safe at the
-         * outermost delivery depth; a nested re-entrant (WS fan-out) delivery
-         * may hold rm in an enclosing loop's saved rm_next, so at deeper depths
-         * mark the node and defer to the retained_delivering==0 post-loop reap. */
-        if (rm->pending_delete ||
-            (rm->expiry_sec > 0 &&
+    base = BrokerRetainedTree_Match(broker, filter, &end);
+    for (m = base; m < end; m++) {
+        rm = broker->retained_tree.match[m];
+        /* Skip messages deleted by an earlier delivery in this loop, and
+         * drop expired ones; both are freed after the outermost delivery. */
+        if (rm->pending_delete) {
+            continue;
+        }
+        if (rm->expiry_sec > 0 &&
             now >= rm->store_time &&
-            (now - rm->store_time) >= rm->expiry_sec)) {
-            if (broker->retained_delivering > 1) {
-                rm->pending_delete = 1;
-                rm_prev = rm;
-                rm = rm_next;
-                continue;
-            }
+            (now - rm->store_time) >= rm->expiry_sec) {
             WBLOG_DBG(broker, "broker: retained expired topic=%s",
                 BrokerLog_Sanitize(rm->topic));
-            if (rm_prev) {
-                rm_prev->next = rm_next;
-            }
-            else {
-                broker->retained = rm_next;
-            }
-            if (rm->topic) {
-                BROKER_FORCE_ZERO(rm->topic, XSTRLEN(rm->topic) + 1);
-                WOLFMQTT_FREE(rm->topic);
-            }
-            if (rm->payload) {
-                BROKER_FORCE_ZERO(rm->payload, rm->payload_len);
-                WOLFMQTT_FREE(rm->payload);
-            }
-            WOLFMQTT_FREE(rm);
-            if (broker->retained_count > 0) {
-                broker->retained_count--;
-            }
-            rm = rm_next;
+            BrokerRetained_Drop(broker, rm);
             continue;
         }
-        if (rm->topic != NULL && BrokerTopicMatch(filter, rm->topic)) {
+        {
             MqttQoS eff_qos = (rm->qos < sub_qos) ? rm->qos : sub_qos;
             if (eff_qos >= MQTT_QOS_1) {
                 /* Route QoS 1/2 through out_q so it survives reconnect. A full
                  * queue must not silently drop a required retained delivery:
                  * disconnect the slow subscriber with Quota Exceeded, matching
                  * the live PUBLISH fan-out policy. */
-                if (bc->out_q_count >= BROKER_MAX_QUEUED_MSGS_PER_SUB) {
+                if (BrokerClient_OutQFull(bc, eff_qos)) {
                     WBLOG_ERR(broker,
                         "broker: retained out_q full (%d) -> disconnect sock=%d",
                         bc->out_q_count, (int)bc->sock);
                 #ifdef WOLFMQTT_V5
                     (void)BrokerSend_Disconnect(bc, MQTT_REASON_QUOTA_EXCEEDED);
                 #endif
-                    if (bc->sock != BROKER_SOCKET_INVALID) {
-                        broker->net.close(broker->net.ctx, bc->sock);
-                        bc->sock = BROKER_SOCKET_INVALID;
-                    }
+                    (void)BrokerNetDisconnect(bc);
                     bc->connected = 0;
                     break;
                 }
                 else {
-                    BrokerOutPub* e = BrokerOutPub_Alloc(rm->topic,
-                        (rm->payload_len > 0) ? rm->payload : NULL,
+                    BrokerMsg* msg = BrokerMsg_NewPublish(broker,
+                        rm->topic, (rm->payload_len > 0) ? rm->payload : NULL,
                         rm->payload_len
                     #ifdef WOLFMQTT_V5
                         , NULL
                     #endif
                         );
-                    if (e == NULL) {
+                    int enq_rc = BrokerClient_EnqueueOutPub(bc, msg, eff_qos,
+                        1);
+                    BrokerMsg_Release(msg);
+                    if (enq_rc != MQTT_CODE_SUCCESS) {
                         WBLOG_ERR(broker,
-                            "broker: retained alloc failed sock=%d topic=%s",
-                            (int)bc->sock, BrokerLog_Sanitize(rm->topic));
+                            "broker: retained enqueue failed sock=%d "
+                            "topic=%s rc=%d", (int)bc->sock,
+                            BrokerLog_Sanitize(rm->topic), enq_rc);
                     }
                     else {
-                        e->qos = eff_qos;
-                        e->packet_id = BrokerNextPacketId(broker);
-                        e->retain = 1;
-                        e->state = BROKER_OUTQ_QUEUED;
-                    #ifdef WOLFMQTT_V5
-                        e->protocol_level = bc->protocol_level;
-                    #endif
-                        BrokerClient_EnqueueOutPub(bc, e);
                         WBLOG_DBG(broker,
                             "broker: retained enq sock=%d topic=%s qos=%d",
                             (int)bc->sock, BrokerLog_Sanitize(rm->topic),
@@ -5254,6 +8179,10 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
             else {
                 MqttPublish out_pub;
                 int enc_rc, wr_rc;
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                MqttProp alias;
+                int alias_slot;
+#endif
                 XMEMSET(&out_pub, 0, sizeof(out_pub));
                 out_pub.topic_name = rm->topic;
                 out_pub.qos = eff_qos;
@@ -5263,6 +8192,9 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
                 out_pub.total_len = rm->payload_len;
 #ifdef WOLFMQTT_V5
                 out_pub.protocol_level = bc->protocol_level;
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                alias_slot = BrokerTopicAlias_Out(bc, &out_pub, &alias);
 #endif
                 enc_rc = MqttEncode_Publish(bc->tx_buf,
                     BROKER_CLIENT_TX_SZ(bc), &out_pub, 0);
@@ -5273,6 +8205,11 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
                         BrokerLog_Sanitize(rm->topic),
                         (unsigned)rm->payload_len, (int)eff_qos);
                     wr_rc = MqttPacket_Write(&bc->client, bc->tx_buf, enc_rc);
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                    if (wr_rc == enc_rc) {
+                        BrokerTopicAlias_Commit(bc, alias_slot, rm->topic);
+                    }
+#endif
                     /* Scrub tx_buf unless still in-progress (CONTINUE). */
                     if (wr_rc != MQTT_CODE_CONTINUE) {
                         BROKER_FORCE_ZERO(bc->tx_buf, enc_rc);
@@ -5280,47 +8217,27 @@ static void BrokerRetained_DeliverToClient(MqttBroker* broker,
                 }
             }
         }
-        rm_prev = rm;
-        rm = rm_next;
     }
+    broker->retained_tree.match_len = base;
 #endif
 
 #ifndef WOLFMQTT_STATIC_MEMORY
     if (broker->retained_delivering > 0) {
         broker->retained_delivering--;
     }
-    /* When the outermost delivery finishes, reap nodes a re-entrant delete
-     * marked after this loop had already passed them, so they stop counting
-     * against BROKER_MAX_RETAINED. Safe now: no delivery loop holds pointers. */
+    /* When the outermost delivery finishes, free the messages deleted or
+     * expired during it, so they stop counting against BROKER_MAX_RETAINED.
+     * Safe now: no delivery holds them. One stored again meanwhile has
+     * pending_delete cleared and is kept. */
     if (broker->retained_delivering == 0) {
-        BrokerRetainedMsg* p = broker->retained;
-        BrokerRetainedMsg* pprev = NULL;
-        while (p != NULL) {
-            BrokerRetainedMsg* pnext = p->next;
+        while (broker->retained_tree.reap != NULL) {
+            BrokerRetainedMsg* p = broker->retained_tree.reap;
+            broker->retained_tree.reap = p->reap_next;
+            p->reap_next = NULL;
+            p->on_reap = 0;
             if (p->pending_delete) {
-                if (pprev) {
-                    pprev->next = pnext;
-                }
-                else {
-                    broker->retained = pnext;
-                }
-                if (p->topic) {
-                    BROKER_FORCE_ZERO(p->topic, XSTRLEN(p->topic) + 1);
-                    WOLFMQTT_FREE(p->topic);
-                }
-                if (p->payload) {
-                    BROKER_FORCE_ZERO(p->payload, p->payload_len);
-                    WOLFMQTT_FREE(p->payload);
-                }
-                WOLFMQTT_FREE(p);
-                if (broker->retained_count > 0) {
-                    broker->retained_count--;
-                }
-            }
-            else {
-                pprev = p;
+                BrokerRetained_Free(broker, p);
             }
-            p = pnext;
         }
     }
 #endif
@@ -5356,63 +8273,35 @@ static void BrokerClient_PublishWill(MqttBroker* broker, BrokerClient* bc)
         (int)bc->sock, BrokerLog_Sanitize(bc->will_topic),
         (unsigned)bc->will_payload_len);
 
-    BrokerClient_PublishWillImmediate(broker, bc->will_topic,
-        bc->will_payload, bc->will_payload_len, bc->will_qos,
-        bc->will_retain);
-    BrokerClient_ClearWill(bc);
-}
-
-/* Publish a will message immediately (shared by direct and deferred paths) */
-static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
-    const char* topic, const byte* payload, word16 payload_len,
-    MqttQoS qos, byte retain)
-{
-#ifdef WOLFMQTT_STATIC_MEMORY
-    int i;
-#else
-    BrokerSub* sub;
-    BrokerSub* next_sub = NULL;
-#endif
-
-    if (broker == NULL || topic == NULL) {
-        return;
-    }
+    BrokerClient_PublishWillImmediate(broker, bc->will_topic,
+        bc->will_payload, bc->will_payload_len, bc->will_qos,
+        bc->will_retain);
+    BrokerClient_ClearWill(bc);
+}
 
-    /* Handle retain flag on will message */
-    if (retain) {
-        if (payload_len == 0) {
-            BrokerRetained_Delete(broker, topic);
-        }
-        else {
-            int ret_rc = BrokerRetained_Store(broker, topic, payload,
-                payload_len, qos, 0);
-            if (ret_rc != MQTT_CODE_SUCCESS) {
-                WBLOG_ERR(broker, "Retained store failed: %s",
-                    MqttClient_ReturnCodeToString(ret_rc));
-            }
-        }
-    }
+/* Deliver a Will message to the matching subscribers of this broker. */
+static void BrokerWill_FanOut(MqttBroker* broker, const char* topic,
+    const byte* payload, word16 payload_len, MqttQoS qos)
+{
+    word32 base, end, m;
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerMsg* msg = NULL;
+#endif
 
-    /* Fan out to matching subscribers */
+    /* Fan out to matching subscribers. A WS fan-out write can drive an
+     * lws_service spin whose re-entrant CLOSED releases a client's
+     * BrokerSub nodes; they stay readable, as released, until MatchDone. */
+    base = BrokerSubTree_Match(broker, topic, &end);
+    for (m = base; m < end; m++) {
+        BrokerSub* sub = broker->sub_tree.match[m];
 #ifdef WOLFMQTT_STATIC_MEMORY
-    for (i = 0; i < BROKER_MAX_SUBS; i++) {
-        BrokerSub* sub = &broker->subs[i];
         if (!sub->in_use) continue;
-#else
-    sub = broker->subs;
-    while (sub) {
-        /* Snapshot the successor before any MqttPacket_Write: a WS fan-out
-         * write can drive an lws_service spin whose re-entrant CLOSED frees
-         * this client's BrokerSub nodes, so reading sub->next afterwards
-         * would dereference a freed node. */
-        next_sub = sub->next;
 #endif
         if (sub->client != NULL && sub->client->protocol_level != 0 &&
 #ifdef WOLFMQTT_STATIC_MEMORY
             sub->client->connected &&
 #endif
-            BROKER_STR_VALID(sub->filter) &&
-            BrokerTopicMatch(sub->filter, topic)) {
+            BROKER_STR_VALID(sub->filter)) {
             MqttQoS eff_qos = (qos < sub->qos) ? qos : sub->qos;
 #ifdef WOLFMQTT_STATIC_MEMORY
             if (eff_qos >= MQTT_QOS_1) {
@@ -5421,8 +8310,7 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
                         sub->client->client_id);
                 if (orphan != NULL) {
                     int enqueue_rc;
-                    BrokerStaticOrphan_RemoveExpiredQueued(orphan,
-                        WOLFMQTT_BROKER_GET_TIME_S());
+                    BrokerStaticOrphan_RemoveExpiredQueued(orphan, broker->now);
                     if (orphan->out_q_count >=
                             BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB) {
                         WBLOG_ERR(broker,
@@ -5462,8 +8350,7 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
                  * torn down, and a client with several matching subscriptions is
                  * not disconnected twice. Clearing connected lets the reaper
                  * close the transport (BrokerClient_Remove -> ws disconnect). */
-                if (sub->client->out_q_count >=
-                        BROKER_MAX_QUEUED_MSGS_PER_SUB) {
+                if (BrokerClient_OutQFull(sub->client, eff_qos)) {
                     BrokerClient* c = sub->client;
                     if (c->connected) {
                         WBLOG_ERR(broker,
@@ -5473,36 +8360,22 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
                         (void)BrokerSend_Disconnect(c,
                             MQTT_REASON_QUOTA_EXCEEDED);
                     #endif
-                        if (c->sock != BROKER_SOCKET_INVALID) {
-                            broker->net.close(broker->net.ctx, c->sock);
-                            c->sock = BROKER_SOCKET_INVALID;
-                        }
+                        (void)BrokerNetDisconnect(c);
                         c->connected = 0;
                     }
                 }
-                else {
-                    BrokerOutPub* e = BrokerOutPub_Alloc(topic,
+                else if (BrokerClient_EnqueueOutPub(sub->client,
+                        BrokerMsg_Share(broker, &msg, topic,
                         (payload_len > 0) ? payload : NULL, payload_len
                     #ifdef WOLFMQTT_V5
                         , NULL
                     #endif
-                        );
-                    if (e == NULL) {
-                        WBLOG_ERR(broker,
-                            "broker: will alloc failed sock=%d",
-                            (int)sub->client->sock);
-                    }
-                    else {
-                        e->qos = eff_qos;
-                        e->packet_id = BrokerNextPacketId(broker);
-                        e->retain = 0;
-                        e->state = BROKER_OUTQ_QUEUED;
-                    #ifdef WOLFMQTT_V5
-                        e->protocol_level = sub->client->protocol_level;
-                    #endif
-                        BrokerClient_EnqueueOutPub(sub->client, e);
-                        BrokerClient_DrainOutQueue(sub->client);
-                    }
+                        ), eff_qos, 0) != MQTT_CODE_SUCCESS) {
+                    WBLOG_ERR(broker, "broker: will enqueue failed sock=%d",
+                        (int)sub->client->sock);
+                }
+                else {
+                    BrokerClient_DrainOutQueue(sub->client);
                 }
             }
             /* QoS 0 is best effort; skip while tx_buf holds an in-flight
@@ -5512,6 +8385,10 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
             {
                 MqttPublish out_pub;
                 int enc_rc, wr_rc;
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                MqttProp alias;
+                int alias_slot;
+#endif
                 XMEMSET(&out_pub, 0, sizeof(out_pub));
                 out_pub.topic_name = (char*)topic;
                 out_pub.qos = eff_qos;
@@ -5519,17 +8396,31 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
                 out_pub.duplicate = 0;
                 out_pub.buffer = (payload_len > 0) ? (byte*)payload : NULL;
                 out_pub.total_len = payload_len;
+#ifdef WOLFMQTT_STATIC_MEMORY
+                /* Only static memory sends QoS 1/2 here */
                 if (eff_qos >= MQTT_QOS_1) {
-                    out_pub.packet_id = BrokerNextPacketId(broker);
+                    out_pub.packet_id = BrokerNextPacketId(
+                        &sub->client->next_packet_id);
                 }
+#endif
 #ifdef WOLFMQTT_V5
                 out_pub.protocol_level = sub->client->protocol_level;
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                alias_slot = BrokerTopicAlias_Out(sub->client, &out_pub,
+                    &alias);
 #endif
                 enc_rc = MqttEncode_Publish(sub->client->tx_buf,
                     BROKER_CLIENT_TX_SZ(sub->client), &out_pub, 0);
                 if (enc_rc > 0) {
                     wr_rc = MqttPacket_Write(&sub->client->client,
                             sub->client->tx_buf, enc_rc);
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                    if (wr_rc == enc_rc) {
+                        BrokerTopicAlias_Commit(sub->client, alias_slot,
+                            topic);
+                    }
+#endif
                     /* Scrub tx_buf unless still in-progress (CONTINUE). */
                     if (wr_rc != MQTT_CODE_CONTINUE) {
                         BROKER_FORCE_ZERO(sub->client->tx_buf, enc_rc);
@@ -5540,8 +8431,7 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
 #ifdef WOLFMQTT_STATIC_MEMORY
         else if ((sub->client == NULL || !sub->client->connected) &&
                 BROKER_STR_VALID(sub->client_id) &&
-                BROKER_STR_VALID(sub->filter) &&
-                BrokerTopicMatch(sub->filter, topic)) {
+                BROKER_STR_VALID(sub->filter)) {
             MqttQoS eff_qos = (qos < sub->qos) ? qos : sub->qos;
             if (eff_qos >= MQTT_QOS_1) {
                 BrokerStaticOrphanSession* orphan =
@@ -5563,10 +8453,49 @@ static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
             }
         }
 #endif
+    }
+    BrokerSubTree_MatchDone(broker, base);
 #ifndef WOLFMQTT_STATIC_MEMORY
-        sub = next_sub;
+    BrokerMsg_Release(msg);
 #endif
+}
+
+/* Publish a will message immediately (shared by direct and deferred paths) */
+static void BrokerClient_PublishWillImmediate(MqttBroker* broker,
+    const char* topic, const byte* payload, word16 payload_len,
+    MqttQoS qos, byte retain)
+{
+    if (broker == NULL || topic == NULL) {
+        return;
     }
+
+    /* Handle retain flag on will message */
+    if (retain) {
+        int ret_rc = BrokerRetained_Update(broker, topic, payload,
+            payload_len, qos, 0);
+        if (ret_rc != MQTT_CODE_SUCCESS) {
+            WBLOG_ERR(broker, "Retained store failed: %s",
+                MqttClient_ReturnCodeToString(ret_rc));
+        }
+    }
+
+    BrokerWill_FanOut(broker, topic, payload, payload_len, qos);
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* Subscribers on other shards get the Will too */
+    if (broker->shard != NULL) {
+        BrokerShardMsg* msg = BrokerShardMsg_New(BROKER_SHARD_MSG_WILL,
+            topic, payload, payload_len);
+        if (msg == NULL) {
+            WBLOG_ERR(broker, "broker: LWT forward alloc failed topic=%s",
+                BrokerLog_Sanitize(topic));
+        }
+        else {
+            msg->qos = qos;
+            (void)BrokerShard_Broadcast(broker->shard, msg, 0);
+            BrokerShardMsg_Release(msg);
+        }
+    }
+#endif
 }
 #endif /* WOLFMQTT_BROKER_WILL */
 
@@ -5588,43 +8517,31 @@ static int BrokerTopicMatch(const char* filter, const char* topic)
         return 0;
     }
 
-    while (*f && *t) {
-        if (*f == '#') {
+    /* Compare level by level; an empty level ("a//b", "a/") is a level
+     * like any other, so '+' matches it and '#' covers it. */
+    for (;;) {
+        word16 flen = BrokerSubTree_LevelLen(f);
+        word16 tlen = BrokerSubTree_LevelLen(t);
+        if (flen == 1 && *f == '#') {
             return (f[1] == '\0');
         }
-        if (*f == '+') {
-            while (*t && *t != '/') {
-                t++;
-            }
-            f++;
-        }
-        else {
-            if (*f != *t) {
-                return 0;
-            }
-            f++;
-            t++;
-        }
-        if (*t == '/' && *f == '/') {
-            t++;
-            f++;
-        }
-        else if (*t == '/' || *f == '/') {
-            /* [MQTT-4.7.1.2] 'topic/#' must also match 'topic' itself */
-            if (*f == '/' && f[1] == '#' && f[2] == '\0' && *t == '\0') {
-                return 1;
-            }
+        if (!(flen == 1 && *f == '+') &&
+                (flen != tlen || XMEMCMP(f, t, flen) != 0)) {
             return 0;
         }
+        f += flen;
+        t += tlen;
+        if (*f == '\0' || *t == '\0') {
+            break;
+        }
+        f++;
+        t++;
     }
-
-    if (*f == '#') {
-        return (f[1] == '\0');
-    }
-    if (*f == '+' && f[1] == '\0' && *t == '\0') {
-        return 1;
+    if (*f == '\0') {
+        return (*t == '\0');
     }
-    return (*f == '\0' && *t == '\0');
+    /* [MQTT-4.7.1.2] 'topic/#' must also match 'topic' itself */
+    return (f[1] == '#' && f[2] == '\0');
 }
 #else
 /* Exact match only when wildcards are disabled */
@@ -5787,10 +8704,6 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
     XMEMSET(&lwt, 0, sizeof(lwt));
     mc.lwt_msg = &lwt;
 
-#ifdef WOLFMQTT_STATIC_MEMORY
-    BrokerStaticOrphan_Sweep(broker, WOLFMQTT_BROKER_GET_TIME_S());
-#endif
-
     WBLOG_INFO(broker, "broker: CONNECT recv sock=%d len=%d", (int)bc->sock, rx_len);
     rc = MqttDecode_Connect(bc->rx_buf, rx_len, &mc);
     if (rc < 0) {
@@ -5835,6 +8748,7 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
     }
 
     /* Store client ID */
+    BrokerIdIndex_Del(broker, BROKER_ID_CLIENT, bc);
 #ifdef WOLFMQTT_STATIC_MEMORY
     bc->client_id[0] = '\0';
 #endif
@@ -5906,7 +8820,7 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
 
     bc->protocol_level = mc.protocol_level;
     bc->keep_alive_sec = mc.keep_alive_sec;
-    bc->last_rx = WOLFMQTT_BROKER_GET_TIME_S();
+    bc->last_rx = broker->now;
 
     /* Default Session Expiry, overridden below by an explicit v5 property:
      *  - v5: 0 regardless of Clean Start [MQTT-3.1.2.11.2].
@@ -5962,6 +8876,16 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
                 MQTT_PROP_RECEIVE_MAX);
         MqttProp* se_prop = BrokerProps_Find(mc.props,
                 MQTT_PROP_SESSION_EXPIRY_INTERVAL);
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        MqttProp* ta_prop = BrokerProps_Find(mc.props,
+                MQTT_PROP_TOPIC_ALIAS_MAX);
+        /* [MQTT-3.1.2-26] Never send more aliases than the client takes */
+        if (ta_prop != NULL) {
+            bc->alias_out_max =
+                (ta_prop->data_short > BROKER_TOPIC_ALIAS_MAX) ?
+                (word16)BROKER_TOPIC_ALIAS_MAX : ta_prop->data_short;
+        }
+    #endif
         if (rm_prop != NULL) {
 #ifdef WOLFMQTT_STATIC_MEMORY
             bc->static_client_receive_max = rm_prop->data_short;
@@ -5997,19 +8921,32 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
         static const char hex_digits[] = "0123456789abcdef";
         char auto_id[14];
         const word16 auto_len = 13;
-        word32 id_value = broker->next_auto_id++;
+        word32 id_value;
         int i;
-        if (broker->next_auto_id == 0) {
-            /* Skip 0 on wrap for stylistic consistency with next_packet_id;
-             * unlike packet IDs, 0 has no protocol significance here. */
-            broker->next_auto_id = 1;
-        }
-        XMEMCPY(auto_id, "auto-", 5);
-        for (i = 7; i >= 0; i--) {
-            auto_id[5 + i] = hex_digits[id_value & 0xF];
-            id_value >>= 4;
-        }
-        auto_id[auto_len] = '\0';
+        do {
+            id_value = broker->next_auto_id++;
+            if (broker->next_auto_id == 0) {
+                /* Skip 0 on wrap for stylistic consistency with packet
+                 * IDs; unlike packet IDs, 0 has no protocol significance
+                 * here. */
+                broker->next_auto_id = 1;
+            }
+            XMEMCPY(auto_id, "auto-", 5);
+            for (i = 7; i >= 0; i--) {
+                auto_id[5 + i] = hex_digits[id_value & 0xF];
+                id_value >>= 4;
+            }
+            auto_id[auto_len] = '\0';
+        }
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        /* A sharded broker only assigns IDs this shard owns, so the client
+         * keeps its session here when it reconnects with the assigned ID. */
+        while (broker->shard != NULL &&
+            BrokerShard_Owner(broker->shard, auto_id, auto_len) !=
+                broker->shard->index);
+    #else
+        while (0);
+    #endif
         BROKER_STORE_STR(bc->client_id, auto_id, auto_len,
             BROKER_MAX_CLIENT_ID_LEN);
         if (!BROKER_STR_VALID(bc->client_id)) {
@@ -6034,6 +8971,23 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
     #endif
     }
 
+    if (BROKER_STR_VALID(bc->client_id) &&
+            BrokerIdIndex_Add(broker, BROKER_ID_CLIENT, bc) !=
+                MQTT_CODE_SUCCESS) {
+        WBLOG_ERR(broker, "broker: client id index full sock=%d",
+            (int)bc->sock);
+    #ifdef WOLFMQTT_V5
+        if (mc.protocol_level >= MQTT_CONNECT_PROTOCOL_LEVEL_5) {
+            ack.return_code = MQTT_REASON_SERVER_UNAVAILABLE;
+        }
+        else
+    #endif
+        {
+            ack.return_code = MQTT_CONNECT_ACK_CODE_REFUSED_UNAVAIL;
+        }
+        goto send_connack;
+    }
+
     WBLOG_INFO(broker, "broker: CONNECT proto=%u clean=%d will=%d client_id=%s",
         mc.protocol_level, mc.clean_session, mc.enable_lwt,
         BrokerLog_Sanitize(
@@ -6237,7 +9191,6 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
         /* A zero interval ends the Session after this connection closes; it
          * does not prevent Clean Start=0 from resuming an existing Session
          * for this connection [MQTT-3.1.2-4]. */
-        BrokerStaticOrphan_Sweep(broker, WOLFMQTT_BROKER_GET_TIME_S());
         orphan = BrokerStaticOrphan_Find(broker, bc->client_id);
         had_static_session = (orphan != NULL);
     }
@@ -6340,7 +9293,7 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
 #ifdef WOLFMQTT_STATIC_MEMORY
             orphan = BrokerStaticOrphan_Find(broker, bc->client_id);
             if (orphan != NULL) {
-                BrokerStaticOrphan_Clear(orphan);
+                BrokerStaticOrphan_Clear(broker, orphan);
                 had_static_session = 0;
             }
             if (bc->session_expiry_sec != 0) {
@@ -6534,6 +9487,15 @@ static int BrokerHandle_Connect(BrokerClient* bc, int rx_len,
                     (word16)BROKER_MAX_INBOUND_QOS2;
             }
         }
+    #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+        /* [MQTT-3.2.2.3.8] Topic Alias Maximum: how many aliases this client
+         * may set on its PUBLISHes (see BrokerTopicAlias_In). */
+        prop = MqttProps_Add(&ack.props);
+        if (prop != NULL) {
+            prop->type = MQTT_PROP_TOPIC_ALIAS_MAX;
+            prop->data_short = (word16)BROKER_TOPIC_ALIAS_MAX;
+        }
+    #endif
     }
 #endif
 
@@ -6639,8 +9601,10 @@ send_connack:
      * for the duration of CONNECT processing rather than the whole session.
      * Refused/failed CONNECTs return earlier and are wiped when the caller
      * frees the client. Mirrors the client-side CLIENT_FORCE_ZERO hardening
-     * in mqtt_client.c. */
+     * in mqtt_client.c. The CONNECT also passed through the read-ahead
+     * buffer, where everything before rd_pos has been consumed. */
     BROKER_FORCE_ZERO(bc->rx_buf, (word32)rx_len);
+    BrokerClient_ScrubReadAhead(bc);
 #ifdef WOLFMQTT_BROKER_AUTH
 #ifdef WOLFMQTT_STATIC_MEMORY
     BROKER_FORCE_ZERO(bc->username, BROKER_MAX_USERNAME_LEN);
@@ -6667,6 +9631,10 @@ static int BrokerHandle_Subscribe(BrokerClient* bc, int rx_len,
     MqttSubscribe sub;
     MqttTopic topic_buf[MAX_MQTT_TOPICS];
     byte return_codes[MAX_MQTT_TOPICS];
+#ifdef WOLFMQTT_BROKER_PERSIST
+    BrokerSubDelta deltas[MAX_MQTT_TOPICS];
+    int delta_count = 0;
+#endif
 
     XMEMSET(&sub, 0, sizeof(sub));
 #ifdef WOLFMQTT_V5
@@ -6725,6 +9693,15 @@ static int BrokerHandle_Subscribe(BrokerClient* bc, int rx_len,
             {
                 sub_rc = BrokerSubs_Add(broker, bc, f, flen, topic_qos);
             }
+        #ifdef WOLFMQTT_BROKER_PERSIST
+            if (sub_rc >= 0) {
+                deltas[delta_count].filter = f;
+                deltas[delta_count].filter_len = flen;
+                deltas[delta_count].qos = (byte)topic_qos;
+                deltas[delta_count].op = BROKER_SUB_DELTA_ADD;
+                delta_count++;
+            }
+        #endif
             if (sub_rc < 0) {
                 granted_qos = (MqttQoS)fail_code;
             #ifdef WOLFMQTT_V5
@@ -6800,12 +9777,12 @@ static int BrokerHandle_Subscribe(BrokerClient* bc, int rx_len,
     rc = BrokerSend_SubAck(bc, sub.packet_id, return_codes, i);
 
 #ifdef WOLFMQTT_BROKER_PERSIST
-    /* Shadow-write the full subscription list for this client. Only
+    /* Shadow-write the filters this packet added or updated. Only
      * meaningful for clean_session=0 sessions; the persist layer no-ops
      * when no hooks are installed. */
-    if (rc > 0 && bc->session_expiry_sec != 0 &&
+    if (rc > 0 && delta_count > 0 && bc->session_expiry_sec != 0 &&
             BROKER_STR_VALID(bc->client_id)) {
-        (void)BrokerPersist_PutSubs(broker, bc->client_id);
+        (void)BrokerPersist_PutSubsDelta(broker, bc, deltas, delta_count);
     }
 #endif
 
@@ -6828,6 +9805,10 @@ static int BrokerHandle_Unsubscribe(BrokerClient* bc, int rx_len,
 #ifdef WOLFMQTT_V5
     byte reasons[MAX_MQTT_TOPICS];
 #endif
+#ifdef WOLFMQTT_BROKER_PERSIST
+    BrokerSubDelta deltas[MAX_MQTT_TOPICS];
+    int delta_count = 0;
+#endif
 
     XMEMSET(&unsub, 0, sizeof(unsub));
 #ifdef WOLFMQTT_V5
@@ -6850,6 +9831,13 @@ static int BrokerHandle_Unsubscribe(BrokerClient* bc, int rx_len,
         if (f && MqttDecode_Num((byte*)f - MQTT_DATA_LEN_SIZE,
                 &flen, MQTT_DATA_LEN_SIZE) == MQTT_DATA_LEN_SIZE) {
             BrokerSubs_Remove(broker, bc, f, flen);
+        #ifdef WOLFMQTT_BROKER_PERSIST
+            deltas[delta_count].filter = f;
+            deltas[delta_count].filter_len = flen;
+            deltas[delta_count].qos = 0;
+            deltas[delta_count].op = BROKER_SUB_DELTA_REMOVE;
+            delta_count++;
+        #endif
         }
 #ifdef WOLFMQTT_V5
         reasons[i] = MQTT_REASON_SUCCESS;
@@ -6879,20 +9867,429 @@ static int BrokerHandle_Unsubscribe(BrokerClient* bc, int rx_len,
     }
 
 #ifdef WOLFMQTT_BROKER_PERSIST
-    /* Re-snapshot subs (PutSubs converts count=0 into a DelSubs). */
+    /* Record the removed filters, or drop the records once the session
+     * has no subscriptions left. */
     if (rc > 0 && bc->session_expiry_sec != 0 &&
             BROKER_STR_VALID(bc->client_id)) {
-        (void)BrokerPersist_PutSubs(broker, bc->client_id);
+        if (bc->sub_count == 0) {
+            (void)BrokerPersist_DelSubs(broker, bc->client_id);
+        }
+        else if (delta_count > 0) {
+            (void)BrokerPersist_PutSubsDelta(broker, bc, deltas,
+                delta_count);
+        }
+    }
+#endif
+
+#ifdef WOLFMQTT_V5
+    if (unsub.props) {
+        (void)MqttProps_Free(unsub.props);
+    }
+#endif
+    return rc;
+}
+
+/* Deliver a PUBLISH to every matching subscriber of this broker, live or
+ * persistent. src_sock identifies the publisher in logs; it is -1 for a
+ * message forwarded from another shard. */
+static void BrokerPublish_FanOut(MqttBroker* broker, int src_sock,
+    char* topic, byte* payload, word32 payload_len, MqttQoS qos
+#ifdef WOLFMQTT_V5
+    , MqttProp* props
+#endif
+    )
+{
+    MqttQoS eff_qos;
+    BrokerSub* sub;
+    word32 base, end, m;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    BrokerStaticOrphanSession* queued_session;
+    MqttPublish out_pub;
+    int enqueue_rc;
+    int sub_rc;
+    int wr;
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+    MqttProp alias;
+    int alias_slot;
+#endif
+#else
+    BrokerMsg* msg = NULL;
+#endif
+
+    (void)src_sock; /* may be unused if logging disabled */
+
+    /* Fan out to matching subscribers. A fan-out write can drive an
+     * lws_service spin that releases a client's BrokerSub nodes
+     * re-entrantly (LWS_CALLBACK_CLOSED); they stay readable, as released,
+     * until MatchDone. */
+    base = BrokerSubTree_Match(broker, topic, &end);
+    for (m = base; m < end; m++) {
+        sub = broker->sub_tree.match[m];
+#ifdef WOLFMQTT_STATIC_MEMORY
+        if (!sub->in_use) continue;
+#endif
+        if (sub->client != NULL &&
+            sub->client->protocol_level != 0 &&
+            sub->client->connected &&
+            BROKER_STR_VALID(sub->filter)) {
+            eff_qos = (qos < sub->qos) ? qos : sub->qos;
+#ifdef WOLFMQTT_STATIC_MEMORY
+            queued_session = BrokerStaticOrphan_Find(broker,
+                sub->client->client_id);
+            if (eff_qos > MQTT_QOS_0 && queued_session != NULL) {
+                BrokerStaticOrphan_RemoveExpiredQueued(queued_session,
+                    broker->now);
+                if (queued_session->out_q_count >=
+                        BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB) {
+                    BrokerClient* queued_client = sub->client;
+
+                    WBLOG_ERR(broker,
+                        "broker: static live queue full sock=%d",
+                        (int)queued_client->sock);
+                    BrokerStaticClient_QuotaClose(broker,
+                        queued_client);
+                    continue;
+                }
+                enqueue_rc = BrokerStaticOrphan_Enqueue(broker,
+                    queued_session, topic, payload, payload_len,
+                    eff_qos, 0, 0
+                #ifdef WOLFMQTT_V5
+                    , props
+                #endif
+                    );
+                if (enqueue_rc == MQTT_CODE_SUCCESS) {
+                    continue;
+                }
+                WBLOG_ERR(broker,
+                    "broker: static live delivery dropped "
+                    "sock=%d rc=%d", (int)sub->client->sock,
+                    enqueue_rc);
+                continue;
+            }
+            /* Static-memory mode keeps the legacy synchronous
+             * fan-out: no per-subscriber queue, no inflight cap.
+             * Sub-encoder failure is logged but not propagated. */
+            XMEMSET(&out_pub, 0, sizeof(out_pub));
+            out_pub.topic_name = topic;
+            out_pub.qos = eff_qos;
+            if (eff_qos >= MQTT_QOS_1) {
+                out_pub.packet_id = BrokerNextPacketId(
+                    &sub->client->next_packet_id);
+            }
+            out_pub.retain = 0;
+            out_pub.duplicate = 0;
+            out_pub.buffer = payload;
+            out_pub.total_len = payload_len;
+            out_pub.buffer_len = payload_len;
+            #ifdef WOLFMQTT_V5
+            out_pub.protocol_level = sub->client->protocol_level;
+            if (sub->client->protocol_level >=
+                MQTT_CONNECT_PROTOCOL_LEVEL_5) {
+                out_pub.props = props;
+            }
+            #endif
+            #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+            alias_slot = BrokerTopicAlias_Out(sub->client, &out_pub, &alias);
+            #endif
+            sub_rc = MqttEncode_Publish(sub->client->tx_buf,
+                BROKER_CLIENT_TX_SZ(sub->client), &out_pub, 0);
+            if (sub_rc > 0) {
+                WBLOG_DBG(broker,
+                    "broker: PUBLISH fwd sock=%d -> sock=%d "
+                    "topic=%s qos=%d len=%u",
+                    src_sock, (int)sub->client->sock,
+                    BrokerLog_Sanitize(topic), eff_qos,
+                    (unsigned)payload_len);
+                wr = MqttPacket_Write(&sub->client->client,
+                    sub->client->tx_buf, sub_rc);
+                if (wr != sub_rc) {
+                    BrokerStaticClient_Close(broker, sub->client);
+                }
+            #ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+                else {
+                    BrokerTopicAlias_Commit(sub->client, alias_slot, topic);
+                }
+            #endif
+                BROKER_FORCE_ZERO(sub->client->tx_buf, sub_rc);
+            }
+            else {
+                WBLOG_ERR(broker,
+                    "broker: PUBLISH fwd encode failed "
+                    "sock=%d -> sock=%d rc=%d",
+                    src_sock, (int)sub->client->sock, sub_rc);
+            }
+#else
+            /* Dynamic mode: enqueue an entry on the subscriber's
+             * out_q, then drain. The queue gives us the inflight cap
+             * (#7 ordered delivery) and is the substrate for the
+             * offline queue in PR2. Every entry of this fan-out shares
+             * one copy of the message. Invariant: payload holds at
+             * least payload_len contiguous bytes (the PUBLISH was fully
+             * received and decoded, or copied whole into a cross-shard
+             * message); BrokerMsg_Share copies payload_len from that
+             * buffer. */
+            if (BrokerClient_OutQFull(sub->client, eff_qos)) {
+                /* DoS guard: bound the connected subscriber's outbound
+                 * queue depth. The inflight cap above only limits bytes on
+                 * the wire; a subscriber that stops acking lets QUEUED
+                 * entries accumulate one heap-copied PUBLISH at a time
+                 * until the broker exhausts memory. Disconnect the slow /
+                 * abusive subscriber rather than growing out_q or silently
+                 * dropping accepted QoS 1/2 messages. A persistent session
+                 * is reclaimable on reconnect via the (capped) offline
+                 * queue. Mirrors the static partial-write teardown: tear
+                 * the socket down and clear connected so the match guard
+                 * above skips this client's remaining subscriptions; the
+                 * main loop reaps it on the next read error. */
+                /* Cache the client before BrokerSend_Disconnect below: that
+                 * write can drive an lws_service spin whose
+                 * LWS_CALLBACK_CLOSED releases this subscriber's BrokerSub
+                 * nodes re-entrantly, clearing `sub->client`. The
+                 * BrokerClient itself survives the write - its free is
+                 * deferred while the WS context is marked processing - so
+                 * the post-write socket teardown must reach it through this
+                 * cached pointer, never through the released sub node. */
+                BrokerClient* c = sub->client;
+                WBLOG_ERR(broker,
+                    "broker: out_q full (%d) -> disconnect sock=%d "
+                    "(from sock=%d)", c->out_q_count,
+                    (int)c->sock, src_sock);
+            #ifdef WOLFMQTT_V5
+                (void)BrokerSend_Disconnect(c,
+                    MQTT_REASON_QUOTA_EXCEEDED);
+            #endif
+                (void)BrokerNetDisconnect(c);
+                c->connected = 0;
+            }
+            else if (BrokerClient_EnqueueOutPub(sub->client,
+                    BrokerMsg_Share(broker, &msg, topic, payload, payload_len
+                #ifdef WOLFMQTT_V5
+                    , props
+                #endif
+                    ), eff_qos, 0) != MQTT_CODE_SUCCESS) {
+                WBLOG_ERR(broker,
+                    "broker: PUBLISH fwd enqueue failed sock=%d -> sock=%d",
+                    src_sock, (int)sub->client->sock);
+            }
+            else {
+                WBLOG_DBG(broker,
+                    "broker: PUBLISH enq sock=%d -> sock=%d "
+                    "topic=%s qos=%d len=%u",
+                    src_sock, (int)sub->client->sock,
+                    BrokerLog_Sanitize(topic), eff_qos,
+                    (unsigned)payload_len);
+                BrokerClient_DrainOutQueue(sub->client);
+            }
+#endif
+        }
+#ifdef WOLFMQTT_STATIC_MEMORY
+        else if ((sub->client == NULL || !sub->client->connected) &&
+                 BROKER_STR_VALID(sub->client_id) &&
+                 BROKER_STR_VALID(sub->filter)) {
+            /* Persistent static-memory session: retain QoS 1/2 while the
+             * client is offline in the bounded orphan carrier. */
+            eff_qos = (qos < sub->qos) ? qos : sub->qos;
+            if (eff_qos > MQTT_QOS_0) {
+                queued_session = BrokerStaticOrphan_Find(broker,
+                    sub->client_id);
+                if (queued_session == NULL) {
+                    /* A disconnected Clean Session may still be awaiting
+                     * teardown with its subscriptions attached. It has no
+                     * durable carrier and must not affect the publisher. */
+                    if (sub->client == NULL) {
+                        WBLOG_ERR(broker,
+                            "broker: static orphan missing client_id=%s",
+                            BrokerLog_Sanitize(sub->client_id));
+                    }
+                    continue;
+                }
+                enqueue_rc = BrokerStaticOrphan_Enqueue(broker,
+                    queued_session, topic, payload, payload_len,
+                    eff_qos, 0, 0
+                #ifdef WOLFMQTT_V5
+                    , props
+                #endif
+                    );
+                if (enqueue_rc != MQTT_CODE_SUCCESS) {
+                    WBLOG_ERR(broker,
+                        "broker: static offline delivery dropped "
+                        "client_id=%s rc=%d",
+                        BrokerLog_Sanitize(sub->client_id), enqueue_rc);
+                }
+            }
+        }
+#else
+        else if (sub->client == NULL && sub->client_id != NULL &&
+                 BROKER_STR_VALID(sub->filter)) {
+            /* Orphaned persistent session: subscriber is currently
+             * disconnected. Queue QoS 1/2 messages on the orphan
+             * slot for delivery on reconnect. */
+            eff_qos = (qos < sub->qos) ? qos : sub->qos;
+            if (eff_qos > MQTT_QOS_0) {
+                BrokerOrphanSession* o =
+                    BrokerOrphan_Find(broker, sub->client_id);
+                if (o != NULL) {
+                    BrokerOrphan_Enqueue(broker, o, BrokerMsg_Share(broker,
+                        &msg, topic, payload, payload_len
+                    #ifdef WOLFMQTT_V5
+                        , props
+                    #endif
+                        ), eff_qos, 0);
+                }
+            }
+        }
+#endif
+    }
+    BrokerSubTree_MatchDone(broker, base);
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerMsg_Release(msg);
+#endif
+}
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Hand a PUBLISH to every other shard for delivery to its subscribers. */
+static void BrokerShard_ForwardPublish(MqttBroker* broker, const char* topic,
+    const byte* payload, word32 payload_len, MqttQoS qos
+#ifdef WOLFMQTT_V5
+    , const MqttProp* props
+#endif
+    )
+{
+    BrokerShardMsg* msg;
+
+    if (broker->shard->group->count < 2) {
+        return;
+    }
+    msg = BrokerShardMsg_New(BROKER_SHARD_MSG_PUBLISH, topic, payload,
+        payload_len);
+    if (msg == NULL) {
+        WBLOG_ERR(broker, "broker: PUBLISH forward alloc failed topic=%s",
+            BrokerLog_Sanitize(topic));
+        return;
+    }
+    msg->qos = qos;
+#ifdef WOLFMQTT_V5
+    if (props != NULL) {
+        /* Shard messages cross threads, so not from this broker's slab */
+        msg->props = BrokerProps_Clone(NULL, props);
+        if (msg->props == NULL) {
+            WBLOG_ERR(broker, "broker: PUBLISH forward props alloc failed "
+                "topic=%s", BrokerLog_Sanitize(topic));
+            BrokerShardMsg_Release(msg);
+            return;
+        }
+    }
+#endif
+    (void)BrokerShard_Broadcast(broker->shard, msg, 0);
+    BrokerShardMsg_Release(msg);
+}
+#endif /* WOLFMQTT_BROKER_SHARDS */
+
+#ifdef WOLFMQTT_BROKER_PERSIST
+/* Send bc's held acks whose batch has committed, oldest first. Stops at
+ * the first ack still waiting. An ack whose batch was lost instead marks
+ * the client held_ack_failed, for the Step to disconnect. */
+static void BrokerHeldAck_Release(MqttBroker* broker, BrokerClient* bc)
+{
+    BrokerHeldAck* a;
+    MqttPublishResp resp;
+    word32 committed_id;
+    word32 failed_id;
+    int rc;
+
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* Published by the worker thread when it runs */
+    committed_id = BROKER_ATOMIC_LOAD(&broker->persist_committed_id);
+    failed_id = BROKER_ATOMIC_LOAD(&broker->persist_failed_id);
+#else
+    committed_id = broker->persist_committed_id;
+    failed_id = broker->persist_failed_id;
+#endif
+    while (bc->held_ack_count > 0 && !bc->held_ack_failed) {
+        a = &bc->held_ack[bc->held_ack_head];
+        if (a->batch <= failed_id) {
+            bc->held_ack_failed = 1;
+            break;
+        }
+        if (a->batch > committed_id) {
+            break;
+        }
+        XMEMSET(&resp, 0, sizeof(resp));
+        resp.packet_id = a->packet_id;
+    #ifdef WOLFMQTT_V5
+        resp.protocol_level = bc->protocol_level;
+        resp.reason_code = a->reason;
+    #endif
+        rc = MqttEncode_PublishResp(bc->tx_buf, BROKER_CLIENT_TX_SZ(bc),
+            a->type, &resp);
+        if (rc > 0) {
+            WBLOG_DBG(broker, "broker: PUBRESP send sock=%d packet_id=%u "
+                "(durable)", (int)bc->sock, a->packet_id);
+            (void)MqttPacket_Write(&bc->client, bc->tx_buf, rc);
+        }
+        bc->held_ack_head = (word16)((bc->held_ack_head + 1) %
+            BROKER_PERSIST_ACK_MAX);
+        bc->held_ack_count--;
+        if (bc->held_ack_count == 0) {
+            BrokerHeldAck_Unlink(broker, bc);
+        }
+    }
+}
+
+/* Durable-ack mode: hold the ack for a QoS 1/2 PUBLISH just handled while
+ * the records it produced sit in an uncommitted batch, or while earlier
+ * acks of the same client wait, so acks keep the order of the PUBLISHes
+ * [MQTT-4.6.0-2]. Acks of every publisher in the batch go out together
+ * once it commits. Returns 1 if the ack was held (or dropped because the
+ * client is about to be disconnected), 0 to send it now. */
+static int BrokerHeldAck_Hold(MqttBroker* broker, BrokerClient* bc,
+    byte type, const MqttPublishResp* resp)
+{
+    BrokerHeldAck* a;
+    word32 batch;
+
+    if (!broker->persist_durable_ack || broker->persist == NULL) {
+        return 0;
+    }
+    if (bc->held_ack_count == BROKER_PERSIST_ACK_MAX) {
+        /* Out of room: commit now rather than stall the client, and wait
+         * for a worker to finish that commit */
+        (void)BrokerPersist_BatchCommit(broker, BROKER_PERSIST_COMMIT_NOW);
+        BrokerHeldAck_Release(broker, bc);
+        if (bc->held_ack_count == BROKER_PERSIST_ACK_MAX) {
+            BrokerPersist_Barrier(broker);
+            BrokerHeldAck_Release(broker, bc);
+        }
+    }
+    if (bc->held_ack_failed) {
+        return 1;
     }
-#endif
-
-#ifdef WOLFMQTT_V5
-    if (unsub.props) {
-        (void)MqttProps_Free(unsub.props);
+    if (broker->persist_batch_open) {
+        batch = broker->persist_batch_id;
+    }
+    else if (bc->held_ack_count > 0) {
+        batch = bc->held_ack[(bc->held_ack_head + bc->held_ack_count - 1) %
+            BROKER_PERSIST_ACK_MAX].batch;
+    }
+    else {
+        return 0;
     }
+    a = &bc->held_ack[(bc->held_ack_head + bc->held_ack_count) %
+        BROKER_PERSIST_ACK_MAX];
+    a->batch = batch;
+    a->packet_id = resp->packet_id;
+    a->type = type;
+#ifdef WOLFMQTT_V5
+    a->reason = resp->reason_code;
+#else
+    a->reason = 0;
 #endif
-    return rc;
+    if (bc->held_ack_count++ == 0) {
+        BrokerHeldAck_Link(broker, bc);
+    }
+    return 1;
 }
+#endif /* WOLFMQTT_BROKER_PERSIST */
 
 static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
     MqttBroker* broker)
@@ -6902,7 +10299,6 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
     MqttPublishResp resp;
     byte* payload = NULL;
     char* topic = NULL;
-    MqttQoS eff_qos;
 #if defined(WOLFMQTT_V5) && defined(WOLFMQTT_BROKER_RETAINED)
     int retain_rc = MQTT_CODE_SUCCESS;
 #endif
@@ -6910,14 +10306,7 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
     int qos2_duplicate = 0;
 #endif
 #ifdef WOLFMQTT_STATIC_MEMORY
-    BrokerStaticOrphanSession* queued_session;
-    BrokerSub* sub;
-    MqttPublish out_pub;
     char topic_buf[BROKER_MAX_TOPIC_LEN];
-    int enqueue_rc;
-    int i;
-    int sub_rc;
-    int wr;
 #endif
 
     XMEMSET(&pub, 0, sizeof(pub));
@@ -6945,7 +10334,23 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         goto publish_cleanup;
     }
 
-    /* The broker does not implement Topic Aliases (it advertises a Topic Alias
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+    /* Resolve an inbound Topic Alias to its topic (or bind it) before the
+     * topic is used, and drop it from the properties forwarded on. */
+    if (bc->protocol_level >= MQTT_CONNECT_PROTOCOL_LEVEL_5 &&
+            pub.props != NULL) {
+        byte reason = MQTT_REASON_PROTOCOL_ERR;
+        int alias_rc = BrokerTopicAlias_In(bc, &pub, &reason);
+        if (alias_rc != MQTT_CODE_SUCCESS) {
+            WBLOG_ERR(broker, "broker: client PUBLISH Topic Alias refused "
+                "sock=%d reason=0x%02x", (int)bc->sock, reason);
+            (void)BrokerSend_Disconnect(bc, reason);
+            rc = alias_rc;
+            goto publish_cleanup;
+        }
+    }
+#else
+    /* Topic Aliases are compiled out (the broker advertises a Topic Alias
      * Maximum of 0), so any inbound Topic Alias property is a Protocol Error -
      * whether it accompanies an empty Topic Name (an alias-only PUBLISH that
      * cannot be resolved to a topic) or a full one (which would otherwise be
@@ -6960,6 +10365,7 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         rc = MQTT_CODE_ERROR_MALFORMED_DATA;
         goto publish_cleanup;
     }
+#endif /* WOLFMQTT_BROKER_TOPIC_ALIAS */
 #endif
 
     /* The decoder only captured pub.buffer_len bytes of the payload; if that is
@@ -7058,7 +10464,8 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         topic_buf[tlen] = '\0';
         topic = topic_buf;
 #else
-        topic = (char*)WOLFMQTT_MALLOC(pub.topic_name_len + 1);
+        topic = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+            (size_t)pub.topic_name_len + 1);
         if (topic == NULL) {
             /* Without the topic copy, retained-store and fan-out are skipped;
              * returning here prevents the QoS 1/2 ACK encoder below from
@@ -7086,10 +10493,7 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         !qos2_duplicate &&
     #endif
         topic != NULL && pub.retain) {
-        if (pub.total_len == 0) {
-            BrokerRetained_Delete(broker, topic);
-        }
-        else if (payload != NULL) {
+        if (pub.total_len == 0 || payload != NULL) {
             word32 expiry = 0;
 #ifdef WOLFMQTT_V5
             if (pub.props != NULL) {
@@ -7101,7 +10505,7 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
             }
 #endif
             {
-                int ret_rc = BrokerRetained_Store(broker, topic, payload,
+                int ret_rc = BrokerRetained_Update(broker, topic, payload,
                     pub.total_len, pub.qos, expiry);
                 if (ret_rc != MQTT_CODE_SUCCESS) {
                     WBLOG_ERR(broker, "Retained store failed: %s",
@@ -7122,256 +10526,22 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         !qos2_duplicate &&
     #endif
         topic != NULL && (payload != NULL || pub.total_len == 0)) {
-#ifndef WOLFMQTT_STATIC_MEMORY
-        BrokerSub* sub = broker->subs;
-        BrokerSub* next_sub = NULL;
-#endif
-        /* Fan out to matching subscribers */
-#ifdef WOLFMQTT_STATIC_MEMORY
-        for (i = 0; i < BROKER_MAX_SUBS; i++) {
-            sub = &broker->subs[i];
-            if (!sub->in_use) continue;
-#else
-        while (sub) {
-            /* Snapshot the successor before any MqttPacket_Write: a fan-out
-             * write can drive an lws_service spin that frees this client's
-             * BrokerSub nodes re-entrantly (LWS_CALLBACK_CLOSED), so reading
-             * sub->next afterwards would dereference a freed node. */
-            next_sub = sub->next;
-#endif
-            if (sub->client != NULL &&
-                sub->client->protocol_level != 0 &&
-                sub->client->connected &&
-                BROKER_STR_VALID(sub->filter) &&
-                BrokerTopicMatch(sub->filter, topic)) {
-                eff_qos = (pub.qos < sub->qos) ? pub.qos : sub->qos;
-#ifdef WOLFMQTT_STATIC_MEMORY
-                queued_session = BrokerStaticOrphan_Find(broker,
-                    sub->client->client_id);
-                if (eff_qos > MQTT_QOS_0 && queued_session != NULL) {
-                    BrokerStaticOrphan_RemoveExpiredQueued(queued_session,
-                        WOLFMQTT_BROKER_GET_TIME_S());
-                    if (queued_session->out_q_count >=
-                            BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB) {
-                        BrokerClient* queued_client = sub->client;
-
-                        WBLOG_ERR(broker,
-                            "broker: static live queue full sock=%d",
-                            (int)queued_client->sock);
-                        BrokerStaticClient_QuotaClose(broker,
-                            queued_client);
-                        continue;
-                    }
-                    enqueue_rc = BrokerStaticOrphan_Enqueue(broker,
-                        queued_session, topic, payload, pub.total_len,
-                        eff_qos, 0, 0
-                    #ifdef WOLFMQTT_V5
-                        , pub.props
-                    #endif
-                        );
-                    if (enqueue_rc == MQTT_CODE_SUCCESS) {
-                        continue;
-                    }
-                    WBLOG_ERR(broker,
-                        "broker: static live delivery dropped "
-                        "sock=%d rc=%d", (int)sub->client->sock,
-                        enqueue_rc);
-                    continue;
-                }
-                /* Static-memory mode keeps the legacy synchronous
-                 * fan-out: no per-subscriber queue, no inflight cap.
-                 * Sub-encoder failure is logged but not propagated. */
-                XMEMSET(&out_pub, 0, sizeof(out_pub));
-                out_pub.topic_name = topic;
-                out_pub.qos = eff_qos;
-                if (eff_qos >= MQTT_QOS_1) {
-                    out_pub.packet_id = BrokerNextPacketId(broker);
-                }
-                out_pub.retain = 0;
-                out_pub.duplicate = 0;
-                out_pub.buffer = payload;
-                out_pub.total_len = pub.total_len;
-                out_pub.buffer_len = pub.buffer_len;
-                #ifdef WOLFMQTT_V5
-                out_pub.protocol_level = sub->client->protocol_level;
-                if (sub->client->protocol_level >=
-                    MQTT_CONNECT_PROTOCOL_LEVEL_5) {
-                    out_pub.props = pub.props;
-                }
-                #endif
-                sub_rc = MqttEncode_Publish(sub->client->tx_buf,
-                    BROKER_CLIENT_TX_SZ(sub->client), &out_pub, 0);
-                if (sub_rc > 0) {
-                    WBLOG_DBG(broker,
-                        "broker: PUBLISH fwd sock=%d -> sock=%d "
-                        "topic=%s qos=%d len=%u",
-                        (int)bc->sock, (int)sub->client->sock,
-                        BrokerLog_Sanitize(topic), eff_qos,
-                        (unsigned)pub.total_len);
-                    wr = MqttPacket_Write(&sub->client->client,
-                        sub->client->tx_buf, sub_rc);
-                    if (wr != sub_rc) {
-                        BrokerStaticClient_Close(broker, sub->client);
-                    }
-                    BROKER_FORCE_ZERO(sub->client->tx_buf, sub_rc);
-                }
-                else {
-                    WBLOG_ERR(broker,
-                        "broker: PUBLISH fwd encode failed "
-                        "sock=%d -> sock=%d rc=%d",
-                        (int)bc->sock, (int)sub->client->sock, sub_rc);
-                }
-#else
-                /* Dynamic mode: enqueue a heap-owned copy on the
-                 * subscriber's out_q, then drain. The queue gives us
-                 * the inflight cap (#7 ordered delivery) and is the
-                 * substrate for the offline queue in PR2. Invariant:
-                 * MqttDecode_Publish above has populated pub.buffer
-                 * with at least pub.total_len contiguous bytes (full
-                 * PUBLISH is fully received and decoded before we
-                 * reach the fan-out); BrokerOutPub_Alloc deep-copies
-                 * pub.total_len from that buffer. */
-                if (sub->client->out_q_count >=
-                        BROKER_MAX_QUEUED_MSGS_PER_SUB) {
-                    /* DoS guard: bound the connected subscriber's outbound
-                     * queue depth. The inflight cap above only limits bytes on
-                     * the wire; a subscriber that stops acking lets QUEUED
-                     * entries accumulate one heap-copied PUBLISH at a time
-                     * until the broker exhausts memory. Disconnect the slow /
-                     * abusive subscriber rather than growing out_q or silently
-                     * dropping accepted QoS 1/2 messages. A persistent session
-                     * is reclaimable on reconnect via the (capped) offline
-                     * queue. Mirrors the static partial-write teardown: tear
-                     * the socket down and clear connected so the match guard
-                     * above skips this client's remaining subscriptions; the
-                     * main loop reaps it on the next read error. */
-                    /* Cache the client before BrokerSend_Disconnect below: that
-                     * write can drive an lws_service spin whose
-                     * LWS_CALLBACK_CLOSED frees this subscriber's BrokerSub
-                     * nodes re-entrantly (the same hazard the next_sub snapshot
-                     * guards against), leaving `sub` dangling. The BrokerClient
-                     * itself survives the write - its free is deferred while the
-                     * WS context is marked processing - so the post-write socket
-                     * teardown must reach it through this cached pointer, never
-                     * through the freed sub node. */
-                    BrokerClient* c = sub->client;
-                    WBLOG_ERR(broker,
-                        "broker: out_q full (%d) -> disconnect sock=%d "
-                        "(from sock=%d)", c->out_q_count,
-                        (int)c->sock, (int)bc->sock);
-                #ifdef WOLFMQTT_V5
-                    (void)BrokerSend_Disconnect(c,
-                        MQTT_REASON_QUOTA_EXCEEDED);
-                #endif
-                    if (c->sock != BROKER_SOCKET_INVALID) {
-                        broker->net.close(broker->net.ctx,
-                            c->sock);
-                        c->sock = BROKER_SOCKET_INVALID;
-                    }
-                    c->connected = 0;
-                }
-                else {
-                    BrokerOutPub* e = BrokerOutPub_Alloc(topic, payload,
-                                          pub.total_len
-                    #ifdef WOLFMQTT_V5
-                                          , pub.props
-                    #endif
-                                          );
-                    if (e == NULL) {
-                        WBLOG_ERR(broker,
-                            "broker: PUBLISH fwd alloc failed sock=%d "
-                            "-> sock=%d", (int)bc->sock,
-                            (int)sub->client->sock);
-                    }
-                    else {
-                        e->qos = eff_qos;
-                        if (eff_qos >= MQTT_QOS_1) {
-                            e->packet_id = BrokerNextPacketId(broker);
-                        }
-                        e->retain = 0;
-                        e->state = BROKER_OUTQ_QUEUED;
-                    #ifdef WOLFMQTT_V5
-                        e->protocol_level = sub->client->protocol_level;
-                    #endif
-                        BrokerClient_EnqueueOutPub(sub->client, e);
-                        WBLOG_DBG(broker,
-                            "broker: PUBLISH enq sock=%d -> sock=%d "
-                            "topic=%s qos=%d len=%u",
-                            (int)bc->sock, (int)sub->client->sock,
-                            BrokerLog_Sanitize(topic), eff_qos,
-                            (unsigned)pub.total_len);
-                        BrokerClient_DrainOutQueue(sub->client);
-                    }
-                }
-#endif
-            }
-#ifdef WOLFMQTT_STATIC_MEMORY
-            else if ((sub->client == NULL || !sub->client->connected) &&
-                     BROKER_STR_VALID(sub->client_id) &&
-                     BROKER_STR_VALID(sub->filter) &&
-                     BrokerTopicMatch(sub->filter, topic)) {
-                /* Persistent static-memory session: retain QoS 1/2 while the
-                 * client is offline in the bounded orphan carrier. */
-                eff_qos = (pub.qos < sub->qos) ? pub.qos : sub->qos;
-                if (eff_qos > MQTT_QOS_0) {
-                    queued_session = BrokerStaticOrphan_Find(broker,
-                        sub->client_id);
-                    if (queued_session == NULL) {
-                        /* A disconnected Clean Session may still be awaiting
-                         * teardown with its subscriptions attached. It has no
-                         * durable carrier and must not affect the publisher. */
-                        if (sub->client == NULL) {
-                            WBLOG_ERR(broker,
-                                "broker: static orphan missing client_id=%s",
-                                BrokerLog_Sanitize(sub->client_id));
-                        }
-                        continue;
-                    }
-                    enqueue_rc = BrokerStaticOrphan_Enqueue(broker,
-                        queued_session, topic, payload, pub.total_len,
-                        eff_qos, 0, 0
-                    #ifdef WOLFMQTT_V5
-                        , pub.props
-                    #endif
-                        );
-                    if (enqueue_rc != MQTT_CODE_SUCCESS) {
-                        WBLOG_ERR(broker,
-                            "broker: static offline delivery dropped "
-                            "client_id=%s rc=%d",
-                            BrokerLog_Sanitize(sub->client_id), enqueue_rc);
-                    }
-                }
-            }
-#else
-            /* Note on iteration model: static-mode walks the BrokerSub
-             * array via for (i=0; i<BROKER_MAX_SUBS; i++) and gets its
-             * advance from i++. Dynamic-mode walks the linked list and
-             * needs an explicit sub = sub->next below. The orphan
-             * branch (sub->client == NULL) only exists in dynamic mode -
-             * static-mode orphan handling lives in the restore path. */
-            else if (sub->client == NULL && sub->client_id != NULL &&
-                     BROKER_STR_VALID(sub->filter) &&
-                     BrokerTopicMatch(sub->filter, topic)) {
-                /* Orphaned persistent session: subscriber is currently
-                 * disconnected. Queue QoS 1/2 messages on the orphan
-                 * slot for delivery on reconnect. */
-                eff_qos = (pub.qos < sub->qos) ? pub.qos : sub->qos;
-                if (eff_qos > MQTT_QOS_0) {
-                    BrokerOrphanSession* o =
-                        BrokerOrphan_Find(broker, sub->client_id);
-                    if (o != NULL) {
-                        BrokerOrphan_Enqueue(broker, o, topic, payload,
-                            pub.total_len, eff_qos, 0
-                        #ifdef WOLFMQTT_V5
-                            , pub.props
-                        #endif
-                            );
-                    }
-                }
-            }
-            sub = next_sub;
-#endif
+        BrokerPublish_FanOut(broker, (int)bc->sock, topic, payload,
+            pub.total_len, pub.qos
+        #ifdef WOLFMQTT_V5
+            , pub.props
+        #endif
+            );
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        if (broker->shard != NULL) {
+            BrokerShard_ForwardPublish(broker, topic, payload,
+                pub.total_len, pub.qos
+            #ifdef WOLFMQTT_V5
+                , pub.props
+            #endif
+                );
         }
+    #endif
     }
 
     if (pub.qos == MQTT_QOS_1 || pub.qos == MQTT_QOS_2) {
@@ -7388,6 +10558,14 @@ static int BrokerHandle_Publish(BrokerClient* bc, int rx_len,
         }
 #endif
         resp.props = NULL;
+#endif
+#ifdef WOLFMQTT_BROKER_PERSIST
+        if (BrokerHeldAck_Hold(broker, bc, (pub.qos == MQTT_QOS_1) ?
+                MQTT_PACKET_TYPE_PUBLISH_ACK : MQTT_PACKET_TYPE_PUBLISH_REC,
+                &resp)) {
+            rc = MQTT_CODE_SUCCESS;
+            goto publish_cleanup;
+        }
 #endif
         rc = MqttEncode_PublishResp(bc->tx_buf, BROKER_CLIENT_TX_SZ(bc),
                 (pub.qos == MQTT_QOS_1) ? MQTT_PACKET_TYPE_PUBLISH_ACK :
@@ -7407,7 +10585,7 @@ publish_cleanup:
 #endif
 #ifndef WOLFMQTT_STATIC_MEMORY
     if (topic) {
-        WOLFMQTT_FREE(topic);
+        BrokerSlab_Free(topic);
     }
 #endif
 
@@ -7549,67 +10727,300 @@ static void BrokerClient_AbnormalClose(MqttBroker* broker, BrokerClient* bc)
     if (bc->session_expiry_sec == 0) {
         BrokerSubs_EndClientSession(broker, bc);
     }
-    else {
-        BrokerSubs_OrphanClient(broker, bc);
+    else {
+        BrokerSubs_OrphanClient(broker, bc);
+    }
+    BrokerClient_Remove(broker, bc);
+}
+
+/* Returns non-zero for return codes that require the broker to close the
+ * client connection. Includes:
+ *   - Wire-level decode errors (malformed packet, wrong packet type).
+ *   - Packet ID violations: [MQTT-2.3.1-1] requires a non-zero Packet
+ *     Identifier on QoS>0 PUBLISH and on every SUBSCRIBE/UNSUBSCRIBE;
+ *     decoders return MQTT_CODE_ERROR_PACKET_ID for packet_id == 0, and
+ *     [MQTT-4.13]/[MQTT-4.8.0-1] mandate connection close on malformed
+ *     packets.
+ *   - Server-side resource exhaustion (allocator failure, per-client cap
+ *     reached) - the connection must be torn down so resources release.
+ *   - v5 property protocol errors (too many properties, duplicate singleton)
+ *     are malformed packets [MQTT-4.13.1]; the client must be disconnected. */
+static int BrokerRcIsFatal(int rc)
+{
+    return (rc == MQTT_CODE_ERROR_MALFORMED_DATA ||
+            rc == MQTT_CODE_ERROR_PACKET_TYPE ||
+            rc == MQTT_CODE_ERROR_PACKET_ID ||
+            rc == MQTT_CODE_ERROR_PROPERTY ||
+            rc == MQTT_CODE_ERROR_PROPERTY_MISMATCH ||
+            rc == MQTT_CODE_ERROR_MEMORY ||
+            rc == MQTT_CODE_ERROR_OUT_OF_BUFFER);
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Finish an accepted CONNACK whose write returned MQTT_CODE_CONTINUE. Returns
+ * CONTINUE while it is still in flight, MQTT_CODE_SUCCESS once fully written
+ * (deliveries queued meanwhile are then drained), or a negative code after
+ * closing the client on a write failure. */
+static int BrokerClient_ResumeConnAck(MqttBroker* broker, BrokerClient* bc)
+{
+    int rc;
+
+    rc = MqttPacket_Write(&bc->client, bc->tx_buf, bc->connack_pending_len);
+    if (rc == MQTT_CODE_CONTINUE) {
+        return rc;
+    }
+    if (rc != bc->connack_pending_len) {
+        WBLOG_ERR(broker, "broker: CONNACK write failed sock=%d rc=%d",
+            (int)bc->sock, rc);
+        bc->connack_pending_len = 0;
+        BrokerClient_AbnormalClose(broker, bc);
+        return (rc < 0) ? rc : MQTT_CODE_ERROR_NETWORK;
+    }
+    bc->connack_pending_len = 0;
+    if (bc->out_q_count > 0) {
+        BrokerClient_DrainOutQueue(bc);
+    }
+    return MQTT_CODE_SUCCESS;
+}
+#endif /* !WOLFMQTT_STATIC_MEMORY */
+
+/* Keep-alive and pre-CONNECT idle deadlines. Returns 1 when the client was
+ * removed. Runs when the client's timeout timer fires. */
+static int BrokerClient_CheckTimeouts(MqttBroker* broker, BrokerClient* bc)
+{
+    /* Check keepalive timeout (MQTT spec 3.1.2.10: 1.5x keep alive) */
+    if (bc->keep_alive_sec > 0) {
+        WOLFMQTT_BROKER_TIME_T now = broker->now;
+        if (now >= bc->last_rx && (now - bc->last_rx) >
+            (WOLFMQTT_BROKER_TIME_T)(bc->keep_alive_sec * 3 / 2)) {
+            WBLOG_ERR(broker, "broker: keepalive timeout sock=%d", (int)bc->sock);
+        #ifdef WOLFMQTT_V5
+            BrokerSend_Disconnect(bc, MQTT_REASON_KEEP_ALIVE_TIMEOUT);
+        #endif
+            BrokerClient_PublishWill(broker, bc); /* abnormal disconnect */
+            /* Retain subscriptions while the session has not expired. */
+            if (bc->session_expiry_sec == 0) {
+                BrokerSubs_EndClientSession(broker, bc);
+            }
+            else {
+                BrokerSubs_OrphanClient(broker, bc);
+            }
+            BrokerClient_Remove(broker, bc);
+            return 1;
+        }
+    }
+    else if (!bc->connected) {
+        /* Pre-CONNECT idle timeout. A freshly accepted client has
+         * keep_alive_sec == 0 until CONNECT completes, so it is not covered by
+         * the keepalive check above; evict it once it has been idle past the
+         * deadline (last_rx is the accept time until the first full packet)
+         * so half-open sockets cannot squat the client table. */
+        WOLFMQTT_BROKER_TIME_T now = broker->now;
+        if (now >= bc->last_rx && (now - bc->last_rx) >
+                (WOLFMQTT_BROKER_TIME_T)BROKER_CONNECT_TIMEOUT_SEC) {
+            WBLOG_ERR(broker, "broker: pre-CONNECT idle timeout sock=%d",
+                (int)bc->sock);
+            BrokerSubs_RemoveClient(broker, bc);
+            BrokerClient_Remove(broker, bc);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Per-client processing (called from Step)                                    */
+/* -------------------------------------------------------------------------- */
+/* Handle the CONNECT held in bc->rx_buf. Returns 1 when the client is now
+ * connected, 0 when the CONNECT was refused and bc has been removed. */
+static int BrokerClient_OnConnect(MqttBroker* broker, BrokerClient* bc,
+    int rx_len)
+{
+    int c_rc = BrokerHandle_Connect(bc, rx_len, broker);
+    if (c_rc <= 0
+#ifndef WOLFMQTT_STATIC_MEMORY
+            && bc->connack_pending_len == 0
+#endif
+            ) {
+        /* Refused/decode-failed CONNECTs have no established Session. A
+         * CONNECT accepted internally whose CONNACK write failed has already
+         * resumed/created Session state; preserve it according to the
+         * negotiated expiry. */
+        if (bc->session_established) {
+            if (bc->session_expiry_sec == 0) {
+                BrokerSubs_EndClientSession(broker, bc);
+            }
+            else {
+                BrokerSubs_OrphanClient(broker, bc);
+            }
+        }
+        else {
+            BrokerSubs_RemoveClient(broker, bc);
+        }
+        BrokerClient_Remove(broker, bc);
+        return 0;
+    }
+    bc->connected = 1;
+    BrokerClient_ArmTimeout(broker, bc);
+    return 1;
+}
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Returns the shard owning the Client Identifier of a CONNECT, or -1 when
+ * it is empty or cannot be located; BrokerHandle_Connect then decides on
+ * this shard, and an assigned ID is chosen to hash here. Only the fields in
+ * front of the Client Identifier are walked. */
+static int BrokerShard_ConnectOwner(BrokerShard* shard, byte* buf,
+    word32 len)
+{
+    word32 pos = 1;
+    word32 remain;
+    word16 n;
+    int rc;
+#ifdef WOLFMQTT_V5
+    byte level;
+    word32 props_len;
+#endif
+
+    rc = MqttDecode_Vbi(buf + pos, &remain, len - pos);
+    if (rc < 0) {
+        return -1;
+    }
+    pos += (word32)rc;
+    /* Protocol Name */
+    if (pos + 2 > len || MqttDecode_Num(buf + pos, &n, len - pos) < 0) {
+        return -1;
+    }
+    pos += 2 + n;
+    /* Protocol Level, Connect Flags, Keep Alive */
+    if (pos + 4 > len) {
+        return -1;
+    }
+#ifdef WOLFMQTT_V5
+    level = buf[pos];
+#endif
+    pos += 4;
+#ifdef WOLFMQTT_V5
+    if (level >= MQTT_CONNECT_PROTOCOL_LEVEL_5) {
+        if (pos >= len) {
+            return -1;
+        }
+        rc = MqttDecode_Vbi(buf + pos, &props_len, len - pos);
+        if (rc < 0 || props_len > len - pos - (word32)rc) {
+            return -1;
+        }
+        pos += (word32)rc + props_len;
+    }
+#endif
+    if (pos + 2 > len || MqttDecode_Num(buf + pos, &n, len - pos) < 0) {
+        return -1;
     }
-    BrokerClient_Remove(broker, bc);
+    pos += 2;
+    if (n == 0 || n > len - pos) {
+        return -1;
+    }
+    return BrokerShard_Owner(shard, (const char*)buf + pos, n);
 }
 
-/* Returns non-zero for return codes that require the broker to close the
- * client connection. Includes:
- *   - Wire-level decode errors (malformed packet, wrong packet type).
- *   - Packet ID violations: [MQTT-2.3.1-1] requires a non-zero Packet
- *     Identifier on QoS>0 PUBLISH and on every SUBSCRIBE/UNSUBSCRIBE;
- *     decoders return MQTT_CODE_ERROR_PACKET_ID for packet_id == 0, and
- *     [MQTT-4.13]/[MQTT-4.8.0-1] mandate connection close on malformed
- *     packets.
- *   - Server-side resource exhaustion (allocator failure, per-client cap
- *     reached) - the connection must be torn down so resources release.
- *   - v5 property protocol errors (too many properties, duplicate singleton)
- *     are malformed packets [MQTT-4.13.1]; the client must be disconnected. */
-static int BrokerRcIsFatal(int rc)
+/* Client IDs are partitioned across shards so that session lookup, takeover
+ * and Will cancellation never cross threads. A CONNECT read by a shard that
+ * does not own its ID is passed, socket and bytes, to the owner - including
+ * anything the client pipelined behind it that is already in the read-ahead
+ * buffer. Returns 1 when bc was handed off (and freed here). */
+static int BrokerShard_HandOff(MqttBroker* broker, BrokerClient* bc,
+    int rx_len)
 {
-    return (rc == MQTT_CODE_ERROR_MALFORMED_DATA ||
-            rc == MQTT_CODE_ERROR_PACKET_TYPE ||
-            rc == MQTT_CODE_ERROR_PACKET_ID ||
-            rc == MQTT_CODE_ERROR_PROPERTY ||
-            rc == MQTT_CODE_ERROR_PROPERTY_MISMATCH ||
-            rc == MQTT_CODE_ERROR_MEMORY ||
-            rc == MQTT_CODE_ERROR_OUT_OF_BUFFER);
+    BrokerShard* shard = broker->shard;
+    BrokerShardMsg* msg;
+    BROKER_SOCKET_T sock = bc->sock;
+    int pending = MqttClient_ReadPending(&bc->client);
+    int owner;
+
+    if (shard == NULL || shard->group->count < 2) {
+        return 0;
+    }
+    owner = BrokerShard_ConnectOwner(shard, bc->rx_buf, (word32)rx_len);
+    if (owner < 0 || owner == shard->index) {
+        return 0;
+    }
+    msg = BrokerShardMsg_New(BROKER_SHARD_MSG_CONNECT, NULL, NULL,
+        (word32)(rx_len + pending));
+    if (msg == NULL) {
+        WBLOG_ERR(broker, "broker: CONNECT handoff alloc failed sock=%d",
+            (int)sock);
+        BrokerSubs_RemoveClient(broker, bc);
+        BrokerClient_Remove(broker, bc);
+        return 1;
+    }
+    msg->sock = sock;
+    msg->connect_len = (word32)rx_len;
+    XMEMCPY(msg->payload, bc->rx_buf, (size_t)rx_len);
+    if (pending > 0) {
+        XMEMCPY(msg->payload + rx_len,
+            bc->client.rd_buf + bc->client.rd_pos, (size_t)pending);
+    }
+    WBLOG_DBG(broker, "broker: CONNECT sock=%d handed to shard %d",
+        (int)sock, owner);
+
+    /* Detach the socket so removing bc does not close it */
+    if (bc->poll_registered && broker->net.poll_del != NULL) {
+        (void)broker->net.poll_del(broker->net.ctx, sock);
+        bc->poll_registered = 0;
+    }
+    bc->sock = BROKER_SOCKET_INVALID;
+    BROKER_FORCE_ZERO(bc->rx_buf, (word32)rx_len);
+    BrokerClient_ScrubReadAhead(bc);
+    BrokerSubs_RemoveClient(broker, bc);
+    BrokerClient_Remove(broker, bc);
+
+    if (BrokerShard_Send(shard, owner, msg, 0) != MQTT_CODE_SUCCESS) {
+        broker->net.close(broker->net.ctx, sock);
+    }
+    BrokerShardMsg_Release(msg);
+    return 1;
 }
 
-#ifndef WOLFMQTT_STATIC_MEMORY
-/* Finish an accepted CONNACK whose write returned MQTT_CODE_CONTINUE. Returns
- * CONTINUE while it is still in flight, MQTT_CODE_SUCCESS once fully written
- * (deliveries queued meanwhile are then drained), or a negative code after
- * closing the client on a write failure. */
-static int BrokerClient_ResumeConnAck(MqttBroker* broker, BrokerClient* bc)
+/* Take over a connection handed off by another shard and handle its
+ * CONNECT as if it had been read here. Bytes that followed the CONNECT are
+ * put back in the read-ahead buffer for the next Process pass. */
+static void BrokerShard_Adopt(MqttBroker* broker, BrokerShardMsg* msg)
 {
-    int rc;
+    BrokerClient* bc = BrokerClient_Add(broker, msg->sock, 0);
+    word32 rest;
 
-    rc = MqttPacket_Write(&bc->client, bc->tx_buf, bc->connack_pending_len);
-    if (rc == MQTT_CODE_CONTINUE) {
-        return rc;
+    if (bc == NULL) {
+        WBLOG_ERR(broker, "broker: adopt sock=%d rejected (alloc)",
+            (int)msg->sock);
+        broker->net.close(broker->net.ctx, msg->sock);
+        return;
     }
-    if (rc != bc->connack_pending_len) {
-        WBLOG_ERR(broker, "broker: CONNACK write failed sock=%d rc=%d",
-            (int)bc->sock, rc);
-        bc->connack_pending_len = 0;
-        BrokerClient_AbnormalClose(broker, bc);
-        return (rc < 0) ? rc : MQTT_CODE_ERROR_NETWORK;
+    rest = msg->payload_len - msg->connect_len;
+    if (msg->connect_len > (word32)BROKER_CLIENT_RX_SZ(bc) ||
+            (rest > 0 && (bc->client.rd_buf == NULL ||
+             rest > (word32)bc->client.rd_buf_len))) {
+        BrokerClient_Remove(broker, bc);
+        return;
     }
-    bc->connack_pending_len = 0;
-    if (bc->out_q_count > 0) {
-        BrokerClient_DrainOutQueue(bc);
+    XMEMCPY(bc->rx_buf, msg->payload, msg->connect_len);
+    if (rest > 0) {
+        XMEMCPY(bc->client.rd_buf, msg->payload + msg->connect_len, rest);
+        bc->client.rd_pos = 0;
+        bc->client.rd_len = (int)rest;
+    }
+    WBLOG_DBG(broker, "broker: adopted sock=%d", (int)bc->sock);
+    if (BrokerClient_OnConnect(broker, bc, (int)msg->connect_len)) {
+        /* The bytes put back are not announced by the socket */
+        BrokerClient_Requeue(bc);
     }
-    return MQTT_CODE_SUCCESS;
 }
-#endif /* !WOLFMQTT_STATIC_MEMORY */
+#endif /* WOLFMQTT_BROKER_SHARDS */
 
-/* -------------------------------------------------------------------------- */
-/* Per-client processing (called from Step)                                    */
-/* -------------------------------------------------------------------------- */
-static int BrokerClient_Process(MqttBroker* broker, BrokerClient* bc)
+/* Read and dispatch at most one packet. Sets *more when a packet was
+ * handled and the next one is already (at least partly) in the read-ahead
+ * buffer, so the caller can go again without waiting on the socket. */
+static int BrokerClient_ProcessOne(MqttBroker* broker, BrokerClient* bc,
+    int* more)
 {
     int rc;
     int activity = 0;
@@ -7703,7 +11114,7 @@ static int BrokerClient_Process(MqttBroker* broker, BrokerClient* bc)
 
     if (rc > 0) {
         byte type = MQTT_PACKET_TYPE_GET(bc->rx_buf[0]);
-        bc->last_rx = WOLFMQTT_BROKER_GET_TIME_S();
+        bc->last_rx = broker->now;
         activity = 1;
         WBLOG_DBG(broker, "broker: packet sock=%d type=%u len=%d",
             (int)bc->sock, type, rc);
@@ -7749,34 +11160,15 @@ static int BrokerClient_Process(MqttBroker* broker, BrokerClient* bc)
         }
         switch (type) {
             case MQTT_PACKET_TYPE_CONNECT:
-            {
-                int c_rc = BrokerHandle_Connect(bc, rc, broker);
-                if (c_rc <= 0
-            #ifndef WOLFMQTT_STATIC_MEMORY
-                        && bc->connack_pending_len == 0
+            #ifdef WOLFMQTT_BROKER_SHARDS
+                if (BrokerShard_HandOff(broker, bc, rc)) {
+                    return 1; /* bc now belongs to the owning shard */
+                }
             #endif
-                        ) {
-                    /* Refused/decode-failed CONNECTs have no established
-                     * Session. A CONNECT accepted internally whose CONNACK
-                     * write failed has already resumed/created Session state;
-                     * preserve it according to the negotiated expiry. */
-                    if (bc->session_established) {
-                        if (bc->session_expiry_sec == 0) {
-                            BrokerSubs_EndClientSession(broker, bc);
-                        }
-                        else {
-                            BrokerSubs_OrphanClient(broker, bc);
-                        }
-                    }
-                    else {
-                        BrokerSubs_RemoveClient(broker, bc);
-                    }
-                    BrokerClient_Remove(broker, bc);
+                if (!BrokerClient_OnConnect(broker, bc, rc)) {
                     return 0;
                 }
-                bc->connected = 1;
                 break;
-            }
             case MQTT_PACKET_TYPE_PUBLISH:
             {
                 int p_rc = BrokerHandle_Publish(bc, rc, broker);
@@ -7994,72 +11386,508 @@ static int BrokerClient_Process(MqttBroker* broker, BrokerClient* bc)
                 BrokerClient_AbnormalClose(broker, bc);
                 return 0;
         }
-#ifdef ENABLE_MQTT_WEBSOCKET
+#ifdef ENABLE_MQTT_WEBSOCKET
+        if (bc->ws_ctx != NULL) {
+            BrokerWsCtx *wsc = (BrokerWsCtx*)bc->ws_ctx;
+            wsc->processing = 0;
+            if (wsc->pending_remove) {
+                /* The peer closed bc's connection while we were dispatching a
+                 * packet (LWS_CALLBACK_CLOSED deferred the free to here). */
+                BrokerClient_Remove(broker, bc);
+                return 0;
+            }
+        }
+#endif
+    }
+
+#ifdef WOLFMQTT_STATIC_MEMORY
+    if (bc->client.write.pos != 0) {
+        /* Socket clients queue whole packets, so this is the WebSocket
+         * transport. Static mode has no connection-owned staging buffer with
+         * which to resume a partial control packet. Close before another
+         * packet can overwrite tx_buf and replay persistent deliveries on
+         * reconnect. */
+        WBLOG_ERR(broker, "broker: abandoning partial write sock=%d pos=%d",
+            (int)bc->sock, bc->client.write.pos);
+        BrokerStaticClient_Close(broker, bc);
+        BrokerClient_AbnormalClose(broker, bc);
+        return 0;
+    }
+#endif
+
+    if (rc > 0 && MqttClient_ReadPending(&bc->client) > 0) {
+        *more = 1;
+    }
+    return activity;
+}
+
+/* Handle the packets one recv brought in. A client that pipelines (a burst
+ * of PUBLISHes, or CONNECT followed by SUBSCRIBE) has them framed straight
+ * from its read-ahead buffer, up to BROKER_READ_BURST per pass so a single
+ * busy connection cannot starve the rest. The pass ends early once the
+ * client's output stalls. Whatever is left keeps the client ready (see
+ * BrokerClient_PollIdle) for the next Step. */
+static int BrokerClient_Process(MqttBroker* broker, BrokerClient* bc)
+{
+    int activity = 0;
+    int more = 1;
+    int n;
+
+    for (n = 0; more && n < BROKER_READ_BURST && !bc->wq_blocked; n++) {
+        more = 0;
+        if (BrokerClient_ProcessOne(broker, bc, &more) > 0) {
+            activity = 1;
+        }
+    }
+    return activity;
+}
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Apply messages other shards queued for this one, at most
+ * BROKER_SHARD_DRAIN_MAX per Step so sockets are not starved. Returns the
+ * number applied. */
+WOLFMQTT_LOCAL int BrokerShard_Drain(MqttBroker* broker)
+{
+    BrokerShard* shard = broker->shard;
+    BrokerShardMsg* msg;
+    byte flags;
+    int n = 0;
+
+    while (n < BROKER_SHARD_DRAIN_MAX &&
+            BrokerShard_Recv(shard, &msg, &flags)) {
+        n++;
+        switch (msg->kind) {
+            case BROKER_SHARD_MSG_PUBLISH:
+                BrokerPublish_FanOut(broker, -1, msg->topic, msg->payload,
+                    msg->payload_len, msg->qos
+                #ifdef WOLFMQTT_V5
+                    , msg->props
+                #endif
+                    );
+                break;
+        #ifdef WOLFMQTT_BROKER_WILL
+            case BROKER_SHARD_MSG_WILL:
+                BrokerWill_FanOut(broker, msg->topic, msg->payload,
+                    (word16)msg->payload_len, msg->qos);
+                break;
+        #endif
+        #ifdef WOLFMQTT_BROKER_RETAINED
+            case BROKER_SHARD_MSG_RETAIN:
+            {
+                int rc = BrokerRetained_Apply(broker, msg->topic,
+                    msg->payload, msg->payload_len, msg->qos,
+                    msg->expiry_sec);
+                if (rc != MQTT_CODE_SUCCESS) {
+                    WBLOG_ERR(broker, "Retained store failed: %s",
+                        MqttClient_ReturnCodeToString(rc));
+                }
+                else if (flags & BROKER_SHARD_F_RELAY) {
+                    /* This shard owns the topic: replicate in its order */
+                    (void)BrokerShard_Broadcast(shard, msg, 0);
+                }
+                break;
+            }
+        #endif
+            case BROKER_SHARD_MSG_CONNECT:
+                BrokerShard_Adopt(broker, msg);
+                break;
+            default:
+                break;
+        }
+        BrokerShardMsg_Release(msg);
+    }
+    return n;
+}
+#endif /* WOLFMQTT_BROKER_SHARDS */
+
+/* Returns 1 when the readiness backend reported nothing for bc this Step and
+ * no broker-side work is pending, so reading from it can be skipped. */
+static int BrokerClient_PollIdle(const BrokerClient* bc)
+{
+    if (!bc->poll_registered || bc->poll_ready != 0) {
+        return 0;
+    }
+    if (bc->wq_blocked) {
+        /* Nothing is read until the stalled output is sent, which waits
+         * for writability (or the retry in BrokerWait_TimeoutMs). */
+        return 1;
+    }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    if (bc->connack_pending_len != 0) {
+        return 0;
+    }
+#else
+    /* A fan-out write from another client's handler may have left a partial
+     * packet that only Process knows how to abandon. */
+    if (bc->client.write.pos != 0) {
+        return 0;
+    }
+#endif
+    /* Bytes already pulled into the read-ahead buffer need no readiness */
+    if (bc->client.rd_pos < bc->client.rd_len) {
+        return 0;
+    }
+#ifdef ENABLE_MQTT_TLS
+    /* Handshake progress and records wolfSSL already pulled off the socket
+     * are not visible to the readiness backend. */
+    if (bc->client.tls.ssl != NULL && (!bc->tls_handshake_done ||
+            wolfSSL_pending(bc->client.tls.ssl) > 0)) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Queue bc for the next Step when it has work no readiness event will
+ * announce: read-ahead bytes, TLS records, a partial CONNACK, or a socket
+ * the backend does not watch (WebSocket clients, failed registration). */
+static void BrokerClient_Requeue(BrokerClient* bc)
+{
+    if (!bc->wq_blocked && !BrokerClient_PollIdle(bc)) {
+        BrokerReady_Push(bc->broker, bc);
+    }
+}
+#endif
+
+/* Ask the readiness backend which sockets are ready. Listener readiness is
+ * latched on the broker and client readiness in poll_ready, both consumed by
+ * the next Step. Every owner pointer is still live here: clients unregister
+ * in BrokerNetDisconnect before they are freed. */
+static int BrokerPoll_Harvest(MqttBroker* broker, int timeout_ms)
+{
+    MqttBrokerNetEvent events[BROKER_POLL_MAX_EVENTS];
+    int n;
+    int i;
+
+    n = broker->net.poll_wait(broker->net.ctx, events,
+        BROKER_POLL_MAX_EVENTS, timeout_ms);
+    for (i = 0; i < n; i++) {
+        if (events[i].owner == (void*)&broker->listen_sock) {
+            broker->poll_listen_ready = 1;
+        }
+    #ifdef ENABLE_MQTT_TLS
+        else if (events[i].owner == (void*)&broker->listen_sock_tls) {
+            broker->poll_listen_tls_ready = 1;
+        }
+    #endif
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        else if (events[i].owner == (void*)broker->shard) {
+            /* Wake pipe: the rings are drained by the next Step */
+            BrokerShard_Awake(broker->shard);
+        }
+    #endif
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+        else if (broker->persist_worker != NULL &&
+                events[i].owner == (void*)broker->persist_worker) {
+            /* A batch committed: the next Step sends its held acks */
+            BrokerPersistWorker_Awake(broker);
+        }
+    #endif
+        else if (events[i].owner != NULL) {
+            BrokerClient* bc = (BrokerClient*)events[i].owner;
+            bc->poll_ready |= events[i].events;
+        #ifndef WOLFMQTT_STATIC_MEMORY
+            BrokerReady_Push(broker, bc);
+        #endif
+        }
+    }
+    if (n >= 0) {
+        broker->poll_pending = 1;
+    }
+    return n;
+}
+
+/* Dispatch an expired timer to its owner. t is already unlinked; the
+ * callback may re-arm it or free its owner. */
+static void BrokerTimer_Fire(MqttBroker* broker, BrokerTimer* t)
+{
+    switch (t->kind) {
+        case BROKER_TIMER_CLIENT:
+        {
+            BrokerClient* bc = (BrokerClient*)t->owner;
+        #ifdef ENABLE_MQTT_WEBSOCKET
+            /* Already closed by its peer; reaped by BrokerClient_Process
+             * this Step without a second Will. */
+            if (bc->ws_ctx != NULL &&
+                    ((BrokerWsCtx*)bc->ws_ctx)->pending_remove) {
+                break;
+            }
+        #endif
+            if (!BrokerClient_CheckTimeouts(broker, bc)) {
+                BrokerClient_ArmTimeout(broker, bc);
+                if (t->link.next != NULL &&
+                        t->expires <= broker->timers.clock) {
+                    BrokerTimer_Defer(broker, t);
+                }
+            }
+            break;
+        }
+        case BROKER_TIMER_ORPHAN:
+        #ifdef WOLFMQTT_STATIC_MEMORY
+            BrokerStaticOrphan_OnExpiry(broker,
+                (BrokerStaticOrphanSession*)t->owner);
+        #else
+            BrokerOrphan_OnExpiry(broker, (BrokerOrphanSession*)t->owner);
+        #endif
+            break;
+    #ifdef WOLFMQTT_BROKER_WILL
+        case BROKER_TIMER_WILL:
+            BrokerPendingWill_OnDelay(broker, (BrokerPendingWill*)t->owner);
+            break;
+    #endif
+    #ifdef WOLFMQTT_BROKER_RETAINED
+        case BROKER_TIMER_RETAINED:
+            BrokerRetained_OnExpiry(broker, (BrokerRetainedMsg*)t->owner);
+            break;
+    #endif
+        default:
+            break;
+    }
+}
+
+/* Re-hash every timer on list into the wheel at its current clock. */
+static void BrokerTimer_Rehash(BrokerTimerWheel* w, BrokerTimerLink* list)
+{
+    while (list->next != list) {
+        BrokerTimerLink* link = list->next;
+        link->prev->next = link->next;
+        link->next->prev = link->prev;
+        BrokerTimer_Hash(w, (BrokerTimer*)link);
+    }
+}
+
+/* Run every timer due at or before now. The wheel clock advances one second
+ * per tick; entering a slot of a higher level cascades its timers down, so a
+ * Step touches only the slots it passes and the timers in them. A jump of
+ * more than SLOTS^2 seconds (suspend, first Step long after Init) re-hashes
+ * every timer once instead of ticking. A clock that stepped back fires
+ * nothing new until it passes the wheel clock again. Returns the number of
+ * timers fired. */
+static int BrokerTimer_Advance(MqttBroker* broker, WOLFMQTT_BROKER_TIME_T now)
+{
+    BrokerTimerWheel* w = &broker->timers;
+    BrokerTimerLink fire;
+    BrokerTimerLink moved;
+    int fired = 0;
+    int lvl, i;
+
+    BrokerTimerList_Init(&fire);
+    BrokerTimerList_Init(&moved);
+    if (now > w->clock && now - w->clock > (WOLFMQTT_BROKER_TIME_T)
+            BROKER_TIMER_SLOTS * BROKER_TIMER_SLOTS) {
+        for (lvl = 0; lvl < BROKER_TIMER_LEVELS; lvl++) {
+            for (i = 0; i < BROKER_TIMER_SLOTS; i++) {
+                BrokerTimerList_Splice(&moved, &w->slots[lvl][i]);
+            }
+        }
+        w->clock = now;
+        BrokerTimer_Rehash(w, &moved);
+    }
+    while (w->clock < now) {
+        w->clock++;
+        for (lvl = 1; lvl < BROKER_TIMER_LEVELS; lvl++) {
+            if ((w->clock & (((WOLFMQTT_BROKER_TIME_T)1 <<
+                    (BROKER_TIMER_BITS * lvl)) - 1)) != 0) {
+                break;
+            }
+            BrokerTimerList_Splice(&moved, &w->slots[lvl][(w->clock >>
+                (BROKER_TIMER_BITS * lvl)) & BROKER_TIMER_MASK]);
+            BrokerTimer_Rehash(w, &moved);
+        }
+        BrokerTimerList_Splice(&fire,
+            &w->slots[0][w->clock & BROKER_TIMER_MASK]);
+    }
+    BrokerTimerList_Splice(&fire, &w->due);
+
+    /* Timers stay linked (and counted) on the local list until popped, so a
+     * callback may still cancel one that has not run yet. */
+    while (fire.next != &fire) {
+        BrokerTimer* t = (BrokerTimer*)fire.next;
+        BrokerTimer_Cancel(broker, t);
+        if (t->expires > w->clock) {
+            BrokerTimer_Arm(broker, t, t->kind, t->owner, t->expires);
+            continue;
+        }
+        BrokerTimer_Fire(broker, t);
+        fired++;
+    }
+    return fired;
+}
+
+/* Seconds past the wheel clock at which the next armed timer is reached:
+ * 0 when some are already due. A slot above level 0 is reached when its
+ * timers cascade, never after they expire, so waiting this long cannot
+ * oversleep a deadline. Returns 0 when no timer is armed. */
+static int BrokerTimer_NextDue(const BrokerTimerWheel* w,
+    WOLFMQTT_BROKER_TIME_T* delta)
+{
+    int have = 0;
+    int lvl, k;
+
+    if (w->count == 0) {
+        return 0;
+    }
+    if (w->due.next != &w->due) {
+        *delta = 0;
+        return 1;
+    }
+    for (lvl = 0; lvl < BROKER_TIMER_LEVELS; lvl++) {
+        WOLFMQTT_BROKER_TIME_T base = w->clock >> (BROKER_TIMER_BITS * lvl);
+        for (k = 1; k <= BROKER_TIMER_SLOTS; k++) {
+            const BrokerTimerLink* head =
+                &w->slots[lvl][(base + (WOLFMQTT_BROKER_TIME_T)k) &
+                    BROKER_TIMER_MASK];
+            if (head->next != head) {
+                WOLFMQTT_BROKER_TIME_T at = (base +
+                    (WOLFMQTT_BROKER_TIME_T)k) << (BROKER_TIMER_BITS * lvl);
+                if (!have || at - w->clock < *delta) {
+                    *delta = at - w->clock;
+                    have = 1;
+                }
+                break;
+            }
+        }
+    }
+    return have;
+}
+
+/* Milliseconds MqttBroker_Wait may block: until the next timer is reached,
+ * capped at BROKER_WAIT_MAX_MS. Zero when a client has work the readiness
+ * backend cannot report. The clock has one second resolution, so a deadline
+ * fires at most one second late, as with the previous fixed-interval
+ * polling. */
+static int BrokerWait_TimeoutMs(MqttBroker* broker)
+{
+    WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
+    WOLFMQTT_BROKER_TIME_T delta = 0;
+    int timeout_ms = BROKER_WAIT_MAX_MS;
+    int retry_ms = -1;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    int i;
+#endif
+    BrokerClient* bc;
+
+#ifdef WOLFMQTT_STATIC_MEMORY
+    for (i = 0; i < BROKER_MAX_CLIENTS; i++) {
+        bc = &broker->clients[i];
+        if (!bc->in_use) {
+            continue;
+        }
+    #ifdef ENABLE_MQTT_WEBSOCKET
+        if (bc->ws_ctx != NULL) {
+            continue; /* serviced through lws, see below */
+        }
+    #endif
+        if (!BrokerClient_PollIdle(bc)) {
+            return 0;
+        }
+    }
+#else
+    /* Only clients the last Step left with work are on the ready list */
+    for (bc = broker->ready; bc != NULL; bc = bc->ready_next) {
+    #ifdef ENABLE_MQTT_WEBSOCKET
         if (bc->ws_ctx != NULL) {
-            BrokerWsCtx *wsc = (BrokerWsCtx*)bc->ws_ctx;
-            wsc->processing = 0;
-            if (wsc->pending_remove) {
-                /* The peer closed bc's connection while we were dispatching a
-                 * packet (LWS_CALLBACK_CLOSED deferred the free to here). */
-                BrokerClient_Remove(broker, bc);
-                return 0;
-            }
+            continue; /* serviced through lws, see below */
         }
+    #endif
+        return 0;
+    }
 #endif
+    for (bc = broker->wq_stalled; bc != NULL; bc = bc->wq_next) {
+        if (!BrokerWq_Polled(bc)) {
+            /* The backend cannot report writability: retry the stalled
+             * output on the cadence used without a readiness backend. */
+            retry_ms = 10;
+            break;
+        }
     }
 
-#ifdef WOLFMQTT_STATIC_MEMORY
-    if (bc->client.write.pos != 0) {
-        /* Static mode has no connection-owned staging buffer with which to
-         * resume a partial control packet. Close before another packet can
-         * overwrite tx_buf and replay persistent deliveries on reconnect. */
-        WBLOG_ERR(broker, "broker: abandoning partial write sock=%d pos=%d",
-            (int)bc->sock, bc->client.write.pos);
-        BrokerStaticClient_Close(broker, bc);
-        BrokerClient_AbnormalClose(broker, bc);
-        return 0;
+    if (BrokerTimer_NextDue(&broker->timers, &delta)) {
+        WOLFMQTT_BROKER_TIME_T next = broker->timers.clock + delta;
+        if (next <= now) {
+            timeout_ms = 0;
+        }
+        else if (next - now < (WOLFMQTT_BROKER_TIME_T)
+                (BROKER_WAIT_MAX_MS / 1000)) {
+            timeout_ms = (int)(next - now) * 1000;
+        }
+    }
+#ifdef ENABLE_MQTT_WEBSOCKET
+    /* lws is serviced from Step with a zero timeout; keep the old 10 ms
+     * cadence while a WebSocket listener is active. */
+    if (broker->ws_ctx != NULL && timeout_ms > 10) {
+        timeout_ms = 10;
+    }
+#endif
+    if (retry_ms >= 0 && timeout_ms > retry_ms) {
+        timeout_ms = retry_ms;
+    }
+#ifdef WOLFMQTT_BROKER_PERSIST
+    /* Wake in time to commit a batch held open by persist_commit_ms */
+    retry_ms = BrokerPersist_BatchDueMs(broker);
+    if (retry_ms >= 0 && timeout_ms > retry_ms) {
+        timeout_ms = retry_ms;
     }
 #endif
+    return timeout_ms;
+}
 
-    /* Check keepalive timeout (MQTT spec 3.1.2.10: 1.5x keep alive) */
-    if (bc->keep_alive_sec > 0) {
-        WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
-        if (now >= bc->last_rx && (now - bc->last_rx) >
-            (WOLFMQTT_BROKER_TIME_T)(bc->keep_alive_sec * 3 / 2)) {
-            WBLOG_ERR(broker, "broker: keepalive timeout sock=%d", (int)bc->sock);
-        #ifdef WOLFMQTT_V5
-            BrokerSend_Disconnect(bc, MQTT_REASON_KEEP_ALIVE_TIMEOUT);
-        #endif
-            BrokerClient_PublishWill(broker, bc); /* abnormal disconnect */
-            /* Retain subscriptions while the session has not expired. */
-            if (bc->session_expiry_sec == 0) {
-                BrokerSubs_EndClientSession(broker, bc);
-            }
-            else {
-                BrokerSubs_OrphanClient(broker, bc);
-            }
-            BrokerClient_Remove(broker, bc);
-            return 0;
+#ifdef WOLFMQTT_BROKER_PERSIST
+/* After a commit, send the held acks it released and disconnect the
+ * publishers whose held acks belonged to a lost batch: they resend what
+ * was not acked. Conservative when several batches closed in one Step,
+ * since only the newest lost one is known. */
+static void BrokerHeldAck_Flush(MqttBroker* broker)
+{
+    BrokerClient* bc = broker->persist_held;
+    BrokerClient* next;
+
+    while (bc != NULL) {
+        next = bc->held_next;
+        BrokerHeldAck_Release(broker, bc);
+        if (bc->held_ack_failed) {
+            WBLOG_ERR(broker, "broker: persist commit lost, closing "
+                "publisher sock=%d unacked=%u", (int)bc->sock,
+                (unsigned)bc->held_ack_count);
+            BrokerClient_AbnormalClose(broker, bc);
+            /* The close may have taken other clients off the list:
+             * start over, released clients are cheap to revisit */
+            next = broker->persist_held;
         }
+        bc = next;
     }
-    else if (!bc->connected) {
-        /* Pre-CONNECT idle timeout. A freshly accepted client has
-         * keep_alive_sec == 0 until CONNECT completes, so it is not covered by
-         * the keepalive check above; evict it once it has been idle past the
-         * deadline (last_rx is the accept time until the first full packet)
-         * so half-open sockets cannot squat the client table. */
-        WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
-        if (now >= bc->last_rx && (now - bc->last_rx) >
-                (WOLFMQTT_BROKER_TIME_T)BROKER_CONNECT_TIMEOUT_SEC) {
-            WBLOG_ERR(broker, "broker: pre-CONNECT idle timeout sock=%d",
-                (int)bc->sock);
-            BrokerSubs_RemoveClient(broker, bc);
-            BrokerClient_Remove(broker, bc);
-            return 0;
+}
+#endif
+
+/* Admit up to BROKER_ACCEPT_BURST queued connections from one listener, so a
+ * reconnect storm drains the backlog in a few Steps rather than one socket
+ * per Step. Stops early once the queue is empty, on an accept error, or when
+ * no client slot can be allocated; readiness is level-triggered, so a
+ * listener with connections left over is reported again on the next Step.
+ * Returns the number of connections accepted (including rejected ones). */
+static int BrokerListener_Accept(MqttBroker* broker,
+    BROKER_SOCKET_T listen_sock, int use_tls)
+{
+    int count;
+
+    for (count = 0; count < BROKER_ACCEPT_BURST; count++) {
+        BROKER_SOCKET_T new_sock = BROKER_SOCKET_INVALID;
+        int rc = broker->net.accept(broker->net.ctx, listen_sock, &new_sock);
+        if (rc != MQTT_CODE_SUCCESS || new_sock == BROKER_SOCKET_INVALID) {
+            break;
+        }
+        WBLOG_INFO(broker, "broker: accept sock=%d (%s)", (int)new_sock,
+            use_tls ? "TLS" : "plain");
+        if (BrokerClient_Add(broker, new_sock, use_tls) == NULL) {
+            WBLOG_ERR(broker, "broker: accept sock=%d rejected (alloc)",
+                (int)new_sock);
+            broker->net.close(broker->net.ctx, new_sock);
+            count++;
+            break;
         }
     }
-
-    return activity;
+    return count;
 }
 
 /* -------------------------------------------------------------------------- */
@@ -8080,7 +11908,20 @@ int MqttBroker_Init(MqttBroker* broker, MqttBrokerNet* net)
 #endif
     broker->running = 0;
     broker->log_level = BROKER_LOG_LEVEL_DEFAULT;
-    broker->next_packet_id = 1;
+#ifdef WOLFMQTT_BROKER_EPOLL
+    broker->poll_fd = -1;
+#endif
+#ifdef WOLFMQTT_BROKER_PERSIST
+    broker->persist_commit_ms = BROKER_PERSIST_COMMIT_MS;
+    broker->persist_durable_ack = BROKER_PERSIST_DURABLE_ACK;
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    broker->persist_use_worker = BROKER_PERSIST_WORKER;
+    #endif
+#endif
+    BrokerTimer_Init(broker);
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerSlab_Init(broker);
+#endif
     /* Seed the auto-id counter from a CSPRNG so the initial value
      * doesn't reveal broker uptime or start time. The counter still
      * advances by +1 per empty-ID CONNECT, so observing one assigned
@@ -8126,6 +11967,8 @@ int MqttBroker_Step(MqttBroker* broker)
 {
     int activity = 0;
     int rc;
+    byte listen_ready = 1;
+    byte listen_tls_ready = 1;
 
     if (broker == NULL) {
         return MQTT_CODE_ERROR_BAD_ARG;
@@ -8134,82 +11977,62 @@ int MqttBroker_Step(MqttBroker* broker)
         return MQTT_CODE_SUCCESS;
     }
 
-    /* Orphan expiry sweep, rate-limited to once per second. */
-    {
-        WOLFMQTT_BROKER_TIME_T now = WOLFMQTT_BROKER_GET_TIME_S();
-        if (now < broker->orphan_last_expire_check ||
-                (now - broker->orphan_last_expire_check) >= 1) {
-#ifdef WOLFMQTT_STATIC_MEMORY
-            BrokerStaticOrphan_Sweep(broker, now);
-#else
-            BrokerOrphan_ExpireSweep(broker);
-#endif
-            broker->orphan_last_expire_check = now;
+    /* Every deadline and timestamp in this Step is measured against one
+     * sample of the clock. */
+    broker->now = WOLFMQTT_BROKER_GET_TIME_S();
+
+    /* 0. Collect socket readiness, unless MqttBroker_Wait already did.
+     * Without a readiness backend every listener and client is polled
+     * below, as before. */
+    if (broker->net.poll_wait != NULL) {
+        if (!broker->poll_pending) {
+            rc = BrokerPoll_Harvest(broker, 0);
+            if (rc < 0) {
+                WBLOG_ERR(broker, "broker: poll wait failed rc=%d", rc);
+                return rc;
+            }
         }
+        listen_ready = broker->poll_listen_ready;
+        listen_tls_ready = broker->poll_listen_tls_ready;
+        broker->poll_listen_ready = 0;
+        broker->poll_listen_tls_ready = 0;
+        broker->poll_pending = 0;
+    }
+
+    /* 0b. Fire expired timers: keep-alive and pre-CONNECT timeouts, Will
+     * Delay, Session Expiry and retained Message Expiry. Runs before any
+     * packet is handled so a CONNECT never resumes a session that has
+     * already expired at this Step's time. */
+    if (BrokerTimer_Advance(broker, broker->now) > 0) {
+        activity = 1;
+    }
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* 0c. Apply publishes, retained updates and handed-off connections
+     * queued by other shards. */
+    if (broker->shard != NULL && BrokerShard_Drain(broker) > 0) {
+        activity = 1;
     }
+#endif
 
     /* 1. Try to accept new connections (non-blocking) */
 
     /* Plain (non-TLS) listener */
-    if (broker->listen_sock != BROKER_SOCKET_INVALID) {
-        BROKER_SOCKET_T new_sock = BROKER_SOCKET_INVALID;
-        rc = broker->net.accept(broker->net.ctx, broker->listen_sock,
-            &new_sock);
-        if (rc == MQTT_CODE_SUCCESS && new_sock != BROKER_SOCKET_INVALID) {
-        #ifdef WOLFMQTT_POSIX_SOCKET
-            /* Reject socket if >= FD_SETSIZE (would overflow fd_set) */
-            if (new_sock >= FD_SETSIZE) {
-                WBLOG_ERR(broker,
-                    "broker: accept sock=%d rejected (>= FD_SETSIZE)",
-                    (int)new_sock);
-                broker->net.close(broker->net.ctx, new_sock);
-            }
-            else
-        #endif
-            {
-                WBLOG_INFO(broker, "broker: accept sock=%d (plain)",
-                    (int)new_sock);
-                if (BrokerClient_Add(broker, new_sock, 0) == NULL) {
-                    WBLOG_ERR(broker,
-                        "broker: accept sock=%d rejected (alloc)",
-                        (int)new_sock);
-                    broker->net.close(broker->net.ctx, new_sock);
-                }
-                activity = 1;
-            }
+    if (broker->listen_sock != BROKER_SOCKET_INVALID && listen_ready) {
+        if (BrokerListener_Accept(broker, broker->listen_sock, 0) > 0) {
+            activity = 1;
         }
     }
 
 #ifdef ENABLE_MQTT_TLS
     /* TLS listener */
-    if (broker->listen_sock_tls != BROKER_SOCKET_INVALID) {
-        BROKER_SOCKET_T new_sock = BROKER_SOCKET_INVALID;
-        rc = broker->net.accept(broker->net.ctx, broker->listen_sock_tls,
-            &new_sock);
-        if (rc == MQTT_CODE_SUCCESS && new_sock != BROKER_SOCKET_INVALID) {
-        #ifdef WOLFMQTT_POSIX_SOCKET
-            /* Reject socket if >= FD_SETSIZE (would overflow fd_set) */
-            if (new_sock >= FD_SETSIZE) {
-                WBLOG_ERR(broker,
-                    "broker: accept sock=%d rejected (>= FD_SETSIZE)",
-                    (int)new_sock);
-                broker->net.close(broker->net.ctx, new_sock);
-            }
-            else
-        #endif
-            {
-                WBLOG_INFO(broker, "broker: accept sock=%d (TLS)",
-                    (int)new_sock);
-                if (BrokerClient_Add(broker, new_sock, 1) == NULL) {
-                    WBLOG_ERR(broker,
-                        "broker: accept sock=%d rejected (alloc)",
-                        (int)new_sock);
-                    broker->net.close(broker->net.ctx, new_sock);
-                }
-                activity = 1;
-            }
+    if (broker->listen_sock_tls != BROKER_SOCKET_INVALID && listen_tls_ready) {
+        if (BrokerListener_Accept(broker, broker->listen_sock_tls, 1) > 0) {
+            activity = 1;
         }
     }
+#else
+    (void)listen_tls_ready;
 #endif /* ENABLE_MQTT_TLS */
 
 #ifdef ENABLE_MQTT_WEBSOCKET
@@ -8236,7 +12059,14 @@ int MqttBroker_Step(MqttBroker* broker)
                 BrokerClient_AbnormalClose(broker, bc);
                 continue;
             }
-            rc = BrokerClient_Process(broker, bc);
+            rc = 0;
+            if (bc->wq_blocked && BrokerWq_Resume(bc)) {
+                activity = 1;
+            }
+            if (!bc->wq_blocked && !BrokerClient_PollIdle(bc)) {
+                bc->poll_ready = 0;
+                rc = BrokerClient_Process(broker, bc);
+            }
             if (rc > 0) {
                 activity = 1;
             }
@@ -8257,38 +12087,99 @@ int MqttBroker_Step(MqttBroker* broker)
     }
 #else
     {
-        BrokerClient* bc = broker->clients;
-        while (bc) {
-            BrokerClient* next = bc->next;
-            rc = BrokerClient_Process(broker, bc);
+        BrokerClient* bc;
+        /* Stalled output the backend cannot report writable is retried */
+        for (bc = broker->wq_stalled; bc != NULL; bc = bc->wq_next) {
+            if (!BrokerWq_Polled(bc)) {
+                BrokerReady_Push(broker, bc);
+            }
+        }
+        /* Only clients on the ready list are visited, in the order they
+         * became ready. A packet handler may remove any client, including
+         * this one (e.g. client ID takeover), which takes it off the list.
+         * Clients requeued here carry this Step's stamp and wait for the
+         * next one. */
+        broker->ready_step++;
+        while ((bc = broker->ready) != NULL &&
+                bc->ready_step != broker->ready_step) {
+            BrokerReady_Remove(broker, bc);
+            rc = 0;
+            if (bc->wq_blocked && BrokerWq_Resume(bc)) {
+                /* Output caught up: send what queued up behind it */
+                BrokerClient_DrainOutQueue(bc);
+                activity = 1;
+            }
+            if (!bc->wq_blocked && !BrokerClient_PollIdle(bc)) {
+                bc->poll_ready = 0;
+                rc = BrokerClient_Process(broker, bc);
+            }
             if (rc > 0) {
                 activity = 1;
             }
-            /* BrokerClient_Process may remove another client (e.g. client ID
-             * takeover), which could free the node that next points to.
-             * Validate next is still in the linked list before dereferencing */
-            if (next != NULL) {
-                BrokerClient* v = broker->clients;
-                while (v != NULL && v != next) {
-                    v = v->next;
-                }
-                if (v == NULL) {
-                    break; /* next was freed; remaining clients handled next step */
-                }
+            if (!bc->unlinked) {
+                BrokerClient_Requeue(bc);
             }
-            bc = next;
         }
     }
 #endif
 
-    /* 3. Process pending wills (v5 Will Delay Interval) */
-    if (BrokerPendingWill_Process(broker) > 0) {
-        activity = 1;
+#ifdef WOLFMQTT_BROKER_PERSIST
+    /* 2b. Commit the shadow writes of this Step as one batch, before the
+     * acks for them are sent (or later, if a commit latency is set), and
+     * release the acks durable-ack mode held for it. */
+    (void)BrokerPersist_BatchCommit(broker, BROKER_PERSIST_COMMIT_DUE);
+    if (broker->persist_durable_ack) {
+        BrokerHeldAck_Flush(broker);
     }
+#endif
+
+    /* 3. Send what the Step produced, one gather write per client. Output
+     * the socket does not take is parked on its client (BrokerWq_Resume). */
+    while (broker->wq_dirty != NULL) {
+        (void)BrokerWq_Flush(broker->wq_dirty);
+    }
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerClient_Reap(broker);
+#endif
 
     return activity ? MQTT_CODE_SUCCESS : MQTT_CODE_CONTINUE;
 }
 
+int MqttBroker_Wait(MqttBroker* broker)
+{
+    int rc;
+
+    if (broker == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (broker->net.poll_wait == NULL) {
+        /* No readiness backend - sleep briefly to avoid busy-waiting */
+        BROKER_SLEEP_MS(10);
+        return MQTT_CODE_SUCCESS;
+    }
+    if (!broker->running || broker->poll_pending) {
+        return MQTT_CODE_SUCCESS; /* nothing to wait for / not yet consumed */
+    }
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* Announce the sleep to producers, unless they already queued work */
+    if (broker->shard != NULL && !BrokerShard_Sleep(broker->shard)) {
+        return MQTT_CODE_SUCCESS;
+    }
+#endif
+    rc = BrokerPoll_Harvest(broker, BrokerWait_TimeoutMs(broker));
+#ifdef WOLFMQTT_BROKER_SHARDS
+    if (broker->shard != NULL) {
+        BrokerShard_Awake(broker->shard);
+    }
+#endif
+    if (rc < 0) {
+        WBLOG_ERR(broker, "broker: poll wait failed rc=%d", rc);
+        return rc;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
 int MqttBroker_Start(MqttBroker* broker)
 {
     int rc;
@@ -8296,6 +12187,7 @@ int MqttBroker_Start(MqttBroker* broker)
     if (broker == NULL) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
+    broker->now = WOLFMQTT_BROKER_GET_TIME_S();
 
 #ifdef WOLFMQTT_BROKER_PERSIST
     /* Restore persisted state (orphan subs, retained messages) before
@@ -8429,6 +12321,32 @@ int MqttBroker_Start(MqttBroker* broker)
         return MQTT_CODE_ERROR_BAD_ARG;
     }
 
+    if (broker->net.poll_add != NULL) {
+        rc = MQTT_CODE_SUCCESS;
+        if (broker->listen_sock != BROKER_SOCKET_INVALID) {
+            rc = broker->net.poll_add(broker->net.ctx, broker->listen_sock,
+                BROKER_NET_EV_READ, &broker->listen_sock);
+        }
+    #ifdef ENABLE_MQTT_TLS
+        if (rc == MQTT_CODE_SUCCESS &&
+                broker->listen_sock_tls != BROKER_SOCKET_INVALID) {
+            rc = broker->net.poll_add(broker->net.ctx, broker->listen_sock_tls,
+                BROKER_NET_EV_READ, &broker->listen_sock_tls);
+        }
+    #endif
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        if (rc == MQTT_CODE_SUCCESS && broker->shard != NULL) {
+            rc = broker->net.poll_add(broker->net.ctx,
+                broker->shard->wake_fd[0], BROKER_NET_EV_READ, broker->shard);
+        }
+    #endif
+        if (rc != MQTT_CODE_SUCCESS) {
+            WBLOG_ERR(broker, "broker: poll register listener failed rc=%d",
+                rc);
+            return rc;
+        }
+    }
+
 #ifdef ENABLE_MQTT_WEBSOCKET
     if (broker->use_websocket) {
     #ifdef WOLFMQTT_BROKER_NO_INSECURE
@@ -8449,6 +12367,21 @@ int MqttBroker_Start(MqttBroker* broker)
     }
 #endif
 
+#ifdef WOLFMQTT_BROKER_PERSIST
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* Restore is done; from here on the worker owns the backend */
+    if (broker->persist != NULL && broker->persist_use_worker) {
+        rc = BrokerPersistWorker_Start(broker);
+        if (rc != MQTT_CODE_SUCCESS) {
+            WBLOG_ERR(broker, "broker: persist worker start failed rc=%d",
+                rc);
+            return rc;
+        }
+    }
+    #endif
+    /* From here on shadow writes are grouped, see MqttBroker_Step */
+    broker->persist_batching = 1;
+#endif
     broker->running = 1;
     return MQTT_CODE_SUCCESS;
 }
@@ -8465,13 +12398,16 @@ int MqttBroker_Run(MqttBroker* broker)
     while (broker->running) {
         rc = MqttBroker_Step(broker);
         if (rc == MQTT_CODE_CONTINUE) {
-            /* Idle - sleep briefly to avoid busy-waiting */
-            BROKER_SLEEP_MS(10);
+            /* Idle - block until a socket is ready or a deadline is due */
+            rc = MqttBroker_Wait(broker);
         }
-        else if (rc < 0) {
+        if (rc < 0) {
             break;
         }
     }
+#ifdef WOLFMQTT_BROKER_PERSIST
+    (void)BrokerPersist_BatchCommit(broker, BROKER_PERSIST_COMMIT_FINAL);
+#endif
 
     /* Propagate a fatal step error; a clean stop leaves rc idle or success. */
     if (rc == MQTT_CODE_CONTINUE || rc > 0) {
@@ -8495,21 +12431,12 @@ static void BrokerSubs_FreeAll(MqttBroker* broker)
     BROKER_FORCE_ZERO(broker->subs, sizeof(broker->subs));
 #else
     while (broker->subs != NULL) {
-        BrokerSub* next = broker->subs->next;
-        if (broker->subs->filter != NULL) {
-            BROKER_FORCE_ZERO(broker->subs->filter,
-                XSTRLEN(broker->subs->filter) + 1);
-            WOLFMQTT_FREE(broker->subs->filter);
-        }
-        if (broker->subs->client_id != NULL) {
-            BROKER_FORCE_ZERO(broker->subs->client_id,
-                XSTRLEN(broker->subs->client_id) + 1);
-            WOLFMQTT_FREE(broker->subs->client_id);
-        }
-        WOLFMQTT_FREE(broker->subs);
-        broker->subs = next;
+        BrokerSub* sub = broker->subs;
+        broker->subs = sub->next;
+        BrokerSub_Release(broker, sub);
     }
 #endif
+    BrokerSubTree_Free(broker);
 }
 
 #ifdef WOLFMQTT_BROKER_PERSIST
@@ -8520,15 +12447,20 @@ WOLFMQTT_LOCAL void BrokerPersist_RestoreRollback(MqttBroker* broker)
         return;
     }
     BrokerSubs_FreeAll(broker);
+    BrokerPersist_FreeSubsLogs(broker);
 #ifdef WOLFMQTT_STATIC_MEMORY
-    BROKER_FORCE_ZERO(broker->static_orphans, sizeof(broker->static_orphans));
+    {
+        int i;
+        for (i = 0; i < BROKER_MAX_STATIC_ORPHAN_SESSIONS; i++) {
+            BrokerStaticOrphan_Clear(broker, &broker->static_orphans[i]);
+        }
+    }
 #else
     BrokerOrphan_FreeAll(broker);
 #endif
 #ifdef WOLFMQTT_BROKER_RETAINED
     BrokerRetained_FreeAll(broker);
 #endif
-    broker->next_packet_id = 1;
 }
 #endif
 
@@ -8571,6 +12503,7 @@ int MqttBroker_Free(MqttBroker* broker)
         BrokerSubs_RemoveClient(broker, broker->clients);
         BrokerClient_Remove(broker, broker->clients);
     }
+    BrokerClient_Reap(broker);
 #endif
     /* Free any orphaned subs (e.g. from clean_session=0 clients). */
     BrokerSubs_FreeAll(broker);
@@ -8579,11 +12512,29 @@ int MqttBroker_Free(MqttBroker* broker)
     BrokerPendingWill_FreeAll(broker);
     BrokerRetained_FreeAll(broker);
 #ifdef WOLFMQTT_STATIC_MEMORY
-    BROKER_FORCE_ZERO(broker->static_orphans, sizeof(broker->static_orphans));
+    {
+        int i;
+        for (i = 0; i < BROKER_MAX_STATIC_ORPHAN_SESSIONS; i++) {
+            BrokerStaticOrphan_Clear(broker, &broker->static_orphans[i]);
+        }
+    }
 #else
     BrokerOrphan_FreeAll(broker);
 #endif
 #ifdef WOLFMQTT_BROKER_PERSIST
+    BrokerPersist_FreeSubsLogs(broker);
+#endif
+    BrokerIdIndex_Free(broker);
+#ifndef WOLFMQTT_STATIC_MEMORY
+    BrokerSlab_FreeAll(broker);
+#endif
+#ifdef WOLFMQTT_BROKER_PERSIST
+    /* Commit what the teardown above and the last Steps wrote */
+    (void)BrokerPersist_BatchCommit(broker, BROKER_PERSIST_COMMIT_FINAL);
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* Flush barrier: the worker applies everything queued, then exits */
+    BrokerPersistWorker_Stop(broker);
+    #endif
     broker->persist_restored = 0;
     broker->persist = NULL;
 #endif
@@ -8612,15 +12563,25 @@ int MqttBroker_Free(MqttBroker* broker)
 #endif
 
     if (broker->listen_sock != BROKER_SOCKET_INVALID) {
+        if (broker->net.poll_del != NULL) {
+            (void)broker->net.poll_del(broker->net.ctx, broker->listen_sock);
+        }
         broker->net.close(broker->net.ctx, broker->listen_sock);
         broker->listen_sock = BROKER_SOCKET_INVALID;
     }
 #ifdef ENABLE_MQTT_TLS
     if (broker->listen_sock_tls != BROKER_SOCKET_INVALID) {
+        if (broker->net.poll_del != NULL) {
+            (void)broker->net.poll_del(broker->net.ctx,
+                broker->listen_sock_tls);
+        }
         broker->net.close(broker->net.ctx, broker->listen_sock_tls);
         broker->listen_sock_tls = BROKER_SOCKET_INVALID;
     }
 #endif
+    if (broker->net.poll_free != NULL) {
+        (void)broker->net.poll_free(broker->net.ctx);
+    }
 
 #if defined(WOLFMQTT_BROKER_PERSIST) && \
     defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT)
@@ -8651,6 +12612,12 @@ static void BrokerUsage(const char* prog)
 #endif
 #ifdef ENABLE_MQTT_WEBSOCKET
            " [-w port]"
+#endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+           " [-T shards]"
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+           " [-U]"
 #endif
            , prog);
     PRINTF("  -p <port>   Plain port (default: %d)", MQTT_DEFAULT_PORT);
@@ -8668,6 +12635,23 @@ static void BrokerUsage(const char* prog)
 #endif
 #ifdef WOLFMQTT_BROKER_PERSIST
     PRINTF("  -D <dir>    Persistent storage directory (enables persistence)");
+    PRINTF("  -L          Store -D state in an append-only log instead of "
+           "one file per record");
+    PRINTF("  -G <ms>     Longest a persistence commit may be deferred "
+           "(default: %d)", BROKER_PERSIST_COMMIT_MS);
+    PRINTF("  -Q          Ack QoS 1/2 publishes only once their records are "
+           "committed");
+#endif
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    PRINTF("  -W          Write and commit persistence on a worker thread");
+#endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+    PRINTF("  -T <n>      Event-loop threads sharing the port (default: 1, "
+           "max: %d)", BROKER_MAX_SHARDS);
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+    PRINTF("  -U          Use the io_uring network backend (falls back to "
+           "sockets if unavailable)");
 #endif
     PRINTF("Features:"
 #ifdef WOLFMQTT_BROKER_RETAINED
@@ -8701,8 +12685,17 @@ static void BrokerUsage(const char* prog)
     defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT_DEV_KEY)
            " persist-encrypt-dev-key"
 #endif
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+           " persist-worker"
+#endif
 #ifdef WOLFMQTT_STATIC_MEMORY
            " static-memory"
+#endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+           " shards"
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+           " io_uring"
 #endif
            );
 }
@@ -8795,10 +12788,18 @@ int wolfmqtt_broker(int argc, char** argv)
 #ifdef WOLFMQTT_BROKER_AUTH
     char auth_pass_buf[BROKER_MAX_PASSWORD_LEN] = {0};
 #endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+    MqttBrokerShards shards;
+    int shard_count = 1;
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+    int use_uring = 0;
+#endif
 #ifdef WOLFMQTT_BROKER_PERSIST
     MqttBrokerPersistHooks persist_hooks;
     const char* persist_dir = NULL;
     int persist_initialized = 0;
+    int persist_log = 0;
     #if defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT) && \
         defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT_DEV_KEY)
     /* Encrypt-key source. NULL = unset (broker refuses to start when
@@ -8885,6 +12886,20 @@ int wolfmqtt_broker(int argc, char** argv)
         else if (XSTRCMP(argv[i], "-D") == 0 && i + 1 < argc) {
             persist_dir = argv[++i];
         }
+        else if (XSTRCMP(argv[i], "-L") == 0) {
+            persist_log = 1;
+        }
+        else if (XSTRCMP(argv[i], "-G") == 0 && i + 1 < argc) {
+            broker.persist_commit_ms = (word32)XATOI(argv[++i]);
+        }
+        else if (XSTRCMP(argv[i], "-Q") == 0) {
+            broker.persist_durable_ack = 1;
+        }
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+        else if (XSTRCMP(argv[i], "-W") == 0) {
+            broker.persist_use_worker = 1;
+        }
+    #endif
     #if defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT) && \
         defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT_DEV_KEY)
         else if (XSTRCMP(argv[i], "-E") == 0 && i + 1 < argc) {
@@ -8898,6 +12913,16 @@ int wolfmqtt_broker(int argc, char** argv)
             encrypt_key_source = argv[++i];
         }
     #endif
+#endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+        else if (XSTRCMP(argv[i], "-T") == 0 && i + 1 < argc) {
+            shard_count = XATOI(argv[++i]);
+        }
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+        else if (XSTRCMP(argv[i], "-U") == 0) {
+            use_uring = 1;
+        }
 #endif
         else if (XSTRCMP(argv[i], "-h") == 0) {
             BrokerUsage(argv[0]);
@@ -8911,6 +12936,21 @@ int wolfmqtt_broker(int argc, char** argv)
         }
     }
 
+#ifdef WOLFMQTT_BROKER_IO_URING
+    /* Swap the sockets backend for io_uring before anything is opened. The
+     * broker stays the callbacks' ctx. */
+    if (use_uring) {
+        if (MqttBrokerNet_IoUring_Init(&net) == MQTT_CODE_SUCCESS) {
+            net.ctx = &broker;
+            XMEMCPY(&broker.net, &net, sizeof(net));
+            PRINTF("broker: using io_uring network backend");
+        }
+        else {
+            PRINTF("broker: io_uring unavailable, using sockets backend");
+        }
+    }
+#endif
+
 #ifdef WOLFMQTT_BROKER_PERSIST
     /* If -D was passed, enable the default POSIX persistence backend
      * rooted at that directory. Absent the flag, persist hooks remain
@@ -8948,7 +12988,13 @@ int wolfmqtt_broker(int argc, char** argv)
         return MQTT_CODE_ERROR_BAD_ARG;
         #endif
     #endif
-        rc = MqttBrokerNet_PersistPosix_Init(&persist_hooks, persist_dir);
+        if (persist_log) {
+            rc = MqttBrokerNet_PersistWal_Init(&persist_hooks, persist_dir);
+        }
+        else {
+            rc = MqttBrokerNet_PersistPosix_Init(&persist_hooks,
+                persist_dir);
+        }
         if (rc != 0) {
             PRINTF("broker: persist init failed dir=%s rc=%d",
                 persist_dir, rc);
@@ -8968,11 +13014,17 @@ int wolfmqtt_broker(int argc, char** argv)
         if (rc != MQTT_CODE_SUCCESS) {
             PRINTF("broker: persist hook install failed rc=%d", rc);
             MqttBroker_Free(&broker);
-            MqttBrokerNet_PersistPosix_Free(&persist_hooks);
+            if (persist_log) {
+                MqttBrokerNet_PersistWal_Free(&persist_hooks);
+            }
+            else {
+                MqttBrokerNet_PersistPosix_Free(&persist_hooks);
+            }
             BROKER_WIPE_AUTH_PASS();
             return rc;
         }
-        PRINTF("broker: persist enabled dir=%s%s", persist_dir,
+        PRINTF("broker: persist enabled dir=%s%s%s", persist_dir,
+            persist_log ? " (log)" : "",
         #if defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT) && \
             defined(WOLFMQTT_BROKER_PERSIST_ENCRYPT_DEV_KEY)
             " (encrypted, DEV-KEY: NOT FOR PRODUCTION)"
@@ -8985,6 +13037,19 @@ int wolfmqtt_broker(int argc, char** argv)
     }
 #endif
 
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* The configured broker becomes shard 0 and is driven below as usual;
+     * the other shards run on their own threads. */
+    XMEMSET(&shards, 0, sizeof(shards));
+    if (shard_count > 1) {
+        rc = MqttBrokerShards_Init(&shards, &broker, shard_count);
+        if (rc != MQTT_CODE_SUCCESS) {
+            PRINTF("broker: shard init failed count=%d rc=%d", shard_count,
+                rc);
+        }
+    }
+#endif
+
 #if !defined(WOLFMQTT_WOLFIP) && !defined(WOLFMQTT_BROKER_CUSTOM_NET) && \
     !defined(NO_MAIN_DRIVER)
     /* Reset shutdown flag so this wrapper is reusable across multiple
@@ -9000,14 +13065,23 @@ int wolfmqtt_broker(int argc, char** argv)
     signal(SIGPIPE, SIG_IGN);
 #endif
 
-    rc = MqttBroker_Start(&broker);
+    if (rc == MQTT_CODE_SUCCESS) {
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        if (shards.count > 1) {
+            rc = MqttBrokerShards_Start(&shards);
+        }
+        else
+    #endif
+        rc = MqttBroker_Start(&broker);
+    }
     if (rc == MQTT_CODE_SUCCESS) {
         while (broker.running && !g_broker_shutdown) {
             rc = MqttBroker_Step(&broker);
             if (rc == MQTT_CODE_CONTINUE) {
-                BROKER_SLEEP_MS(10);
+                /* Returns early on SIGINT/SIGTERM (EINTR) */
+                rc = MqttBroker_Wait(&broker);
             }
-            else if (rc < 0) {
+            if (rc < 0) {
                 break;
             }
         }
@@ -9018,9 +13092,21 @@ int wolfmqtt_broker(int argc, char** argv)
         }
     }
 #else
-    rc = MqttBroker_Run(&broker);
+    if (rc == MQTT_CODE_SUCCESS) {
+    #ifdef WOLFMQTT_BROKER_SHARDS
+        if (shards.count > 1) {
+            rc = MqttBrokerShards_Run(&shards);
+        }
+        else
+    #endif
+        rc = MqttBroker_Run(&broker);
+    }
 #endif
 
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* Stops and joins the shard threads; shard 0 is freed below */
+    (void)MqttBrokerShards_Free(&shards);
+#endif
     MqttBroker_Free(&broker);
 
     /* Erase the broker-owned password copy before returning. */
@@ -9028,7 +13114,12 @@ int wolfmqtt_broker(int argc, char** argv)
 
 #ifdef WOLFMQTT_BROKER_PERSIST
     if (persist_initialized) {
-        MqttBrokerNet_PersistPosix_Free(&persist_hooks);
+        if (persist_log) {
+            MqttBrokerNet_PersistWal_Free(&persist_hooks);
+        }
+        else {
+            MqttBrokerNet_PersistPosix_Free(&persist_hooks);
+        }
     }
 #endif
 
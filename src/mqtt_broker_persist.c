@@ -83,6 +83,26 @@
     #endif
 #endif
 
+/* Millisecond clock for the group-commit deadline. Only differences are
+ * taken, so it may wrap. Falls back to the second clock where no
+ * monotonic clock is available. */
+#ifndef WOLFMQTT_BROKER_GET_TIME_MS
+    #if defined(CLOCK_MONOTONIC) && !defined(WOLFMQTT_WOLFIP)
+static word32 wmqb_time_ms(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return (word32)WOLFMQTT_BROKER_GET_TIME_S() * 1000;
+    }
+    return (word32)ts.tv_sec * 1000 + (word32)(ts.tv_nsec / 1000000);
+}
+        #define WOLFMQTT_BROKER_GET_TIME_MS() wmqb_time_ms()
+    #else
+        #define WOLFMQTT_BROKER_GET_TIME_MS() \
+            ((word32)WOLFMQTT_BROKER_GET_TIME_S() * 1000)
+    #endif
+#endif
+
 #ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
     #include <wolfssl/wolfcrypt/aes.h>
     #include <wolfssl/wolfcrypt/random.h>
@@ -380,42 +400,200 @@ static int wmqb_decrypt_blob(MqttBroker* broker,
 }
 #endif /* WOLFMQTT_BROKER_PERSIST_ENCRYPT */
 
-/* Commit a blob to the backend and sync if available. Returns the hook's
- * return code, or 0 if hooks are disabled (silent no-op). When persist
- * encryption is enabled, the blob is wrapped here so callers can keep
- * passing plaintext (header + body). */
-static int wmqb_kv_put_commit(MqttBroker* broker, byte ns,
-    const byte* key, word16 key_len, const byte* blob, word32 blob_len)
+/* With a persistence worker running, the hooks are called on its thread:
+ * writes, begin, sync and commit are queued to it in order instead. */
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    #define WMQB_WORKER(b) ((b)->persist_worker != NULL)
+#else
+    #define WMQB_WORKER(b) 0
+    #define BrokerPersistWorker_Push(b, kind, ns, k, kl, v, vl, batch) \
+        MQTT_CODE_ERROR_SYSTEM
+#endif
+
+/* Group commit. While the broker runs (persist_batching), the first write
+ * opens a batch through the optional begin hook and later writes join it
+ * without a sync of their own; BrokerPersist_BatchCommit closes it. Writes
+ * made outside a running broker (restore, teardown) sync one by one. A
+ * failed begin also falls back to syncing each write; the worker makes
+ * that fallback itself, as it learns of the failure. */
+static void wmqb_batch_join(MqttBroker* broker)
+{
+    const MqttBrokerPersistHooks* h = broker->persist;
+
+    if (!broker->persist_batching || broker->persist_batch_open) {
+        return;
+    }
+    if (WMQB_WORKER(broker)) {
+        if (h->begin != NULL && BrokerPersistWorker_Push(broker,
+                BROKER_PERSIST_OP_BEGIN, 0, NULL, 0, NULL, 0, 0) != 0) {
+            return;
+        }
+    }
+    else if (h->begin != NULL && h->begin(h->ctx) != 0) {
+        return;
+    }
+    broker->persist_batch_open = 1;
+    broker->persist_batch_failed = 0;
+    broker->persist_batch_id++;
+    broker->persist_batch_since = WOLFMQTT_BROKER_GET_TIME_MS();
+}
+
+/* Note a shadow write that did not reach the backend. The batch it belongs
+ * to is then lost as a whole, so no ack held for that batch is sent.
+ * Returns rc. */
+static int wmqb_batch_fail(MqttBroker* broker, int rc)
+{
+    if (rc != 0 && broker->persist_batching) {
+        wmqb_batch_join(broker);
+        if (broker->persist_batch_open) {
+            broker->persist_batch_failed = 1;
+        }
+    }
+    return rc;
+}
+
+/* Make the writes just issued durable, or leave that to the open batch. */
+static void wmqb_sync(MqttBroker* broker)
+{
+    const MqttBrokerPersistHooks* h = broker->persist;
+
+    if (broker->persist_batch_open || h->sync == NULL) {
+        return;
+    }
+    if (WMQB_WORKER(broker)) {
+        (void)BrokerPersistWorker_Push(broker, BROKER_PERSIST_OP_SYNC, 0,
+            NULL, 0, NULL, 0, 0);
+    }
+    else {
+        (void)h->sync(h->ctx);
+    }
+}
+
+int BrokerPersist_BatchCommit(MqttBroker* broker, int mode)
 {
-    int rc;
     const MqttBrokerPersistHooks* h;
+    int rc = 0;
+
     if (broker == NULL) {
         return 0;
     }
+    if (mode == BROKER_PERSIST_COMMIT_FINAL) {
+        broker->persist_batching = 0;
+    }
     h = broker->persist;
-    if (h == NULL || h->kv_put == NULL) {
+    if (!broker->persist_batch_open || h == NULL) {
+        broker->persist_batch_open = 0;
         return 0;
     }
-#ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
-    {
-        byte*  enc;
-        word32 enc_len;
-        rc = wmqb_encrypt_blob(broker, blob, blob_len, &enc, &enc_len);
+    if (mode == BROKER_PERSIST_COMMIT_DUE &&
+            BrokerPersist_BatchDueMs(broker) > 0) {
+        return 0;
+    }
+    broker->persist_batch_open = 0;
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    if (broker->persist_worker != NULL) {
+        /* The worker publishes the batch's outcome once it is done */
+        rc = BrokerPersistWorker_Push(broker, broker->persist_batch_failed ?
+            BROKER_PERSIST_OP_COMMIT_LOST : BROKER_PERSIST_OP_COMMIT, 0,
+            NULL, 0, NULL, 0, broker->persist_batch_id);
         if (rc != 0) {
-            return rc;
+            WMQB_LOG_ERR(broker, "broker: persist batch commit failed "
+                "rc=%d", rc);
+            BROKER_ATOMIC_STORE(&broker->persist_failed_id,
+                broker->persist_batch_id);
         }
-        rc = h->kv_put(h->ctx, ns, key, key_len, enc, enc_len);
-        WOLFMQTT_FREE(enc);
+        return rc;
+    }
+#endif
+    if (h->commit != NULL) {
+        rc = h->commit(h->ctx);
+    }
+    else if (h->sync != NULL) {
+        rc = h->sync(h->ctx);
+    }
+    if (rc != 0) {
+        WMQB_LOG_ERR(broker, "broker: persist batch commit failed rc=%d",
+            rc);
+    }
+    if (rc != 0 || broker->persist_batch_failed) {
+        broker->persist_failed_id = broker->persist_batch_id;
+    }
+    else {
+        broker->persist_committed_id = broker->persist_batch_id;
+    }
+    return rc;
+}
+
+int BrokerPersist_BatchDueMs(MqttBroker* broker)
+{
+    word32 age;
+
+    if (broker == NULL || !broker->persist_batch_open) {
+        return -1;
     }
+    age = WOLFMQTT_BROKER_GET_TIME_MS() - broker->persist_batch_since;
+    if (age >= broker->persist_commit_ms) {
+        return 0;
+    }
+    return (int)(broker->persist_commit_ms - age);
+}
+
+/* Hand a plaintext blob (header + body) to the backend. When persist
+ * encryption is enabled, the blob is wrapped here so callers can keep
+ * passing plaintext. Runs on the worker thread when there is one. */
+int BrokerPersist_ApplyPut(MqttBroker* broker, byte ns,
+    const byte* key, word16 key_len, const byte* blob, word32 blob_len)
+{
+    const MqttBrokerPersistHooks* h = broker->persist;
+    int rc;
+
+#ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
+    byte*  enc;
+    word32 enc_len;
+
+    rc = wmqb_encrypt_blob(broker, blob, blob_len, &enc, &enc_len);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = h->kv_put(h->ctx, ns, key, key_len, enc, enc_len);
+    WOLFMQTT_FREE(enc);
 #else
     rc = h->kv_put(h->ctx, ns, key, key_len, blob, blob_len);
 #endif
-    if (rc == 0 && h->sync != NULL) {
-        (void)h->sync(h->ctx);
-    }
     return rc;
 }
 
+/* Commit a blob to the backend and sync if available. Returns the hook's
+ * return code, or 0 if hooks are disabled (silent no-op). With a worker
+ * the write is only queued, and a failure surfaces at its batch's
+ * commit. */
+static int wmqb_kv_put_commit(MqttBroker* broker, byte ns,
+    const byte* key, word16 key_len, const byte* blob, word32 blob_len)
+{
+    int rc;
+    const MqttBrokerPersistHooks* h;
+    if (broker == NULL) {
+        return 0;
+    }
+    h = broker->persist;
+    if (h == NULL || h->kv_put == NULL) {
+        return 0;
+    }
+    wmqb_batch_join(broker);
+    if (WMQB_WORKER(broker)) {
+        rc = BrokerPersistWorker_Push(broker, BROKER_PERSIST_OP_PUT, ns,
+            key, key_len, blob, blob_len, 0);
+    }
+    else {
+        rc = BrokerPersist_ApplyPut(broker, ns, key, key_len, blob,
+            blob_len);
+    }
+    if (rc == 0) {
+        wmqb_sync(broker);
+    }
+    return wmqb_batch_fail(broker, rc);
+}
+
 static int wmqb_kv_del_commit(MqttBroker* broker, byte ns,
     const byte* key, word16 key_len)
 {
@@ -428,9 +606,16 @@ static int wmqb_kv_del_commit(MqttBroker* broker, byte ns,
     if (h == NULL || h->kv_del == NULL) {
         return 0;
     }
-    rc = h->kv_del(h->ctx, ns, key, key_len);
-    if (rc == 0 && h->sync != NULL) {
-        (void)h->sync(h->ctx);
+    wmqb_batch_join(broker);
+    if (WMQB_WORKER(broker)) {
+        rc = BrokerPersistWorker_Push(broker, BROKER_PERSIST_OP_DEL, ns,
+            key, key_len, NULL, 0, 0);
+    }
+    else {
+        rc = h->kv_del(h->ctx, ns, key, key_len);
+    }
+    if (rc == 0) {
+        wmqb_sync(broker);
     }
     return rc;
 }
@@ -573,6 +758,10 @@ int MqttBroker_SetPersistHooks(MqttBroker* broker,
     if (hooks != NULL && (broker->running || broker->persist_restored)) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* Let the worker finish with the hooks being detached */
+    BrokerPersistWorker_Stop(broker);
+#endif
     broker->persist = hooks;
     return MQTT_CODE_SUCCESS;
 }
@@ -681,21 +870,28 @@ int BrokerPersist_DelSession(MqttBroker* broker, const char* client_id)
         (const byte*)client_id, (word16)XSTRLEN(client_id));
 }
 
-/* Snapshot every BrokerSub bound to client_id into a single per-client
- * subscription record.
+/* Encode the subs of one session into one snapshot record stored under
+ * key: every BrokerSub bound to client_id (static memory), or the session
+ * chain at head. *count is the number found; nothing is written when it
+ * is 0.
  *
  * Body layout:
  *   off  size   field
- *     0    2    count   (big endian; 0 == "no subs", caller may DelSubs instead)
+ *     0    2    count   (big endian)
  *     2   ...   N entries, each:
  *                  1    qos
  *                  1    options (reserved for v5 NL/RAP/RH bits)
  *                  2    filter_len  (big endian)
  *                  N    filter      (no NUL)
  */
-int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
+#ifdef WOLFMQTT_STATIC_MEMORY
+static int wmqb_put_subs_record(MqttBroker* broker, const char* client_id,
+    const byte* key, word16 key_len, int* count_out)
+#else
+static int wmqb_put_subs_record(MqttBroker* broker, const BrokerSub* head,
+    const byte* key, word16 key_len, int* count_out)
+#endif
 {
-    word16 cid_len;
     word32 body_len;
     word32 total_len;
     byte*  buf;
@@ -708,22 +904,6 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
     const BrokerSub* sub;
 #endif
 
-    if (broker == NULL || broker->persist == NULL || client_id == NULL ||
-        *client_id == '\0') {
-        return 0;
-    }
-    {
-        size_t raw = XSTRLEN(client_id);
-        /* word16 downcast - reject lengths that wouldn't fit instead
-         * of silently truncating. MQTT v3.1.1 caps client_id at 23
-         * bytes; v5 caps at 65535 (i.e., fits in word16). Anything
-         * longer is malformed input from a caller. */
-        if (raw == 0 || raw > 0xFFFFu) {
-            return MQTT_CODE_ERROR_OUT_OF_BUFFER;
-        }
-        cid_len = (word16)raw;
-    }
-
     /* Pass 1: count + size */
     body_len = 2;
 #ifdef WOLFMQTT_STATIC_MEMORY
@@ -739,11 +919,7 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
         body_len += 1 + 1 + 2 + (word32)XSTRLEN(s->filter);
     }
 #else
-    for (sub = broker->subs; sub != NULL; sub = sub->next) {
-        if (sub->client_id == NULL ||
-            XSTRCMP(sub->client_id, client_id) != 0) {
-            continue;
-        }
+    for (sub = head; sub != NULL; sub = sub->sess_next) {
         if (sub->filter == NULL) {
             continue;
         }
@@ -751,11 +927,9 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
         body_len += 1 + 1 + 2 + (word32)XSTRLEN(sub->filter);
     }
 #endif
-
+    *count_out = count;
     if (count == 0) {
-        /* Caller did all the unsubscribes; remove the record entirely. */
-        return wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS,
-            (const byte*)client_id, cid_len);
+        return 0;
     }
 
     total_len = WMQB_HDR_LEN + body_len;
@@ -784,11 +958,9 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
         XMEMCPY(p, s->filter, flen); p += flen;
     }
 #else
-    for (sub = broker->subs; sub != NULL; sub = sub->next) {
+    for (sub = head; sub != NULL; sub = sub->sess_next) {
         word16 flen;
-        if (sub->client_id == NULL ||
-            XSTRCMP(sub->client_id, client_id) != 0 ||
-            sub->filter == NULL) {
+        if (sub->filter == NULL) {
             continue;
         }
         flen = (word16)XSTRLEN(sub->filter);
@@ -800,7 +972,7 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
 #endif
 
     rc = wmqb_kv_put_commit(broker, BROKER_PERSIST_NS_SUBS,
-        (const byte*)client_id, cid_len, buf, total_len);
+        key, key_len, buf, total_len);
 #ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
     wmqb_force_zero(buf, total_len);
 #endif
@@ -808,6 +980,56 @@ int BrokerPersist_PutSubs(MqttBroker* broker, const char* client_id)
     return rc;
 }
 
+/* Length of a client_id used as a record key. The word16 downcast
+ * rejects lengths that wouldn't fit instead of silently truncating.
+ * MQTT v3.1.1 caps client_id at 23 bytes; v5 caps at 65535 (i.e., fits
+ * in word16). Anything longer is malformed input from a caller. */
+static int wmqb_subs_cid_len(const char* client_id, word16* cid_len)
+{
+    size_t raw = XSTRLEN(client_id);
+    if (raw == 0 || raw > 0xFFFFu) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    *cid_len = (word16)raw;
+    return 0;
+}
+
+#ifdef WOLFMQTT_STATIC_MEMORY
+/* Static builds hold at most BROKER_MAX_SUBS subscriptions, so every change
+ * rewrites the client's single whole-list record keyed by client_id. */
+int BrokerPersist_PutSubs(MqttBroker* broker, const BrokerClient* bc)
+{
+    const char* client_id;
+    word16 cid_len;
+    int count = 0;
+    int rc;
+
+    if (broker == NULL || broker->persist == NULL || bc == NULL ||
+        bc->client_id[0] == '\0') {
+        return 0;
+    }
+    client_id = bc->client_id;
+    rc = wmqb_subs_cid_len(client_id, &cid_len);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = wmqb_put_subs_record(broker, client_id, (const byte*)client_id,
+        cid_len, &count);
+    if (rc == 0 && count == 0) {
+        /* Caller did all the unsubscribes; remove the record entirely. */
+        rc = wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS,
+            (const byte*)client_id, cid_len);
+    }
+    return rc;
+}
+
+int BrokerPersist_PutSubsDelta(MqttBroker* broker, const BrokerClient* bc,
+    const BrokerSubDelta* d, int count)
+{
+    (void)d; (void)count;
+    return BrokerPersist_PutSubs(broker, bc);
+}
+
 int BrokerPersist_DelSubs(MqttBroker* broker, const char* client_id)
 {
     if (broker == NULL || broker->persist == NULL || client_id == NULL) {
@@ -817,6 +1039,325 @@ int BrokerPersist_DelSubs(MqttBroker* broker, const char* client_id)
         (const byte*)client_id, (word16)XSTRLEN(client_id));
 }
 
+void BrokerPersist_FreeSubsLogs(MqttBroker* broker)
+{
+    (void)broker;
+}
+#else
+/* Subscription log key encoding:
+ *   client_id_bytes || 0x00 || gen_be(4 bytes) || seq_be(2 bytes)
+ * seq 0 is the generation's snapshot (the whole-list layout above) and
+ * seq 1.. are its deltas, in the order they were made. Generation 0 is
+ * the whole-list record keyed by the bare client_id; no client_id holds
+ * a 0x00 byte, so the two key forms cannot collide (see
+ * wmqb_outq_build_key). A new snapshot is written before the records it
+ * replaces are deleted, and restore uses the newest generation, so a
+ * crash in between loses nothing. */
+#define WMQB_SUBS_KEY_TAIL  7
+#define WMQB_SUBS_KEY_MAX   (256 + WMQB_SUBS_KEY_TAIL)
+
+static int wmqb_subs_build_key(const char* cid, word16 cid_len, word32 gen,
+    word16 seq, byte* out_key, word16* out_len)
+{
+    if ((word32)cid_len + WMQB_SUBS_KEY_TAIL > WMQB_SUBS_KEY_MAX) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    XMEMCPY(out_key, cid, cid_len);
+    out_key[cid_len] = 0x00;
+    wmqb_w_u32(&out_key[cid_len + 1], gen);
+    wmqb_w_u16(&out_key[cid_len + 5], seq);
+    *out_len = (word16)(cid_len + WMQB_SUBS_KEY_TAIL);
+    return 0;
+}
+
+static BrokerSubsLog* wmqb_subs_log_find(MqttBroker* broker,
+    const char* cid, word16 cid_len)
+{
+    return (BrokerSubsLog*)BrokerIdIndex_Find(broker, BROKER_ID_SUBS_LOG,
+        cid, cid_len, NULL);
+}
+
+/* New log at generation 0, i.e. owning whatever whole-list record is
+ * stored under the bare client_id. NULL when out of memory. */
+static BrokerSubsLog* wmqb_subs_log_new(MqttBroker* broker,
+    const char* cid, word16 cid_len)
+{
+    BrokerSubsLog* log;
+
+    log = (BrokerSubsLog*)WOLFMQTT_MALLOC(sizeof(*log));
+    if (log == NULL) {
+        return NULL;
+    }
+    XMEMSET(log, 0, sizeof(*log));
+    log->client_id = (char*)WOLFMQTT_MALLOC((size_t)cid_len + 1);
+    if (log->client_id == NULL) {
+        WOLFMQTT_FREE(log);
+        return NULL;
+    }
+    XMEMCPY(log->client_id, cid, cid_len);
+    log->client_id[cid_len] = '\0';
+    if (BrokerIdIndex_Add(broker, BROKER_ID_SUBS_LOG, log) !=
+            MQTT_CODE_SUCCESS) {
+        WOLFMQTT_FREE(log->client_id);
+        WOLFMQTT_FREE(log);
+        return NULL;
+    }
+    return log;
+}
+
+static void wmqb_subs_log_free(MqttBroker* broker, BrokerSubsLog* log)
+{
+    BrokerIdIndex_Del(broker, BROKER_ID_SUBS_LOG, log);
+    WOLFMQTT_FREE(log->client_id);
+    WOLFMQTT_FREE(log);
+}
+
+static int wmqb_subs_del_rec(MqttBroker* broker, const char* cid,
+    word16 cid_len, word32 gen, word16 seq)
+{
+    byte key[WMQB_SUBS_KEY_MAX];
+    word16 key_len;
+    int rc;
+
+    if (gen == 0) {
+        return wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS,
+            (const byte*)cid, cid_len);
+    }
+    rc = wmqb_subs_build_key(cid, cid_len, gen, seq, key, &key_len);
+    if (rc == 0) {
+        rc = wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS, key,
+            key_len);
+    }
+    return rc;
+}
+
+/* Delete the records of one generation: newest delta first and the
+ * snapshot last, so an interrupted delete still leaves an earlier state
+ * of the list. */
+static int wmqb_subs_del_gen(MqttBroker* broker, const char* cid,
+    word16 cid_len, word32 gen, word16 deltas)
+{
+    word16 seq = (gen == 0) ? 0 : deltas;
+    int rc = 0;
+    int del_rc;
+
+    for (;;) {
+        del_rc = wmqb_subs_del_rec(broker, cid, cid_len, gen, seq);
+        if (del_rc != 0 && rc == 0) {
+            rc = del_rc;
+        }
+        if (seq == 0) {
+            break;
+        }
+        seq--;
+    }
+    return rc;
+}
+
+/* Start a new generation for log from the subscriptions on the session
+ * chain at head, then delete the generation it replaces. A failed snapshot
+ * keeps the old records and makes the next change try again. */
+static int wmqb_subs_rebase(MqttBroker* broker, BrokerSubsLog* log,
+    const BrokerSub* head, int* count)
+{
+    byte key[WMQB_SUBS_KEY_MAX];
+    word16 key_len;
+    word16 cid_len = (word16)XSTRLEN(log->client_id);
+    word32 gen;
+    int rc;
+
+    gen = broker->persist_subs_gen + 1;
+    if (gen == 0) {
+        gen = 1;
+    }
+    broker->persist_subs_gen = gen;
+    rc = wmqb_subs_build_key(log->client_id, cid_len, gen, 0, key,
+        &key_len);
+    if (rc == 0) {
+        rc = wmqb_put_subs_record(broker, head, key, key_len, count);
+    }
+    if (rc != 0) {
+        log->deltas = BROKER_PERSIST_SUBS_DELTA_MAX;
+        return rc;
+    }
+    if (*count == 0) {
+        return 0;
+    }
+    (void)wmqb_subs_del_gen(broker, log->client_id, cid_len, log->gen,
+        log->deltas);
+    log->gen = gen;
+    log->deltas = 0;
+    return 0;
+}
+
+/* Snapshot the subs on bc's session chain into a new generation of its
+ * subscription log, replacing the old one, so the cost follows the
+ * session and not every subscription on the broker. Client IDs too long
+ * for a log key, or a log that cannot be allocated, fall back to the
+ * single whole-list record. */
+int BrokerPersist_PutSubs(MqttBroker* broker, const BrokerClient* bc)
+{
+    BrokerSubsLog* log;
+    const char* client_id;
+    word16 cid_len;
+    int count = 0;
+    int rc;
+
+    if (broker == NULL || broker->persist == NULL || bc == NULL ||
+        bc->client_id == NULL || *bc->client_id == '\0') {
+        return 0;
+    }
+    client_id = bc->client_id;
+    rc = wmqb_subs_cid_len(client_id, &cid_len);
+    if (rc != 0) {
+        return rc;
+    }
+    log = wmqb_subs_log_find(broker, client_id, cid_len);
+    if (log == NULL &&
+            (word32)cid_len + WMQB_SUBS_KEY_TAIL <= WMQB_SUBS_KEY_MAX) {
+        log = wmqb_subs_log_new(broker, client_id, cid_len);
+    }
+    if (log == NULL) {
+        rc = wmqb_put_subs_record(broker, bc->subs,
+            (const byte*)client_id, cid_len, &count);
+        if (rc == 0 && count == 0) {
+            rc = wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS,
+                (const byte*)client_id, cid_len);
+        }
+        return rc;
+    }
+    rc = wmqb_subs_rebase(broker, log, bc->subs, &count);
+    if (rc == 0 && count == 0) {
+        /* Caller did all the unsubscribes; remove the records entirely. */
+        rc = BrokerPersist_DelSubs(broker, client_id);
+    }
+    return rc;
+}
+
+/* Append one delta record holding the changes of a SUBSCRIBE or
+ * UNSUBSCRIBE to the client's subscription log, so the cost follows the
+ * packet and not the number of subscriptions. The first change of a
+ * session, and every BROKER_PERSIST_SUBS_DELTA_MAX-th after it, writes a
+ * snapshot instead (PutSubs).
+ *
+ * Delta body layout:
+ *   off  size   field
+ *     0    2    count   (big endian)
+ *     2   ...   N entries, each:
+ *                  1    op          (BROKER_SUB_DELTA_*)
+ *                  1    qos
+ *                  2    filter_len  (big endian)
+ *                  N    filter      (no NUL)
+ */
+int BrokerPersist_PutSubsDelta(MqttBroker* broker, const BrokerClient* bc,
+    const BrokerSubDelta* d, int count)
+{
+    BrokerSubsLog* log;
+    const char* client_id;
+    byte key[WMQB_SUBS_KEY_MAX];
+    word16 key_len;
+    word16 cid_len;
+    word32 body_len;
+    word32 total_len;
+    byte*  buf;
+    byte*  p;
+    int    i;
+    int    rc;
+
+    if (broker == NULL || broker->persist == NULL || bc == NULL ||
+        bc->client_id == NULL || *bc->client_id == '\0' || d == NULL ||
+        count <= 0) {
+        return 0;
+    }
+    client_id = bc->client_id;
+    rc = wmqb_subs_cid_len(client_id, &cid_len);
+    if (rc != 0) {
+        return rc;
+    }
+    log = wmqb_subs_log_find(broker, client_id, cid_len);
+    if (log == NULL || log->gen == 0 || count > 0xFFFF ||
+            log->deltas >= BROKER_PERSIST_SUBS_DELTA_MAX) {
+        return BrokerPersist_PutSubs(broker, bc);
+    }
+    rc = wmqb_subs_build_key(client_id, cid_len, log->gen,
+        (word16)(log->deltas + 1), key, &key_len);
+    if (rc != 0) {
+        return rc;
+    }
+    body_len = 2;
+    for (i = 0; i < count; i++) {
+        body_len += 1 + 1 + 2 + d[i].filter_len;
+    }
+    total_len = WMQB_HDR_LEN + body_len;
+    buf = (byte*)WOLFMQTT_MALLOC(total_len);
+    if (buf == NULL) {
+        log->deltas = BROKER_PERSIST_SUBS_DELTA_MAX;
+        return wmqb_batch_fail(broker, MQTT_CODE_ERROR_MEMORY);
+    }
+    wmqb_write_header(buf, BROKER_PERSIST_NS_SUBS, body_len);
+    p = &buf[WMQB_HDR_LEN];
+    wmqb_w_u16(p, (word16)count); p += 2;
+    for (i = 0; i < count; i++) {
+        *p++ = d[i].op;
+        *p++ = d[i].qos;
+        wmqb_w_u16(p, d[i].filter_len); p += 2;
+        XMEMCPY(p, d[i].filter, d[i].filter_len); p += d[i].filter_len;
+    }
+
+    rc = wmqb_kv_put_commit(broker, BROKER_PERSIST_NS_SUBS,
+        key, key_len, buf, total_len);
+#ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
+    wmqb_force_zero(buf, total_len);
+#endif
+    WOLFMQTT_FREE(buf);
+    /* A lost delta leaves a hole, so the next change snapshots instead */
+    log->deltas = (rc == 0) ? (word16)(log->deltas + 1) :
+        (word16)BROKER_PERSIST_SUBS_DELTA_MAX;
+    return rc;
+}
+
+int BrokerPersist_DelSubs(MqttBroker* broker, const char* client_id)
+{
+    BrokerSubsLog* log;
+    word16 cid_len;
+    int rc;
+
+    if (broker == NULL || broker->persist == NULL || client_id == NULL) {
+        return 0;
+    }
+    cid_len = (word16)XSTRLEN(client_id);
+    log = wmqb_subs_log_find(broker, client_id, cid_len);
+    if (log == NULL) {
+        return wmqb_kv_del_commit(broker, BROKER_PERSIST_NS_SUBS,
+            (const byte*)client_id, cid_len);
+    }
+    rc = wmqb_subs_del_gen(broker, client_id, cid_len, log->gen,
+        log->deltas);
+    wmqb_subs_log_free(broker, log);
+    return rc;
+}
+
+/* Free every subscription log. A delete can shift a later entry of the
+ * probe run back into slot i, so i only advances past other kinds. */
+void BrokerPersist_FreeSubsLogs(MqttBroker* broker)
+{
+    word32 i = 0;
+
+    if (broker == NULL) {
+        return;
+    }
+    while (i < broker->ids.cap) {
+        BrokerIdEntry* e = &broker->ids.slots[i];
+        if (e->obj != NULL && e->kind == BROKER_ID_SUBS_LOG) {
+            wmqb_subs_log_free(broker, (BrokerSubsLog*)e->obj);
+        }
+        else {
+            i++;
+        }
+    }
+}
+#endif /* WOLFMQTT_STATIC_MEMORY */
+
 /* Snapshot a retained message into a persisted record.
  *
  * Body layout:
@@ -860,7 +1401,7 @@ int BrokerPersist_PutRetained(MqttBroker* broker,
     total_len = WMQB_HDR_LEN + body_len;
     buf = (byte*)WOLFMQTT_MALLOC(total_len);
     if (buf == NULL) {
-        return MQTT_CODE_ERROR_MEMORY;
+        return wmqb_batch_fail(broker, MQTT_CODE_ERROR_MEMORY);
     }
     wmqb_write_header(buf, BROKER_PERSIST_NS_RETAINED, body_len);
     p = &buf[WMQB_HDR_LEN];
@@ -963,23 +1504,23 @@ int BrokerPersist_PutOutPub(MqttBroker* broker, const char* client_id,
     if (p_e->qos == MQTT_QOS_0) {
         return 0;
     }
-    if (p_e->topic == NULL) {
+    if (p_e->msg == NULL) {
         return MQTT_CODE_ERROR_BAD_ARG;
     }
-    topic_len = (word16)XSTRLEN(p_e->topic);
-    payload_len = p_e->payload_len;
+    topic_len = (word16)XSTRLEN(p_e->msg->topic);
+    payload_len = p_e->msg->payload_len;
 
     rc = wmqb_outq_build_key(client_id, p_e->packet_id, key, sizeof(key),
             &key_len);
     if (rc != 0) {
-        return rc;
+        return wmqb_batch_fail(broker, rc);
     }
     body_len = 1 + 1 + 1 + 1 + 2 + 2 + 8 + 4 + 2 + topic_len + 4
                 + payload_len;
     total_len = WMQB_HDR_LEN + body_len;
     buf = (byte*)WOLFMQTT_MALLOC(total_len);
     if (buf == NULL) {
-        return MQTT_CODE_ERROR_MEMORY;
+        return wmqb_batch_fail(broker, MQTT_CODE_ERROR_MEMORY);
     }
     wmqb_write_header(buf, BROKER_PERSIST_NS_OUTQ, body_len);
     bp = &buf[WMQB_HDR_LEN];
@@ -992,10 +1533,10 @@ int BrokerPersist_PutOutPub(MqttBroker* broker, const char* client_id,
     wmqb_w_u64(bp, (word64)p_e->enq_time); bp += 8;
     wmqb_w_u32(bp, p_e->expiry_sec); bp += 4;
     wmqb_w_u16(bp, topic_len); bp += 2;
-    XMEMCPY(bp, p_e->topic, topic_len); bp += topic_len;
+    XMEMCPY(bp, p_e->msg->topic, topic_len); bp += topic_len;
     wmqb_w_u32(bp, payload_len); bp += 4;
-    if (payload_len > 0 && p_e->payload != NULL) {
-        XMEMCPY(bp, p_e->payload, payload_len);
+    if (payload_len > 0 && p_e->msg->payload != NULL) {
+        XMEMCPY(bp, p_e->msg->payload, payload_len);
     }
 
     rc = wmqb_kv_put_commit(broker, BROKER_PERSIST_NS_OUTQ,
@@ -1109,6 +1650,41 @@ static int wmqb_delq_iter_cb(const byte* key, word16 key_len,
     dq->head = node;
     return 0;
 }
+
+/* Delete every OUTQ record of cid; join the group commit first when join
+ * is set and there is something to delete. Returns the number deleted.
+ * DelOutQueue only needs keys, not blob bodies - the wipe-key iterator
+ * callback ignores blob bytes - so bypassing the decrypt wrapper here is
+ * safe and avoids unnecessary AES cycles. */
+static int wmqb_delq_delete(MqttBroker* broker, const byte* cid,
+    word16 cid_len, int join)
+{
+    const MqttBrokerPersistHooks* h = broker->persist;
+    struct wmqb_delq_ctx ctx;
+    struct wmqb_wipe_key* cur;
+    int deleted = 0;
+
+    XMEMSET(&ctx, 0, sizeof(ctx));
+    ctx.cid = cid;
+    ctx.cid_len = cid_len;
+    (void)h->kv_iter(h->ctx, BROKER_PERSIST_NS_OUTQ, wmqb_delq_iter_cb,
+        &ctx);
+    cur = ctx.head;
+    if (cur != NULL && join) {
+        wmqb_batch_join(broker);
+    }
+    while (cur != NULL) {
+        struct wmqb_wipe_key* next = cur->next;
+        if (h->kv_del(h->ctx, BROKER_PERSIST_NS_OUTQ, cur->key,
+                cur->key_len) == 0) {
+            deleted++;
+        }
+        WOLFMQTT_FREE(cur->key);
+        WOLFMQTT_FREE(cur);
+        cur = next;
+    }
+    return deleted;
+}
 #endif
 
 int BrokerPersist_DelOutQueue(MqttBroker* broker, const char* client_id)
@@ -1149,40 +1725,54 @@ int BrokerPersist_DelOutQueue(MqttBroker* broker, const char* client_id)
 #else
     {
         const MqttBrokerPersistHooks* h = broker->persist;
-        struct wmqb_delq_ctx ctx;
-        struct wmqb_wipe_key* cur;
-        int deleted = 0;
+        int deleted;
+        int rc;
         if (h->kv_iter == NULL || h->kv_del == NULL) {
             return 0;
         }
-        XMEMSET(&ctx, 0, sizeof(ctx));
-        ctx.cid = (const byte*)client_id;
-        ctx.cid_len = (word16)XSTRLEN(client_id);
-        /* DelOutQueue only needs keys, not blob bodies - the wipe-key
-         * iterator callback ignores blob bytes - so bypassing the
-         * decrypt wrapper here is safe and avoids unnecessary AES
-         * cycles. */
-        (void)h->kv_iter(h->ctx, BROKER_PERSIST_NS_OUTQ,
-            wmqb_delq_iter_cb, &ctx);
-        cur = ctx.head;
-        while (cur != NULL) {
-            struct wmqb_wipe_key* next = cur->next;
-            if (h->kv_del(h->ctx, BROKER_PERSIST_NS_OUTQ, cur->key,
-                    cur->key_len) == 0) {
-                deleted++;
+        if (WMQB_WORKER(broker)) {
+            /* The queue's records may still be on their way to the
+             * backend, so the worker looks them up after they land */
+            wmqb_batch_join(broker);
+            rc = BrokerPersistWorker_Push(broker, BROKER_PERSIST_OP_DELQ,
+                BROKER_PERSIST_NS_OUTQ, (const byte*)client_id,
+                (word16)XSTRLEN(client_id), NULL, 0, 0);
+            if (rc == 0) {
+                wmqb_sync(broker);
             }
-            WOLFMQTT_FREE(cur->key);
-            WOLFMQTT_FREE(cur);
-            cur = next;
+            return wmqb_batch_fail(broker, rc);
         }
-        if (h->sync != NULL) {
-            (void)h->sync(h->ctx);
+        deleted = wmqb_delq_delete(broker, (const byte*)client_id,
+            (word16)XSTRLEN(client_id), 1);
+        if (deleted > 0) {
+            wmqb_sync(broker);
         }
         return deleted;
     }
 #endif
 }
 
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+/* Worker side of a queued DelOutQueue: delete every OUTQ record of cid.
+ * Returns the number deleted. */
+int BrokerPersist_ApplyDelQueue(MqttBroker* broker, const byte* cid,
+    word16 cid_len)
+{
+    return wmqb_delq_delete(broker, cid, cid_len, 0);
+}
+#endif
+
+void BrokerPersist_Barrier(MqttBroker* broker)
+{
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    if (broker != NULL && broker->persist_worker != NULL) {
+        BrokerPersistWorker_Barrier(broker);
+    }
+#else
+    (void)broker;
+#endif
+}
+
 /* META record. Body = 4-byte big-endian schema_ver (redundant with the
  * header check, but lets a stand-alone tool inspect the file without
  * knowing the broker's header format). Key is the single zero byte. */
@@ -1257,6 +1847,14 @@ struct wmqb_ended_session {
     byte   outq_err;
     struct wmqb_ended_session* next;
 };
+
+/* An OUTQ record whose packet identifier collided with one restored
+ * before it; re-keyed once every record is loaded. */
+struct wmqb_outq_moved {
+    BrokerOrphanSession* o;
+    BrokerOutPub e;     /* holds a reference to e.msg */
+    struct wmqb_outq_moved* next;
+};
 #endif
 
 /* Restore iterator context. Used for retained-msg, subs, session,
@@ -1270,6 +1868,7 @@ struct wmqb_restore_ctx {
     /* Session keys whose zero Session Expiry ended them before this restart */
     struct wmqb_ended_session* ended;
     int         ended_count;
+    struct wmqb_outq_moved* moved;
 #endif
 };
 
@@ -1400,30 +1999,25 @@ static BrokerStaticOrphanSession* wmqb_restore_create_orphan(
     orphan->in_use = 1;
     XMEMCPY(orphan->client_id, client_id, cid_len);
     orphan->client_id[cid_len] = '\0';
+    /* Cannot fail: BROKER_ID_INDEX_SZ has room for every slot */
+    (void)BrokerIdIndex_Add(broker, BROKER_ID_ORPHAN, orphan);
     orphan->protocol_level = protocol_level;
     orphan->session_expiry_sec = session_expiry_sec;
     orphan->orphan_since = (orphan_since != 0) ?
         (WOLFMQTT_BROKER_TIME_T)orphan_since :
         WOLFMQTT_BROKER_GET_TIME_S();
+    BrokerStaticOrphan_ArmExpiry(broker, orphan);
     return orphan;
 }
 
 static BrokerStaticOrphanSession* wmqb_restore_find_orphan(
     MqttBroker* broker, const byte* client_id, word16 cid_len)
 {
-    int i;
-
     if (broker == NULL || client_id == NULL) {
         return NULL;
     }
-    for (i = 0; i < BROKER_MAX_STATIC_ORPHAN_SESSIONS; i++) {
-        BrokerStaticOrphanSession* orphan = &broker->static_orphans[i];
-        if (orphan->in_use && XSTRLEN(orphan->client_id) == cid_len &&
-                XMEMCMP(orphan->client_id, client_id, cid_len) == 0) {
-            return orphan;
-        }
-    }
-    return NULL;
+    return (BrokerStaticOrphanSession*)BrokerIdIndex_Find(broker,
+        BROKER_ID_ORPHAN, (const char*)client_id, cid_len, NULL);
 }
 #else
 /* Create an orphan slot from a NS_SESSION record. Does NOT call the
@@ -1443,18 +2037,25 @@ static BrokerOrphanSession* wmqb_restore_create_orphan(MqttBroker* broker,
          * runs), the oldest restored sessions get skipped. */
         return NULL;
     }
-    o = (BrokerOrphanSession*)WOLFMQTT_MALLOC(sizeof(*o));
+    o = (BrokerOrphanSession*)BrokerSlab_Alloc(broker, BROKER_SLAB_ORPHAN,
+        sizeof(*o));
     if (o == NULL) {
         return NULL;
     }
     XMEMSET(o, 0, sizeof(*o));
-    o->client_id = (char*)WOLFMQTT_MALLOC((size_t)cid_len + 1);
+    o->client_id = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        (size_t)cid_len + 1);
     if (o->client_id == NULL) {
-        WOLFMQTT_FREE(o);
+        BrokerSlab_Free(o);
         return NULL;
     }
     XMEMCPY(o->client_id, client_id, cid_len);
     o->client_id[cid_len] = '\0';
+    if (BrokerIdIndex_Add(broker, BROKER_ID_ORPHAN, o) != MQTT_CODE_SUCCESS) {
+        BrokerSlab_Free(o->client_id);
+        BrokerSlab_Free(o);
+        return NULL;
+    }
     o->protocol_level = protocol_level;
     o->session_expiry_sec = session_expiry_sec;
     /* Use the persisted disconnect time so the v5 Session Expiry timer is
@@ -1466,33 +2067,25 @@ static BrokerOrphanSession* wmqb_restore_create_orphan(MqttBroker* broker,
     o->next = broker->orphan_sessions;
     broker->orphan_sessions = o;
     broker->orphan_session_count++;
+    BrokerOrphan_ArmExpiry(broker, o);
     return o;
 }
 
-/* Locate an existing orphan by client_id (linear scan; pool is small
- * by design). NULL if none. */
+/* Locate an existing orphan by client_id through the client ID index.
+ * NULL if none. */
 static BrokerOrphanSession* wmqb_restore_find_orphan(MqttBroker* broker,
     const byte* client_id, word16 cid_len)
 {
-    BrokerOrphanSession* cur;
     if (broker == NULL || client_id == NULL) {
         return NULL;
     }
-    for (cur = broker->orphan_sessions; cur != NULL; cur = cur->next) {
-        if (cur->client_id == NULL) {
-            continue;
-        }
-        if (XSTRLEN(cur->client_id) == cid_len &&
-                XMEMCMP(cur->client_id, client_id, cid_len) == 0) {
-            return cur;
-        }
-    }
-    return NULL;
+    return (BrokerOrphanSession*)BrokerIdIndex_Find(broker, BROKER_ID_ORPHAN,
+        (const char*)client_id, cid_len, NULL);
 }
 #endif /* WOLFMQTT_STATIC_MEMORY */
 
 /* Allocate and insert a retained-message node from a decoded NS_RETAINED
- * blob. Dynamic mode prepends a heap node onto broker->retained; static
+ * blob. Dynamic mode links a heap node into broker->retained; static
  * mode copies into the first free slot of broker->retained[]. Mirrors
  * BrokerRetained_Store but without the already-exists merge logic
  * (every key is fresh at startup). */
@@ -1576,6 +2169,9 @@ static int wmqb_decode_and_insert_retained(MqttBroker* broker,
         slot->qos = (MqttQoS)qos;
         slot->store_time = (WOLFMQTT_BROKER_TIME_T)store_time;
         slot->expiry_sec = expiry;
+    #ifdef WOLFMQTT_BROKER_RETAINED
+        BrokerRetained_ArmExpiry(broker, slot);
+    #endif
     }
 #else
     {
@@ -1621,9 +2217,22 @@ static int wmqb_decode_and_insert_retained(MqttBroker* broker,
         m->qos = (MqttQoS)qos;
         m->store_time = (WOLFMQTT_BROKER_TIME_T)store_time;
         m->expiry_sec = expiry;
+    #ifdef WOLFMQTT_BROKER_RETAINED
+        rc = BrokerRetained_Link(broker, m);
+        if (rc != MQTT_CODE_SUCCESS) {
+            if (m->payload != NULL) {
+                WOLFMQTT_FREE(m->payload);
+            }
+            WOLFMQTT_FREE(m->topic);
+            WOLFMQTT_FREE(m);
+            return rc;
+        }
+        BrokerRetained_ArmExpiry(broker, m);
+    #else
         m->next = broker->retained;
         broker->retained = m;
         broker->retained_count++;
+    #endif
     }
 #endif
     return 0;
@@ -1645,16 +2254,16 @@ static int wmqb_iter_retained_cb(const byte* key, word16 key_len,
     return 0; /* always continue */
 }
 
+#ifdef WOLFMQTT_STATIC_MEMORY
 /* Allocate orphan subs from a decoded NS_SUBS blob. The blob key carries
  * the client_id - subs created here have client=NULL, client_id set;
  * the existing BrokerSubs_ReassociateClient path on reconnect rebinds
  * them to the new BrokerClient.
  *
- * All-or-nothing: decode into a local working list (dynamic) or a
- * tracked slot-index array (static) first, then commit on success.
- * If any entry fails to decode or allocate, the partial work is rolled
- * back so broker->subs (and slot.in_use flags) end up exactly as they
- * were on entry. */
+ * All-or-nothing: decode into a tracked slot-index array first, then
+ * commit on success. If any entry fails to decode or allocate, the
+ * claimed slots are released so broker->subs (and slot.in_use flags) end
+ * up exactly as they were on entry. */
 static int wmqb_decode_and_insert_subs(MqttBroker* broker,
     const byte* key, word16 key_len, const byte* blob, word32 blob_len)
 {
@@ -1664,17 +2273,12 @@ static int wmqb_decode_and_insert_subs(MqttBroker* broker,
     const byte* end;
     word16 count;
     word16 i;
-#ifdef WOLFMQTT_STATIC_MEMORY
     /* Track slots we claimed in this call so we can release on failure.
      * BROKER_MAX_SUBS bounds the working set; allocating on the stack
      * keeps the failure path simple. */
     int claimed[BROKER_MAX_SUBS];
     int claimed_count = 0;
     int j;
-#else
-    BrokerSub* local_head = NULL;
-    BrokerSub* local_tail = NULL;
-#endif
 
     rc = wmqb_read_header(blob, blob_len, BROKER_PERSIST_NS_SUBS,
             &body_len);
@@ -1697,6 +2301,8 @@ static int wmqb_decode_and_insert_subs(MqttBroker* broker,
     for (i = 0; i < count; i++) {
         byte qos;
         word16 flen;
+        BrokerSub* slot = NULL;
+        int k;
 
         if ((word32)(end - p) < 4) {
             rc = MQTT_CODE_ERROR_MALFORMED_DATA;
@@ -1709,118 +2315,45 @@ static int wmqb_decode_and_insert_subs(MqttBroker* broker,
             rc = MQTT_CODE_ERROR_MALFORMED_DATA;
             goto rollback;
         }
-
-#ifdef WOLFMQTT_STATIC_MEMORY
-        {
-            BrokerSub* slot = NULL;
-            int k;
-            /* >= (not + 1 >) so a malformed flen / key_len == 0xFFFF
-             * on a word16 cannot wrap to 0 and bypass this check. */
-            if (flen >= BROKER_MAX_FILTER_LEN ||
-                    key_len >= BROKER_MAX_CLIENT_ID_LEN) {
-                rc = MQTT_CODE_ERROR_OUT_OF_BUFFER;
-                goto rollback;
-            }
-            for (k = 0; k < BROKER_MAX_SUBS; k++) {
-                if (!broker->subs[k].in_use) {
-                    slot = &broker->subs[k];
-                    claimed[claimed_count++] = k;
-                    break;
-                }
-            }
-            if (slot == NULL) {
-                rc = MQTT_CODE_ERROR_OUT_OF_BUFFER;
-                goto rollback;
-            }
-            XMEMSET(slot, 0, sizeof(*slot));
-            slot->in_use = 1;
-            XMEMCPY(slot->filter, p, flen);
-            slot->filter[flen] = '\0';
-            XMEMCPY(slot->client_id, key, key_len);
-            slot->client_id[key_len] = '\0';
-            slot->client = NULL; /* orphan until reconnect */
-            slot->qos = (MqttQoS)qos;
+        /* >= (not + 1 >) so a malformed flen / key_len == 0xFFFF
+         * on a word16 cannot wrap to 0 and bypass this check. */
+        if (flen >= BROKER_MAX_FILTER_LEN ||
+                key_len >= BROKER_MAX_CLIENT_ID_LEN) {
+            rc = MQTT_CODE_ERROR_OUT_OF_BUFFER;
+            goto rollback;
         }
-        p += flen;
-#else
-        {
-            BrokerSub* sub;
-            char* cid;
-            sub = (BrokerSub*)WOLFMQTT_MALLOC(sizeof(*sub));
-            if (sub == NULL) {
-                rc = MQTT_CODE_ERROR_MEMORY;
-                goto rollback;
-            }
-            XMEMSET(sub, 0, sizeof(*sub));
-            sub->filter = (char*)WOLFMQTT_MALLOC((size_t)flen + 1);
-            if (sub->filter == NULL) {
-                WOLFMQTT_FREE(sub);
-                rc = MQTT_CODE_ERROR_MEMORY;
-                goto rollback;
-            }
-            XMEMCPY(sub->filter, p, flen);
-            sub->filter[flen] = '\0';
-            p += flen;
-
-            cid = (char*)WOLFMQTT_MALLOC((size_t)key_len + 1);
-            if (cid == NULL) {
-                WOLFMQTT_FREE(sub->filter);
-                WOLFMQTT_FREE(sub);
-                rc = MQTT_CODE_ERROR_MEMORY;
-                goto rollback;
-            }
-            XMEMCPY(cid, key, key_len);
-            cid[key_len] = '\0';
-            sub->client_id = cid;
-            sub->client = NULL; /* orphan until reconnect */
-            sub->qos = (MqttQoS)qos;
-            sub->next = NULL;
-
-            /* Append to local list (preserve decode order so the
-             * eventual broker->subs walk sees the same order as a
-             * shadow-write would have produced). */
-            if (local_tail == NULL) {
-                local_head = sub;
-            }
-            else {
-                local_tail->next = sub;
+        for (k = 0; k < BROKER_MAX_SUBS; k++) {
+            if (!broker->subs[k].in_use) {
+                slot = &broker->subs[k];
+                claimed[claimed_count++] = k;
+                break;
             }
-            local_tail = sub;
         }
-#endif
+        if (slot == NULL) {
+            rc = MQTT_CODE_ERROR_OUT_OF_BUFFER;
+            goto rollback;
+        }
+        XMEMSET(slot, 0, sizeof(*slot));
+        slot->in_use = 1;
+        XMEMCPY(slot->filter, p, flen);
+        slot->filter[flen] = '\0';
+        XMEMCPY(slot->client_id, key, key_len);
+        slot->client_id[key_len] = '\0';
+        slot->client = NULL; /* orphan until reconnect */
+        slot->qos = (MqttQoS)qos;
+        p += flen;
     }
 
-    /* All entries decoded - splice into broker->subs. For dynamic mode,
-     * prepend the local list head-first to match the existing
-     * shadow-write order; tail->next is set to the prior head. */
-#ifndef WOLFMQTT_STATIC_MEMORY
-    if (local_head != NULL) {
-        local_tail->next = broker->subs;
-        broker->subs = local_head;
+    /* All entries decoded - index them. */
+    for (j = 0; j < claimed_count; j++) {
+        BrokerSubTree_Insert(broker, &broker->subs[claimed[j]]);
     }
-#else
-    (void)j;
-#endif
     return 0;
 
 rollback:
-#ifdef WOLFMQTT_STATIC_MEMORY
     for (j = 0; j < claimed_count; j++) {
         XMEMSET(&broker->subs[claimed[j]], 0, sizeof(BrokerSub));
     }
-#else
-    while (local_head != NULL) {
-        BrokerSub* nxt = local_head->next;
-        if (local_head->filter != NULL) {
-            WOLFMQTT_FREE(local_head->filter);
-        }
-        if (local_head->client_id != NULL) {
-            WOLFMQTT_FREE(local_head->client_id);
-        }
-        WOLFMQTT_FREE(local_head);
-        local_head = nxt;
-    }
-#endif
     return rc;
 }
 
@@ -1839,6 +2372,359 @@ static int wmqb_iter_subs_cb(const byte* key, word16 key_len,
     }
     return 0;
 }
+#else
+/* One NS_SUBS record held by restore until every record of its client has
+ * been read, since the iterator returns them in no particular order. */
+struct BrokerSubsRec {
+    word32 gen;
+    word16 seq;
+    word32 blob_len;
+    byte*  blob;
+    struct BrokerSubsRec* next;
+};
+
+struct wmqb_subs_restore_ctx {
+    MqttBroker*    broker;
+    BrokerSubsLog* logs;    /* every log created by this restore */
+    word32         max_gen;
+    int            rc;
+};
+
+static void wmqb_subs_recs_free(struct BrokerSubsRec* r)
+{
+    while (r != NULL) {
+        struct BrokerSubsRec* next = r->next;
+#ifdef WOLFMQTT_BROKER_PERSIST_ENCRYPT
+        wmqb_force_zero(r->blob, r->blob_len);
+#endif
+        WOLFMQTT_FREE(r->blob);
+        WOLFMQTT_FREE(r);
+        r = next;
+    }
+}
+
+/* File each record under its client's log, ordered by generation and then
+ * sequence. Keys of neither form are left alone. */
+static int wmqb_iter_subs_log_cb(const byte* key, word16 key_len,
+    const byte* blob, word32 blob_len, void* cb_ctx)
+{
+    struct wmqb_subs_restore_ctx* c = (struct wmqb_subs_restore_ctx*)cb_ctx;
+    BrokerSubsLog* log;
+    struct BrokerSubsRec* rec;
+    struct BrokerSubsRec** pos;
+    word16 cid_len = key_len;
+    word32 gen = 0;
+    word16 seq = 0;
+    word16 i;
+
+    if (key_len > WMQB_SUBS_KEY_TAIL &&
+            key[key_len - WMQB_SUBS_KEY_TAIL] == 0x00) {
+        cid_len = (word16)(key_len - WMQB_SUBS_KEY_TAIL);
+        gen = wmqb_r_u32(&key[cid_len + 1]);
+        seq = wmqb_r_u16(&key[cid_len + 5]);
+        if (gen == 0) {
+            return 0;
+        }
+    }
+    for (i = 0; i < cid_len; i++) {
+        if (key[i] == 0x00) {
+            return 0;
+        }
+    }
+    if (cid_len == 0) {
+        return 0;
+    }
+
+    log = wmqb_subs_log_find(c->broker, (const char*)key, cid_len);
+    if (log == NULL) {
+        log = wmqb_subs_log_new(c->broker, (const char*)key, cid_len);
+        if (log == NULL) {
+            c->rc = MQTT_CODE_ERROR_MEMORY;
+            return 1;
+        }
+        log->restore_next = c->logs;
+        c->logs = log;
+    }
+    rec = (struct BrokerSubsRec*)WOLFMQTT_MALLOC(sizeof(*rec));
+    if (rec == NULL) {
+        c->rc = MQTT_CODE_ERROR_MEMORY;
+        return 1;
+    }
+    rec->blob = (byte*)WOLFMQTT_MALLOC(blob_len > 0 ? blob_len : 1);
+    if (rec->blob == NULL) {
+        WOLFMQTT_FREE(rec);
+        c->rc = MQTT_CODE_ERROR_MEMORY;
+        return 1;
+    }
+    XMEMCPY(rec->blob, blob, blob_len);
+    rec->blob_len = blob_len;
+    rec->gen = gen;
+    rec->seq = seq;
+    pos = &log->restore_recs;
+    while (*pos != NULL && ((*pos)->gen < gen ||
+            ((*pos)->gen == gen && (*pos)->seq < seq))) {
+        pos = &(*pos)->next;
+    }
+    rec->next = *pos;
+    *pos = rec;
+    if (gen > log->gen) {
+        log->gen = gen;
+    }
+    if (gen > c->max_gen) {
+        c->max_gen = gen;
+    }
+    return 0;
+}
+
+/* Orphan sub (client NULL) for cid, bound on reconnect by
+ * BrokerSubs_ReassociateClient. */
+static BrokerSub* wmqb_subs_alloc(MqttBroker* broker, const char* cid,
+    word16 cid_len, const byte* filter, word16 flen, byte qos)
+{
+    BrokerSub* sub;
+
+    sub = (BrokerSub*)BrokerSlab_Alloc(broker, BROKER_SLAB_SUB,
+        sizeof(*sub));
+    if (sub == NULL) {
+        return NULL;
+    }
+    XMEMSET(sub, 0, sizeof(*sub));
+    sub->filter = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        (size_t)flen + 1);
+    sub->client_id = (char*)BrokerSlab_Alloc(broker, BROKER_SLAB_SIZED,
+        (size_t)cid_len + 1);
+    if (sub->filter == NULL || sub->client_id == NULL) {
+        if (sub->filter != NULL) {
+            BrokerSlab_Free(sub->filter);
+        }
+        if (sub->client_id != NULL) {
+            BrokerSlab_Free(sub->client_id);
+        }
+        BrokerSlab_Free(sub);
+        return NULL;
+    }
+    XMEMCPY(sub->filter, filter, flen);
+    sub->filter[flen] = '\0';
+    XMEMCPY(sub->client_id, cid, cid_len);
+    sub->client_id[cid_len] = '\0';
+    sub->client = NULL; /* orphan until reconnect */
+    sub->qos = (MqttQoS)qos;
+    return sub;
+}
+
+static void wmqb_subs_free_list(BrokerSub* sub)
+{
+    while (sub != NULL) {
+        BrokerSub* next = sub->next;
+        BrokerSlab_Free(sub->filter);
+        BrokerSlab_Free(sub->client_id);
+        BrokerSlab_Free(sub);
+        sub = next;
+    }
+}
+
+/* Apply a snapshot (seq 0) or delta record to the client's list, which
+ * runs from *head to the next pointer at *tail. Snapshot entries are
+ * appended in decode order; delta entries update, append or unlink the
+ * filter they name. On error the list may be half applied. */
+static int wmqb_subs_apply(MqttBroker* broker, const BrokerSubsLog* log,
+    const struct BrokerSubsRec* rec, BrokerSub** head, BrokerSub*** tail)
+{
+    word16 cid_len = (word16)XSTRLEN(log->client_id);
+    word32 body_len = 0;
+    const byte* p;
+    const byte* end;
+    word16 count;
+    word16 i;
+    int rc;
+
+    rc = wmqb_read_header(rec->blob, rec->blob_len, BROKER_PERSIST_NS_SUBS,
+            &body_len);
+    if (rc != 0) {
+        return rc;
+    }
+    p = &rec->blob[WMQB_HDR_LEN];
+    end = p + body_len;
+    if ((word32)(end - p) < 2) {
+        return MQTT_CODE_ERROR_MALFORMED_DATA;
+    }
+    count = wmqb_r_u16(p); p += 2;
+
+    for (i = 0; i < count; i++) {
+        byte op;
+        byte qos;
+        word16 flen;
+        BrokerSub** pp;
+        BrokerSub* sub;
+
+        if ((word32)(end - p) < 4) {
+            return MQTT_CODE_ERROR_MALFORMED_DATA;
+        }
+        if (rec->seq == 0) {
+            op = BROKER_SUB_DELTA_ADD;
+            qos = *p++;
+            p++; /* options reserved */
+        }
+        else {
+            op = *p++;
+            qos = *p++;
+        }
+        flen = wmqb_r_u16(p); p += 2;
+        if ((word32)(end - p) < flen) {
+            return MQTT_CODE_ERROR_MALFORMED_DATA;
+        }
+        pp = *tail;
+        if (rec->seq != 0) {
+            for (pp = head; *pp != NULL; pp = &(*pp)->next) {
+                if ((word16)XSTRLEN((*pp)->filter) == flen &&
+                        XMEMCMP((*pp)->filter, p, flen) == 0) {
+                    break;
+                }
+            }
+        }
+        if (op == BROKER_SUB_DELTA_REMOVE) {
+            if (*pp != NULL) {
+                sub = *pp;
+                *pp = sub->next;
+                if (*tail == &sub->next) {
+                    *tail = pp;
+                }
+                sub->next = NULL;
+                wmqb_subs_free_list(sub);
+            }
+        }
+        else if (op == BROKER_SUB_DELTA_ADD) {
+            if (*pp != NULL) {
+                (*pp)->qos = (MqttQoS)qos;
+            }
+            else {
+                sub = wmqb_subs_alloc(broker, log->client_id, cid_len, p,
+                    flen, qos);
+                if (sub == NULL) {
+                    return MQTT_CODE_ERROR_MEMORY;
+                }
+                *pp = sub;
+                *tail = &sub->next;
+            }
+        }
+        else {
+            return MQTT_CODE_ERROR_MALFORMED_DATA;
+        }
+        p += flen;
+    }
+    return 0;
+}
+
+/* Replay one client's log into orphan subs: the newest generation's
+ * snapshot, then its deltas in order. Records of older generations, of a
+ * client with no restored session, or past a missing delta are deleted.
+ * When a record cannot be applied the client's subs are skipped and its
+ * records kept until the next change replaces them with a snapshot. A
+ * whole-list record from before the log is moved to a log snapshot. */
+static void wmqb_subs_restore_log(MqttBroker* broker, BrokerSubsLog* log,
+    struct wmqb_restore_ctx* ctx)
+{
+    struct BrokerSubsRec* recs = log->restore_recs;
+    struct BrokerSubsRec* r;
+    BrokerSub* head = NULL;
+    BrokerSub** tail = &head;
+    BrokerSub* sub;
+    BrokerOrphanSession* o;
+    word16 cid_len = (word16)XSTRLEN(log->client_id);
+    word16 next_seq = 0;
+    int applied = 0;
+    int live;
+    int count;
+    int rc = 0;
+
+    log->restore_recs = NULL;
+    o = wmqb_restore_find_orphan(broker, (const byte*)log->client_id,
+        cid_len);
+    live = (o != NULL);
+    for (r = recs; r != NULL; r = r->next) {
+        if (live && r->gen == log->gen) {
+            if (rc == 0 && r->seq == next_seq) {
+                rc = wmqb_subs_apply(broker, log, r, &head, &tail);
+                if (rc == 0) {
+                    next_seq++;
+                    applied++;
+                }
+                continue;
+            }
+            if (rc != 0) {
+                continue;
+            }
+        }
+        (void)wmqb_subs_del_rec(broker, log->client_id, cid_len, r->gen,
+            r->seq);
+    }
+    wmqb_subs_recs_free(recs);
+
+    if (rc != 0) {
+        wmqb_subs_free_list(head);
+        log->deltas = BROKER_PERSIST_SUBS_DELTA_MAX;
+        ctx->skipped++;
+        return;
+    }
+    if (!live || applied == 0) {
+        wmqb_subs_log_free(broker, log);
+        if (!live) {
+            ctx->skipped++;
+        }
+        return;
+    }
+    log->deltas = (word16)(applied - 1);
+    /* The orphan carries the session chain until the client reconnects */
+    for (sub = head; sub != NULL; sub = sub->next) {
+        BrokerSub_SessLink(&o->subs, sub);
+    }
+    if (log->gen == 0) {
+        (void)wmqb_subs_rebase(broker, log, o->subs, &count);
+    }
+    /* Splice into broker->subs and index them */
+    if (head != NULL) {
+        for (sub = head; sub != NULL; sub = sub->next) {
+            BrokerSubTree_Insert(broker, sub);
+        }
+        *tail = broker->subs;
+        broker->subs = head;
+    }
+    ctx->loaded++;
+}
+
+/* Read every NS_SUBS record, then replay each client's log. */
+static int wmqb_restore_subs(MqttBroker* broker,
+    struct wmqb_restore_ctx* ctx)
+{
+    struct wmqb_subs_restore_ctx sc;
+    BrokerSubsLog* log;
+    BrokerSubsLog* next;
+    int rc;
+
+    XMEMSET(&sc, 0, sizeof(sc));
+    sc.broker = broker;
+    rc = wmqb_kv_iter(broker, BROKER_PERSIST_NS_SUBS,
+        wmqb_iter_subs_log_cb, &sc);
+    if (rc == 0) {
+        rc = sc.rc;
+    }
+    if (sc.max_gen > broker->persist_subs_gen) {
+        broker->persist_subs_gen = sc.max_gen;
+    }
+    for (log = sc.logs; log != NULL; log = next) {
+        next = log->restore_next;
+        log->restore_next = NULL;
+        if (rc == 0) {
+            wmqb_subs_restore_log(broker, log, ctx);
+        }
+        else {
+            wmqb_subs_recs_free(log->restore_recs);
+            log->restore_recs = NULL;
+        }
+    }
+    return rc;
+}
+#endif /* WOLFMQTT_STATIC_MEMORY */
 
 /* Decode NS_SESSION record and create a matching orphan slot. */
 static int wmqb_decode_and_insert_session(MqttBroker* broker,
@@ -2133,17 +3019,57 @@ static void wmqb_restore_drop_ended(MqttBroker* broker,
 #endif /* !WOLFMQTT_STATIC_MEMORY */
 
 #ifndef WOLFMQTT_STATIC_MEMORY
-/* Decode NS_OUTQ record and append to the matching orphan's queue.
- * Insertion is sorted by enq_time so replay preserves publish order. */
-static int wmqb_decode_and_insert_outq(MqttBroker* broker,
+/* Position in o's queue for e, sorted by (enq_time, packet_id) so replay
+ * preserves publish order. Two messages enqueued within the same second
+ * (broker time granularity is 1s) tie-break on packet_id, which each
+ * session hands out in ascending order (BrokerPacketIds). Across a wrap
+ * packet_id restarts but ordering is still preserved within each window
+ * since the saved enq_time advances between windows. Records mostly
+ * arrive in order, so search back from the tail. */
+static word32 wmqb_outq_insert_pos(const BrokerOrphanSession* o,
+    const BrokerOutPub* e)
+{
+    word32 n = o->out_q.tail - o->out_q.head;
+
+    while (n > 0) {
+        const BrokerOutPub* iter = BROKER_OUTQ_AT(&o->out_q,
+            o->out_q.head + n - 1);
+        if (iter->enq_time < e->enq_time ||
+                (iter->enq_time == e->enq_time &&
+                 iter->packet_id < e->packet_id)) {
+            break;
+        }
+        n--;
+    }
+    return n;
+}
+
+static void wmqb_outq_restored(BrokerOrphanSession* o, const BrokerOutPub* e)
+{
+    o->out_q_count++;
+    if (e->state == BROKER_OUTQ_PUBLISH_SENT ||
+            e->state == BROKER_OUTQ_PUBREL_SENT) {
+        o->out_q_inflight++;
+    }
+}
+
+/* Decode NS_OUTQ record and insert it into the matching orphan's queue.
+ * A record whose packet identifier slot is already taken (written by a
+ * build with another BROKER_PACKET_ID_SLOTS, or before identifiers were
+ * per session) is set aside on c->moved for wmqb_restore_outq_moved. */
+static int wmqb_decode_and_insert_outq(struct wmqb_restore_ctx* c,
     const byte* key, word16 key_len, const byte* blob, word32 blob_len)
 {
+    MqttBroker* broker = c->broker;
+    struct wmqb_outq_moved* mv;
     word32 body_len = 0;
     int rc;
     const byte* p;
     const byte* end;
     BrokerOrphanSession* o;
-    BrokerOutPub* e;
+    BrokerOutPub e;
+    BrokerMsg* msg;
+    const byte* topic;
     word16 cid_len;
     word16 topic_len;
     word32 payload_len;
@@ -2154,8 +3080,6 @@ static int wmqb_decode_and_insert_outq(MqttBroker* broker,
     word16 packet_id;
     word64 enq_time;
     word32 expiry_sec;
-    BrokerOutPub** prev_link;
-    BrokerOutPub*  iter;
 
     if (key == NULL || key_len < 3) {
         return MQTT_CODE_ERROR_BAD_ARG;
@@ -2195,89 +3119,111 @@ static int wmqb_decode_and_insert_outq(MqttBroker* broker,
         return MQTT_CODE_ERROR_NOT_FOUND;
     }
 
-    e = (BrokerOutPub*)WOLFMQTT_MALLOC(sizeof(*e));
-    if (e == NULL) {
-        return MQTT_CODE_ERROR_MEMORY;
-    }
-    XMEMSET(e, 0, sizeof(*e));
-    e->topic = (char*)WOLFMQTT_MALLOC((size_t)topic_len + 1);
-    if (e->topic == NULL) {
-        WOLFMQTT_FREE(e);
-        return MQTT_CODE_ERROR_MEMORY;
-    }
-    XMEMCPY(e->topic, p, topic_len);
-    e->topic[topic_len] = '\0';
+    topic = p;
     p += topic_len;
-
     payload_len = wmqb_r_u32(p); p += 4;
     if ((word32)(end - p) < payload_len) {
-        WOLFMQTT_FREE(e->topic);
-        WOLFMQTT_FREE(e);
         return MQTT_CODE_ERROR_MALFORMED_DATA;
     }
-    if (payload_len > 0) {
-        e->payload = (byte*)WOLFMQTT_MALLOC(payload_len);
-        if (e->payload == NULL) {
-            WOLFMQTT_FREE(e->topic);
-            WOLFMQTT_FREE(e);
+    msg = BrokerMsg_New(broker, (const char*)topic, topic_len, p,
+        payload_len);
+    if (msg == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    XMEMSET(&e, 0, sizeof(e));
+    e.msg = msg;
+    e.qos = (MqttQoS)qos;
+    e.packet_id = packet_id;
+    e.retain = retain;
+    e.state = state;
+    e.enq_time = (WOLFMQTT_BROKER_TIME_T)enq_time;
+    e.expiry_sec = expiry_sec;
+    e.protocol_level = protocol_level;
+
+    /* Index the restored id in the session's packet identifier table, so a
+     * fresh identifier cannot reissue one that is still queued, which would
+     * corrupt ack correlation and overwrite NS_OUTQ records (the key is
+     * derived from packet_id). */
+    rc = BrokerOutQ_Insert(broker, &o->out_q, &o->packet_ids, &e,
+        wmqb_outq_insert_pos(o, &e), NULL);
+    if (rc == MQTT_CODE_ERROR_PACKET_ID && packet_id != 0) {
+        mv = (struct wmqb_outq_moved*)WOLFMQTT_MALLOC(sizeof(*mv));
+        if (mv == NULL) {
+            BrokerMsg_Release(msg);
             return MQTT_CODE_ERROR_MEMORY;
         }
-        XMEMCPY(e->payload, p, payload_len);
-    }
-    e->payload_len = payload_len;
-    e->qos = (MqttQoS)qos;
-    e->packet_id = packet_id;
-    e->retain = retain;
-    e->state = state;
-    e->enq_time = (WOLFMQTT_BROKER_TIME_T)enq_time;
-    e->expiry_sec = expiry_sec;
-    e->protocol_level = protocol_level;
-
-    /* Advance the broker packet-id counter past this restored id so a fresh
-     * BrokerNextPacketId() cannot reissue an id that is still queued, which
-     * would corrupt ack correlation and overwrite NS_OUTQ records (the key
-     * is derived from packet_id). */
-    if (packet_id >= broker->next_packet_id) {
-        broker->next_packet_id = (word16)(packet_id + 1);
-        if (broker->next_packet_id == 0) {
-            broker->next_packet_id = 1;
-        }
-    }
-
-    /* Insertion-sort by (enq_time, packet_id) so replay preserves
-     * publish order. Two messages enqueued within the same second
-     * (broker time granularity is 1s) tie-break on packet_id, which
-     * the broker hands out monotonically for the lifetime of a
-     * process. Across a restart packet_id resets but ordering is
-     * still preserved within each window since the saved enq_time
-     * advances between windows. */
-    prev_link = &o->out_q_head;
-    iter = o->out_q_head;
-    while (iter != NULL) {
-        if (iter->enq_time < e->enq_time) {
-            prev_link = &iter->next;
-            iter = iter->next;
+        mv->o = o;
+        mv->e = e; /* takes over the reference to msg */
+        mv->next = c->moved;
+        c->moved = mv;
+        return 0;
+    }
+    BrokerMsg_Release(msg);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
+    }
+    wmqb_outq_restored(o, &e);
+    return 0;
+}
+
+static void wmqb_free_outq_moved(struct wmqb_outq_moved* mv)
+{
+    struct wmqb_outq_moved* next;
+
+    for (; mv != NULL; mv = next) {
+        next = mv->next;
+        BrokerMsg_Release(mv->e.msg);
+        WOLFMQTT_FREE(mv);
+    }
+}
+
+/* Give each set-aside OUTQ entry a fresh packet identifier and rewrite its
+ * record under the new key. Every stale key is deleted before any new one
+ * is written, so a new key can never land on a record still to be moved.
+ * An in-flight entry keeps its state and is resent under the new
+ * identifier when its client returns. An entry that finds every
+ * identifier busy is dropped, its record with it. */
+static void wmqb_restore_outq_moved(MqttBroker* broker,
+    struct wmqb_outq_moved* moved)
+{
+    struct wmqb_outq_moved* mv;
+    BrokerOutPub* d;
+    word16 old_id;
+    word32 n;
+    int rc;
+
+    for (mv = moved; mv != NULL; mv = mv->next) {
+        (void)BrokerPersist_DelOutPub(broker, mv->o->client_id,
+            mv->e.packet_id);
+    }
+    for (mv = moved; mv != NULL; mv = mv->next) {
+        /* Placed by its old identifier, like the entries around it */
+        n = wmqb_outq_insert_pos(mv->o, &mv->e);
+        old_id = mv->e.packet_id;
+        (void)old_id; /* may be unused if logging disabled */
+        mv->e.packet_id = 0;
+        rc = BrokerOutQ_Insert(broker, &mv->o->out_q, &mv->o->packet_ids,
+            &mv->e, n, &d);
+        if (rc != MQTT_CODE_SUCCESS) {
+            WMQB_LOG_ERR(broker,
+                "broker: persist dropped queued msg client_id=%s "
+                "packet_id=%u rc=%d", mv->o->client_id, (unsigned)old_id,
+                rc);
             continue;
         }
-        if (iter->enq_time == e->enq_time &&
-                iter->packet_id < e->packet_id) {
-            prev_link = &iter->next;
-            iter = iter->next;
-            continue;
+        wmqb_outq_restored(mv->o, d);
+        WMQB_LOG_INFO(broker,
+            "broker: persist moved queued msg client_id=%s "
+            "packet_id=%u->%u", mv->o->client_id, (unsigned)old_id,
+            (unsigned)d->packet_id);
+        rc = BrokerPersist_PutOutPub(broker, mv->o->client_id, d);
+        if (rc != 0) {
+            WMQB_LOG_ERR(broker,
+                "broker: persist rewrite queued msg failed client_id=%s "
+                "rc=%d", mv->o->client_id, rc);
         }
-        break;
-    }
-    e->next = iter;
-    *prev_link = e;
-    if (iter == NULL) {
-        o->out_q_tail = e;
     }
-    o->out_q_count++;
-    if (state == BROKER_OUTQ_PUBLISH_SENT ||
-            state == BROKER_OUTQ_PUBREL_SENT) {
-        o->out_q_inflight++;
-    }
-    return 0;
+    wmqb_free_outq_moved(moved);
 }
 
 static int wmqb_iter_outq_cb(const byte* key, word16 key_len,
@@ -2285,8 +3231,7 @@ static int wmqb_iter_outq_cb(const byte* key, word16 key_len,
 {
     struct wmqb_restore_ctx* c = (struct wmqb_restore_ctx*)cb_ctx;
     int rc;
-    rc = wmqb_decode_and_insert_outq(c->broker, key, key_len, blob,
-            blob_len);
+    rc = wmqb_decode_and_insert_outq(c, key, key_len, blob, blob_len);
     if (rc == 0) {
         c->loaded++;
     }
@@ -2558,8 +3503,12 @@ int BrokerPersist_Restore(MqttBroker* broker)
     }
 #endif
     if (h->kv_iter != NULL) {
+#ifdef WOLFMQTT_STATIC_MEMORY
         rc = wmqb_kv_iter(broker, BROKER_PERSIST_NS_SUBS,
             wmqb_iter_subs_cb, &ctx);
+#else
+        rc = wmqb_restore_subs(broker, &ctx);
+#endif
         if (rc != 0) {
             WMQB_LOG_ERR(broker,
                 "broker: persist restore subs failed rc=%d", rc);
@@ -2579,9 +3528,12 @@ int BrokerPersist_Restore(MqttBroker* broker)
         if (rc != 0) {
             WMQB_LOG_ERR(broker,
                 "broker: persist restore outq failed rc=%d", rc);
+            wmqb_free_outq_moved(ctx.moved);
             BrokerPersist_RestoreRollback(broker);
             return rc;
         }
+        wmqb_restore_outq_moved(broker, ctx.moved);
+        ctx.moved = NULL;
         WMQB_LOG_INFO(broker,
             "broker: persist restore outq loaded=%d skipped=%d",
             ctx.loaded, ctx.skipped);
@@ -0,0 +1,1186 @@
+/* mqtt_broker_persist_wal.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* Append-only log persistence backend.
+ *
+ * Layout under <root>:
+ *
+ *   <root>/<seq as 8 hex digits>.wal
+ *
+ * Every kv_put and kv_del appends one CRC-framed record to the newest
+ * (active) segment; nothing is rewritten in place. sync is the only
+ * fsync on the write path, so the broker's one-sync-per-commit pattern
+ * costs a single sequential fsync instead of the file backend's
+ * tmp-file + rename + directory fsync chain. When the active segment
+ * reaches BROKER_WAL_SEGMENT_SZ a new one is started.
+ *
+ * Segment file:
+ *
+ *   off  size   field
+ *     0    4    magic       = "WMQL"
+ *     4    4    version     = WMQB_WAL_VERSION (big endian)
+ *     8    4    seq         (big endian, matches the file name)
+ *    12    4    crc32 of bytes 0..11
+ *    16   ...   records
+ *
+ * Record:
+ *
+ *     0    4    crc32 of bytes 4..end (big endian)
+ *     4    4    len         = bytes after this field (big endian)
+ *     8    1    type        = PUT or DEL
+ *     9    1    ns
+ *    10    2    key_len     (big endian)
+ *    12   ...   key, then the blob (PUT only)
+ *
+ * Init replays the segments oldest first into an in-memory index of the
+ * newest PUT per (ns, key); kv_get and kv_iter read the blob back from
+ * its segment. Replay stops a segment at the first short or corrupt
+ * record. In the newest segment that is a torn write from a crash, so
+ * the file is truncated there and appends continue from the last
+ * complete record. Segments are fsync'd before a newer one is started,
+ * so an older segment only ends early after media damage.
+ *
+ * Once more than half of the log is superseded data, the oldest segment
+ * is compacted a few records per write: records the index still points
+ * at are copied to the active segment, and the old file is unlinked
+ * only after the copies are fsync'd. A crash mid-compaction leaves both
+ * copies on disk, and replay order makes the newer one win. DEL
+ * records are dropped once they reach the oldest segment, since no
+ * older PUT can remain for them to shadow.
+ *
+ * As with the file backend, a single broker process owns the
+ * directory, which is created with mode 0700. */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include "wolfmqtt/mqtt_client.h"
+#include "wolfmqtt/mqtt_broker.h"
+
+#ifdef WOLFMQTT_BROKER_PERSIST
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+
+#define WMQB_WAL_VERSION    1
+#define WMQB_WAL_SEG_HDR    16
+#define WMQB_WAL_REC_HDR    12
+#define WMQB_WAL_PUT        1
+#define WMQB_WAL_DEL        2
+/* Same limits as the file backend: keys are a client_id or topic, and
+ * blobs over 16 MiB are refused. */
+#define WMQB_WAL_MAX_KEY    256
+#define WMQB_WAL_MAX_BLOB   (16 * 1024 * 1024)
+#define WMQB_WAL_INDEX_MIN  64
+
+/* Diagnostics go to stderr like the file backend's init warning, unless
+ * broker logging is compiled out. */
+#ifdef WOLFMQTT_BROKER_NO_LOG
+    #define WMQB_WAL_WARN(...)  do { } while (0)
+#else
+    #define WMQB_WAL_WARN(...)  fprintf(stderr, __VA_ARGS__)
+#endif
+
+/* Newest PUT of one (ns, key). key == NULL marks an empty slot. */
+typedef struct WmqbWalEntry {
+    byte*  key;
+    word32 hash;
+    word32 seq;      /* segment holding the record */
+    word32 off;      /* record offset in that segment */
+    word32 rec_len;  /* whole record, header included */
+    word16 key_len;
+    byte   ns;
+} WmqbWalEntry;
+
+typedef struct WmqbWalSeg {
+    word32 seq;
+    word32 size;     /* bytes of valid data, header included */
+    int    fd;
+} WmqbWalSeg;
+
+/* Context held by the backend. Lives inside the hooks->ctx pointer. */
+typedef struct WmqbWalCtx {
+    char dir[512];
+    /* Oldest first; the last one is the active segment. */
+    WmqbWalSeg* segs;
+    word32 seg_count;
+    word32 seg_cap;
+    /* Above every segment file seen, including unreadable ones. */
+    word32 next_seq;
+    /* Open-addressed (ns, key) index, linear probing. */
+    WmqbWalEntry* slots;
+    word32 cap;
+    word32 count;
+    /* Bytes in all segments, and the share the index still points at. */
+    word64 total;
+    word64 live;
+    /* Scan position in segs[0] while it is being compacted, else 0. */
+    word32 compact_off;
+    /* Nonzero inside kv_iter; compaction waits so the segments a
+     * snapshot refers to stay put. */
+    int    iter_depth;
+    int    dirty;
+    int    owned;
+    word32 crc_table[256];
+} WmqbWalCtx;
+
+static int wmqb_wal_put(void* ctx, byte ns, const byte* key, word16 key_len,
+    const byte* blob, word32 blob_len);
+static int wmqb_wal_get(void* ctx, byte ns, const byte* key, word16 key_len,
+    byte* out, word32* inout_len);
+static int wmqb_wal_del(void* ctx, byte ns, const byte* key, word16 key_len);
+static int wmqb_wal_iter(void* ctx, byte ns, MqttBrokerPersist_IterCb cb,
+    void* cb_ctx);
+static int wmqb_wal_sync(void* ctx);
+
+/* Secure zeroing via a volatile pointer so the compiler cannot elide the
+ * stores. File-local for the same reason as the file backend's copy. */
+static void wmqb_wal_force_zero(void* mem, word32 len)
+{
+    volatile byte* p = (volatile byte*)mem;
+    word32 i;
+    for (i = 0; i < len; i++) {
+        p[i] = 0;
+    }
+}
+
+static void wmqb_wal_w_u32(byte* p, word32 v)
+{
+    p[0] = (byte)(v >> 24);
+    p[1] = (byte)(v >> 16);
+    p[2] = (byte)(v >> 8);
+    p[3] = (byte)v;
+}
+
+static word32 wmqb_wal_r_u32(const byte* p)
+{
+    return ((word32)p[0] << 24) | ((word32)p[1] << 16) |
+           ((word32)p[2] << 8) | (word32)p[3];
+}
+
+/* CRC-32 (IEEE 802.3, reflected), table built once per context. */
+static void wmqb_wal_crc_init(WmqbWalCtx* c)
+{
+    word32 i, k, v;
+    for (i = 0; i < 256; i++) {
+        v = i;
+        for (k = 0; k < 8; k++) {
+            v = (v & 1) ? (0xEDB88320u ^ (v >> 1)) : (v >> 1);
+        }
+        c->crc_table[i] = v;
+    }
+}
+
+static word32 wmqb_wal_crc(const WmqbWalCtx* c, const byte* p, word32 len)
+{
+    word32 v = 0xFFFFFFFFu;
+    word32 i;
+    for (i = 0; i < len; i++) {
+        v = c->crc_table[(v ^ p[i]) & 0xFF] ^ (v >> 8);
+    }
+    return v ^ 0xFFFFFFFFu;
+}
+
+/* FNV-1a over the namespace byte and the key */
+static word32 wmqb_wal_hash(byte ns, const byte* key, word16 key_len)
+{
+    word32 h = 2166136261u;
+    word16 i;
+    h = (h ^ ns) * 16777619u;
+    for (i = 0; i < key_len; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Write all of buf, with the file backend's bounded EINTR retry. */
+static int wmqb_wal_write_all(int fd, const byte* buf, word32 len)
+{
+    word32 done = 0;
+    int eintr_count = 0;
+    ssize_t w;
+    while (done < len) {
+        w = write(fd, buf + done, len - done);
+        if (w < 0) {
+            if (errno == EINTR && eintr_count++ < 16) {
+                continue;
+            }
+            return MQTT_CODE_ERROR_SYSTEM;
+        }
+        done += (word32)w;
+    }
+    return 0;
+}
+
+/* Read exactly len bytes at off. Returns MQTT_CODE_ERROR_NOT_FOUND when
+ * the file ends first. */
+static int wmqb_wal_read_at(int fd, byte* buf, word32 len, word32 off)
+{
+    word32 done = 0;
+    int eintr_count = 0;
+    ssize_t r;
+    while (done < len) {
+        r = pread(fd, buf + done, len - done, (off_t)off + done);
+        if (r == 0) {
+            return MQTT_CODE_ERROR_NOT_FOUND;
+        }
+        if (r < 0) {
+            if (errno == EINTR && eintr_count++ < 16) {
+                continue;
+            }
+            return MQTT_CODE_ERROR_SYSTEM;
+        }
+        done += (word32)r;
+    }
+    return 0;
+}
+
+/* fsync a directory by open() + fsync() + close(). Best-effort. */
+static void wmqb_wal_fsync_dir(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        (void)fsync(fd);
+        (void)close(fd);
+    }
+}
+
+static int wmqb_wal_seg_path(const WmqbWalCtx* c, word32 seq, char* out,
+    size_t out_cap)
+{
+    int n = snprintf(out, out_cap, "%s/%08x.wal", c->dir, (unsigned)seq);
+    if (n <= 0 || (size_t)n >= out_cap) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    return 0;
+}
+
+static WmqbWalSeg* wmqb_wal_seg_find(const WmqbWalCtx* c, word32 seq)
+{
+    word32 lo = 0;
+    word32 hi = c->seg_count;
+    while (lo < hi) {
+        word32 mid = lo + (hi - lo) / 2;
+        if (c->segs[mid].seq == seq) {
+            return &c->segs[mid];
+        }
+        if (c->segs[mid].seq < seq) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+static WmqbWalSeg* wmqb_wal_active(const WmqbWalCtx* c)
+{
+    return &c->segs[c->seg_count - 1];
+}
+
+/* Append a segment descriptor, growing the array as needed. */
+static int wmqb_wal_seg_push(WmqbWalCtx* c, word32 seq, word32 size,
+    int fd)
+{
+    if (c->seg_count == c->seg_cap) {
+        word32 cap = (c->seg_cap == 0) ? 4 : c->seg_cap * 2;
+        WmqbWalSeg* segs = (WmqbWalSeg*)WOLFMQTT_MALLOC(
+            cap * sizeof(WmqbWalSeg));
+        if (segs == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        if (c->segs != NULL) {
+            XMEMCPY(segs, c->segs, c->seg_count * sizeof(WmqbWalSeg));
+            WOLFMQTT_FREE(c->segs);
+        }
+        c->segs = segs;
+        c->seg_cap = cap;
+    }
+    c->segs[c->seg_count].seq = seq;
+    c->segs[c->seg_count].size = size;
+    c->segs[c->seg_count].fd = fd;
+    c->seg_count++;
+    return 0;
+}
+
+/* Start a new active segment. The previous one is fsync'd first so that
+ * only the newest segment can ever end in a torn record. */
+static int wmqb_wal_seg_new(WmqbWalCtx* c)
+{
+    char path[560];
+    byte hdr[WMQB_WAL_SEG_HDR];
+    word32 seq = c->next_seq;
+    int fd;
+    int rc;
+
+    if (c->seg_count > 0) {
+        if (c->dirty && fsync(wmqb_wal_active(c)->fd) < 0) {
+            return MQTT_CODE_ERROR_SYSTEM;
+        }
+        c->dirty = 0;
+    }
+    rc = wmqb_wal_seg_path(c, seq, path, sizeof(path));
+    if (rc != 0) {
+        return rc;
+    }
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_APPEND, 0600);
+    if (fd < 0) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    hdr[0] = 'W'; hdr[1] = 'M'; hdr[2] = 'Q'; hdr[3] = 'L';
+    wmqb_wal_w_u32(hdr + 4, WMQB_WAL_VERSION);
+    wmqb_wal_w_u32(hdr + 8, seq);
+    wmqb_wal_w_u32(hdr + 12, wmqb_wal_crc(c, hdr, 12));
+    rc = wmqb_wal_write_all(fd, hdr, sizeof(hdr));
+    if (rc == 0 && fsync(fd) < 0) {
+        rc = MQTT_CODE_ERROR_SYSTEM;
+    }
+    if (rc == 0) {
+        rc = wmqb_wal_seg_push(c, seq, WMQB_WAL_SEG_HDR, fd);
+    }
+    if (rc != 0) {
+        (void)close(fd);
+        (void)unlink(path);
+        return rc;
+    }
+    wmqb_wal_fsync_dir(c->dir);
+    c->next_seq = seq + 1;
+    c->total += WMQB_WAL_SEG_HDR;
+    return 0;
+}
+
+/* Slot of (ns, key), or -1 when absent. */
+static int wmqb_wal_find(const WmqbWalCtx* c, byte ns, const byte* key,
+    word16 key_len, word32 h)
+{
+    word32 i;
+    if (c->count == 0) {
+        return -1;
+    }
+    i = h & (c->cap - 1);
+    while (c->slots[i].key != NULL) {
+        const WmqbWalEntry* e = &c->slots[i];
+        if (e->hash == h && e->ns == ns && e->key_len == key_len &&
+                XMEMCMP(e->key, key, key_len) == 0) {
+            return (int)i;
+        }
+        i = (i + 1) & (c->cap - 1);
+    }
+    return -1;
+}
+
+static int wmqb_wal_index_grow(WmqbWalCtx* c)
+{
+    word32 cap = (c->cap == 0) ? WMQB_WAL_INDEX_MIN : c->cap * 2;
+    WmqbWalEntry* slots;
+    word32 i, j;
+
+    slots = (WmqbWalEntry*)WOLFMQTT_MALLOC(cap * sizeof(WmqbWalEntry));
+    if (slots == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    XMEMSET(slots, 0, cap * sizeof(WmqbWalEntry));
+    for (i = 0; i < c->cap; i++) {
+        if (c->slots[i].key != NULL) {
+            j = c->slots[i].hash & (cap - 1);
+            while (slots[j].key != NULL) {
+                j = (j + 1) & (cap - 1);
+            }
+            slots[j] = c->slots[i];
+        }
+    }
+    if (c->slots != NULL) {
+        WOLFMQTT_FREE(c->slots);
+    }
+    c->slots = slots;
+    c->cap = cap;
+    return 0;
+}
+
+/* Point (ns, key) at a record, replacing any older one. */
+static int wmqb_wal_index_set(WmqbWalCtx* c, byte ns, const byte* key,
+    word16 key_len, word32 seq, word32 off, word32 rec_len)
+{
+    word32 h = wmqb_wal_hash(ns, key, key_len);
+    int s = wmqb_wal_find(c, ns, key, key_len, h);
+    WmqbWalEntry* e;
+
+    if (s >= 0) {
+        e = &c->slots[s];
+        c->live -= e->rec_len;
+    }
+    else {
+        word32 i;
+        byte* k;
+        if ((c->count + 1) * 2 > c->cap && wmqb_wal_index_grow(c) != 0) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        k = (byte*)WOLFMQTT_MALLOC(key_len > 0 ? key_len : 1);
+        if (k == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        XMEMCPY(k, key, key_len);
+        i = h & (c->cap - 1);
+        while (c->slots[i].key != NULL) {
+            i = (i + 1) & (c->cap - 1);
+        }
+        e = &c->slots[i];
+        e->key = k;
+        e->hash = h;
+        e->key_len = key_len;
+        e->ns = ns;
+        c->count++;
+    }
+    e->seq = seq;
+    e->off = off;
+    e->rec_len = rec_len;
+    c->live += rec_len;
+    return 0;
+}
+
+/* Drop slot i, closing the gap like BrokerIdIndex_Del so no tombstones
+ * are needed. */
+static void wmqb_wal_index_del(WmqbWalCtx* c, word32 i)
+{
+    word32 j, home;
+
+    c->live -= c->slots[i].rec_len;
+    WOLFMQTT_FREE(c->slots[i].key);
+    j = i;
+    for (;;) {
+        j = (j + 1) & (c->cap - 1);
+        if (c->slots[j].key == NULL) {
+            break;
+        }
+        home = c->slots[j].hash & (c->cap - 1);
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+            c->slots[i] = c->slots[j];
+            i = j;
+        }
+    }
+    XMEMSET(&c->slots[i], 0, sizeof(c->slots[i]));
+    c->count--;
+}
+
+/* Append one record image (CRC already in place) to the active segment,
+ * rolling to a new segment first if it would overflow. On a failed write
+ * the partial record is cut off again so later appends stay readable. */
+static int wmqb_wal_append(WmqbWalCtx* c, const byte* rec, word32 rec_len,
+    word32* out_seq, word32* out_off)
+{
+    WmqbWalSeg* a = wmqb_wal_active(c);
+    int rc;
+
+    if (a->size > WMQB_WAL_SEG_HDR &&
+            (word64)a->size + rec_len > BROKER_WAL_SEGMENT_SZ) {
+        rc = wmqb_wal_seg_new(c);
+        if (rc != 0) {
+            return rc;
+        }
+        a = wmqb_wal_active(c);
+    }
+    if ((word64)a->size + rec_len > 0xFFFFFFFFu) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    rc = wmqb_wal_write_all(a->fd, rec, rec_len);
+    if (rc != 0) {
+        (void)ftruncate(a->fd, (off_t)a->size);
+        return rc;
+    }
+    *out_seq = a->seq;
+    *out_off = a->size;
+    a->size += rec_len;
+    c->total += rec_len;
+    c->dirty = 1;
+    return 0;
+}
+
+/* Build a record image in a heap buffer. */
+static byte* wmqb_wal_frame(const WmqbWalCtx* c, byte type, byte ns,
+    const byte* key, word16 key_len, const byte* blob, word32 blob_len,
+    word32* out_len)
+{
+    word32 len = WMQB_WAL_REC_HDR + key_len + blob_len;
+    byte* rec = (byte*)WOLFMQTT_MALLOC(len);
+    if (rec == NULL) {
+        return NULL;
+    }
+    wmqb_wal_w_u32(rec + 4, len - 8);
+    rec[8] = type;
+    rec[9] = ns;
+    rec[10] = (byte)(key_len >> 8);
+    rec[11] = (byte)key_len;
+    XMEMCPY(rec + WMQB_WAL_REC_HDR, key, key_len);
+    if (blob_len > 0) {
+        XMEMCPY(rec + WMQB_WAL_REC_HDR + key_len, blob, blob_len);
+    }
+    wmqb_wal_w_u32(rec, wmqb_wal_crc(c, rec + 4, len - 4));
+    *out_len = len;
+    return rec;
+}
+
+/* Parse and check a record header. Returns the whole record length, or 0
+ * when the bytes cannot start a valid record. */
+static word32 wmqb_wal_rec_len(const byte* hdr)
+{
+    word32 len = wmqb_wal_r_u32(hdr + 4);
+    word16 key_len = (word16)(((word16)hdr[10] << 8) | hdr[11]);
+
+    if (len < WMQB_WAL_REC_HDR - 8 + (word32)key_len ||
+            key_len > WMQB_WAL_MAX_KEY ||
+            len - (WMQB_WAL_REC_HDR - 8) - key_len > WMQB_WAL_MAX_BLOB) {
+        return 0;
+    }
+    if (hdr[8] == WMQB_WAL_DEL) {
+        if (len != WMQB_WAL_REC_HDR - 8 + (word32)key_len) {
+            return 0;
+        }
+    }
+    else if (hdr[8] != WMQB_WAL_PUT) {
+        return 0;
+    }
+    return len + 8;
+}
+
+/* Move live records out of the oldest segment, at most
+ * BROKER_WAL_COMPACT_STEP records per call. Starts a pass once the log
+ * is over BROKER_WAL_COMPACT_MIN bytes and more than half dead. Errors
+ * abandon the pass; it restarts from the top on a later write. */
+static void wmqb_wal_compact_step(WmqbWalCtx* c)
+{
+    byte hdr[WMQB_WAL_REC_HDR + WMQB_WAL_MAX_KEY];
+    WmqbWalSeg* s;
+    char path[560];
+    int n;
+
+    if (c->iter_depth > 0) {
+        return;
+    }
+    if (c->compact_off == 0) {
+        if (c->total < BROKER_WAL_COMPACT_MIN ||
+                (c->total - c->live) * 2 <= c->total) {
+            return;
+        }
+        /* Everything may sit in the active segment; seal it so there is
+         * an older segment to drain. */
+        if (c->seg_count < 2 && wmqb_wal_seg_new(c) != 0) {
+            return;
+        }
+        c->compact_off = WMQB_WAL_SEG_HDR;
+    }
+    for (n = 0; n < BROKER_WAL_COMPACT_STEP; n++) {
+        word32 off = c->compact_off;
+        word32 rec_len;
+        word16 key_len;
+        word32 seq, new_off;
+        byte* rec;
+        int slot;
+
+        s = &c->segs[0];
+        if (off >= s->size) {
+            break;
+        }
+        if (wmqb_wal_read_at(s->fd, hdr, WMQB_WAL_REC_HDR, off) != 0) {
+            c->compact_off = 0;
+            return;
+        }
+        rec_len = wmqb_wal_rec_len(hdr);
+        key_len = (word16)(((word16)hdr[10] << 8) | hdr[11]);
+        if (rec_len == 0 || (word64)off + rec_len > s->size ||
+                wmqb_wal_read_at(s->fd, hdr + WMQB_WAL_REC_HDR, key_len,
+                    off + WMQB_WAL_REC_HDR) != 0) {
+            c->compact_off = 0;
+            return;
+        }
+        c->compact_off = off + rec_len;
+        if (hdr[8] != WMQB_WAL_PUT) {
+            continue;
+        }
+        slot = wmqb_wal_find(c, hdr[9], hdr + WMQB_WAL_REC_HDR, key_len,
+            wmqb_wal_hash(hdr[9], hdr + WMQB_WAL_REC_HDR, key_len));
+        if (slot < 0 || c->slots[slot].seq != s->seq ||
+                c->slots[slot].off != off) {
+            continue;
+        }
+        /* The CRC does not cover the record's position, so the image is
+         * copied verbatim. */
+        rec = (byte*)WOLFMQTT_MALLOC(rec_len);
+        if (rec == NULL) {
+            c->compact_off = 0;
+            return;
+        }
+        if (wmqb_wal_read_at(s->fd, rec, rec_len, off) != 0 ||
+                wmqb_wal_append(c, rec, rec_len, &seq, &new_off) != 0) {
+            wmqb_wal_force_zero(rec, rec_len);
+            WOLFMQTT_FREE(rec);
+            c->compact_off = 0;
+            return;
+        }
+        wmqb_wal_force_zero(rec, rec_len);
+        WOLFMQTT_FREE(rec);
+        c->slots[slot].seq = seq;
+        c->slots[slot].off = new_off;
+    }
+    s = &c->segs[0];
+    if (c->compact_off < s->size) {
+        return;
+    }
+    /* Drained: make the copies durable before the originals go away. */
+    if (c->dirty) {
+        if (fsync(wmqb_wal_active(c)->fd) < 0) {
+            c->compact_off = 0;
+            return;
+        }
+        c->dirty = 0;
+    }
+    c->compact_off = 0;
+    if (wmqb_wal_seg_path(c, s->seq, path, sizeof(path)) != 0 ||
+            unlink(path) < 0) {
+        return;
+    }
+    wmqb_wal_fsync_dir(c->dir);
+    (void)close(s->fd);
+    c->total -= s->size;
+    c->seg_count--;
+    XMEMMOVE(&c->segs[0], &c->segs[1], c->seg_count * sizeof(WmqbWalSeg));
+}
+
+static int wmqb_wal_put(void* ctx, byte ns, const byte* key,
+    word16 key_len, const byte* blob, word32 blob_len)
+{
+    WmqbWalCtx* c = (WmqbWalCtx*)ctx;
+    byte* rec;
+    word32 rec_len, seq, off;
+    int rc;
+
+    if (c == NULL || key == NULL || blob == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (key_len > WMQB_WAL_MAX_KEY || blob_len > WMQB_WAL_MAX_BLOB) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    rec = wmqb_wal_frame(c, WMQB_WAL_PUT, ns, key, key_len, blob, blob_len,
+        &rec_len);
+    if (rec == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    rc = wmqb_wal_append(c, rec, rec_len, &seq, &off);
+    wmqb_wal_force_zero(rec, rec_len);
+    WOLFMQTT_FREE(rec);
+    if (rc == 0) {
+        rc = wmqb_wal_index_set(c, ns, key, key_len, seq, off, rec_len);
+    }
+    if (rc == 0) {
+        wmqb_wal_compact_step(c);
+    }
+    return rc;
+}
+
+static int wmqb_wal_get(void* ctx, byte ns, const byte* key,
+    word16 key_len, byte* out, word32* inout_len)
+{
+    WmqbWalCtx* c = (WmqbWalCtx*)ctx;
+    const WmqbWalEntry* e;
+    WmqbWalSeg* s;
+    word32 blob_len;
+    int slot;
+    int rc;
+
+    if (c == NULL || key == NULL || inout_len == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    slot = wmqb_wal_find(c, ns, key, key_len,
+        wmqb_wal_hash(ns, key, key_len));
+    if (slot < 0) {
+        *inout_len = 0;
+        return MQTT_CODE_ERROR_NOT_FOUND;
+    }
+    e = &c->slots[slot];
+    s = wmqb_wal_seg_find(c, e->seq);
+    if (s == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    /* Like the file backend, a short buffer gets a truncated blob. */
+    blob_len = e->rec_len - WMQB_WAL_REC_HDR - e->key_len;
+    if (blob_len > *inout_len) {
+        blob_len = *inout_len;
+    }
+    rc = wmqb_wal_read_at(s->fd, out, blob_len,
+        e->off + WMQB_WAL_REC_HDR + e->key_len);
+    if (rc != 0) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    *inout_len = blob_len;
+    return 0;
+}
+
+static int wmqb_wal_del(void* ctx, byte ns, const byte* key,
+    word16 key_len)
+{
+    WmqbWalCtx* c = (WmqbWalCtx*)ctx;
+    byte* rec;
+    word32 rec_len, seq, off;
+    int slot;
+    int rc;
+
+    if (c == NULL || key == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    slot = wmqb_wal_find(c, ns, key, key_len,
+        wmqb_wal_hash(ns, key, key_len));
+    if (slot < 0) {
+        return 0;
+    }
+    rec = wmqb_wal_frame(c, WMQB_WAL_DEL, ns, key, key_len, NULL, 0,
+        &rec_len);
+    if (rec == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    rc = wmqb_wal_append(c, rec, rec_len, &seq, &off);
+    WOLFMQTT_FREE(rec);
+    if (rc != 0) {
+        return rc;
+    }
+    /* A roll inside append does not move index slots. */
+    wmqb_wal_index_del(c, (word32)slot);
+    wmqb_wal_compact_step(c);
+    return 0;
+}
+
+/* Location of one record to visit, taken before any callback runs so
+ * callbacks may put or delete. */
+typedef struct WmqbWalIterPos {
+    word32 seq;
+    word32 off;
+    word32 rec_len;
+} WmqbWalIterPos;
+
+static int wmqb_wal_iter(void* ctx, byte ns, MqttBrokerPersist_IterCb cb,
+    void* cb_ctx)
+{
+    WmqbWalCtx* c = (WmqbWalCtx*)ctx;
+    WmqbWalIterPos* pos;
+    word32 n = 0;
+    word32 i;
+    int rc = 0;
+
+    if (c == NULL || cb == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (c->count == 0) {
+        return 0;
+    }
+    pos = (WmqbWalIterPos*)WOLFMQTT_MALLOC(
+        c->count * sizeof(WmqbWalIterPos));
+    if (pos == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    for (i = 0; i < c->cap; i++) {
+        if (c->slots[i].key != NULL && c->slots[i].ns == ns) {
+            pos[n].seq = c->slots[i].seq;
+            pos[n].off = c->slots[i].off;
+            pos[n].rec_len = c->slots[i].rec_len;
+            n++;
+        }
+    }
+    c->iter_depth++;
+    for (i = 0; i < n; i++) {
+        WmqbWalSeg* s = wmqb_wal_seg_find(c, pos[i].seq);
+        word32 len = pos[i].rec_len;
+        word16 key_len;
+        byte* rec;
+        int slot;
+        int stop;
+
+        if (s == NULL) {
+            continue;
+        }
+        rec = (byte*)WOLFMQTT_MALLOC(len);
+        if (rec == NULL) {
+            rc = MQTT_CODE_ERROR_MEMORY;
+            break;
+        }
+        /* Re-check the CRC: the data may have rotted since replay. */
+        if (wmqb_wal_read_at(s->fd, rec, len, pos[i].off) != 0 ||
+                wmqb_wal_r_u32(rec) != wmqb_wal_crc(c, rec + 4, len - 4)) {
+            wmqb_wal_force_zero(rec, len);
+            WOLFMQTT_FREE(rec);
+            continue;
+        }
+        key_len = (word16)(((word16)rec[10] << 8) | rec[11]);
+        /* Skip records an earlier callback deleted or replaced. */
+        slot = wmqb_wal_find(c, ns, rec + WMQB_WAL_REC_HDR, key_len,
+            wmqb_wal_hash(ns, rec + WMQB_WAL_REC_HDR, key_len));
+        if (slot < 0 || c->slots[slot].seq != pos[i].seq ||
+                c->slots[slot].off != pos[i].off) {
+            wmqb_wal_force_zero(rec, len);
+            WOLFMQTT_FREE(rec);
+            continue;
+        }
+        stop = cb(rec + WMQB_WAL_REC_HDR, key_len,
+            rec + WMQB_WAL_REC_HDR + key_len,
+            len - WMQB_WAL_REC_HDR - key_len, cb_ctx);
+        wmqb_wal_force_zero(rec, len);
+        WOLFMQTT_FREE(rec);
+        if (stop != 0) {
+            break;
+        }
+    }
+    c->iter_depth--;
+    WOLFMQTT_FREE(pos);
+    return rc;
+}
+
+static int wmqb_wal_sync(void* ctx)
+{
+    WmqbWalCtx* c = (WmqbWalCtx*)ctx;
+    if (c == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (c->dirty) {
+        if (fsync(wmqb_wal_active(c)->fd) < 0) {
+            return MQTT_CODE_ERROR_SYSTEM;
+        }
+        c->dirty = 0;
+    }
+    return 0;
+}
+
+/* Replay one segment into the index. Returns the length of its valid
+ * prefix, or 0 when the segment header itself is bad. */
+static word32 wmqb_wal_replay_seg(WmqbWalCtx* c, int fd, word32 seq,
+    word32 file_len)
+{
+    byte hdr[WMQB_WAL_SEG_HDR];
+    byte* buf = NULL;
+    word32 buf_cap = 0;
+    word32 off = WMQB_WAL_SEG_HDR;
+
+    if (wmqb_wal_read_at(fd, hdr, sizeof(hdr), 0) != 0 ||
+            hdr[0] != 'W' || hdr[1] != 'M' || hdr[2] != 'Q' ||
+            hdr[3] != 'L' ||
+            wmqb_wal_r_u32(hdr + 4) != WMQB_WAL_VERSION ||
+            wmqb_wal_r_u32(hdr + 8) != seq ||
+            wmqb_wal_r_u32(hdr + 12) != wmqb_wal_crc(c, hdr, 12)) {
+        return 0;
+    }
+    while (off + WMQB_WAL_REC_HDR <= file_len) {
+        byte rh[WMQB_WAL_REC_HDR];
+        word32 rec_len;
+        word16 key_len;
+        int slot;
+
+        if (wmqb_wal_read_at(fd, rh, sizeof(rh), off) != 0) {
+            break;
+        }
+        rec_len = wmqb_wal_rec_len(rh);
+        if (rec_len == 0 || (word64)off + rec_len > file_len) {
+            break;
+        }
+        if (rec_len > buf_cap) {
+            if (buf != NULL) {
+                wmqb_wal_force_zero(buf, buf_cap);
+                WOLFMQTT_FREE(buf);
+            }
+            buf = (byte*)WOLFMQTT_MALLOC(rec_len);
+            if (buf == NULL) {
+                buf_cap = 0;
+                break;
+            }
+            buf_cap = rec_len;
+        }
+        if (wmqb_wal_read_at(fd, buf, rec_len, off) != 0 ||
+                wmqb_wal_r_u32(buf) != wmqb_wal_crc(c, buf + 4,
+                    rec_len - 4)) {
+            break;
+        }
+        key_len = (word16)(((word16)buf[10] << 8) | buf[11]);
+        if (buf[8] == WMQB_WAL_PUT) {
+            if (wmqb_wal_index_set(c, buf[9], buf + WMQB_WAL_REC_HDR,
+                    key_len, seq, off, rec_len) != 0) {
+                break;
+            }
+        }
+        else {
+            slot = wmqb_wal_find(c, buf[9], buf + WMQB_WAL_REC_HDR, key_len,
+                wmqb_wal_hash(buf[9], buf + WMQB_WAL_REC_HDR, key_len));
+            if (slot >= 0) {
+                wmqb_wal_index_del(c, (word32)slot);
+            }
+        }
+        off += rec_len;
+    }
+    if (buf != NULL) {
+        wmqb_wal_force_zero(buf, buf_cap);
+        WOLFMQTT_FREE(buf);
+    }
+    return off;
+}
+
+static int wmqb_wal_seq_cmp(const void* a, const void* b)
+{
+    word32 x = *(const word32*)a;
+    word32 y = *(const word32*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Collect the segment sequence numbers found in the directory, sorted. */
+static int wmqb_wal_list(const WmqbWalCtx* c, word32** out, word32* out_n)
+{
+    DIR* d;
+    struct dirent* ent;
+    word32* seqs = NULL;
+    word32 n = 0;
+    word32 cap = 0;
+
+    d = opendir(c->dir);
+    if (d == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        const char* p = ent->d_name;
+        word32 seq = 0;
+        int i;
+
+        if (XSTRLEN(p) != 12 || XSTRCMP(p + 8, ".wal") != 0) {
+            continue;
+        }
+        for (i = 0; i < 8; i++) {
+            char ch = p[i];
+            word32 v;
+            if (ch >= '0' && ch <= '9') v = (word32)(ch - '0');
+            else if (ch >= 'a' && ch <= 'f') v = (word32)(10 + ch - 'a');
+            else break;
+            seq = (seq << 4) | v;
+        }
+        if (i != 8 || seq == 0) {
+            continue;
+        }
+        if (n == cap) {
+            word32 ncap = (cap == 0) ? 8 : cap * 2;
+            word32* ns = (word32*)WOLFMQTT_MALLOC(ncap * sizeof(word32));
+            if (ns == NULL) {
+                if (seqs != NULL) {
+                    WOLFMQTT_FREE(seqs);
+                }
+                (void)closedir(d);
+                return MQTT_CODE_ERROR_MEMORY;
+            }
+            if (seqs != NULL) {
+                XMEMCPY(ns, seqs, n * sizeof(word32));
+                WOLFMQTT_FREE(seqs);
+            }
+            seqs = ns;
+            cap = ncap;
+        }
+        seqs[n++] = seq;
+    }
+    (void)closedir(d);
+    if (n > 1) {
+        qsort(seqs, n, sizeof(word32), wmqb_wal_seq_cmp);
+    }
+    *out = seqs;
+    *out_n = n;
+    return 0;
+}
+
+/* Rebuild the index from every segment on disk and reopen the newest as
+ * the active segment (or start one when there is none). */
+static int wmqb_wal_open(WmqbWalCtx* c)
+{
+    word32* seqs = NULL;
+    word32 n = 0;
+    word32 i;
+    word32 last_len = 0;
+    int rc;
+
+    rc = wmqb_wal_list(c, &seqs, &n);
+    if (rc != 0) {
+        return rc;
+    }
+    c->next_seq = (n > 0) ? seqs[n - 1] + 1 : 1;
+    for (i = 0; i < n && rc == 0; i++) {
+        char path[560];
+        struct stat st;
+        word32 valid;
+        int fd;
+
+        rc = wmqb_wal_seg_path(c, seqs[i], path, sizeof(path));
+        if (rc != 0) {
+            break;
+        }
+        fd = open(path, O_RDWR | O_APPEND);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) {
+                (void)close(fd);
+            }
+            rc = MQTT_CODE_ERROR_SYSTEM;
+            break;
+        }
+        if ((word64)st.st_size > 0xFFFFFFFFu) {
+            (void)close(fd);
+            rc = MQTT_CODE_ERROR_SYSTEM;
+            break;
+        }
+        valid = wmqb_wal_replay_seg(c, fd, seqs[i], (word32)st.st_size);
+        if (valid == 0) {
+            (void)close(fd);
+            /* A short newest file is a segment whose creation was cut
+             * off; no record can have been written to it yet. Anything
+             * else this build cannot read is left alone. */
+            if (i + 1 == n && st.st_size < WMQB_WAL_SEG_HDR) {
+                (void)unlink(path);
+                continue;
+            }
+            WMQB_WAL_WARN("wolfmqtt: persist log skipped bad segment "
+                "\"%s\"\n", path);
+            continue;
+        }
+        if (valid != (word32)st.st_size) {
+            WMQB_WAL_WARN("wolfmqtt: persist log \"%s\" ends in a torn "
+                "or corrupt record at %u of %u bytes\n", path,
+                (unsigned)valid, (unsigned)st.st_size);
+        }
+        rc = wmqb_wal_seg_push(c, seqs[i], valid, fd);
+        if (rc != 0) {
+            (void)close(fd);
+            break;
+        }
+        c->total += valid;
+        last_len = (word32)st.st_size;
+    }
+    if (seqs != NULL) {
+        WOLFMQTT_FREE(seqs);
+    }
+    /* Appends go to the newest readable segment, so cut its bad tail off
+     * first; older segments just keep theirs as dead bytes. */
+    if (rc == 0 && c->seg_count > 0 &&
+            wmqb_wal_active(c)->size != last_len &&
+            (ftruncate(wmqb_wal_active(c)->fd,
+                (off_t)wmqb_wal_active(c)->size) < 0 ||
+             fsync(wmqb_wal_active(c)->fd) < 0)) {
+        rc = MQTT_CODE_ERROR_SYSTEM;
+    }
+    if (rc == 0 && (c->seg_count == 0 ||
+            wmqb_wal_active(c)->size >= BROKER_WAL_SEGMENT_SZ)) {
+        rc = wmqb_wal_seg_new(c);
+    }
+    return rc;
+}
+
+static void wmqb_wal_release(WmqbWalCtx* c)
+{
+    word32 i;
+    for (i = 0; i < c->seg_count; i++) {
+        (void)close(c->segs[i].fd);
+    }
+    if (c->segs != NULL) {
+        WOLFMQTT_FREE(c->segs);
+    }
+    for (i = 0; i < c->cap; i++) {
+        if (c->slots[i].key != NULL) {
+            wmqb_wal_force_zero(c->slots[i].key, c->slots[i].key_len);
+            WOLFMQTT_FREE(c->slots[i].key);
+        }
+    }
+    if (c->slots != NULL) {
+        WOLFMQTT_FREE(c->slots);
+    }
+}
+
+int MqttBrokerNet_PersistWal_Init(MqttBrokerPersistHooks* hooks,
+    const char* dir)
+{
+    WmqbWalCtx* c;
+    const char* use_dir = (dir != NULL) ? dir : BROKER_PERSIST_DIR_DEFAULT;
+    size_t dlen;
+    int rc;
+
+    if (hooks == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    dlen = strlen(use_dir);
+    if (dlen == 0 || dlen >= sizeof(((WmqbWalCtx*)0)->dir)) {
+        return MQTT_CODE_ERROR_OUT_OF_BUFFER;
+    }
+    c = (WmqbWalCtx*)WOLFMQTT_MALLOC(sizeof(*c));
+    if (c == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    XMEMSET(c, 0, sizeof(*c));
+    XMEMCPY(c->dir, use_dir, dlen);
+    c->dir[dlen] = '\0';
+    c->owned = 1;
+    wmqb_wal_crc_init(c);
+
+    /* Unlike the file backend the log must be replayed before the first
+     * kv_iter, so an unusable directory fails here. */
+    if (mkdir(c->dir, 0700) != 0 && errno != EEXIST) {
+        WMQB_WAL_WARN(
+            "wolfmqtt: persist root mkdir failed dir=\"%s\" errno=%d (%s)\n",
+            c->dir, errno, strerror(errno));
+        WOLFMQTT_FREE(c);
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    rc = wmqb_wal_open(c);
+    if (rc != 0) {
+        WMQB_WAL_WARN("wolfmqtt: persist log open failed dir=\"%s\" "
+            "rc=%d\n", c->dir, rc);
+        wmqb_wal_release(c);
+        WOLFMQTT_FREE(c);
+        return rc;
+    }
+
+    XMEMSET(hooks, 0, sizeof(*hooks));
+    hooks->kv_put     = wmqb_wal_put;
+    hooks->kv_get     = wmqb_wal_get;
+    hooks->kv_del     = wmqb_wal_del;
+    hooks->kv_iter    = wmqb_wal_iter;
+    hooks->sync       = wmqb_wal_sync;
+    hooks->ctx        = c;
+    return 0;
+}
+
+void MqttBrokerNet_PersistWal_Free(MqttBrokerPersistHooks* hooks)
+{
+    WmqbWalCtx* c;
+    if (hooks == NULL) {
+        return;
+    }
+    c = (WmqbWalCtx*)hooks->ctx;
+    if (c != NULL && c->owned) {
+        (void)wmqb_wal_sync(c);
+        wmqb_wal_release(c);
+        WOLFMQTT_FREE(c);
+    }
+    XMEMSET(hooks, 0, sizeof(*hooks));
+}
+
+#endif /* WOLFMQTT_BROKER_PERSIST */
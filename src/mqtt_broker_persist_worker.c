@@ -0,0 +1,463 @@
+/* mqtt_broker_persist_worker.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* Persistence worker thread.
+ *
+ * The event loop is the only producer and the worker the only consumer of
+ * one ring of BROKER_PERSIST_QUEUE_SZ slots. A slot carries a batch marker
+ * (BEGIN, SYNC, COMMIT) or a record image: a private copy of the key and
+ * plaintext blob, so the loop never waits for the worker to be done with
+ * its buffers. The worker applies slots strictly in ring order, which keeps
+ * every key's writes in the order they were made and lets a COMMIT cover
+ * exactly the writes pushed before it.
+ *
+ * The worker sleeps on a condition variable when the ring is empty. Like
+ * the shard rings, the producer only takes the lock to wake it when the
+ * worker announced it is going to sleep, so a busy loop pushes without
+ * locking. A producer finding the ring full waits for the worker; that is
+ * the backpressure, and it is counted. After each commit the worker writes
+ * a wake pipe registered with the loop's readiness backend, so acks held
+ * for that batch go out without waiting for the next poll timeout. */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include "wolfmqtt/mqtt_client.h"
+#include "wolfmqtt/mqtt_broker.h"
+
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Local mirror of the WBLOG_* macros from mqtt_broker.c, as in
+ * mqtt_broker_persist.c. */
+#ifdef WOLFMQTT_BROKER_NO_LOG
+    #define WMQB_LOG_ERR(b, ...)   do { (void)(b); } while(0)
+#else
+    #define WMQB_LOG(b, level, ...) \
+        do { if ((b)->log_level >= (level)) PRINTF(__VA_ARGS__); } while(0)
+    #define WMQB_LOG_ERR(b, ...)   WMQB_LOG(b, BROKER_LOG_ERROR, __VA_ARGS__)
+#endif
+
+typedef struct BrokerPersistWorker BrokerPersistWorker;
+
+/* Record image: key, then blob, in the same allocation */
+typedef struct BrokerPersistRec {
+    word32 blob_len;
+    word16 key_len;
+    byte   ns;
+    byte*  blob;
+    byte   key[1];
+} BrokerPersistRec;
+
+typedef struct BrokerPersistSlot {
+    BrokerPersistRec* rec;      /* PUT / DEL / DELQ, else NULL */
+    word32            batch;    /* COMMIT / COMMIT_LOST */
+    byte              kind;     /* BROKER_PERSIST_OP_* */
+} BrokerPersistSlot;
+
+struct BrokerPersistWorker {
+    MqttBroker*     broker;
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  work;       /* worker: the ring is no longer empty */
+    pthread_cond_t  idle;       /* producer: the worker caught up */
+    int             wake_fd[2]; /* worker to event loop, after commits */
+    /* Ring indices. head is the worker's, tail the producer's. */
+    word32          head;
+    word32          tail;
+    byte            sleeping;   /* worker waits on work */
+    byte            waiting;    /* producer waits on idle */
+    byte            stop;
+    byte            registered; /* wake_fd[0] is in the readiness backend */
+    /* Worker-side batch state */
+    byte            begin_failed; /* sync each write until the commit */
+    byte            batch_lost;   /* a write of the open batch failed */
+    /* Counters, see MqttBrokerPersistWorkerStats. Producer-owned except
+     * applied and failed, which the worker updates. */
+    word32          queued;
+    word32          applied;
+    word32          depth_max;
+    word32          full_waits;
+    word32          failed;
+    BrokerPersistSlot slots[BROKER_PERSIST_QUEUE_SZ];
+};
+
+/* -------------------------------------------------------------------------- */
+/* Worker thread                                                               */
+/* -------------------------------------------------------------------------- */
+
+static void BrokerPersistWorker_Fail(BrokerPersistWorker* w, int rc,
+    const char* what)
+{
+    WMQB_LOG_ERR(w->broker, "broker: persist worker %s failed rc=%d", what,
+        rc);
+    (void)BROKER_ATOMIC_ADD(&w->failed, 1);
+}
+
+static void BrokerPersistWorker_Apply(BrokerPersistWorker* w,
+    const BrokerPersistSlot* slot)
+{
+    MqttBroker* broker = w->broker;
+    const MqttBrokerPersistHooks* h = broker->persist;
+    const BrokerPersistRec* rec = slot->rec;
+    int rc = 0;
+    byte b = 1;
+
+    switch (slot->kind) {
+        case BROKER_PERSIST_OP_BEGIN:
+            if (h->begin(h->ctx) != 0) {
+                w->begin_failed = 1;
+            }
+            return;
+        case BROKER_PERSIST_OP_PUT:
+            rc = BrokerPersist_ApplyPut(broker, rec->ns, rec->key,
+                rec->key_len, rec->blob, rec->blob_len);
+            break;
+        case BROKER_PERSIST_OP_DEL:
+            rc = h->kv_del(h->ctx, rec->ns, rec->key, rec->key_len);
+            break;
+        case BROKER_PERSIST_OP_DELQ:
+            (void)BrokerPersist_ApplyDelQueue(broker, rec->key,
+                rec->key_len);
+            break;
+        case BROKER_PERSIST_OP_SYNC:
+            rc = h->sync(h->ctx);
+            if (rc != 0) {
+                BrokerPersistWorker_Fail(w, rc, "sync");
+            }
+            return;
+        case BROKER_PERSIST_OP_COMMIT:
+        case BROKER_PERSIST_OP_COMMIT_LOST:
+            if (h->commit != NULL) {
+                rc = h->commit(h->ctx);
+            }
+            else if (h->sync != NULL) {
+                rc = h->sync(h->ctx);
+            }
+            if (rc != 0) {
+                BrokerPersistWorker_Fail(w, rc, "batch commit");
+            }
+            if (rc != 0 || w->batch_lost ||
+                    slot->kind == BROKER_PERSIST_OP_COMMIT_LOST) {
+                BROKER_ATOMIC_STORE(&broker->persist_failed_id, slot->batch);
+            }
+            else {
+                BROKER_ATOMIC_STORE(&broker->persist_committed_id,
+                    slot->batch);
+            }
+            w->batch_lost = 0;
+            w->begin_failed = 0;
+            /* A full pipe already holds a pending wakeup */
+            (void)write(w->wake_fd[1], &b, 1);
+            return;
+        default:
+            return;
+    }
+    if (rc != 0) {
+        BrokerPersistWorker_Fail(w, rc, "write");
+        w->batch_lost = 1;
+    }
+    else if (w->begin_failed && h->sync != NULL) {
+        (void)h->sync(h->ctx);
+    }
+}
+
+/* Pairs with BrokerPersistWorker_Notify: the fence orders the sleeping
+ * announcement before the ring check, so either the worker sees the new
+ * slot or the producer sees the worker asleep. */
+static void BrokerPersistWorker_Sleep(BrokerPersistWorker* w)
+{
+    BROKER_ATOMIC_STORE(&w->sleeping, 1);
+    BROKER_ATOMIC_FENCE();
+    if (BROKER_ATOMIC_LOAD(&w->tail) != w->head) {
+        BROKER_ATOMIC_STORE(&w->sleeping, 0);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    while (BROKER_ATOMIC_LOAD(&w->sleeping) && !w->stop) {
+        pthread_cond_wait(&w->work, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    BROKER_ATOMIC_STORE(&w->sleeping, 0);
+}
+
+static void* BrokerPersistWorker_Thread(void* arg)
+{
+    BrokerPersistWorker* w = (BrokerPersistWorker*)arg;
+    BrokerPersistSlot slot;
+    word32 head;
+    sigset_t set;
+
+    /* Leave process signals to the event loop thread */
+    (void)sigfillset(&set);
+    (void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        head = w->head;
+        if (head == BROKER_ATOMIC_LOAD(&w->tail)) {
+            pthread_mutex_lock(&w->lock);
+            if (w->stop) {
+                pthread_mutex_unlock(&w->lock);
+                break;
+            }
+            pthread_mutex_unlock(&w->lock);
+            BrokerPersistWorker_Sleep(w);
+            continue;
+        }
+        slot = w->slots[head & (BROKER_PERSIST_QUEUE_SZ - 1)];
+        BrokerPersistWorker_Apply(w, &slot);
+        if (slot.rec != NULL) {
+            WOLFMQTT_FREE(slot.rec);
+        }
+        BROKER_ATOMIC_STORE(&w->head, head + 1);
+        (void)BROKER_ATOMIC_ADD(&w->applied, 1);
+        /* A producer waiting for room or for a barrier */
+        BROKER_ATOMIC_FENCE();
+        if (BROKER_ATOMIC_LOAD(&w->waiting)) {
+            pthread_mutex_lock(&w->lock);
+            pthread_cond_broadcast(&w->idle);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Event loop side                                                             */
+/* -------------------------------------------------------------------------- */
+
+static void BrokerPersistWorker_Notify(BrokerPersistWorker* w)
+{
+    BROKER_ATOMIC_FENCE();
+    if (BROKER_ATOMIC_LOAD(&w->sleeping) &&
+            BROKER_ATOMIC_XCHG(&w->sleeping, 0)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->work);
+        pthread_mutex_unlock(&w->lock);
+    }
+}
+
+/* Block until the worker has applied everything up to tail, or, when
+ * room is set, until one slot is free. */
+static void BrokerPersistWorker_WaitFor(BrokerPersistWorker* w, int room)
+{
+    word32 tail = w->tail;
+
+    BROKER_ATOMIC_STORE(&w->waiting, 1);
+    BROKER_ATOMIC_FENCE();
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        word32 head = BROKER_ATOMIC_LOAD(&w->head);
+        if (room ? (tail - head < BROKER_PERSIST_QUEUE_SZ) : (head == tail)) {
+            break;
+        }
+        pthread_cond_wait(&w->idle, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    BROKER_ATOMIC_STORE(&w->waiting, 0);
+}
+
+int BrokerPersistWorker_Push(MqttBroker* broker, byte kind, byte ns,
+    const byte* key, word16 key_len, const byte* blob, word32 blob_len,
+    word32 batch)
+{
+    BrokerPersistWorker* w;
+    BrokerPersistSlot* slot;
+    BrokerPersistRec* rec = NULL;
+    word32 depth;
+
+    if (broker == NULL || broker->persist_worker == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    w = broker->persist_worker;
+    if (kind == BROKER_PERSIST_OP_PUT || kind == BROKER_PERSIST_OP_DEL ||
+            kind == BROKER_PERSIST_OP_DELQ) {
+        rec = (BrokerPersistRec*)WOLFMQTT_MALLOC(sizeof(BrokerPersistRec) +
+            key_len + blob_len);
+        if (rec == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        rec->ns = ns;
+        rec->key_len = key_len;
+        rec->blob_len = blob_len;
+        rec->blob = &rec->key[key_len];
+        if (key_len > 0) {
+            XMEMCPY(rec->key, key, key_len);
+        }
+        if (blob_len > 0) {
+            XMEMCPY(rec->blob, blob, blob_len);
+        }
+    }
+
+    if (w->tail - BROKER_ATOMIC_LOAD(&w->head) >= BROKER_PERSIST_QUEUE_SZ) {
+        w->full_waits++;
+        BrokerPersistWorker_WaitFor(w, 1);
+    }
+    slot = &w->slots[w->tail & (BROKER_PERSIST_QUEUE_SZ - 1)];
+    slot->rec = rec;
+    slot->batch = batch;
+    slot->kind = kind;
+    BROKER_ATOMIC_STORE(&w->tail, w->tail + 1);
+    w->queued++;
+    depth = w->tail - BROKER_ATOMIC_LOAD(&w->head);
+    if (depth > w->depth_max) {
+        w->depth_max = depth;
+    }
+    BrokerPersistWorker_Notify(w);
+    return MQTT_CODE_SUCCESS;
+}
+
+void BrokerPersistWorker_Barrier(MqttBroker* broker)
+{
+    if (broker != NULL && broker->persist_worker != NULL) {
+        BrokerPersistWorker_WaitFor(broker->persist_worker, 0);
+    }
+}
+
+void BrokerPersistWorker_Awake(MqttBroker* broker)
+{
+    byte buf[64];
+
+    /* Wakeups carry no data; the Step reads the published batch ids */
+    while (read(broker->persist_worker->wake_fd[0], buf, sizeof(buf)) ==
+            (ssize_t)sizeof(buf)) {
+    }
+}
+
+static void BrokerPersistWorker_Free(BrokerPersistWorker* w)
+{
+    if (w->wake_fd[0] >= 0) {
+        close(w->wake_fd[0]);
+        close(w->wake_fd[1]);
+    }
+    pthread_cond_destroy(&w->idle);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    WOLFMQTT_FREE(w);
+}
+
+int BrokerPersistWorker_Start(MqttBroker* broker)
+{
+    BrokerPersistWorker* w;
+    int rc = MQTT_CODE_SUCCESS;
+
+    if (broker == NULL || broker->persist == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (broker->persist_worker != NULL) {
+        return MQTT_CODE_SUCCESS;
+    }
+    w = (BrokerPersistWorker*)WOLFMQTT_MALLOC(sizeof(BrokerPersistWorker));
+    if (w == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    XMEMSET(w, 0, sizeof(*w));
+    w->broker = broker;
+    w->wake_fd[0] = w->wake_fd[1] = -1;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->idle, NULL);
+
+    if (pipe(w->wake_fd) != 0) {
+        WMQB_LOG_ERR(broker, "broker: persist worker wake pipe failed (%d)",
+            errno);
+        w->wake_fd[0] = w->wake_fd[1] = -1;
+        rc = MQTT_CODE_ERROR_SYSTEM;
+    }
+    if (rc == MQTT_CODE_SUCCESS) {
+        (void)fcntl(w->wake_fd[0], F_SETFL,
+            fcntl(w->wake_fd[0], F_GETFL, 0) | O_NONBLOCK);
+        (void)fcntl(w->wake_fd[1], F_SETFL,
+            fcntl(w->wake_fd[1], F_GETFL, 0) | O_NONBLOCK);
+        if (broker->net.poll_add != NULL) {
+            rc = broker->net.poll_add(broker->net.ctx, w->wake_fd[0],
+                BROKER_NET_EV_READ, w);
+            w->registered = (byte)(rc == MQTT_CODE_SUCCESS);
+        }
+    }
+    if (rc == MQTT_CODE_SUCCESS &&
+            pthread_create(&w->thread, NULL, BrokerPersistWorker_Thread,
+                w) != 0) {
+        WMQB_LOG_ERR(broker, "broker: persist worker thread failed");
+        rc = MQTT_CODE_ERROR_SYSTEM;
+    }
+    if (rc != MQTT_CODE_SUCCESS) {
+        if (w->registered) {
+            (void)broker->net.poll_del(broker->net.ctx, w->wake_fd[0]);
+        }
+        BrokerPersistWorker_Free(w);
+        return rc;
+    }
+    broker->persist_worker = w;
+    return MQTT_CODE_SUCCESS;
+}
+
+void BrokerPersistWorker_Stop(MqttBroker* broker)
+{
+    BrokerPersistWorker* w;
+
+    if (broker == NULL || broker->persist_worker == NULL) {
+        return;
+    }
+    w = broker->persist_worker;
+    BrokerPersistWorker_WaitFor(w, 0);
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->work);
+    pthread_mutex_unlock(&w->lock);
+    (void)pthread_join(w->thread, NULL);
+
+    if (w->registered && broker->net.poll_del != NULL) {
+        (void)broker->net.poll_del(broker->net.ctx, w->wake_fd[0]);
+    }
+    broker->persist_worker = NULL;
+    BrokerPersistWorker_Free(w);
+}
+
+int MqttBroker_PersistWorkerStats(MqttBroker* broker,
+    MqttBrokerPersistWorkerStats* stats)
+{
+    BrokerPersistWorker* w;
+
+    if (broker == NULL || stats == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    XMEMSET(stats, 0, sizeof(*stats));
+    w = broker->persist_worker;
+    if (w == NULL) {
+        return MQTT_CODE_SUCCESS;
+    }
+    stats->queued = w->queued;
+    stats->applied = BROKER_ATOMIC_LOAD(&w->applied);
+    stats->depth = w->tail - BROKER_ATOMIC_LOAD(&w->head);
+    stats->depth_max = w->depth_max;
+    stats->full_waits = w->full_waits;
+    stats->failed = BROKER_ATOMIC_LOAD(&w->failed);
+    return MQTT_CODE_SUCCESS;
+}
+
+#endif /* WOLFMQTT_BROKER_PERSIST_WORKER */
@@ -0,0 +1,634 @@
+/* mqtt_broker_shard.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* Sharded multi-core broker.
+ *
+ * A group runs one MqttBroker per shard, each on its own thread with its own
+ * readiness backend and SO_REUSEPORT listener, so the kernel spreads new
+ * connections across shards. Shards share nothing but the rings below:
+ *
+ *   rings[src * count + dst]   single producer (src), single consumer (dst)
+ *
+ * A shard that finds its peer's ring full does not drop the message. It
+ * moves its own inbound messages to a private stash and yields until the
+ * peer catches up; since every waiting shard keeps emptying its inbound
+ * rings, two shards publishing to each other cannot deadlock.
+ *
+ * A shard blocked in MqttBroker_Wait is woken through a pipe registered with
+ * its readiness backend. The producer only writes the pipe when the consumer
+ * announced it is going to sleep, so a busy group never touches it. */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include "wolfmqtt/mqtt_client.h"
+#include "wolfmqtt/mqtt_broker.h"
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Local mirror of the WBLOG_* macros from mqtt_broker.c, as in
+ * mqtt_broker_persist.c. */
+#ifdef WOLFMQTT_BROKER_NO_LOG
+    #define WMQB_LOG_ERR(b, ...)   do { (void)(b); } while(0)
+    #define WMQB_LOG_INFO(b, ...)  do { (void)(b); } while(0)
+#else
+    #define WMQB_LOG(b, level, ...) \
+        do { if ((b)->log_level >= (level)) PRINTF(__VA_ARGS__); } while(0)
+    #define WMQB_LOG_ERR(b, ...)   WMQB_LOG(b, BROKER_LOG_ERROR, __VA_ARGS__)
+    #define WMQB_LOG_INFO(b, ...)  WMQB_LOG(b, BROKER_LOG_INFO, __VA_ARGS__)
+#endif
+
+#define BROKER_SHARD_RING(group, src, dst) \
+    (&(group)->rings[(src) * (group)->count + (dst)])
+
+/* -------------------------------------------------------------------------- */
+/* Ownership                                                                   */
+/* -------------------------------------------------------------------------- */
+
+/* FNV-1a over the key. Client IDs and retained topics are owned by the shard
+ * the hash selects, so every shard computes the same owner without asking. */
+int BrokerShard_Owner(const BrokerShard* shard, const char* key, word32 len)
+{
+    word32 h = 2166136261u;
+    word32 i;
+
+    if (shard == NULL || shard->group == NULL || key == NULL) {
+        return 0;
+    }
+    for (i = 0; i < len; i++) {
+        h ^= (byte)key[i];
+        h *= 16777619u;
+    }
+    return (int)(h % (word32)shard->group->count);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Rings                                                                       */
+/* -------------------------------------------------------------------------- */
+
+static int BrokerShardRing_Push(BrokerShardRing* ring, BrokerShardMsg* msg,
+    byte flags)
+{
+    word32 tail = ring->tail;
+    word32 head = BROKER_ATOMIC_LOAD(&ring->head);
+    BrokerShardSlot* slot;
+
+    if (tail - head >= BROKER_SHARD_RING_SZ) {
+        return MQTT_CODE_CONTINUE; /* full */
+    }
+    slot = &ring->slots[tail & (BROKER_SHARD_RING_SZ - 1)];
+    slot->msg = msg;
+    slot->flags = flags;
+    BROKER_ATOMIC_STORE(&ring->tail, tail + 1);
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerShardRing_Pop(BrokerShardRing* ring, BrokerShardSlot* out)
+{
+    word32 head = ring->head;
+    word32 tail = BROKER_ATOMIC_LOAD(&ring->tail);
+
+    if (head == tail) {
+        return 0;
+    }
+    *out = ring->slots[head & (BROKER_SHARD_RING_SZ - 1)];
+    BROKER_ATOMIC_STORE(&ring->head, head + 1);
+    return 1;
+}
+
+static int BrokerShardRing_Empty(BrokerShardRing* ring)
+{
+    return BROKER_ATOMIC_LOAD(&ring->head) ==
+        BROKER_ATOMIC_LOAD(&ring->tail);
+}
+
+/* -------------------------------------------------------------------------- */
+/* Wakeups                                                                     */
+/* -------------------------------------------------------------------------- */
+
+static void BrokerShard_Wake(BrokerShard* shard)
+{
+    byte b = 1;
+    if (shard->wake_fd[1] >= 0) {
+        /* A full pipe already holds a pending wakeup */
+        (void)write(shard->wake_fd[1], &b, 1);
+    }
+}
+
+/* Pairs with BrokerShard_Sleep: the fence orders the ring publish before
+ * the sleeping check, so either the consumer sees the message or this side
+ * sees the consumer asleep. */
+static void BrokerShard_Notify(BrokerShard* shard)
+{
+    BROKER_ATOMIC_FENCE();
+    if (BROKER_ATOMIC_LOAD(&shard->sleeping) &&
+            BROKER_ATOMIC_XCHG(&shard->sleeping, 0)) {
+        BrokerShard_Wake(shard);
+    }
+}
+
+static int BrokerShard_Pending(BrokerShard* shard)
+{
+    MqttBrokerShards* group = shard->group;
+    int src;
+
+    if (shard->stash_head != NULL) {
+        return 1;
+    }
+    for (src = 0; src < group->count; src++) {
+        if (src != shard->index &&
+                !BrokerShardRing_Empty(BROKER_SHARD_RING(group, src,
+                    shard->index))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int BrokerShard_Sleep(BrokerShard* shard)
+{
+    BROKER_ATOMIC_STORE(&shard->sleeping, 1);
+    BROKER_ATOMIC_FENCE();
+    if (BrokerShard_Pending(shard) ||
+            !BROKER_ATOMIC_LOAD(&shard->group->running)) {
+        BROKER_ATOMIC_STORE(&shard->sleeping, 0);
+        return 0;
+    }
+    return 1;
+}
+
+void BrokerShard_Awake(BrokerShard* shard)
+{
+    byte buf[64];
+
+    BROKER_ATOMIC_STORE(&shard->sleeping, 0);
+    /* Consume wakeups; they carry no data and the rings are drained next */
+    while (read(shard->wake_fd[0], buf, sizeof(buf)) == (ssize_t)sizeof(buf)) {
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Send / receive                                                              */
+/* -------------------------------------------------------------------------- */
+
+/* Move everything queued for this shard onto its stash, in arrival order,
+ * without applying it: the caller may be inside a packet handler. */
+static int BrokerShard_Stash(BrokerShard* shard)
+{
+    MqttBrokerShards* group = shard->group;
+    int src;
+    int moved = 0;
+
+    for (src = 0; src < group->count; src++) {
+        BrokerShardRing* ring;
+        if (src == shard->index) {
+            continue;
+        }
+        ring = BROKER_SHARD_RING(group, src, shard->index);
+        while (!BrokerShardRing_Empty(ring)) {
+            /* Allocate before popping: without memory the message stays on
+             * the ring and the producer keeps waiting. */
+            BrokerShardStash* s = (BrokerShardStash*)WOLFMQTT_MALLOC(
+                sizeof(BrokerShardStash));
+            if (s == NULL) {
+                return moved;
+            }
+            (void)BrokerShardRing_Pop(ring, &s->slot);
+            s->next = NULL;
+            if (shard->stash_tail != NULL) {
+                shard->stash_tail->next = s;
+            }
+            else {
+                shard->stash_head = s;
+            }
+            shard->stash_tail = s;
+            moved++;
+        }
+    }
+    return moved;
+}
+
+int BrokerShard_Send(BrokerShard* shard, int dst, BrokerShardMsg* msg,
+    byte flags)
+{
+    MqttBrokerShards* group;
+    BrokerShardRing* ring;
+    BrokerShard* peer;
+
+    if (shard == NULL || msg == NULL || dst < 0 ||
+            dst >= shard->group->count || dst == shard->index) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    group = shard->group;
+    if (!BROKER_ATOMIC_LOAD(&group->running)) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    ring = BROKER_SHARD_RING(group, shard->index, dst);
+    peer = &group->shards[dst];
+
+    (void)BROKER_ATOMIC_ADD(&msg->refs, 1);
+    while (BrokerShardRing_Push(ring, msg, flags) != MQTT_CODE_SUCCESS) {
+        if (!BROKER_ATOMIC_LOAD(&group->running)) {
+            (void)BROKER_ATOMIC_ADD(&msg->refs, -1);
+            return MQTT_CODE_ERROR_NETWORK;
+        }
+        BrokerShard_Wake(peer);
+        (void)BrokerShard_Stash(shard);
+        (void)sched_yield();
+    }
+    BrokerShard_Notify(peer);
+    return MQTT_CODE_SUCCESS;
+}
+
+int BrokerShard_Broadcast(BrokerShard* shard, BrokerShardMsg* msg,
+    byte flags)
+{
+    int dst;
+    int rc = MQTT_CODE_SUCCESS;
+
+    if (shard == NULL || msg == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    for (dst = 0; dst < shard->group->count; dst++) {
+        if (dst != shard->index) {
+            int s_rc = BrokerShard_Send(shard, dst, msg, flags);
+            if (s_rc != MQTT_CODE_SUCCESS) {
+                rc = s_rc;
+            }
+        }
+    }
+    return rc;
+}
+
+int BrokerShard_Recv(BrokerShard* shard, BrokerShardMsg** msg, byte* flags)
+{
+    MqttBrokerShards* group = shard->group;
+    BrokerShardSlot slot;
+    int i;
+
+    if (shard->stash_head != NULL) {
+        BrokerShardStash* s = shard->stash_head;
+        shard->stash_head = s->next;
+        if (shard->stash_head == NULL) {
+            shard->stash_tail = NULL;
+        }
+        *msg = s->slot.msg;
+        *flags = s->slot.flags;
+        WOLFMQTT_FREE(s);
+        return 1;
+    }
+    /* Start where the last drain stopped so one busy peer cannot starve the
+     * others. */
+    for (i = 0; i < group->count; i++) {
+        int src = (shard->next_src + i) % group->count;
+        if (src == shard->index) {
+            continue;
+        }
+        if (BrokerShardRing_Pop(BROKER_SHARD_RING(group, src, shard->index),
+                &slot)) {
+            shard->next_src = (src + 1) % group->count;
+            *msg = slot.msg;
+            *flags = slot.flags;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Release whatever is still queued for a stopped shard. Handed-off sockets
+ * have no owner any more and are closed. */
+static void BrokerShard_Discard(BrokerShard* shard)
+{
+    BrokerShardMsg* msg;
+    byte flags;
+
+    while (BrokerShard_Recv(shard, &msg, &flags)) {
+        if (msg->kind == BROKER_SHARD_MSG_CONNECT) {
+            shard->broker->net.close(shard->broker->net.ctx, msg->sock);
+        }
+        BrokerShardMsg_Release(msg);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Group lifecycle                                                             */
+/* -------------------------------------------------------------------------- */
+
+static void* BrokerShard_Thread(void* arg)
+{
+    BrokerShard* shard = (BrokerShard*)arg;
+    MqttBroker* broker = shard->broker;
+    int rc = MQTT_CODE_SUCCESS;
+    sigset_t set;
+
+    /* Leave process signals (SIGINT, SIGTERM) to the thread driving shard
+     * 0, so its wait is the one interrupted. */
+    (void)sigfillset(&set);
+    (void)pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    while (BROKER_ATOMIC_LOAD(&broker->running)) {
+        rc = MqttBroker_Step(broker);
+        if (rc == MQTT_CODE_CONTINUE) {
+            rc = MqttBroker_Wait(broker);
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    if (rc < 0) {
+        /* One shard failing takes the group down rather than leaving its
+         * share of the client ID space unserved. */
+        (void)MqttBrokerShards_Stop(shard->group);
+    }
+    return NULL;
+}
+
+static void BrokerShards_FreeBroker(MqttBrokerShards* group, int i)
+{
+    BrokerShard* shard = &group->shards[i];
+    MqttBroker* broker = group->brokers[i];
+
+    if (broker != NULL) {
+        if (shard->wake_fd[0] >= 0 && broker->net.poll_del != NULL) {
+            (void)broker->net.poll_del(broker->net.ctx, shard->wake_fd[0]);
+        }
+        broker->shard = NULL;
+        if (i > 0) {
+            (void)MqttBroker_Free(broker);
+            WOLFMQTT_FREE(broker);
+            group->brokers[i] = NULL;
+        }
+    }
+    if (shard->wake_fd[0] >= 0) {
+        close(shard->wake_fd[0]);
+        close(shard->wake_fd[1]);
+        shard->wake_fd[0] = shard->wake_fd[1] = -1;
+    }
+}
+
+int MqttBrokerShards_Init(MqttBrokerShards* group, MqttBroker* config,
+    int count)
+{
+    int i;
+    int rc = MQTT_CODE_SUCCESS;
+
+    if (group == NULL || config == NULL || count < 1 ||
+            count > BROKER_MAX_SHARDS) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#ifdef ENABLE_MQTT_TLS
+    if (config->use_tls) {
+        WMQB_LOG_ERR(config, "broker: TLS is not supported with shards");
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#endif
+#ifdef ENABLE_MQTT_WEBSOCKET
+    if (config->use_websocket) {
+        WMQB_LOG_ERR(config, "broker: WebSocket is not supported with shards");
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#endif
+#ifdef WOLFMQTT_BROKER_PERSIST
+    if (config->persist != NULL) {
+        WMQB_LOG_ERR(config,
+            "broker: persistence is not supported with shards");
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+    /* Its receives would consume the wake pipe and the bytes of a
+     * connection being handed to another shard. */
+    if (BrokerUring_IsNet(&config->net)) {
+        WMQB_LOG_ERR(config,
+            "broker: io_uring backend is not supported with shards");
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+#endif
+
+    XMEMSET(group, 0, sizeof(*group));
+    group->count = count;
+    group->brokers = (MqttBroker**)WOLFMQTT_MALLOC(
+        sizeof(MqttBroker*) * (size_t)count);
+    group->shards = (BrokerShard*)WOLFMQTT_MALLOC(
+        sizeof(BrokerShard) * (size_t)count);
+    group->rings = (BrokerShardRing*)WOLFMQTT_MALLOC(
+        sizeof(BrokerShardRing) * (size_t)count * (size_t)count);
+    group->threads = WOLFMQTT_MALLOC(sizeof(pthread_t) * (size_t)count);
+    if (group->brokers == NULL || group->shards == NULL ||
+            group->rings == NULL || group->threads == NULL) {
+        rc = MQTT_CODE_ERROR_MEMORY;
+    }
+    if (rc == MQTT_CODE_SUCCESS) {
+        XMEMSET(group->brokers, 0, sizeof(MqttBroker*) * (size_t)count);
+        XMEMSET(group->shards, 0, sizeof(BrokerShard) * (size_t)count);
+        XMEMSET(group->rings, 0,
+            sizeof(BrokerShardRing) * (size_t)count * (size_t)count);
+        for (i = 0; i < count; i++) {
+            group->shards[i].wake_fd[0] = group->shards[i].wake_fd[1] = -1;
+        }
+        group->brokers[0] = config;
+    }
+
+    for (i = 0; rc == MQTT_CODE_SUCCESS && i < count; i++) {
+        BrokerShard* shard = &group->shards[i];
+        MqttBroker* broker = group->brokers[i];
+
+        if (broker == NULL) {
+            MqttBrokerNet net = config->net;
+            /* A context pointing at the config broker is the default POSIX
+             * backend's; let MqttBroker_Init point it at the new shard. */
+            if (net.ctx == (void*)config) {
+                net.ctx = NULL;
+            }
+            broker = (MqttBroker*)WOLFMQTT_MALLOC(sizeof(MqttBroker));
+            if (broker == NULL) {
+                rc = MQTT_CODE_ERROR_MEMORY;
+                break;
+            }
+            rc = MqttBroker_Init(broker, &net);
+            if (rc != MQTT_CODE_SUCCESS) {
+                WOLFMQTT_FREE(broker);
+                break;
+            }
+            broker->port = config->port;
+            broker->log_level = config->log_level;
+        #ifdef WOLFMQTT_BROKER_AUTH
+            broker->auth_user = config->auth_user;
+            broker->auth_pass = config->auth_pass;
+        #endif
+            group->brokers[i] = broker;
+        }
+        shard->broker = broker;
+        shard->group = group;
+        shard->index = i;
+        if (pipe(shard->wake_fd) != 0) {
+            WMQB_LOG_ERR(broker, "broker: shard %d wake pipe failed (%d)", i,
+                errno);
+            shard->wake_fd[0] = shard->wake_fd[1] = -1;
+            rc = MQTT_CODE_ERROR_SYSTEM;
+            break;
+        }
+        (void)fcntl(shard->wake_fd[0], F_SETFL,
+            fcntl(shard->wake_fd[0], F_GETFL, 0) | O_NONBLOCK);
+        (void)fcntl(shard->wake_fd[1], F_SETFL,
+            fcntl(shard->wake_fd[1], F_GETFL, 0) | O_NONBLOCK);
+        broker->shard = shard;
+    }
+
+    if (rc == MQTT_CODE_SUCCESS) {
+        group->running = 1;
+    }
+    else {
+        (void)MqttBrokerShards_Free(group);
+    }
+    return rc;
+}
+
+int MqttBrokerShards_Start(MqttBrokerShards* group)
+{
+    pthread_t* threads;
+    int i;
+    int rc = MQTT_CODE_SUCCESS;
+
+    if (group == NULL || group->brokers == NULL || group->started) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    threads = (pthread_t*)group->threads;
+    group->started = 1;
+
+    for (i = 0; rc == MQTT_CODE_SUCCESS && i < group->count; i++) {
+        MqttBroker* broker = group->brokers[i];
+        rc = MqttBroker_Start(broker);
+        if (rc != MQTT_CODE_SUCCESS) {
+            WMQB_LOG_ERR(broker, "broker: shard %d start failed rc=%d", i, rc);
+        }
+    }
+    for (i = 1; rc == MQTT_CODE_SUCCESS && i < group->count; i++) {
+        if (pthread_create(&threads[i], NULL, BrokerShard_Thread,
+                &group->shards[i]) != 0) {
+            WMQB_LOG_ERR(group->brokers[i],
+                "broker: shard %d thread failed", i);
+            rc = MQTT_CODE_ERROR_SYSTEM;
+            break;
+        }
+        group->nthreads = i;
+    }
+    if (rc != MQTT_CODE_SUCCESS) {
+        (void)MqttBrokerShards_Stop(group);
+    }
+    else {
+        WMQB_LOG_INFO(group->brokers[0], "broker: %d shards running",
+            group->count);
+    }
+    return rc;
+}
+
+int MqttBrokerShards_Run(MqttBrokerShards* group)
+{
+    MqttBroker* broker;
+    int rc;
+
+    rc = MqttBrokerShards_Start(group);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
+    }
+    broker = group->brokers[0];
+    while (BROKER_ATOMIC_LOAD(&broker->running)) {
+        rc = MqttBroker_Step(broker);
+        if (rc == MQTT_CODE_CONTINUE) {
+            rc = MqttBroker_Wait(broker);
+        }
+        if (rc < 0) {
+            break;
+        }
+    }
+    (void)MqttBrokerShards_Stop(group);
+    if (rc == MQTT_CODE_CONTINUE || rc > 0) {
+        rc = MQTT_CODE_SUCCESS;
+    }
+    return rc;
+}
+
+int MqttBrokerShards_Stop(MqttBrokerShards* group)
+{
+    int i;
+
+    if (group == NULL || group->shards == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    BROKER_ATOMIC_STORE(&group->running, 0);
+    for (i = 0; i < group->count; i++) {
+        if (group->brokers[i] != NULL) {
+            BROKER_ATOMIC_STORE(&group->brokers[i]->running, 0);
+        }
+        BrokerShard_Wake(&group->shards[i]);
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+int MqttBrokerShards_Free(MqttBrokerShards* group)
+{
+    pthread_t* threads;
+    int i;
+
+    if (group == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    threads = (pthread_t*)group->threads;
+    if (group->shards != NULL) {
+        (void)MqttBrokerShards_Stop(group);
+        for (i = 1; i <= group->nthreads; i++) {
+            (void)pthread_join(threads[i], NULL);
+        }
+        for (i = 0; i < group->count; i++) {
+            if (group->shards[i].group != NULL) {
+                BrokerShard_Discard(&group->shards[i]);
+            }
+        }
+        for (i = 0; group->brokers != NULL && i < group->count; i++) {
+            BrokerShards_FreeBroker(group, i);
+        }
+    }
+    if (group->brokers != NULL) {
+        WOLFMQTT_FREE(group->brokers);
+    }
+    if (group->shards != NULL) {
+        WOLFMQTT_FREE(group->shards);
+    }
+    if (group->rings != NULL) {
+        WOLFMQTT_FREE(group->rings);
+    }
+    if (group->threads != NULL) {
+        WOLFMQTT_FREE(group->threads);
+    }
+    XMEMSET(group, 0, sizeof(*group));
+    return MQTT_CODE_SUCCESS;
+}
+
+#endif /* WOLFMQTT_BROKER_SHARDS */
@@ -0,0 +1,1425 @@
+/* mqtt_broker_uring.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* io_uring network backend.
+ *
+ * A drop-in MqttBrokerNet for Linux that replaces the per-operation socket
+ * syscalls of the default backend with one submission/completion ring:
+ *
+ *   - each listener keeps a multishot ACCEPT outstanding; accepted
+ *     descriptors queue on the listener until the accept callback takes them
+ *   - each connection keeps one RECV outstanding that takes a buffer from a
+ *     ring of provided buffers only when data arrives, so idle connections
+ *     pin no memory; the read callback copies out of that buffer and the
+ *     RECV is re-armed once it is drained
+ *   - the write callback copies into a per-connection queue that is sent as
+ *     a chain of linked SENDs
+ *
+ * The callbacks never enter the kernel themselves. poll_wait submits all
+ * work queued since the previous call and reaps completions in a single
+ * io_uring_enter, then reports every connection holding received data, an
+ * error or accepted descriptors as readable. The broker's readiness loop
+ * thus drives the completion ring unchanged, at one syscall per Step.
+ *
+ * A connection the broker closes keeps its descriptor until its queued
+ * output is sent (at most BROKER_URING_LINGER_MS) and its outstanding
+ * operations have completed, so no submission can land on a reused
+ * descriptor number. */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include "wolfmqtt/mqtt_client.h"
+#include "wolfmqtt/mqtt_broker.h"
+
+#ifdef WOLFMQTT_BROKER_IO_URING
+
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/* Local mirror of the WBLOG_* macros from mqtt_broker.c, as in
+ * mqtt_broker_persist.c. */
+#ifdef WOLFMQTT_BROKER_NO_LOG
+    #define WMQB_LOG_ERR(b, ...)   do { (void)(b); } while(0)
+#else
+    #define WMQB_LOG(b, level, ...) \
+        do { if ((b) != NULL && (b)->log_level >= (level)) \
+            PRINTF(__VA_ARGS__); } while(0)
+    #define WMQB_LOG_ERR(b, ...)   WMQB_LOG(b, BROKER_LOG_ERROR, __VA_ARGS__)
+#endif
+
+#if (BROKER_URING_BUF_COUNT & (BROKER_URING_BUF_COUNT - 1)) != 0 || \
+    BROKER_URING_BUF_COUNT > 32768
+    #error "BROKER_URING_BUF_COUNT must be a power of two up to 32768"
+#endif
+
+/* Operation tag in the low bits of a completion's user_data. The rest is the
+ * BrokerUringSock (ACCEPT, RECV) or BrokerUringTx (SEND) it belongs to. */
+#define BROKER_URING_OP_ACCEPT  1
+#define BROKER_URING_OP_RECV    2
+#define BROKER_URING_OP_SEND    3
+#define BROKER_URING_OP_CANCEL  4
+#define BROKER_URING_OP_MASK    7
+
+#define BROKER_URING_BGID       0   /* provided buffer group */
+
+/* BrokerUringSock.flags */
+#define BROKER_URING_LISTENER   0x0001
+#define BROKER_URING_ACCEPTING  0x0002  /* multishot ACCEPT outstanding */
+#define BROKER_URING_RECEIVING  0x0004  /* RECV outstanding */
+#define BROKER_URING_EOF        0x0008  /* peer closed its side */
+#define BROKER_URING_READY      0x0010  /* on the ready list */
+#define BROKER_URING_FLUSH      0x0020  /* on the flush list */
+#define BROKER_URING_STARVED    0x0040  /* RECV found no free buffer */
+#define BROKER_URING_CLOSING    0x0080  /* closed by the broker */
+#define BROKER_URING_SHUT       0x0100  /* linger expired, shut down */
+#define BROKER_URING_NO_READ    0x0200  /* owner asked for no read events */
+#define BROKER_URING_WANT_WRITE 0x0400  /* owner asked for write events */
+
+struct BrokerUringSock;
+
+/* Queued output. Small writes are appended to the tail segment until it is
+ * submitted; off advances as the kernel reports bytes sent. */
+typedef struct BrokerUringTx {
+    struct BrokerUringTx*   next;
+    struct BrokerUringSock* sock;
+    word32  len;
+    word32  off;
+    word32  cap;
+    byte    busy;   /* part of the SEND chain in flight */
+    /* data follows */
+} BrokerUringTx;
+
+#define BROKER_URING_TX_DATA(tx) ((byte*)((tx) + 1))
+
+typedef struct BrokerUringSock {
+    struct BrokerUringSock* ready_prev;
+    struct BrokerUringSock* ready_next;
+    struct BrokerUringSock* flush_next;
+    struct BrokerUringSock* starved_next;
+    struct BrokerUringSock* zombie_next;
+    void*           owner;      /* poll_add owner, NULL when unregistered */
+    BrokerUringTx*  tx_head;
+    BrokerUringTx*  tx_tail;
+    word32          tx_bytes;   /* queued, including the chain in flight */
+    int             tx_inflight;
+    int             fd;
+    int             ops;        /* operations queued or outstanding */
+    int             err;        /* first receive or send error, -errno */
+    int             rx_bid;     /* provided buffer with unread data, or -1 */
+    word32          rx_off;
+    word32          rx_len;
+    word32          flags;
+    /* Listener: accepted descriptors not yet taken by the accept callback */
+    int*            acc_fd;
+    int             acc_head;
+    int             acc_count;
+    int             acc_cap;
+    uint64_t        linger_ms;  /* CLOSING: when to stop flushing */
+} BrokerUringSock;
+
+typedef struct BrokerUring {
+    MqttBroker* broker;
+    int         ring_fd;
+    void*       ring;
+    size_t      ring_sz;
+    struct io_uring_sqe* sqes;
+    size_t      sqes_sz;
+    unsigned*   sq_khead;
+    unsigned*   sq_ktail;
+    unsigned*   sq_kflags;
+    unsigned    sq_mask;
+    unsigned    sq_entries;
+    unsigned    sq_tail;    /* local tail, published by BrokerUring_Enter */
+    unsigned*   cq_khead;
+    unsigned*   cq_ktail;
+    unsigned    cq_mask;
+    struct io_uring_cqe* cqes;
+    /* Provided receive buffers */
+    struct io_uring_buf_ring* br;
+    size_t      br_sz;
+    byte*       bufs;
+    size_t      bufs_sz;
+    unsigned short br_tail;
+    /* Sockets by descriptor, and the lists that drive poll_wait */
+    BrokerUringSock** socks;
+    int         nsocks;
+    BrokerUringSock* ready_head;
+    BrokerUringSock* ready_tail;
+    int         nready;
+    BrokerUringSock* flush;
+    BrokerUringSock* starved;
+    BrokerUringSock* zombies;
+    int         ops;
+    byte        closing;
+} BrokerUring;
+
+static uint64_t BrokerUring_NowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Ring setup and submission                                                   */
+/* -------------------------------------------------------------------------- */
+
+static void BrokerUring_Free(BrokerUring* u);
+
+/* Create the ring and register the provided buffers. broker may be NULL
+ * when probing for kernel support. */
+static BrokerUring* BrokerUring_New(MqttBroker* broker)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    BrokerUring* u;
+    byte* ring;
+    unsigned i;
+
+    u = (BrokerUring*)WOLFMQTT_MALLOC(sizeof(BrokerUring));
+    if (u == NULL) {
+        return NULL;
+    }
+    XMEMSET(u, 0, sizeof(*u));
+    u->broker = broker;
+    u->ring_fd = -1;
+
+    XMEMSET(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    p.cq_entries = BROKER_URING_CQ_ENTRIES;
+    u->ring_fd = (int)syscall(__NR_io_uring_setup, BROKER_URING_SQ_ENTRIES,
+        &p);
+    if (u->ring_fd < 0) {
+        WMQB_LOG_ERR(broker, "broker: io_uring_setup failed (%d)", errno);
+        BrokerUring_Free(u);
+        return NULL;
+    }
+    /* One mapping for both rings, no dropped completions, wait timeouts */
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+            (p.features & IORING_FEAT_NODROP) == 0 ||
+            (p.features & IORING_FEAT_EXT_ARG) == 0) {
+        WMQB_LOG_ERR(broker, "broker: io_uring features 0x%x unsupported",
+            p.features);
+        BrokerUring_Free(u);
+        return NULL;
+    }
+
+    u->ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+            u->ring_sz) {
+        u->ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    u->ring = mmap(NULL, u->ring_sz, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(NULL, u->sqes_sz,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->ring_fd,
+        IORING_OFF_SQES);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        WMQB_LOG_ERR(broker, "broker: io_uring mmap failed (%d)", errno);
+        BrokerUring_Free(u);
+        return NULL;
+    }
+    ring = (byte*)u->ring;
+    u->sq_khead = (unsigned*)(ring + p.sq_off.head);
+    u->sq_ktail = (unsigned*)(ring + p.sq_off.tail);
+    u->sq_kflags = (unsigned*)(ring + p.sq_off.flags);
+    u->sq_mask = *(unsigned*)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_tail = *u->sq_ktail;
+    for (i = 0; i < p.sq_entries; i++) {
+        ((unsigned*)(ring + p.sq_off.array))[i] = i;
+    }
+    u->cq_khead = (unsigned*)(ring + p.cq_off.head);
+    u->cq_ktail = (unsigned*)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned*)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+    /* Provided buffers: the kernel picks one per RECV completion */
+    u->br_sz = BROKER_URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->br = (struct io_uring_buf_ring*)mmap(NULL, u->br_sz,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufs_sz = (size_t)BROKER_URING_BUF_COUNT * BROKER_URING_BUF_SIZE;
+    u->bufs = (byte*)mmap(NULL, u->bufs_sz, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED || u->bufs == MAP_FAILED) {
+        WMQB_LOG_ERR(broker, "broker: io_uring buffer mmap failed (%d)",
+            errno);
+        BrokerUring_Free(u);
+        return NULL;
+    }
+    XMEMSET(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t)u->br;
+    reg.ring_entries = BROKER_URING_BUF_COUNT;
+    reg.bgid = BROKER_URING_BGID;
+    if (syscall(__NR_io_uring_register, u->ring_fd,
+            IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        WMQB_LOG_ERR(broker, "broker: io_uring buffer ring failed (%d)",
+            errno);
+        BrokerUring_Free(u);
+        return NULL;
+    }
+    for (i = 0; i < BROKER_URING_BUF_COUNT; i++) {
+        struct io_uring_buf* b = &u->br->bufs[i];
+        b->addr = (__u64)(uintptr_t)(u->bufs + (size_t)i *
+            BROKER_URING_BUF_SIZE);
+        b->len = BROKER_URING_BUF_SIZE;
+        b->bid = (__u16)i;
+    }
+    u->br_tail = (unsigned short)BROKER_URING_BUF_COUNT;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return u;
+}
+
+/* Publish queued submissions and enter the kernel. With wait set, block
+ * until a completion arrives or timeout_ms passes (< 0 waits forever).
+ * Skips the syscall when there is nothing to submit, wait for or flush. */
+static int BrokerUring_Enter(BrokerUring* u, int wait, int timeout_ms)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned submit;
+    unsigned flags = 0;
+    void* argp = NULL;
+    size_t argsz = 0;
+    int rc;
+
+    __atomic_store_n(u->sq_ktail, u->sq_tail, __ATOMIC_RELEASE);
+    submit = u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE);
+    if (wait || (__atomic_load_n(u->sq_kflags, __ATOMIC_RELAXED) &
+            (IORING_SQ_CQ_OVERFLOW | IORING_SQ_TASKRUN)) != 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    if (submit == 0 && flags == 0) {
+        return 0;
+    }
+    if (wait && timeout_ms >= 0) {
+        XMEMSET(&arg, 0, sizeof(arg));
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (__u64)(uintptr_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    rc = (int)syscall(__NR_io_uring_enter, u->ring_fd, submit,
+        wait ? 1 : 0, flags, argp, argsz);
+    if (rc < 0) {
+        /* Timed out, interrupted, or short of resources for a moment:
+         * whatever was not submitted stays queued for the next call. */
+        if (errno == ETIME || errno == EINTR || errno == EAGAIN ||
+                errno == EBUSY) {
+            return 0;
+        }
+        WMQB_LOG_ERR(u->broker, "broker: io_uring_enter failed (%d)", errno);
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    return rc;
+}
+
+static unsigned BrokerUring_SqRoom(BrokerUring* u)
+{
+    return u->sq_entries -
+        (u->sq_tail - __atomic_load_n(u->sq_khead, __ATOMIC_ACQUIRE));
+}
+
+/* Next free submission entry, zeroed. Submits what is queued when the
+ * submission queue is full. Returns NULL if it stays full. */
+static struct io_uring_sqe* BrokerUring_Sqe(BrokerUring* u)
+{
+    struct io_uring_sqe* sqe;
+
+    if (BrokerUring_SqRoom(u) == 0) {
+        (void)BrokerUring_Enter(u, 0, 0);
+        if (BrokerUring_SqRoom(u) == 0) {
+            return NULL;
+        }
+    }
+    sqe = &u->sqes[u->sq_tail & u->sq_mask];
+    XMEMSET(sqe, 0, sizeof(*sqe));
+    u->sq_tail++;
+    return sqe;
+}
+
+/* -------------------------------------------------------------------------- */
+/* Socket state                                                                */
+/* -------------------------------------------------------------------------- */
+
+static BrokerUringSock* BrokerUring_Lookup(BrokerUring* u, int fd)
+{
+    if (u == NULL || fd < 0 || fd >= u->nsocks) {
+        return NULL;
+    }
+    return u->socks[fd];
+}
+
+/* State for fd, created on first use */
+static BrokerUringSock* BrokerUring_Attach(BrokerUring* u, int fd)
+{
+    BrokerUringSock* s;
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fd >= u->nsocks) {
+        int n = (u->nsocks > 0) ? u->nsocks : 64;
+        BrokerUringSock** socks;
+        while (n <= fd) {
+            n *= 2;
+        }
+        socks = (BrokerUringSock**)WOLFMQTT_MALLOC(
+            sizeof(BrokerUringSock*) * (size_t)n);
+        if (socks == NULL) {
+            return NULL;
+        }
+        XMEMSET(socks, 0, sizeof(BrokerUringSock*) * (size_t)n);
+        if (u->socks != NULL) {
+            XMEMCPY(socks, u->socks,
+                sizeof(BrokerUringSock*) * (size_t)u->nsocks);
+            WOLFMQTT_FREE(u->socks);
+        }
+        u->socks = socks;
+        u->nsocks = n;
+    }
+    s = u->socks[fd];
+    if (s == NULL) {
+        s = (BrokerUringSock*)WOLFMQTT_MALLOC(sizeof(BrokerUringSock));
+        if (s == NULL) {
+            return NULL;
+        }
+        XMEMSET(s, 0, sizeof(*s));
+        s->fd = fd;
+        s->rx_bid = -1;
+        u->socks[fd] = s;
+    }
+    return s;
+}
+
+static void BrokerUring_SockFree(BrokerUringSock* s)
+{
+    while (s->tx_head != NULL) {
+        BrokerUringTx* tx = s->tx_head;
+        s->tx_head = tx->next;
+        WOLFMQTT_FREE(tx);
+    }
+    while (s->acc_count > 0) {
+        close(s->acc_fd[s->acc_head]);
+        s->acc_head = (s->acc_head + 1) % s->acc_cap;
+        s->acc_count--;
+    }
+    if (s->acc_fd != NULL) {
+        WOLFMQTT_FREE(s->acc_fd);
+    }
+    WOLFMQTT_FREE(s);
+}
+
+static int BrokerUring_HasInput(const BrokerUringSock* s)
+{
+    return s->rx_bid >= 0 || s->err != 0 ||
+        (s->flags & BROKER_URING_EOF) != 0 || s->acc_count > 0;
+}
+
+/* BROKER_NET_EV_* s can report under its owner's interest. Errors and EOF
+ * are read events regardless, as with EPOLLERR and EPOLLHUP. Output counts
+ * as writable once the queue has drained to half its cap. */
+static byte BrokerUring_Events(const BrokerUringSock* s)
+{
+    byte ev = 0;
+
+    if (BrokerUring_HasInput(s) && ((s->flags & BROKER_URING_NO_READ) == 0 ||
+            s->err != 0 || (s->flags & BROKER_URING_EOF) != 0)) {
+        ev |= BROKER_NET_EV_READ;
+    }
+    if ((s->flags & BROKER_URING_WANT_WRITE) != 0 &&
+            (s->tx_bytes <= BROKER_URING_TX_MAX / 2 || s->err != 0)) {
+        ev |= BROKER_NET_EV_WRITE;
+    }
+    return ev;
+}
+
+/* Put s on the ready list if it is registered and has an event to report */
+static void BrokerUring_SetReady(BrokerUring* u, BrokerUringSock* s)
+{
+    if ((s->flags & BROKER_URING_READY) != 0 || s->owner == NULL ||
+            BrokerUring_Events(s) == 0) {
+        return;
+    }
+    s->flags |= BROKER_URING_READY;
+    s->ready_next = NULL;
+    s->ready_prev = u->ready_tail;
+    if (u->ready_tail != NULL) {
+        u->ready_tail->ready_next = s;
+    }
+    else {
+        u->ready_head = s;
+    }
+    u->ready_tail = s;
+    u->nready++;
+}
+
+static void BrokerUring_ClearReady(BrokerUring* u, BrokerUringSock* s)
+{
+    if ((s->flags & BROKER_URING_READY) == 0) {
+        return;
+    }
+    if (s->ready_prev != NULL) {
+        s->ready_prev->ready_next = s->ready_next;
+    }
+    else {
+        u->ready_head = s->ready_next;
+    }
+    if (s->ready_next != NULL) {
+        s->ready_next->ready_prev = s->ready_prev;
+    }
+    else {
+        u->ready_tail = s->ready_prev;
+    }
+    s->ready_prev = s->ready_next = NULL;
+    s->flags &= ~BROKER_URING_READY;
+    u->nready--;
+}
+
+static void BrokerUring_SetInterest(BrokerUringSock* s, byte events)
+{
+    s->flags &= ~(BROKER_URING_NO_READ | BROKER_URING_WANT_WRITE);
+    if ((events & BROKER_NET_EV_READ) == 0) {
+        s->flags |= BROKER_URING_NO_READ;
+    }
+    if ((events & BROKER_NET_EV_WRITE) != 0) {
+        s->flags |= BROKER_URING_WANT_WRITE;
+    }
+}
+
+/* Revisit s in the next BrokerUring_Flush */
+static void BrokerUring_Defer(BrokerUring* u, BrokerUringSock* s)
+{
+    if ((s->flags & BROKER_URING_FLUSH) == 0) {
+        s->flags |= BROKER_URING_FLUSH;
+        s->flush_next = u->flush;
+        u->flush = s;
+    }
+}
+
+static void BrokerUring_ArmAccept(BrokerUring* u, BrokerUringSock* s)
+{
+    struct io_uring_sqe* sqe;
+
+    if ((s->flags & (BROKER_URING_ACCEPTING | BROKER_URING_CLOSING)) != 0 ||
+            u->closing) {
+        return;
+    }
+    sqe = BrokerUring_Sqe(u);
+    if (sqe == NULL) {
+        BrokerUring_Defer(u, s);
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = s->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (__u64)(uintptr_t)s | BROKER_URING_OP_ACCEPT;
+    s->flags |= BROKER_URING_ACCEPTING;
+    s->ops++;
+    u->ops++;
+}
+
+/* Keep one RECV outstanding while the connection has no unread data */
+static void BrokerUring_ArmRecv(BrokerUring* u, BrokerUringSock* s)
+{
+    struct io_uring_sqe* sqe;
+
+    if ((s->flags & (BROKER_URING_LISTENER | BROKER_URING_RECEIVING |
+            BROKER_URING_STARVED | BROKER_URING_EOF |
+            BROKER_URING_CLOSING)) != 0 ||
+            s->rx_bid >= 0 || s->err != 0 || u->closing) {
+        return;
+    }
+    sqe = BrokerUring_Sqe(u);
+    if (sqe == NULL) {
+        BrokerUring_Defer(u, s);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = s->fd;
+    sqe->len = BROKER_URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BROKER_URING_BGID;
+    sqe->user_data = (__u64)(uintptr_t)s | BROKER_URING_OP_RECV;
+    s->flags |= BROKER_URING_RECEIVING;
+    s->ops++;
+    u->ops++;
+}
+
+/* Hand a drained buffer back to the kernel. A connection whose RECV found
+ * the ring empty gets to retry. */
+static void BrokerUring_BufPut(BrokerUring* u, int bid)
+{
+    struct io_uring_buf* b;
+    BrokerUringSock* s;
+
+    b = &u->br->bufs[u->br_tail & (BROKER_URING_BUF_COUNT - 1)];
+    b->addr = (__u64)(uintptr_t)(u->bufs + (size_t)bid *
+        BROKER_URING_BUF_SIZE);
+    b->len = BROKER_URING_BUF_SIZE;
+    b->bid = (__u16)bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+
+    s = u->starved;
+    if (s != NULL) {
+        u->starved = s->starved_next;
+        s->starved_next = NULL;
+        s->flags &= ~BROKER_URING_STARVED;
+        BrokerUring_ArmRecv(u, s);
+    }
+}
+
+static void BrokerUring_Unstarve(BrokerUring* u, BrokerUringSock* s)
+{
+    BrokerUringSock** pp;
+
+    if ((s->flags & BROKER_URING_STARVED) == 0) {
+        return;
+    }
+    for (pp = &u->starved; *pp != NULL; pp = &(*pp)->starved_next) {
+        if (*pp == s) {
+            *pp = s->starved_next;
+            break;
+        }
+    }
+    s->starved_next = NULL;
+    s->flags &= ~BROKER_URING_STARVED;
+}
+
+static void BrokerUring_Cancel(BrokerUring* u, BrokerUringSock* s, int op)
+{
+    struct io_uring_sqe* sqe = BrokerUring_Sqe(u);
+
+    if (sqe == NULL) {
+        /* Completes the operation just the same */
+        (void)shutdown(s->fd, SHUT_RDWR);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (__u64)(uintptr_t)s | (__u64)op;
+    sqe->user_data = BROKER_URING_OP_CANCEL;
+}
+
+/* A closed connection's output is done: stop its remaining operations */
+static void BrokerUring_Retire(BrokerUring* u, BrokerUringSock* s)
+{
+    if ((s->flags & BROKER_URING_RECEIVING) != 0) {
+        BrokerUring_Cancel(u, s, BROKER_URING_OP_RECV);
+    }
+    if ((s->flags & BROKER_URING_ACCEPTING) != 0) {
+        BrokerUring_Cancel(u, s, BROKER_URING_OP_ACCEPT);
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Output                                                                      */
+/* -------------------------------------------------------------------------- */
+
+/* Submit s's queued output as one chain of linked SENDs. MSG_WAITALL makes
+ * each SEND finish its segment unless the connection fails; a short one
+ * cancels the rest of the chain, which is resubmitted from where it
+ * stopped once every completion is in. */
+static void BrokerUring_TxSubmit(BrokerUring* u, BrokerUringSock* s)
+{
+    BrokerUringTx* tx;
+    unsigned room;
+    int n = 0;
+    int i;
+
+    if (s->tx_inflight > 0 || s->tx_head == NULL || s->err != 0) {
+        return;
+    }
+    room = BrokerUring_SqRoom(u);
+    if (room < BROKER_URING_TX_CHAIN) {
+        (void)BrokerUring_Enter(u, 0, 0);
+        room = BrokerUring_SqRoom(u);
+    }
+    for (tx = s->tx_head; tx != NULL && n < BROKER_URING_TX_CHAIN &&
+            (unsigned)n < room; tx = tx->next) {
+        n++;
+    }
+    if (n == 0) {
+        BrokerUring_Defer(u, s);
+        return;
+    }
+    for (i = 0, tx = s->tx_head; i < n; i++, tx = tx->next) {
+        struct io_uring_sqe* sqe = BrokerUring_Sqe(u);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = s->fd;
+        sqe->addr = (__u64)(uintptr_t)(BROKER_URING_TX_DATA(tx) + tx->off);
+        sqe->len = tx->len - tx->off;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (i + 1 < n) {
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        sqe->user_data = (__u64)(uintptr_t)tx | BROKER_URING_OP_SEND;
+        tx->busy = 1;
+        s->tx_inflight++;
+        s->ops++;
+        u->ops++;
+    }
+}
+
+/* Every SEND of the chain has completed */
+static void BrokerUring_TxDone(BrokerUring* u, BrokerUringSock* s)
+{
+    BrokerUringTx* tx;
+
+    while ((tx = s->tx_head) != NULL && (tx->off >= tx->len || s->err != 0)) {
+        s->tx_head = tx->next;
+        s->tx_bytes -= tx->len;
+        WOLFMQTT_FREE(tx);
+    }
+    if ((s->flags & BROKER_URING_WANT_WRITE) != 0) {
+        BrokerUring_SetReady(u, s);
+    }
+    if (s->tx_head == NULL) {
+        s->tx_tail = NULL;
+        if ((s->flags & BROKER_URING_CLOSING) != 0) {
+            BrokerUring_Retire(u, s);
+        }
+        return;
+    }
+    for (tx = s->tx_head; tx != NULL; tx = tx->next) {
+        tx->busy = 0;
+    }
+    BrokerUring_Defer(u, s);
+}
+
+/* Queue everything the callbacks deferred since the last call */
+static void BrokerUring_Flush(BrokerUring* u)
+{
+    BrokerUringSock* s = u->flush;
+
+    u->flush = NULL;
+    while (s != NULL) {
+        BrokerUringSock* next = s->flush_next;
+        s->flush_next = NULL;
+        s->flags &= ~BROKER_URING_FLUSH;
+        if ((s->flags & BROKER_URING_LISTENER) != 0) {
+            BrokerUring_ArmAccept(u, s);
+        }
+        else {
+            BrokerUring_ArmRecv(u, s);
+            BrokerUring_TxSubmit(u, s);
+        }
+        s = next;
+    }
+}
+
+/* -------------------------------------------------------------------------- */
+/* Completions                                                                 */
+/* -------------------------------------------------------------------------- */
+
+static int BrokerUring_AcceptPush(BrokerUringSock* s, int fd)
+{
+    if (s->acc_count == s->acc_cap) {
+        int cap = (s->acc_cap > 0) ? s->acc_cap * 2 : 64;
+        int* q = (int*)WOLFMQTT_MALLOC(sizeof(int) * (size_t)cap);
+        int i;
+        if (q == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        for (i = 0; i < s->acc_count; i++) {
+            q[i] = s->acc_fd[(s->acc_head + i) % s->acc_cap];
+        }
+        if (s->acc_fd != NULL) {
+            WOLFMQTT_FREE(s->acc_fd);
+        }
+        s->acc_fd = q;
+        s->acc_cap = cap;
+        s->acc_head = 0;
+    }
+    s->acc_fd[(s->acc_head + s->acc_count) % s->acc_cap] = fd;
+    s->acc_count++;
+    return MQTT_CODE_SUCCESS;
+}
+
+static void BrokerUring_OnAccept(BrokerUring* u, BrokerUringSock* s,
+    int res, unsigned cflags)
+{
+    if (res >= 0) {
+        if ((s->flags & BROKER_URING_CLOSING) != 0 ||
+                BrokerUring_AcceptPush(s, res) != MQTT_CODE_SUCCESS) {
+            close(res);
+        }
+        else {
+            BrokerUring_SetReady(u, s);
+        }
+    }
+    else if (res != -ECANCELED) {
+        WMQB_LOG_ERR(u->broker, "broker: accept error sock=%d (%d)", s->fd,
+            -res);
+    }
+    if ((cflags & IORING_CQE_F_MORE) == 0) {
+        /* Multishot ended (error or cancel): re-arm unless closing */
+        s->flags &= ~BROKER_URING_ACCEPTING;
+        s->ops--;
+        u->ops--;
+        BrokerUring_ArmAccept(u, s);
+    }
+}
+
+static void BrokerUring_OnRecv(BrokerUring* u, BrokerUringSock* s, int res,
+    unsigned cflags)
+{
+    int bid = -1;
+
+    if ((cflags & IORING_CQE_F_BUFFER) != 0) {
+        bid = (int)(cflags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    s->flags &= ~BROKER_URING_RECEIVING;
+    s->ops--;
+    u->ops--;
+    if ((s->flags & BROKER_URING_CLOSING) != 0 || res == -ECANCELED) {
+        if (bid >= 0) {
+            BrokerUring_BufPut(u, bid);
+        }
+    }
+    else if (res > 0 && bid >= 0) {
+        s->rx_bid = bid;
+        s->rx_off = 0;
+        s->rx_len = (word32)res;
+        BrokerUring_SetReady(u, s);
+    }
+    else if (res == -ENOBUFS) {
+        /* Every buffer holds unread data; retry when one is handed back */
+        s->flags |= BROKER_URING_STARVED;
+        s->starved_next = u->starved;
+        u->starved = s;
+    }
+    else if (res == -EINTR || res == -EAGAIN) {
+        BrokerUring_ArmRecv(u, s);
+    }
+    else {
+        if (bid >= 0) {
+            BrokerUring_BufPut(u, bid);
+        }
+        if (res == 0) {
+            s->flags |= BROKER_URING_EOF;
+        }
+        else if (s->err == 0) {
+            s->err = res;
+        }
+        BrokerUring_SetReady(u, s);
+    }
+}
+
+static void BrokerUring_OnSend(BrokerUring* u, BrokerUringTx* tx, int res)
+{
+    BrokerUringSock* s = tx->sock;
+
+    if (res > 0) {
+        tx->off += (word32)res;
+    }
+    else if (res != -ECANCELED) {
+        /* Reported through the next read or write */
+        if (s->err == 0) {
+            s->err = (res < 0) ? res : -EPIPE;
+        }
+        BrokerUring_SetReady(u, s);
+    }
+    s->tx_inflight--;
+    s->ops--;
+    u->ops--;
+    if (s->tx_inflight == 0) {
+        BrokerUring_TxDone(u, s);
+    }
+}
+
+/* Consume every completion in the ring */
+static int BrokerUring_Reap(BrokerUring* u)
+{
+    unsigned head = *u->cq_khead;
+    unsigned tail;
+    int n = 0;
+
+    while (head != (tail = __atomic_load_n(u->cq_ktail, __ATOMIC_ACQUIRE))) {
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+            __u64 ud = cqe->user_data;
+            void* p = (void*)(uintptr_t)(ud & ~(__u64)BROKER_URING_OP_MASK);
+
+            switch ((int)(ud & BROKER_URING_OP_MASK)) {
+                case BROKER_URING_OP_ACCEPT:
+                    BrokerUring_OnAccept(u, (BrokerUringSock*)p, cqe->res,
+                        cqe->flags);
+                    break;
+                case BROKER_URING_OP_RECV:
+                    BrokerUring_OnRecv(u, (BrokerUringSock*)p, cqe->res,
+                        cqe->flags);
+                    break;
+                case BROKER_URING_OP_SEND:
+                    BrokerUring_OnSend(u, (BrokerUringTx*)p, cqe->res);
+                    break;
+                default:
+                    break;
+            }
+            n++;
+        }
+        __atomic_store_n(u->cq_khead, head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+/* Submit deferred work and wait up to timeout_ms (0 = poll) for
+ * completions, then process them */
+static int BrokerUring_Wait(BrokerUring* u, int timeout_ms)
+{
+    int rc;
+
+    BrokerUring_Flush(u);
+    rc = BrokerUring_Enter(u, timeout_ms != 0, timeout_ms);
+    if (rc < 0) {
+        return rc;
+    }
+    (void)BrokerUring_Reap(u);
+    if ((__atomic_load_n(u->sq_kflags, __ATOMIC_RELAXED) &
+            IORING_SQ_CQ_OVERFLOW) != 0) {
+        /* Completions spilled past the ring; flush them in */
+        rc = BrokerUring_Enter(u, 0, 0);
+        (void)BrokerUring_Reap(u);
+    }
+    return (rc < 0) ? rc : MQTT_CODE_SUCCESS;
+}
+
+/* Release closed connections whose operations have all completed, and shut
+ * down those still flushing after BROKER_URING_LINGER_MS. */
+static void BrokerUring_Sweep(BrokerUring* u)
+{
+    BrokerUringSock** pp = &u->zombies;
+    BrokerUringSock* s;
+    uint64_t now = 0;
+
+    while ((s = *pp) != NULL) {
+        if (s->ops == 0 && s->tx_head == NULL &&
+                (s->flags & BROKER_URING_FLUSH) == 0) {
+            *pp = s->zombie_next;
+            close(s->fd);
+            BrokerUring_SockFree(s);
+            continue;
+        }
+        if ((s->flags & BROKER_URING_SHUT) == 0) {
+            if (now == 0) {
+                now = BrokerUring_NowMs();
+            }
+            if (now >= s->linger_ms) {
+                s->flags |= BROKER_URING_SHUT;
+                (void)shutdown(s->fd, SHUT_RDWR);
+                BrokerUring_Retire(u, s);
+            }
+        }
+        pp = &s->zombie_next;
+    }
+}
+
+static void BrokerUring_Free(BrokerUring* u)
+{
+    int i;
+
+    if (u == NULL) {
+        return;
+    }
+    if (u->ring_fd >= 0 && u->sqes != NULL && u->sqes != MAP_FAILED) {
+        /* Give closed connections a last chance to flush, and wind down the
+         * receives of any the application left open. */
+        uint64_t end = BrokerUring_NowMs() + 2 * BROKER_URING_LINGER_MS;
+        u->closing = 1;
+        for (i = 0; i < u->nsocks; i++) {
+            if (u->socks[i] != NULL) {
+                BrokerUring_Retire(u, u->socks[i]);
+            }
+        }
+        while (u->ops > 0 || u->zombies != NULL) {
+            BrokerUring_Sweep(u);
+            if (BrokerUring_NowMs() >= end || BrokerUring_Wait(u, 10) < 0) {
+                break;
+            }
+        }
+    }
+    while (u->zombies != NULL) {
+        BrokerUringSock* s = u->zombies;
+        u->zombies = s->zombie_next;
+        close(s->fd);
+        BrokerUring_SockFree(s);
+    }
+    /* Closing the ring cancels anything still outstanding */
+    if (u->ring_fd >= 0) {
+        close(u->ring_fd);
+    }
+    for (i = 0; i < u->nsocks; i++) {
+        if (u->socks[i] != NULL) {
+            BrokerUring_SockFree(u->socks[i]);
+        }
+    }
+    if (u->socks != NULL) {
+        WOLFMQTT_FREE(u->socks);
+    }
+    if (u->ring != NULL && u->ring != MAP_FAILED) {
+        munmap(u->ring, u->ring_sz);
+    }
+    if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sqes_sz);
+    }
+    if (u->br != NULL && u->br != MAP_FAILED) {
+        munmap(u->br, u->br_sz);
+    }
+    if (u->bufs != NULL && u->bufs != MAP_FAILED) {
+        munmap(u->bufs, u->bufs_sz);
+    }
+    WOLFMQTT_FREE(u);
+}
+
+/* -------------------------------------------------------------------------- */
+/* MqttBrokerNet callbacks                                                     */
+/* -------------------------------------------------------------------------- */
+
+/* ctx is the owning MqttBroker, which holds the ring; it is created on first
+ * use. */
+
+static BrokerUring* BrokerUring_Get(MqttBroker* broker)
+{
+    if (broker == NULL) {
+        return NULL;
+    }
+    if (broker->uring == NULL) {
+        broker->uring = BrokerUring_New(broker);
+    }
+    return (BrokerUring*)broker->uring;
+}
+
+static int BrokerUring_Listen(void* ctx, BROKER_SOCKET_T* sock,
+    word16 port, int backlog)
+{
+    BrokerUring* u;
+    BrokerUringSock* s;
+    int rc;
+
+    rc = BrokerPosix_Listen(ctx, sock, port, backlog);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
+    }
+    u = BrokerUring_Get((MqttBroker*)ctx);
+    s = (u != NULL) ? BrokerUring_Attach(u, *sock) : NULL;
+    if (s == NULL) {
+        close(*sock);
+        *sock = BROKER_SOCKET_INVALID;
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    s->flags |= BROKER_URING_LISTENER;
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerUring_Accept(void* ctx, BROKER_SOCKET_T listen_sock,
+    BROKER_SOCKET_T* client_sock)
+{
+    BrokerUring* u = BrokerUring_Get((MqttBroker*)ctx);
+    BrokerUringSock* s = BrokerUring_Lookup(u, listen_sock);
+
+    if (s == NULL || (s->flags & BROKER_URING_LISTENER) == 0) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    if (s->acc_count == 0) {
+        BrokerUring_ArmAccept(u, s);
+        return MQTT_CODE_CONTINUE;
+    }
+    *client_sock = s->acc_fd[s->acc_head];
+    s->acc_head = (s->acc_head + 1) % s->acc_cap;
+    s->acc_count--;
+    if (s->acc_count == 0) {
+        BrokerUring_ClearReady(u, s);
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerUring_Read(void* ctx, BROKER_SOCKET_T sock,
+    byte* buf, int buf_len, int timeout_ms)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u;
+    BrokerUringSock* s;
+    uint64_t deadline = 0;
+    int rc;
+
+    if (buf == NULL || buf_len <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (sock < 0) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    u = BrokerUring_Get(broker);
+    if (u == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    s = BrokerUring_Attach(u, sock);
+    if (s == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+
+    for (;;) {
+        uint64_t now;
+
+        if (s->rx_bid >= 0) {
+            word32 n = s->rx_len - s->rx_off;
+            if (n > (word32)buf_len) {
+                n = (word32)buf_len;
+            }
+            XMEMCPY(buf, u->bufs + (size_t)s->rx_bid * BROKER_URING_BUF_SIZE +
+                s->rx_off, n);
+            s->rx_off += n;
+            if (s->rx_off >= s->rx_len) {
+                int bid = s->rx_bid;
+                s->rx_bid = -1;
+                if (BrokerUring_Events(s) == 0) {
+                    BrokerUring_ClearReady(u, s);
+                }
+                BrokerUring_BufPut(u, bid);
+                BrokerUring_ArmRecv(u, s);
+            }
+            return (int)n;
+        }
+        if (s->err != 0 || (s->flags & BROKER_URING_EOF) != 0) {
+            WMQB_LOG_ERR(broker, "broker: recv error sock=%d rc=0 errno=%d",
+                (int)sock, -s->err);
+            return MQTT_CODE_ERROR_NETWORK;
+        }
+        BrokerUring_ArmRecv(u, s);
+        if (timeout_ms <= 0) {
+            return MQTT_CODE_CONTINUE;
+        }
+        now = BrokerUring_NowMs();
+        if (deadline == 0) {
+            deadline = now + (uint64_t)timeout_ms;
+        }
+        else if (now >= deadline) {
+            return MQTT_CODE_ERROR_TIMEOUT;
+        }
+        rc = BrokerUring_Wait(u, (int)(deadline - now));
+        if (rc < 0) {
+            return rc;
+        }
+    }
+}
+
+static int BrokerUring_Write(void* ctx, BROKER_SOCKET_T sock,
+    const byte* buf, int buf_len, int timeout_ms)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u;
+    BrokerUringSock* s;
+    BrokerUringTx* tx;
+    uint64_t deadline = 0;
+    int rc;
+
+    if (buf == NULL || buf_len <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    if (sock < 0) {
+        return MQTT_CODE_ERROR_NETWORK;
+    }
+    u = BrokerUring_Get(broker);
+    if (u == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    s = BrokerUring_Attach(u, sock);
+    if (s == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+
+    /* A peer that stops reading holds at most BROKER_URING_TX_MAX bytes.
+     * Beyond that a zero-timeout write is refused like a send to a full
+     * socket, and any other waits for the queue to drain. */
+    for (;;) {
+        uint64_t now;
+
+        if (s->err != 0) {
+            WMQB_LOG_ERR(broker, "broker: send error sock=%d rc=-1 errno=%d",
+                (int)sock, -s->err);
+            return MQTT_CODE_ERROR_NETWORK;
+        }
+        if (s->tx_bytes == 0 ||
+                s->tx_bytes + (word32)buf_len <= BROKER_URING_TX_MAX) {
+            break;
+        }
+        if (timeout_ms <= 0) {
+            return MQTT_CODE_CONTINUE;
+        }
+        now = BrokerUring_NowMs();
+        if (deadline == 0) {
+            deadline = now + (uint64_t)timeout_ms;
+        }
+        if (now >= deadline) {
+            return MQTT_CODE_ERROR_TIMEOUT;
+        }
+        rc = BrokerUring_Wait(u, (int)(deadline - now));
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    tx = s->tx_tail;
+    if (tx == NULL || tx->busy || tx->cap - tx->len < (word32)buf_len) {
+        word32 cap = ((word32)buf_len > BROKER_URING_BUF_SIZE) ?
+            (word32)buf_len : BROKER_URING_BUF_SIZE;
+        tx = (BrokerUringTx*)WOLFMQTT_MALLOC(sizeof(BrokerUringTx) + cap);
+        if (tx == NULL) {
+            return MQTT_CODE_ERROR_MEMORY;
+        }
+        XMEMSET(tx, 0, sizeof(*tx));
+        tx->sock = s;
+        tx->cap = cap;
+        if (s->tx_tail != NULL) {
+            s->tx_tail->next = tx;
+        }
+        else {
+            s->tx_head = tx;
+        }
+        s->tx_tail = tx;
+    }
+    XMEMCPY(BROKER_URING_TX_DATA(tx) + tx->len, buf, (size_t)buf_len);
+    tx->len += (word32)buf_len;
+    s->tx_bytes += (word32)buf_len;
+    BrokerUring_Defer(u, s);
+    return buf_len;
+}
+
+static int BrokerUring_Close(void* ctx, BROKER_SOCKET_T sock)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u = (broker != NULL) ? (BrokerUring*)broker->uring : NULL;
+    BrokerUringSock* s = BrokerUring_Lookup(u, sock);
+
+    if (s == NULL) {
+        if (sock != BROKER_SOCKET_INVALID) {
+            close(sock);
+        }
+        return MQTT_CODE_SUCCESS;
+    }
+    /* Detach from the descriptor and drain; BrokerUring_Sweep closes it */
+    u->socks[sock] = NULL;
+    BrokerUring_ClearReady(u, s);
+    BrokerUring_Unstarve(u, s);
+    s->owner = NULL;
+    s->flags |= BROKER_URING_CLOSING;
+    if (s->rx_bid >= 0) {
+        BrokerUring_BufPut(u, s->rx_bid);
+        s->rx_bid = -1;
+    }
+    while (s->acc_count > 0) {
+        close(s->acc_fd[s->acc_head]);
+        s->acc_head = (s->acc_head + 1) % s->acc_cap;
+        s->acc_count--;
+    }
+    s->linger_ms = BrokerUring_NowMs() + BROKER_URING_LINGER_MS;
+    s->zombie_next = u->zombies;
+    u->zombies = s;
+    if (s->err != 0 && s->tx_inflight == 0) {
+        BrokerUring_TxDone(u, s);
+    }
+    else if (s->tx_head == NULL) {
+        BrokerUring_Retire(u, s);
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerUring_PollAdd(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
+{
+    BrokerUring* u;
+    BrokerUringSock* s;
+
+    if (ctx == NULL || sock < 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    u = BrokerUring_Get((MqttBroker*)ctx);
+    if (u == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    s = BrokerUring_Attach(u, sock);
+    if (s == NULL) {
+        return MQTT_CODE_ERROR_MEMORY;
+    }
+    /* Writes are queued, so write interest is answered from the queue
+     * level and only read interest needs a completion behind it. */
+    BrokerUring_SetInterest(s, events);
+    s->owner = owner;
+    if ((s->flags & BROKER_URING_LISTENER) != 0) {
+        BrokerUring_ArmAccept(u, s);
+    }
+    else {
+        BrokerUring_ArmRecv(u, s);
+    }
+    BrokerUring_SetReady(u, s);
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerUring_PollMod(void* ctx, BROKER_SOCKET_T sock, byte events,
+    void* owner)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u = (broker != NULL) ? (BrokerUring*)broker->uring : NULL;
+    BrokerUringSock* s;
+
+    if (u == NULL || sock < 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    s = BrokerUring_Lookup(u, sock);
+    if (s == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    BrokerUring_SetInterest(s, events);
+    s->owner = owner;
+    BrokerUring_ClearReady(u, s);
+    BrokerUring_SetReady(u, s);
+    return MQTT_CODE_SUCCESS;
+}
+
+static int BrokerUring_PollDel(void* ctx, BROKER_SOCKET_T sock)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u = (broker != NULL) ? (BrokerUring*)broker->uring : NULL;
+    BrokerUringSock* s;
+
+    if (u == NULL || sock < 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    s = BrokerUring_Lookup(u, sock);
+    if (s != NULL) {
+        BrokerUring_ClearReady(u, s);
+        s->owner = NULL;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+/* Submit, reap, then report connections with events. The ready list is
+ * rotated so a backlog longer than max_events is served round-robin. */
+static int BrokerUring_PollWait(void* ctx, MqttBrokerNetEvent* events,
+    int max_events, int timeout_ms)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+    BrokerUring* u;
+    int rc;
+    int n = 0;
+    int scan;
+
+    if (broker == NULL || events == NULL || max_events <= 0) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    u = (BrokerUring*)broker->uring;
+    if (u == NULL) {
+        return 0;
+    }
+    BrokerUring_Sweep(u);
+    if (u->ready_head != NULL) {
+        timeout_ms = 0;
+    }
+    else if (u->zombies != NULL && (timeout_ms < 0 ||
+            timeout_ms > BROKER_URING_LINGER_MS)) {
+        timeout_ms = BROKER_URING_LINGER_MS;
+    }
+    rc = BrokerUring_Wait(u, timeout_ms);
+    if (rc < 0) {
+        return rc;
+    }
+    scan = u->nready;
+    while (n < max_events && scan-- > 0) {
+        BrokerUringSock* s = u->ready_head;
+        byte ev = BrokerUring_Events(s);
+        BrokerUring_ClearReady(u, s);
+        if (ev == 0) {
+            continue; /* output refilled since s became writable */
+        }
+        BrokerUring_SetReady(u, s);
+        events[n].owner = s->owner;
+        events[n].events = ev;
+        n++;
+    }
+    return n;
+}
+
+static int BrokerUring_PollFree(void* ctx)
+{
+    MqttBroker* broker = (MqttBroker*)ctx;
+
+    if (broker != NULL && broker->uring != NULL) {
+        BrokerUring_Free((BrokerUring*)broker->uring);
+        broker->uring = NULL;
+    }
+    return MQTT_CODE_SUCCESS;
+}
+
+int MqttBrokerNet_IoUring_Init(MqttBrokerNet* net)
+{
+    BrokerUring* probe;
+    int rc;
+
+    if (net == NULL) {
+        return MQTT_CODE_ERROR_BAD_ARG;
+    }
+    /* Fail now, while the caller can still fall back to
+     * MqttBrokerNet_Init, rather than at the first listen. */
+    probe = BrokerUring_New(NULL);
+    if (probe == NULL) {
+        return MQTT_CODE_ERROR_SYSTEM;
+    }
+    BrokerUring_Free(probe);
+
+    /* Same process setup (SIGPIPE) and listen path as the sockets backend */
+    rc = MqttBrokerNet_Init(net);
+    if (rc != MQTT_CODE_SUCCESS) {
+        return rc;
+    }
+    net->listen = BrokerUring_Listen;
+    net->accept = BrokerUring_Accept;
+    net->read   = BrokerUring_Read;
+    net->write  = BrokerUring_Write;
+    net->close  = BrokerUring_Close;
+    net->poll_add  = BrokerUring_PollAdd;
+    net->poll_del  = BrokerUring_PollDel;
+    net->poll_wait = BrokerUring_PollWait;
+    net->poll_free = BrokerUring_PollFree;
+    net->poll_mod  = BrokerUring_PollMod;
+    /* Write already gathers a connection's output into one deferred send,
+     * so the broker's write queue goes through it segment by segment. */
+    net->writev = NULL;
+    return MQTT_CODE_SUCCESS;
+}
+
+int BrokerUring_IsNet(const MqttBrokerNet* net)
+{
+    return net != NULL && net->read == BrokerUring_Read;
+}
+
+#endif /* WOLFMQTT_BROKER_IO_URING */
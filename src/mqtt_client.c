@@ -810,6 +810,13 @@ static int MqttClient_DecodePacket(MqttClient* client, byte* rx_buf,
             else {
                 p_publish = &publish;
                 XMEMSET(p_publish, 0, sizeof(MqttPublish));
+            #ifdef WOLFMQTT_V5
+                /* The header peek also needs the protocol level: a v5
+                 * PUBLISH may carry a zero-length Topic Name paired with a
+                 * Topic Alias, which is only valid once the properties are
+                 * parsed. The peek's property list is released below. */
+                p_publish->protocol_level = client->protocol_level;
+            #endif
             }
             rc = MqttDecode_Publish(rx_buf, rx_len, p_publish);
             if (rc >= 0) {
@@ -824,6 +831,10 @@ static int MqttClient_DecodePacket(MqttClient* client, byte* rx_buf,
                         rc = tmp;
                     }
                 }
+                if (packet_obj == NULL) {
+                    MqttProps_Free(p_publish->props);
+                    p_publish->props = NULL;
+                }
             #endif
             }
             break;
@@ -1959,6 +1970,27 @@ int MqttClient_SetPropertyCallback(MqttClient *client, MqttPropertyCb propCb,
 }
 #endif
 
+int MqttClient_SetReadAhead(MqttClient *client, byte *buf, int buf_len)
+{
+    if (client == NULL || (buf != NULL && buf_len <= 0))
+        return MQTT_TRACE_ERROR(MQTT_CODE_ERROR_BAD_ARG);
+
+    client->rd_buf = buf;
+    client->rd_buf_len = (buf != NULL) ? buf_len : 0;
+    client->rd_pos = 0;
+    client->rd_len = 0;
+
+    return MQTT_CODE_SUCCESS;
+}
+
+int MqttClient_ReadPending(MqttClient *client)
+{
+    if (client == NULL)
+        return 0;
+
+    return client->rd_len - client->rd_pos;
+}
+
 int MqttClient_Connect(MqttClient *client, MqttConnect *mc_connect)
 {
     int rc;
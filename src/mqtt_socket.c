@@ -281,6 +281,61 @@ static int MqttSocket_ReadDo(MqttClient *client, byte* buf, int buf_len,
     return rc;
 }
 
+/* Serve a read from the client's read-ahead buffer, refilling it with one
+ * network read of up to rd_buf_len bytes once drained. A remainder at least
+ * as large as the buffer is read straight into buf to avoid the extra copy.
+ * Returns the bytes provided, or the network result if there were none. */
+static int MqttSocket_ReadAhead(MqttClient *client, byte* buf, int buf_len,
+    int timeout_ms)
+{
+    int rc = 0;
+    int pos = 0;
+
+    if (client->rd_buf == NULL) {
+        return MqttSocket_ReadDo(client, buf, buf_len, timeout_ms);
+    }
+
+    while (pos < buf_len) {
+        if (client->rd_pos < client->rd_len) {
+            int len = client->rd_len - client->rd_pos;
+            if (len > buf_len - pos) {
+                len = buf_len - pos;
+            }
+            XMEMCPY(&buf[pos], &client->rd_buf[client->rd_pos], len);
+            client->rd_pos += len;
+            pos += len;
+            continue;
+        }
+
+        if (buf_len - pos >= client->rd_buf_len) {
+            rc = MqttSocket_ReadDo(client, &buf[pos], buf_len - pos,
+                timeout_ms);
+            if (rc > 0) {
+                /* Clamp return value: read callback is user-provided */
+                if (rc > buf_len - pos) {
+                    rc = buf_len - pos;
+                }
+                pos += rc;
+            }
+            break;
+        }
+        rc = MqttSocket_ReadDo(client, client->rd_buf, client->rd_buf_len,
+            timeout_ms);
+        if (rc <= 0) {
+            break;
+        }
+        if (rc > client->rd_buf_len) {
+            rc = client->rd_buf_len;
+        }
+        client->rd_pos = 0;
+        client->rd_len = rc;
+    }
+
+    /* Bytes already copied out are reported first; a network error or
+     * timeout behind them recurs on the next read. */
+    return (pos > 0) ? pos : rc;
+}
+
 int MqttSocket_Read(MqttClient *client, byte* buf, int buf_len, int timeout_ms)
 {
     int rc;
@@ -297,7 +352,7 @@ int MqttSocket_Read(MqttClient *client, byte* buf, int buf_len, int timeout_ms)
     }
 
 #ifdef WOLFMQTT_NONBLOCK
-    rc = MqttSocket_ReadDo(client, &buf[client->read.pos],
+    rc = MqttSocket_ReadAhead(client, &buf[client->read.pos],
         buf_len - client->read.pos, timeout_ms);
     if (rc >= 0) {
         /* Clamp return value: read callback is user-provided and may
@@ -314,7 +369,7 @@ int MqttSocket_Read(MqttClient *client, byte* buf, int buf_len, int timeout_ms)
 
 #else
     do {
-        rc = MqttSocket_ReadDo(client, &buf[client->read.pos],
+        rc = MqttSocket_ReadAhead(client, &buf[client->read.pos],
             buf_len - client->read.pos, timeout_ms);
         if (rc <= 0) {
             break;
@@ -578,6 +633,10 @@ int MqttSocket_Disconnect(MqttClient *client)
         }
         MqttClient_Flags(client, MQTT_CLIENT_FLAG_IS_CONNECTED, 0);
 
+        /* Read-ahead bytes belong to the closed connection */
+        client->rd_pos = 0;
+        client->rd_len = 0;
+
     #ifdef ENABLE_MQTT_CURL
         curl_global_cleanup();
     #endif
@@ -0,0 +1,326 @@
+/* broker_accept.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* Connection-storm benchmark for the wolfMQTT broker.
+ *
+ * Opens N TCP connections to a running broker all at once (as a fleet of
+ * devices does after a network blip), sends an MQTT 3.1.1 CONNECT on each as
+ * soon as the TCP handshake completes, and waits for every CONNACK. Reports
+ * the wall time to admit the whole fleet and the per-connection admission
+ * latency (connect() to CONNACK). Connections are held open until all are
+ * admitted, so the broker carries the full client count at the end.
+ *
+ * Both sides need enough descriptors: raise `ulimit -n` for the broker, this
+ * tool raises its own soft limit as far as the hard limit allows.
+ *
+ * Build: ./configure --enable-broker && make
+ * Run:   ./src/mqtt_broker -p 11883 -v 1 &
+ *        ./tests/bench/broker_accept -p 11883 -n 10000
+ */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BENCH_DEFAULT_HOST    "127.0.0.1"
+#define BENCH_DEFAULT_PORT    1883
+#define BENCH_DEFAULT_COUNT   10000
+#define BENCH_DEFAULT_TIMEOUT 60    /* seconds */
+#define BENCH_CLIENT_ID_MAX   24
+
+enum {
+    BENCH_CONNECTING = 0,   /* waiting for the TCP handshake */
+    BENCH_CONNACK_WAIT,     /* CONNECT sent, waiting for CONNACK */
+    BENCH_ADMITTED,
+    BENCH_FAILED
+};
+
+typedef struct BenchConn {
+    int    fd;
+    int    state;
+    int    rx_len;
+    unsigned char rx[4];
+    double start_ms;
+    double admit_ms;
+} BenchConn;
+
+static double bench_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static int bench_cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_raise_nofile(int need)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)need) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY ||
+            rl.rlim_max >= (rlim_t)need) ? (rlim_t)need : rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+/* MQTT 3.1.1 CONNECT, clean session, keep alive 60, Client ID id. */
+static int bench_encode_connect(unsigned char* buf, int idx)
+{
+    char id[BENCH_CLIENT_ID_MAX];
+    int id_len = snprintf(id, sizeof(id), "bench-%d", idx);
+    int pos = 0;
+
+    buf[pos++] = 0x10;
+    buf[pos++] = (unsigned char)(10 + 2 + id_len);
+    buf[pos++] = 0x00; buf[pos++] = 0x04;
+    buf[pos++] = 'M'; buf[pos++] = 'Q'; buf[pos++] = 'T'; buf[pos++] = 'T';
+    buf[pos++] = 0x04;                  /* protocol level 3.1.1 */
+    buf[pos++] = 0x02;                  /* clean session */
+    buf[pos++] = 0x00; buf[pos++] = 60; /* keep alive */
+    buf[pos++] = 0x00; buf[pos++] = (unsigned char)id_len;
+    memcpy(buf + pos, id, (size_t)id_len);
+    return pos + id_len;
+}
+
+static int bench_open(BenchConn* c, const struct sockaddr_in* addr)
+{
+    int one = 1;
+
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    (void)fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+    (void)setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->start_ms = bench_now_ms();
+    if (connect(c->fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0 &&
+            errno != EINPROGRESS) {
+        return -1;
+    }
+    c->state = BENCH_CONNECTING;
+    return 0;
+}
+
+/* Advance one connection on readiness. Returns 1 once it leaves the
+ * in-flight set (admitted or failed). */
+static int bench_service(BenchConn* c, int idx, short revents)
+{
+    unsigned char pkt[64];
+    int len;
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+
+    if (c->state == BENCH_CONNECTING) {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 ||
+                err != 0) {
+            c->state = BENCH_FAILED;
+            return 1;
+        }
+        len = bench_encode_connect(pkt, idx);
+        if (send(c->fd, pkt, (size_t)len, MSG_NOSIGNAL) != len) {
+            c->state = BENCH_FAILED;
+            return 1;
+        }
+        c->state = BENCH_CONNACK_WAIT;
+        return 0;
+    }
+    if ((revents & POLLIN) == 0) {
+        c->state = BENCH_FAILED;
+        return 1;
+    }
+    len = (int)recv(c->fd, c->rx + c->rx_len,
+        sizeof(c->rx) - (size_t)c->rx_len, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (len <= 0) {
+        c->state = BENCH_FAILED;
+        return 1;
+    }
+    c->rx_len += len;
+    if (c->rx_len < (int)sizeof(c->rx)) {
+        return 0;
+    }
+    if (c->rx[0] != 0x20 || c->rx[1] != 0x02 || c->rx[3] != 0x00) {
+        c->state = BENCH_FAILED;
+        return 1;
+    }
+    c->admit_ms = bench_now_ms() - c->start_ms;
+    c->state = BENCH_ADMITTED;
+    return 1;
+}
+
+static void bench_usage(const char* prog)
+{
+    printf("usage: %s [-h host] [-p port] [-n connections] [-t timeout_sec]\n",
+        prog);
+}
+
+int main(int argc, char** argv)
+{
+    const char* host = BENCH_DEFAULT_HOST;
+    int port = BENCH_DEFAULT_PORT;
+    int count = BENCH_DEFAULT_COUNT;
+    int timeout_sec = BENCH_DEFAULT_TIMEOUT;
+    struct sockaddr_in addr;
+    BenchConn* conns;
+    struct pollfd* pfds;
+    int* pidx;
+    double* lat;
+    double t0, elapsed;
+    int admitted = 0, failed = 0, pending;
+    int i, n;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout_sec = atoi(argv[++i]);
+        }
+        else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (count <= 0 || port <= 0 || port > 65535 || timeout_sec <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bench: bad IPv4 address %s\n", host);
+        return 1;
+    }
+
+    bench_raise_nofile(count + 16);
+    conns = (BenchConn*)calloc((size_t)count, sizeof(BenchConn));
+    pfds = (struct pollfd*)calloc((size_t)count, sizeof(struct pollfd));
+    pidx = (int*)calloc((size_t)count, sizeof(int));
+    lat = (double*)calloc((size_t)count, sizeof(double));
+    if (conns == NULL || pfds == NULL || pidx == NULL || lat == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+
+    /* The storm: every connect() is issued before any CONNACK is read. */
+    t0 = bench_now_ms();
+    for (i = 0; i < count; i++) {
+        conns[i].fd = -1;
+        if (bench_open(&conns[i], &addr) != 0) {
+            if (failed == 0) {
+                fprintf(stderr, "bench: connect %d failed (%s)\n", i,
+                    strerror(errno));
+            }
+            conns[i].state = BENCH_FAILED;
+            failed++;
+        }
+    }
+
+    pending = count - failed;
+    while (pending > 0) {
+        if (bench_now_ms() - t0 > (double)timeout_sec * 1000.0) {
+            fprintf(stderr, "bench: timed out, %d connections pending\n",
+                pending);
+            break;
+        }
+        n = 0;
+        for (i = 0; i < count; i++) {
+            if (conns[i].state == BENCH_CONNECTING ||
+                    conns[i].state == BENCH_CONNACK_WAIT) {
+                pfds[n].fd = conns[i].fd;
+                pfds[n].events = (conns[i].state == BENCH_CONNECTING) ?
+                    POLLOUT : POLLIN;
+                pfds[n].revents = 0;
+                pidx[n++] = i;
+            }
+        }
+        if (poll(pfds, (nfds_t)n, 100) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bench: poll");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (pfds[i].revents != 0 &&
+                    bench_service(&conns[pidx[i]], pidx[i], pfds[i].revents)) {
+                pending--;
+                if (conns[pidx[i]].state == BENCH_ADMITTED) {
+                    lat[admitted++] = conns[pidx[i]].admit_ms;
+                }
+                else {
+                    failed++;
+                }
+            }
+        }
+    }
+    elapsed = bench_now_ms() - t0;
+
+    printf("admitted %d/%d connections in %.1f ms (%.0f conn/s), "
+        "%d failed\n", admitted, count, elapsed,
+        (elapsed > 0.0) ? (double)admitted * 1000.0 / elapsed : 0.0, failed);
+    if (admitted > 0) {
+        qsort(lat, (size_t)admitted, sizeof(double), bench_cmp_double);
+        printf("CONNACK latency ms: p50 %.1f  p99 %.1f  max %.1f\n",
+            lat[admitted / 2], lat[(admitted * 99) / 100],
+            lat[admitted - 1]);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+    }
+    free(lat);
+    free(pidx);
+    free(pfds);
+    free(conns);
+    return (admitted == count) ? 0 : 1;
+}
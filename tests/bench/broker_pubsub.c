@@ -0,0 +1,529 @@
+/* broker_pubsub.c
+ *
+ * Copyright (C) 2006-2026 wolfSSL Inc.
+ *
+ * This file is part of wolfMQTT.
+ *
+ * wolfMQTT is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * wolfMQTT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ */
+
+/* Publish/subscribe throughput benchmark for the wolfMQTT broker.
+ *
+ * Connects N publisher/subscriber pairs to a running broker. Subscriber i
+ * subscribes to "bench/<i>" at QoS 0 and publisher i sends M QoS 0
+ * PUBLISHes of the given payload size to that topic, keeping at most W
+ * messages in flight per pair so the broker is never asked to buffer an
+ * unbounded backlog. Reports the wall time until every subscriber has
+ * received every message, as messages and payload bytes per second.
+ *
+ * Deliveries are counted by walking the fixed headers of the received
+ * stream, so packets of one subscriber may differ in size.
+ *
+ * Use it to compare network backends of the same broker build, e.g.
+ *   ./src/mqtt_broker -p 11883 -v 1 &       (epoll or select)
+ *   ./src/mqtt_broker -p 11883 -v 1 -U &    (io_uring)
+ *   ./tests/bench/broker_pubsub -p 11883 -n 100 -m 10000
+ *
+ * -l pads each topic to the given length. -a switches both sides to MQTT v5
+ * Topic Aliases: the publisher binds alias 1 on its first PUBLISH and then
+ * sends the alias alone, and the subscriber takes one alias from the broker
+ * (Topic Alias Maximum 1). Comparing the wire bytes per message reported
+ * with and without -a shows what aliases save for long topics, e.g.
+ *   ./tests/bench/broker_pubsub -p 11883 -n 10 -m 10000 -s 16 -l 80
+ *   ./tests/bench/broker_pubsub -p 11883 -n 10 -m 10000 -s 16 -l 80 -a
+ */
+
+#ifdef HAVE_CONFIG_H
+    #include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define BENCH_DEFAULT_HOST    "127.0.0.1"
+#define BENCH_DEFAULT_PORT    1883
+#define BENCH_DEFAULT_PAIRS   100
+#define BENCH_DEFAULT_MSGS    10000
+#define BENCH_DEFAULT_PAYLOAD 64
+#define BENCH_DEFAULT_WINDOW  32
+#define BENCH_DEFAULT_TIMEOUT 60    /* seconds */
+#define BENCH_MAX_PAYLOAD     65000
+#define BENCH_TOPIC_MAX       200
+#define BENCH_RX_CHUNK        65536
+
+typedef struct BenchPair {
+    int    pub_fd;
+    int    sub_fd;
+    long   sent;        /* PUBLISHes fully written */
+    int    tx_off;      /* bytes of the current PUBLISH already written */
+    long   tx_bytes;    /* PUBLISH bytes written by the publisher */
+    long   rx_bytes;    /* PUBLISH bytes received by the subscriber */
+    long   rx_msgs;     /* PUBLISHes received by the subscriber */
+    long   rx_skip;     /* bytes left of the packet being received */
+    int    rx_hdr;      /* fixed header bytes seen, 0 between packets */
+    long   rx_remain;   /* Remaining Length decoded so far */
+    long   rx_mult;
+    int    first_len;   /* encoded size of the first PUBLISH */
+    int    pkt_len;     /* encoded size of each later PUBLISH */
+    unsigned char* first;
+    unsigned char* pkt;
+} BenchPair;
+
+static double bench_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+static void bench_raise_nofile(int need)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)need) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY ||
+            rl.rlim_max >= (rlim_t)need) ? (rlim_t)need : rl.rlim_max;
+        (void)setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static int bench_encode_len(unsigned char* buf, int len)
+{
+    int pos = 0;
+    do {
+        buf[pos] = (unsigned char)(len % 128);
+        len /= 128;
+        if (len > 0) {
+            buf[pos] |= 0x80;
+        }
+        pos++;
+    } while (len > 0);
+    return pos;
+}
+
+/* CONNECT, clean session, keep alive 60: MQTT 3.1.1, or v5 when v5 is set,
+ * with a Topic Alias Maximum of 1 when alias_max is set as well. */
+static int bench_encode_connect(unsigned char* buf, const char* id, int v5,
+    int alias_max)
+{
+    int id_len = (int)strlen(id);
+    int props = !v5 ? -1 : (alias_max ? 3 : 0);
+    int pos = 0;
+
+    buf[pos++] = 0x10;
+    buf[pos++] = (unsigned char)(10 + (props + 1) + 2 + id_len);
+    buf[pos++] = 0x00; buf[pos++] = 0x04;
+    buf[pos++] = 'M'; buf[pos++] = 'Q'; buf[pos++] = 'T'; buf[pos++] = 'T';
+    buf[pos++] = v5 ? 0x05 : 0x04;
+    buf[pos++] = 0x02;
+    buf[pos++] = 0x00; buf[pos++] = 60;
+    if (props >= 0) {
+        buf[pos++] = (unsigned char)props;
+        if (props > 0) {
+            /* Topic Alias Maximum = 1 */
+            buf[pos++] = 0x22; buf[pos++] = 0x00; buf[pos++] = 0x01;
+        }
+    }
+    buf[pos++] = 0x00; buf[pos++] = (unsigned char)id_len;
+    memcpy(buf + pos, id, (size_t)id_len);
+    return pos + id_len;
+}
+
+/* SUBSCRIBE packet id 1, single filter at QoS 0. */
+static int bench_encode_subscribe(unsigned char* buf, const char* topic,
+    int v5)
+{
+    int t_len = (int)strlen(topic);
+    int pos = 0;
+
+    buf[pos++] = 0x82;
+    pos += bench_encode_len(buf + pos, 2 + (v5 ? 1 : 0) + 2 + t_len + 1);
+    buf[pos++] = 0x00; buf[pos++] = 0x01;
+    if (v5) {
+        buf[pos++] = 0x00;
+    }
+    buf[pos++] = 0x00; buf[pos++] = (unsigned char)t_len;
+    memcpy(buf + pos, topic, (size_t)t_len);
+    pos += t_len;
+    buf[pos++] = 0x00;
+    return pos;
+}
+
+/* QoS 0 PUBLISH with a fixed-pattern payload. alias < 0 is MQTT 3.1.1; 0 is
+ * v5 without properties; 1 is v5 binding Topic Alias 1 to topic, and 2 is
+ * v5 with Topic Alias 1 and no topic. */
+static unsigned char* bench_encode_publish(const char* topic, int alias,
+    int payload, int* out_len)
+{
+    int t_len = (alias == 2) ? 0 : (int)strlen(topic);
+    int p_len = (alias < 0) ? 0 : ((alias > 0) ? 4 : 1);
+    int rem = 2 + t_len + p_len + payload;
+    unsigned char* buf = (unsigned char*)malloc((size_t)(rem + 5));
+    int pos = 0;
+
+    if (buf == NULL) {
+        return NULL;
+    }
+    buf[pos++] = 0x30;
+    pos += bench_encode_len(buf + pos, rem);
+    buf[pos++] = 0x00; buf[pos++] = (unsigned char)t_len;
+    memcpy(buf + pos, topic, (size_t)t_len);
+    pos += t_len;
+    if (p_len == 1) {
+        buf[pos++] = 0x00;
+    }
+    else if (p_len == 4) {
+        /* Topic Alias = 1 */
+        buf[pos++] = 0x03;
+        buf[pos++] = 0x23; buf[pos++] = 0x00; buf[pos++] = 0x01;
+    }
+    memset(buf + pos, 'x', (size_t)payload);
+    *out_len = pos + payload;
+    return buf;
+}
+
+static int bench_read_full(int fd, unsigned char* buf, int len)
+{
+    int got = 0;
+    while (got < len) {
+        int rc = (int)recv(fd, buf + got, (size_t)(len - got), 0);
+        if (rc <= 0) {
+            return -1;
+        }
+        got += rc;
+    }
+    return 0;
+}
+
+/* Read one acknowledgement of the given type (Remaining Length under 128)
+ * and return its reason or return code byte at offset code_at, else -1. */
+static int bench_read_ack(int fd, unsigned char type, int code_at)
+{
+    unsigned char ack[128];
+
+    if (bench_read_full(fd, ack, 2) != 0 || ack[0] != type ||
+            (ack[1] & 0x80) != 0 || ack[1] <= code_at ||
+            bench_read_full(fd, ack, ack[1]) != 0) {
+        return -1;
+    }
+    return ack[code_at];
+}
+
+/* Blocking connect + CONNECT/CONNACK (+ SUBSCRIBE/SUBACK when topic is
+ * set); the socket is left non-blocking. */
+static int bench_open(const struct sockaddr_in* addr, const char* id,
+    const char* topic, int v5, int alias)
+{
+    unsigned char pkt[BENCH_TOPIC_MAX + 16];
+    int one = 1;
+    int len;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+    (void)setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    len = bench_encode_connect(pkt, id, v5, alias && topic != NULL);
+    if (send(fd, pkt, (size_t)len, MSG_NOSIGNAL) != len ||
+            bench_read_ack(fd, 0x20, 1) != 0x00) {
+        close(fd);
+        return -1;
+    }
+    if (topic != NULL) {
+        len = bench_encode_subscribe(pkt, topic, v5);
+        if (send(fd, pkt, (size_t)len, MSG_NOSIGNAL) != len ||
+                bench_read_ack(fd, 0x90, v5 ? 3 : 2) != 0x00) {
+            close(fd);
+            return -1;
+        }
+    }
+    (void)fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+/* Write PUBLISHes while the pair's window allows. Returns -1 on error. */
+static int bench_publish(BenchPair* p, long msgs, long window)
+{
+    while (p->sent < msgs && p->sent - p->rx_msgs < window) {
+        unsigned char* pkt = (p->sent == 0) ? p->first : p->pkt;
+        int len = (p->sent == 0) ? p->first_len : p->pkt_len;
+        int rc = (int)send(p->pub_fd, pkt + p->tx_off,
+            (size_t)(len - p->tx_off), MSG_NOSIGNAL);
+        if (rc < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        p->tx_off += rc;
+        p->tx_bytes += rc;
+        if (p->tx_off == len) {
+            p->tx_off = 0;
+            p->sent++;
+        }
+    }
+    return 0;
+}
+
+/* Count the packets completed by len more received bytes. Only PUBLISHes
+ * reach a subscriber once its SUBACK has been read. */
+static void bench_count(BenchPair* p, const unsigned char* buf, long len)
+{
+    long i = 0;
+
+    p->rx_bytes += len;
+    while (i < len) {
+        if (p->rx_skip > 0) {
+            long n = (len - i < p->rx_skip) ? len - i : p->rx_skip;
+            p->rx_skip -= n;
+            i += n;
+            if (p->rx_skip == 0) {
+                p->rx_msgs++;
+            }
+            continue;
+        }
+        if (p->rx_hdr++ == 0) {
+            /* packet type and flags */
+            p->rx_remain = 0;
+            p->rx_mult = 1;
+            i++;
+            continue;
+        }
+        p->rx_remain += (long)(buf[i] & 0x7F) * p->rx_mult;
+        p->rx_mult *= 128;
+        if ((buf[i++] & 0x80) == 0) {
+            p->rx_hdr = 0;
+            p->rx_skip = p->rx_remain;
+            if (p->rx_skip == 0) {
+                p->rx_msgs++;
+            }
+        }
+    }
+}
+
+static void bench_usage(const char* prog)
+{
+    printf("usage: %s [-h host] [-p port] [-n pairs] [-m msgs_per_pair] "
+        "[-s payload_bytes] [-w window] [-t timeout_sec] [-l topic_bytes] "
+        "[-a]\n", prog);
+}
+
+int main(int argc, char** argv)
+{
+    const char* host = BENCH_DEFAULT_HOST;
+    int port = BENCH_DEFAULT_PORT;
+    int pairs = BENCH_DEFAULT_PAIRS;
+    long msgs = BENCH_DEFAULT_MSGS;
+    int payload = BENCH_DEFAULT_PAYLOAD;
+    long window = BENCH_DEFAULT_WINDOW;
+    int timeout_sec = BENCH_DEFAULT_TIMEOUT;
+    int topic_len = 0;
+    int alias = 0;
+    struct sockaddr_in addr;
+    BenchPair* bp;
+    struct pollfd* pfds;
+    unsigned char* rx;
+    char id[BENCH_TOPIC_MAX];
+    char topic[BENCH_TOPIC_MAX];
+    double t0, elapsed;
+    long total, delivered = 0;
+    long tx_bytes = 0, rx_bytes = 0;
+    int i, done = 0, err = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+            host = argv[++i];
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            pairs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            msgs = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            payload = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            timeout_sec = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            topic_len = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-a") == 0) {
+            alias = 1;
+        }
+        else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (pairs <= 0 || msgs <= 0 || payload < 0 ||
+            payload > BENCH_MAX_PAYLOAD || window <= 0 || port <= 0 ||
+            port > 65535 || timeout_sec <= 0 || topic_len < 0 ||
+            topic_len >= BENCH_TOPIC_MAX) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bench: bad IPv4 address %s\n", host);
+        return 1;
+    }
+
+    bench_raise_nofile(2 * pairs + 16);
+    bp = (BenchPair*)calloc((size_t)pairs, sizeof(BenchPair));
+    pfds = (struct pollfd*)calloc((size_t)pairs * 2, sizeof(struct pollfd));
+    rx = (unsigned char*)malloc(BENCH_RX_CHUNK);
+    if (bp == NULL || pfds == NULL || rx == NULL) {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < pairs; i++) {
+        bp[i].pub_fd = bp[i].sub_fd = -1;
+    }
+    for (i = 0; i < pairs && err == 0; i++) {
+        int t_len = snprintf(topic, sizeof(topic), "bench/%d", i);
+        if (t_len < topic_len) {
+            /* "bench/<i>/ddd..." */
+            topic[t_len] = '/';
+            memset(topic + t_len + 1, 'd', (size_t)(topic_len - t_len - 1));
+            topic[topic_len] = '\0';
+        }
+        snprintf(id, sizeof(id), "bsub-%d", i);
+        bp[i].sub_fd = bench_open(&addr, id, topic, alias, alias);
+        snprintf(id, sizeof(id), "bpub-%d", i);
+        bp[i].pub_fd = bench_open(&addr, id, NULL, alias, alias);
+        bp[i].first = bench_encode_publish(topic, alias ? 1 : -1, payload,
+            &bp[i].first_len);
+        bp[i].pkt = bench_encode_publish(topic, alias ? 2 : -1, payload,
+            &bp[i].pkt_len);
+        if (bp[i].sub_fd < 0 || bp[i].pub_fd < 0 || bp[i].first == NULL ||
+                bp[i].pkt == NULL) {
+            fprintf(stderr, "bench: setting up pair %d failed (%s)\n", i,
+                strerror(errno));
+            err = 1;
+        }
+    }
+
+    total = (long)pairs * msgs;
+    t0 = bench_now_ms();
+    while (err == 0 && done < pairs) {
+        int n = 0;
+        if (bench_now_ms() - t0 > (double)timeout_sec * 1000.0) {
+            fprintf(stderr, "bench: timed out, %ld messages pending\n",
+                total - delivered);
+            err = 1;
+            break;
+        }
+        for (i = 0; i < pairs; i++) {
+            if (bench_publish(&bp[i], msgs, window) != 0) {
+                err = 1;
+            }
+            pfds[2 * i].fd = bp[i].pub_fd;
+            pfds[2 * i].events = (bp[i].sent < msgs &&
+                bp[i].sent - bp[i].rx_msgs < window) ? POLLOUT : 0;
+            pfds[2 * i + 1].fd = bp[i].sub_fd;
+            pfds[2 * i + 1].events = (bp[i].rx_msgs < msgs) ? POLLIN : 0;
+            n += 2;
+        }
+        if (poll(pfds, (nfds_t)n, 100) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("bench: poll");
+            break;
+        }
+        for (i = 0; i < pairs; i++) {
+            long before, got;
+            if (pfds[2 * i + 1].revents == 0) {
+                continue;
+            }
+            before = bp[i].rx_msgs;
+            for (;;) {
+                int rc = (int)recv(bp[i].sub_fd, rx, BENCH_RX_CHUNK, 0);
+                if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (rc <= 0) {
+                    fprintf(stderr, "bench: subscriber %d lost\n", i);
+                    err = 1;
+                    break;
+                }
+                bench_count(&bp[i], rx, rc);
+            }
+            got = bp[i].rx_msgs;
+            delivered += got - before;
+            if (got >= msgs && before < msgs) {
+                done++;
+            }
+        }
+    }
+    elapsed = bench_now_ms() - t0;
+
+    printf("delivered %ld/%ld messages (%d pairs, %d byte payload, window "
+        "%ld) in %.1f ms\n", delivered, total, pairs, payload, window,
+        elapsed);
+    if (elapsed > 0.0) {
+        printf("throughput: %.0f msg/s, %.2f MB/s payload\n",
+            (double)delivered * 1000.0 / elapsed,
+            (double)delivered * payload / 1000.0 / elapsed);
+    }
+    for (i = 0; i < pairs; i++) {
+        tx_bytes += bp[i].tx_bytes;
+        rx_bytes += bp[i].rx_bytes;
+    }
+    if (delivered > 0) {
+        printf("wire bytes per message (%s, %d byte topic): %.1f in, "
+            "%.1f out\n", alias ? "v5 topic aliases" : "MQTT 3.1.1",
+            (int)strlen(topic), (double)tx_bytes / (double)delivered,
+            (double)rx_bytes / (double)delivered);
+    }
+
+    for (i = 0; i < pairs; i++) {
+        if (bp[i].pub_fd >= 0) {
+            close(bp[i].pub_fd);
+        }
+        if (bp[i].sub_fd >= 0) {
+            close(bp[i].sub_fd);
+        }
+        free(bp[i].first);
+        free(bp[i].pkt);
+    }
+    free(rx);
+    free(pfds);
+    free(bp);
+    return (err == 0 && delivered == total) ? 0 : 1;
+}
@@ -79,11 +79,53 @@
 #ifndef BROKER_TX_BUF_SZ
     #define BROKER_TX_BUF_SZ       4096
 #endif
+/* Per-client read-ahead: each socket read asks for up to this many bytes
+ * and packets are framed from what is left over, so a client pipelining
+ * small packets costs one read for many packets rather than several reads
+ * per packet. 0 disables it. The static default is smaller because the
+ * buffer is reserved for every client slot. */
+#ifndef BROKER_READ_AHEAD_SZ
+    #ifdef WOLFMQTT_STATIC_MEMORY
+        #define BROKER_READ_AHEAD_SZ   512
+    #else
+        #define BROKER_READ_AHEAD_SZ   4096
+    #endif
+#endif
+/* Per-client write queue. Packets produced during a Step are collected
+ * here and sent with one gather write per client when the Step ends; a
+ * queue that fills up is flushed early. Writes never block: what the socket
+ * does not take is kept and resumed once it is writable again. With dynamic
+ * memory a forwarded PUBLISH takes two segments, its header and its payload
+ * (sent in place), so BROKER_WQ_IOV_MAX / 2 PUBLISHes go out per write, and
+ * PUBLISHes for a client whose output is stalled wait in its out_q. The
+ * buffer must hold any packet the broker encodes into tx_buf. Unsent
+ * output may grow it up to BROKER_WQ_MAX_SZ (dynamic memory only); a
+ * client whose stalled output exceeds that is disconnected. */
+#ifndef BROKER_WQ_BUF_SZ
+    #define BROKER_WQ_BUF_SZ       BROKER_TX_BUF_SZ
+#endif
+#ifndef BROKER_WQ_MAX_SZ
+    #define BROKER_WQ_MAX_SZ       65536
+#endif
+#ifndef BROKER_WQ_IOV_MAX
+    #ifdef WOLFMQTT_STATIC_MEMORY
+        #define BROKER_WQ_IOV_MAX  4
+    #else
+        #define BROKER_WQ_IOV_MAX  64
+    #endif
+#endif
 #ifndef BROKER_TIMEOUT_MS
     #define BROKER_TIMEOUT_MS      1000
 #endif
+/* Listen queue depth. A reconnect storm overflowing it costs each dropped
+ * client a SYN retransmit (1 s, then 3 s, ...), so the sockets backend asks
+ * for a deep queue and lets the kernel clamp it (net.core.somaxconn). */
 #ifndef BROKER_LISTEN_BACKLOG
-    #define BROKER_LISTEN_BACKLOG  128
+    #if !defined(WOLFMQTT_WOLFIP) && !defined(WOLFMQTT_BROKER_CUSTOM_NET)
+        #define BROKER_LISTEN_BACKLOG  4096
+    #else
+        #define BROKER_LISTEN_BACKLOG  128
+    #endif
 #endif
 
 /* Static allocation limits */
@@ -120,6 +162,15 @@
 #ifndef BROKER_MAX_FILTER_LEN
     #define BROKER_MAX_FILTER_LEN    128
 #endif
+/* Subscription topic tree arena (static memory): nodes shared by all
+ * filters, and the longest filter level a node can hold. A filter that does
+ * not fit is still accepted and matched by a linear scan. */
+#ifndef BROKER_MAX_SUB_NODES
+    #define BROKER_MAX_SUB_NODES     (BROKER_MAX_SUBS * 2)
+#endif
+#ifndef BROKER_MAX_SUB_LEVEL_LEN
+    #define BROKER_MAX_SUB_LEVEL_LEN 32
+#endif
 #ifndef BROKER_MAX_RETAINED
     #define BROKER_MAX_RETAINED      16
 #endif
@@ -154,6 +205,31 @@
 #ifndef BROKER_MAX_INBOUND_QOS2
     #define BROKER_MAX_INBOUND_QOS2 16
 #endif
+/* Slots in each client's open-addressed set of those packet IDs. A power of
+ * two at least twice BROKER_MAX_INBOUND_QOS2, so the table is never more
+ * than half full and a lookup probes only a few slots. */
+#ifndef BROKER_INBOUND_QOS2_SLOTS
+    #if BROKER_MAX_INBOUND_QOS2 <= 16
+        #define BROKER_INBOUND_QOS2_SLOTS 32
+    #elif BROKER_MAX_INBOUND_QOS2 <= 64
+        #define BROKER_INBOUND_QOS2_SLOTS 128
+    #elif BROKER_MAX_INBOUND_QOS2 <= 256
+        #define BROKER_INBOUND_QOS2_SLOTS 512
+    #elif BROKER_MAX_INBOUND_QOS2 <= 1024
+        #define BROKER_INBOUND_QOS2_SLOTS 2048
+    #elif BROKER_MAX_INBOUND_QOS2 <= 8192
+        #define BROKER_INBOUND_QOS2_SLOTS 16384
+    #else
+        #define BROKER_INBOUND_QOS2_SLOTS 65536
+    #endif
+#endif
+#if BROKER_INBOUND_QOS2_SLOTS < 2 || BROKER_INBOUND_QOS2_SLOTS > 65536 || \
+    (BROKER_INBOUND_QOS2_SLOTS & (BROKER_INBOUND_QOS2_SLOTS - 1)) != 0
+    #error BROKER_INBOUND_QOS2_SLOTS must be a power of two up to 65536
+#endif
+#if BROKER_INBOUND_QOS2_SLOTS <= BROKER_MAX_INBOUND_QOS2
+    #error BROKER_INBOUND_QOS2_SLOTS must exceed BROKER_MAX_INBOUND_QOS2
+#endif
 
 /* Per-subscriber outbound delivery shaping.
  *
@@ -190,6 +266,12 @@
 #ifndef BROKER_MAX_STATIC_ORPHAN_SESSIONS
     #define BROKER_MAX_STATIC_ORPHAN_SESSIONS BROKER_MAX_CLIENTS
 #endif
+/* Client ID index slots; at least twice the clients and sessions it holds
+ * so probe runs stay short */
+#ifndef BROKER_ID_INDEX_SZ
+    #define BROKER_ID_INDEX_SZ \
+        ((BROKER_MAX_CLIENTS + BROKER_MAX_STATIC_ORPHAN_SESSIONS) * 2)
+#endif
 #ifndef BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB
     #define BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB 8
 #endif
@@ -204,6 +286,10 @@
 #if BROKER_MAX_STATIC_ORPHAN_SESSIONS < 1
     #error BROKER_MAX_STATIC_ORPHAN_SESSIONS must be at least 1
 #endif
+#if BROKER_ID_INDEX_SZ <= (BROKER_MAX_CLIENTS + \
+        BROKER_MAX_STATIC_ORPHAN_SESSIONS)
+    #error BROKER_ID_INDEX_SZ must exceed clients plus orphan sessions
+#endif
 #if BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB < 1
     #error BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB must be at least 1
 #endif
@@ -214,6 +300,9 @@
         BROKER_TX_BUF_SZ
     #error BROKER_MAX_STATIC_OFFLINE_DATA_LEN exceeds BROKER_TX_BUF_SZ
 #endif
+#if BROKER_WQ_BUF_SZ < BROKER_TX_BUF_SZ
+    #error BROKER_WQ_BUF_SZ must be at least BROKER_TX_BUF_SZ
+#endif
 #endif /* WOLFMQTT_STATIC_MEMORY */
 #ifndef BROKER_MAX_PERSIST_SESSIONS
     #define BROKER_MAX_PERSIST_SESSIONS 64
@@ -230,9 +319,9 @@
  * how many entries may sit QUEUED behind the inflight window. A subscriber
  * that stops sending PUBACK/PUBREC (a slow consumer, or an attacker keeping
  * the session alive with PINGREQ) saturates the inflight window and then
- * every subsequent matching PUBLISH still allocates a fresh BrokerOutPub plus
- * heap copies of the topic and payload onto out_q. Without a depth cap that
- * queue grows without limit until the broker exhausts memory.
+ * every subsequent matching PUBLISH still adds a BrokerOutPub, pinning
+ * its copy of the topic and payload, to out_q. Without a depth cap
+ * that queue grows without limit until the broker exhausts memory.
  *
  * When a fan-out would exceed this depth the broker disconnects that
  * subscriber (v5: DISCONNECT reason 0x97 Quota Exceeded) rather than growing
@@ -247,6 +336,68 @@
         (BROKER_MAX_INFLIGHT_PER_SUB + BROKER_MAX_OFFLINE_MSGS_PER_SUB)
 #endif
 
+/* Dynamic memory: entries in a new out_q ring (see BrokerOutQ), a power of
+ * two. Rings grow by doubling and shrink back to this once they empty. */
+#ifndef BROKER_OUTQ_INIT_SLOTS
+    #define BROKER_OUTQ_INIT_SLOTS 8
+#endif
+#if BROKER_OUTQ_INIT_SLOTS < 1 || \
+    (BROKER_OUTQ_INIT_SLOTS & (BROKER_OUTQ_INIT_SLOTS - 1)) != 0
+    #error BROKER_OUTQ_INIT_SLOTS must be a power of two
+#endif
+
+/* Dynamic memory: slots in a session's packet identifier table (see
+ * BrokerPacketIds), which bounds how many QoS 1/2 deliveries the session
+ * may hold at once. The default covers the deeper of the live and the
+ * offline queue caps, so the queue caps are reached first. */
+#ifndef BROKER_PACKET_ID_SLOTS
+    #if BROKER_MAX_QUEUED_MSGS_PER_SUB > BROKER_MAX_OFFLINE_MSGS_PER_SUB
+        #define BROKER_PACKET_ID_SLOTS BROKER_MAX_QUEUED_MSGS_PER_SUB
+    #else
+        #define BROKER_PACKET_ID_SLOTS BROKER_MAX_OFFLINE_MSGS_PER_SUB
+    #endif
+#endif
+#if BROKER_PACKET_ID_SLOTS < 1 || BROKER_PACKET_ID_SLOTS > 0xFFFF
+    #error BROKER_PACKET_ID_SLOTS must be between 1 and 65535
+#endif
+
+/* Dynamic memory: bytes the slab allocator (see BrokerSlab) takes from the
+ * backing allocator at a time and carves into blocks of one class. */
+#ifndef BROKER_SLAB_CHUNK_SZ
+    #define BROKER_SLAB_CHUNK_SZ 16384
+#endif
+/* Backing allocator for slab chunks and for requests larger than the
+ * biggest size class. Override both to keep broker objects in a dedicated
+ * heap or arena. */
+#ifndef BROKER_SLAB_MALLOC
+    #define BROKER_SLAB_MALLOC(sz) WOLFMQTT_MALLOC(sz)
+#endif
+#ifndef BROKER_SLAB_FREE
+    #define BROKER_SLAB_FREE(p) WOLFMQTT_FREE(p)
+#endif
+
+/* v5 Topic Aliases per connection, in each direction. The broker
+ * advertises this as Topic Alias Maximum in CONNACK, so a publisher may
+ * send up to that many aliases; outbound, it assigns up to the smaller of
+ * this and the subscriber's own CONNECT Topic Alias Maximum, replacing the
+ * least recently used topic when the table is full. With static memory
+ * each slot holds a BROKER_MAX_TOPIC_LEN copy (two tables per client), so
+ * the default there is off. 0 disables aliases (inbound ones are then
+ * rejected with reason 0x94). */
+#ifndef BROKER_TOPIC_ALIAS_MAX
+    #ifdef WOLFMQTT_STATIC_MEMORY
+        #define BROKER_TOPIC_ALIAS_MAX 0
+    #else
+        #define BROKER_TOPIC_ALIAS_MAX 16
+    #endif
+#endif
+#if BROKER_TOPIC_ALIAS_MAX > 0xFFFF
+    #error BROKER_TOPIC_ALIAS_MAX must fit a two byte alias
+#endif
+#if defined(WOLFMQTT_V5) && BROKER_TOPIC_ALIAS_MAX > 0
+    #define WOLFMQTT_BROKER_TOPIC_ALIAS
+#endif
+
 /* Schema version stamped on every persisted record. Bump when the
  * encoding of any namespace changes incompatibly; a startup with stored
  * records carrying a different version logs a warning, wipes all
@@ -278,6 +429,65 @@
     #define BROKER_PERSIST_DIR_DEFAULT  "/var/lib/wolfmqtt"
 #endif
 
+/* Group commit. The shadow writes made while the broker runs are grouped
+ * into one batch per MqttBroker_Step, committed once before the Step's
+ * output is sent. A nonzero BROKER_PERSIST_COMMIT_MS lets a batch stay open
+ * across Steps for up to that many milliseconds, so a busy broker commits
+ * at most once per interval; acks may then leave before their records are
+ * durable. This is the default for MqttBroker.persist_commit_ms. */
+#ifndef BROKER_PERSIST_COMMIT_MS
+    #define BROKER_PERSIST_COMMIT_MS  0
+#endif
+
+/* Durable-ack mode, the default for MqttBroker.persist_durable_ack. A QoS
+ * 1/2 PUBLISH is acked (PUBACK or PUBREC) only once the batch holding the
+ * records it produced has committed; if a write or the commit fails, the
+ * publisher is disconnected unacked so it sends the message again. Up to
+ * BROKER_PERSIST_ACK_MAX acks per client wait for a commit, and one more
+ * commits the open batch at once. */
+#ifndef BROKER_PERSIST_DURABLE_ACK
+    #define BROKER_PERSIST_DURABLE_ACK  0
+#endif
+#ifndef BROKER_PERSIST_ACK_MAX
+    #define BROKER_PERSIST_ACK_MAX  32
+#endif
+#if BROKER_PERSIST_ACK_MAX < 1 || BROKER_PERSIST_ACK_MAX > 0xFFFF
+    #error BROKER_PERSIST_ACK_MAX must be between 1 and 65535
+#endif
+
+/* Subscription log (dynamic memory). A session's subscriptions are stored
+ * as one snapshot record plus a delta record per SUBSCRIBE or UNSUBSCRIBE.
+ * Once BROKER_PERSIST_SUBS_DELTA_MAX deltas have piled up, the next change
+ * writes a fresh snapshot and drops them. */
+#ifndef BROKER_PERSIST_SUBS_DELTA_MAX
+    #define BROKER_PERSIST_SUBS_DELTA_MAX  64
+#endif
+#if BROKER_PERSIST_SUBS_DELTA_MAX < 1 || BROKER_PERSIST_SUBS_DELTA_MAX > 0xFFFF
+    #error BROKER_PERSIST_SUBS_DELTA_MAX must be between 1 and 65535
+#endif
+
+/* Append-only log backend (MqttBrokerNet_PersistWal_Init). A new segment
+ * file is started once the active one holds BROKER_WAL_SEGMENT_SZ bytes.
+ * Compaction of the oldest segment begins when the log holds at least
+ * BROKER_WAL_COMPACT_MIN bytes and more than half of them are superseded
+ * or deleted records; each put or delete then scans at most
+ * BROKER_WAL_COMPACT_STEP of its records, copying the live ones forward. */
+#ifndef BROKER_WAL_SEGMENT_SZ
+    #define BROKER_WAL_SEGMENT_SZ   (4 * 1024 * 1024)
+#endif
+#ifndef BROKER_WAL_COMPACT_MIN
+    #define BROKER_WAL_COMPACT_MIN  (1024 * 1024)
+#endif
+#ifndef BROKER_WAL_COMPACT_STEP
+    #define BROKER_WAL_COMPACT_STEP 16
+#endif
+#if BROKER_WAL_SEGMENT_SZ < 64
+    #error BROKER_WAL_SEGMENT_SZ must be at least 64 bytes
+#endif
+#if BROKER_WAL_COMPACT_STEP < 1
+    #error BROKER_WAL_COMPACT_STEP must be at least 1
+#endif
+
 /* Persistence namespaces. One per logical record type. The backend
  * is free to map each namespace to a separate directory, table,
  * keyspace, or sub-region; the broker just passes the namespace byte
@@ -310,6 +520,172 @@
     #error "WOLFMQTT_BROKER_NO_INSECURE requires ENABLE_MQTT_TLS"
 #endif
 
+/* Readiness backend for the default POSIX network layer: epoll on Linux,
+ * select() elsewhere. Define WOLFMQTT_BROKER_NO_EPOLL to force select().
+ * Only the epoll backend can register descriptors >= FD_SETSIZE. */
+#if !defined(WOLFMQTT_WOLFIP) && !defined(WOLFMQTT_BROKER_CUSTOM_NET)
+    #define WOLFMQTT_BROKER_POSIX_POLL
+    #if defined(__linux__) && !defined(WOLFMQTT_BROKER_NO_EPOLL)
+        #define WOLFMQTT_BROKER_EPOLL
+    #else
+        #include <sys/select.h>
+    #endif
+#endif
+/* Maximum readiness events harvested per MqttBroker_Step. Sockets left over
+ * stay ready (level-triggered) and are reported on the next Step. */
+#ifndef BROKER_POLL_MAX_EVENTS
+    #define BROKER_POLL_MAX_EVENTS 64
+#endif
+/* Maximum connections admitted per listener per MqttBroker_Step. Bounds how
+ * long a reconnect storm can starve already-connected clients; anything
+ * left in the listen backlog is picked up on the next Step. */
+#ifndef BROKER_ACCEPT_BURST
+    #define BROKER_ACCEPT_BURST 64
+#endif
+/* Maximum packets handled per client per MqttBroker_Step when they are
+ * already held in its read-ahead buffer. Bounds how long one pipelining
+ * client can hold up the others; the rest are handled on the next Step. */
+#ifndef BROKER_READ_BURST
+    #define BROKER_READ_BURST 32
+#endif
+/* Longest MqttBroker_Wait blocks when no broker deadline is nearer. Bounds
+ * how late a MqttBroker_Stop issued outside the loop thread is noticed. */
+#ifndef BROKER_WAIT_MAX_MS
+    #define BROKER_WAIT_MAX_MS 10000
+#endif
+
+/* io_uring network backend (opt-in, --enable-broker-io-uring, Linux 5.19+).
+ * MqttBrokerNet_IoUring_Init installs it in place of the sockets backend:
+ * multishot accept, receives into a shared ring of provided buffers, and
+ * output queued per connection and sent as linked SENDs, all submitted and
+ * reaped in one io_uring_enter per Step. The test and fuzz programs build
+ * the broker on a custom net layer, where the option has nothing to
+ * replace and is dropped. */
+#ifdef WOLFMQTT_BROKER_IO_URING
+    #if !defined(WOLFMQTT_BROKER_POSIX_POLL)
+        #undef WOLFMQTT_BROKER_IO_URING
+    #elif !defined(__linux__)
+        #error "WOLFMQTT_BROKER_IO_URING requires Linux"
+    #elif defined(WOLFMQTT_STATIC_MEMORY)
+        #error "WOLFMQTT_BROKER_IO_URING requires dynamic memory"
+    #endif
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+    /* Submission queue depth; a full queue is submitted early. */
+    #ifndef BROKER_URING_SQ_ENTRIES
+        #define BROKER_URING_SQ_ENTRIES 256
+    #endif
+    /* Completion queue depth. Overflow is held by the kernel, not lost. */
+    #ifndef BROKER_URING_CQ_ENTRIES
+        #define BROKER_URING_CQ_ENTRIES 4096
+    #endif
+    /* Receive buffers shared by all connections (a power of two). A
+     * connection holds one only while it has unread bytes; when all are
+     * held, receives wait for one to be handed back. */
+    #ifndef BROKER_URING_BUF_COUNT
+        #define BROKER_URING_BUF_COUNT 1024
+    #endif
+    #ifndef BROKER_URING_BUF_SIZE
+        #define BROKER_URING_BUF_SIZE 4096
+    #endif
+    /* Output a connection may have queued before a write is refused (the
+     * broker then parks the rest in its write queue), and the number of
+     * SENDs linked into one submission. */
+    #ifndef BROKER_URING_TX_MAX
+        #define BROKER_URING_TX_MAX (256 * 1024)
+    #endif
+    #ifndef BROKER_URING_TX_CHAIN
+        #define BROKER_URING_TX_CHAIN 16
+    #endif
+    /* How long a closed connection keeps flushing its queued output. */
+    #ifndef BROKER_URING_LINGER_MS
+        #define BROKER_URING_LINGER_MS 1000
+    #endif
+#endif
+
+/* Multi-core sharded mode (opt-in, --enable-broker-shards). N event-loop
+ * shards, one thread each, accept on SO_REUSEPORT listeners sharing the
+ * broker port. Every client ID is owned by one shard (hash of the ID), and a
+ * connection whose CONNECT arrives on another shard is handed to its owner,
+ * so sessions, takeover and Wills stay shard-local. PUBLISHes and Wills are
+ * fanned out to the other shards through bounded single-producer /
+ * single-consumer rings; retained updates are ordered by the shard owning
+ * the topic and replicated to every shard. MqttBroker_Step and the
+ * single-threaded build are unchanged when this is not defined. */
+#ifdef WOLFMQTT_BROKER_SHARDS
+    #if defined(WOLFMQTT_STATIC_MEMORY) || defined(WOLFMQTT_WOLFIP)
+        #error "WOLFMQTT_BROKER_SHARDS requires dynamic memory and pthreads"
+    #endif
+    #ifndef BROKER_MAX_SHARDS
+        #define BROKER_MAX_SHARDS 32
+    #endif
+    /* Slots per shard-to-shard ring; must be a power of two. A producer
+     * finding the ring full waits for the consumer rather than dropping. */
+    #ifndef BROKER_SHARD_RING_SZ
+        #define BROKER_SHARD_RING_SZ 256
+    #endif
+    /* Cross-shard messages applied per Step before sockets are serviced. */
+    #ifndef BROKER_SHARD_DRAIN_MAX
+        #define BROKER_SHARD_DRAIN_MAX 256
+    #endif
+    #ifndef BROKER_CACHE_LINE_SZ
+        #define BROKER_CACHE_LINE_SZ 64
+    #endif
+    #if (BROKER_SHARD_RING_SZ & (BROKER_SHARD_RING_SZ - 1)) != 0
+        #error "BROKER_SHARD_RING_SZ must be a power of two"
+    #endif
+    #ifndef BROKER_THREAD_LOCAL
+        #define BROKER_THREAD_LOCAL __thread
+    #endif
+#endif
+
+/* Persistence worker thread (opt-in, --enable-broker-persist-worker). When
+ * MqttBroker.persist_use_worker is set, the event loop hands every shadow
+ * write to one thread as an immutable record image through a bounded
+ * single-producer / single-consumer queue of BROKER_PERSIST_QUEUE_SZ slots.
+ * The thread encrypts, writes and commits the records in queue order, so
+ * writes to one key land in the order they were made. A loop finding the
+ * queue full waits for the thread. BROKER_PERSIST_WORKER is the default for
+ * persist_use_worker. */
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    #if !defined(WOLFMQTT_BROKER_PERSIST) || \
+        defined(WOLFMQTT_STATIC_MEMORY) || defined(WOLFMQTT_WOLFIP)
+        #error "WOLFMQTT_BROKER_PERSIST_WORKER requires persistence, " \
+               "dynamic memory and pthreads"
+    #endif
+    #ifndef BROKER_PERSIST_WORKER
+        #define BROKER_PERSIST_WORKER 0
+    #endif
+    #ifndef BROKER_PERSIST_QUEUE_SZ
+        #define BROKER_PERSIST_QUEUE_SZ 1024
+    #endif
+    #if (BROKER_PERSIST_QUEUE_SZ & (BROKER_PERSIST_QUEUE_SZ - 1)) != 0
+        #error "BROKER_PERSIST_QUEUE_SZ must be a power of two"
+    #endif
+#endif
+
+#if defined(WOLFMQTT_BROKER_SHARDS) || \
+    defined(WOLFMQTT_BROKER_PERSIST_WORKER)
+    /* Ring indices, reference counts and the sleep flags. Override all of
+     * them for compilers without the GCC __atomic builtins. */
+    #ifndef BROKER_ATOMIC_LOAD
+        #if defined(__GNUC__) || defined(__clang__)
+            #define BROKER_ATOMIC_LOAD(p) \
+                __atomic_load_n((p), __ATOMIC_ACQUIRE)
+            #define BROKER_ATOMIC_STORE(p, v) \
+                __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+            #define BROKER_ATOMIC_ADD(p, v) \
+                __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+            #define BROKER_ATOMIC_XCHG(p, v) \
+                __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+            #define BROKER_ATOMIC_FENCE() \
+                __atomic_thread_fence(__ATOMIC_SEQ_CST)
+        #else
+            #error "Threaded broker builds need BROKER_ATOMIC_* definitions"
+        #endif
+    #endif
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* Forward declarations                                                        */
 /* -------------------------------------------------------------------------- */
@@ -328,12 +704,66 @@ typedef int (*MqttBrokerNet_WriteCb)(void* ctx, BROKER_SOCKET_T sock,
     const byte* buf, int buf_len, int timeout_ms);
 typedef int (*MqttBrokerNet_CloseCb)(void* ctx, BROKER_SOCKET_T sock);
 
+/* Optional readiness callbacks. When poll_wait is installed, MqttBroker_Step
+ * asks the backend which sockets are ready and only reads from those
+ * clients, so an idle connection costs no syscalls per Step. poll_add
+ * registers a listener or client socket together with an opaque owner
+ * pointer that poll_wait hands back in each event; poll_del is called before
+ * the socket is closed; poll_free releases the backend once the broker is
+ * freed. Leave all four NULL to keep polling every client on each Step.
+ * Readiness is level-triggered: a socket with unread data keeps being
+ * reported until it is drained. */
+#define BROKER_NET_EV_READ   0x01
+#define BROKER_NET_EV_WRITE  0x02
+
+typedef struct MqttBrokerNetEvent {
+    void*   owner;      /* pointer registered with poll_add */
+    byte    events;     /* BROKER_NET_EV_* */
+} MqttBrokerNetEvent;
+
+typedef int (*MqttBrokerNet_PollAddCb)(void* ctx, BROKER_SOCKET_T sock,
+    byte events, void* owner);
+typedef int (*MqttBrokerNet_PollDelCb)(void* ctx, BROKER_SOCKET_T sock);
+/* Returns the number of events written (0 on timeout) or a negative
+ * MQTT_CODE_ERROR_* code. timeout_ms 0 does not block. */
+typedef int (*MqttBrokerNet_PollWaitCb)(void* ctx, MqttBrokerNetEvent* events,
+    int max_events, int timeout_ms);
+typedef int (*MqttBrokerNet_PollFreeCb)(void* ctx);
+
+/* Optional gather write. In dynamic-memory builds the broker queues what it
+ * produces for a client during a Step and hands it over in one writev call
+ * when the Step ends, so a burst of acks and forwarded PUBLISHes costs one
+ * syscall. Same return convention as write: bytes written (possibly fewer
+ * than the total) or a negative MQTT_CODE_* code. Left NULL, each segment
+ * goes through write in turn. */
+typedef struct MqttBrokerIoVec {
+    const byte* buf;
+    int         len;
+} MqttBrokerIoVec;
+
+typedef int (*MqttBrokerNet_WriteVCb)(void* ctx, BROKER_SOCKET_T sock,
+    const MqttBrokerIoVec* iov, int iov_cnt, int timeout_ms);
+
+/* Optional interest change for a socket registered with poll_add. While a
+ * client's output is stalled the broker asks for BROKER_NET_EV_WRITE only,
+ * so the client is not read (and cannot queue more replies) until its
+ * output drains, then switches back to BROKER_NET_EV_READ. Left NULL, the
+ * stalled output is retried on every Step instead. */
+typedef int (*MqttBrokerNet_PollModCb)(void* ctx, BROKER_SOCKET_T sock,
+    byte events, void* owner);
+
 typedef struct MqttBrokerNet {
     MqttBrokerNet_ListenCb  listen;
     MqttBrokerNet_AcceptCb  accept;
     MqttBrokerNet_ReadCb    read;
     MqttBrokerNet_WriteCb   write;
     MqttBrokerNet_CloseCb   close;
+    MqttBrokerNet_PollAddCb  poll_add;   /* optional */
+    MqttBrokerNet_PollDelCb  poll_del;   /* optional */
+    MqttBrokerNet_PollWaitCb poll_wait;  /* optional */
+    MqttBrokerNet_PollFreeCb poll_free;  /* optional */
+    MqttBrokerNet_WriteVCb   writev;     /* optional */
+    MqttBrokerNet_PollModCb  poll_mod;   /* optional */
     void*                   ctx;
 } MqttBrokerNet;
 
@@ -385,9 +815,16 @@ typedef struct MqttBrokerPersistHooks {
     int (*stream_close)(void* ctx, void* handle);
 
     /* Force all pending writes to durable storage. Called after every
-     * shadow-write commit per plan's "fsync after each commit" choice. */
+     * shadow write made outside a batch, and once per batch when the
+     * backend has no commit hook. */
     int (*sync)(void* ctx);
 
+    /* Optional group commit. begin opens a batch before its first write;
+     * commit makes every write since begin durable. Either may be NULL:
+     * without commit the broker closes a batch with sync instead. */
+    int (*begin)(void* ctx);
+    int (*commit)(void* ctx);
+
     /* Encryption-at-rest key derivation. Called once at broker init when
      * WOLFMQTT_BROKER_PERSIST_ENCRYPT is enabled. Must fill 32 bytes
      * (AES-256) into out_key. */
@@ -398,6 +835,22 @@ typedef struct MqttBrokerPersistHooks {
     /* Backend context pointer passed back into every callback. */
     void* ctx;
 } MqttBrokerPersistHooks;
+
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+/* Persistence worker counters, from MqttBroker_PersistWorkerStats. The
+ * queue counts record images and batch markers alike. */
+typedef struct MqttBrokerPersistWorkerStats {
+    word32 queued;      /* entries handed to the worker */
+    word32 applied;     /* entries the worker has finished */
+    word32 depth;       /* entries waiting now */
+    word32 depth_max;   /* most entries ever waiting */
+    word32 full_waits;  /* times the event loop waited on a full queue */
+    word32 failed;      /* writes and commits the backend failed */
+} MqttBrokerPersistWorkerStats;
+
+/* Worker state, private to mqtt_broker_persist_worker.c */
+struct BrokerPersistWorker;
+#endif
 #endif /* WOLFMQTT_BROKER_PERSIST */
 
 /* -------------------------------------------------------------------------- */
@@ -425,20 +878,72 @@ typedef struct BrokerWsCtx {
 } BrokerWsCtx;
 #endif /* ENABLE_MQTT_WEBSOCKET */
 
+/* -------------------------------------------------------------------------- */
+/* Timer wheel                                                                 */
+/* -------------------------------------------------------------------------- */
+/* Every broker deadline (keep-alive, CONNECT timeout, Will Delay, Session
+ * Expiry, retained Message Expiry) is a BrokerTimer embedded in the object it
+ * expires. Timers hash into a hierarchical wheel of one-second ticks: level 0
+ * spans the next BROKER_TIMER_SLOTS seconds and each higher level
+ * BROKER_TIMER_SLOTS times the level below. Arm and cancel are O(1) and a
+ * Step only touches the timers in the slots it passes. Deadlines beyond the
+ * top level are parked in its farthest slot and re-hashed when they cascade. */
+#ifndef BROKER_TIMER_BITS
+    #define BROKER_TIMER_BITS    6
+#endif
+#ifndef BROKER_TIMER_LEVELS
+    #define BROKER_TIMER_LEVELS  4
+#endif
+#define BROKER_TIMER_SLOTS  (1 << BROKER_TIMER_BITS)
+#define BROKER_TIMER_MASK   (BROKER_TIMER_SLOTS - 1)
+
+enum BrokerTimerKind {
+    BROKER_TIMER_NONE     = 0,
+    BROKER_TIMER_CLIENT   = 1, /* keep-alive / pre-CONNECT idle timeout */
+    BROKER_TIMER_ORPHAN   = 2, /* Session Expiry of a disconnected session */
+    BROKER_TIMER_WILL     = 3, /* v5 Will Delay Interval */
+    BROKER_TIMER_RETAINED = 4  /* v5 Message Expiry of a retained message */
+};
+
+/* Circular list link. Each wheel slot is a sentinel link, so cancel needs no
+ * knowledge of which slot a timer is in. next == NULL means not armed. */
+typedef struct BrokerTimerLink {
+    struct BrokerTimerLink* next;
+    struct BrokerTimerLink* prev;
+} BrokerTimerLink;
+
+typedef struct BrokerTimer {
+    BrokerTimerLink link;           /* must stay first */
+    WOLFMQTT_BROKER_TIME_T expires; /* absolute time, seconds */
+    void*   owner;                  /* object the kind refers to */
+    byte    kind;                   /* BROKER_TIMER_* */
+} BrokerTimer;
+
+typedef struct BrokerTimerWheel {
+    BrokerTimerLink slots[BROKER_TIMER_LEVELS][BROKER_TIMER_SLOTS];
+    BrokerTimerLink due;            /* armed at or before clock */
+    WOLFMQTT_BROKER_TIME_T clock;   /* last tick processed */
+    int     count;                  /* armed timers */
+} BrokerTimerWheel;
+
 /* -------------------------------------------------------------------------- */
 /* Inbound QoS 2 dedup state                                                   */
 /* -------------------------------------------------------------------------- */
 /* Per-client set of QoS 2 packet IDs that have been received and PUBREC'd
  * but not yet PUBREL'd. Used to skip the fan-out for duplicate PUBLISHes
  * per [MQTT-4.3.3] / Method B. Gated by WOLFMQTT_MAX_QOS so capped-QoS
- * broker builds drop the dedup state and PUBREC/PUBREL/PUBCOMP handlers. */
+ * broker builds drop the dedup state and PUBREC/PUBREL/PUBCOMP handlers.
+ *
+ * Open-addressed with linear probing, home slot packet_id & (slots - 1),
+ * so a client's sequential IDs land in consecutive slots. Removal shifts
+ * the rest of the probe run back instead of leaving tombstones. Stored by
+ * value in the client and the offline session in both memory modes: no
+ * allocation, and a session move is a structure copy. */
 #if WOLFMQTT_MAX_QOS >= 2
-#ifndef WOLFMQTT_STATIC_MEMORY
 typedef struct BrokerInboundQos2 {
-    word16  packet_id;
-    struct BrokerInboundQos2* next;
+    word16  slot[BROKER_INBOUND_QOS2_SLOTS]; /* 0 = empty */
+    word16  count;
 } BrokerInboundQos2;
-#endif
 #endif /* WOLFMQTT_MAX_QOS >= 2 */
 
 /* -------------------------------------------------------------------------- */
@@ -486,18 +991,57 @@ typedef struct BrokerStaticOrphanSession {
     char    client_id[BROKER_MAX_CLIENT_ID_LEN];
     word32  session_expiry_sec;
     WOLFMQTT_BROKER_TIME_T orphan_since;
+    BrokerTimer expiry_timer;   /* Session Expiry deadline */
 #if WOLFMQTT_MAX_QOS >= 2
-    word16  qos2_pending[BROKER_MAX_INBOUND_QOS2];
+    BrokerInboundQos2 qos2_pending;
 #endif
     int     out_q_count;
     int     out_q_inflight;
+    word16  next_packet_id;     /* this session's packet identifiers */
     BrokerStaticOutPub out_q[BROKER_MAX_STATIC_OFFLINE_MSGS_PER_SUB];
 } BrokerStaticOrphanSession;
 #else
-typedef struct BrokerOutPub {
-    char*   topic;          /* heap-owned, NUL-terminated */
-    byte*   payload;        /* heap-owned, may be NULL when payload_len == 0 */
+/* PUBLISH header templates kept per message: one with and one without a
+ * packet identifier, and with v5 a property-carrying variant of each. */
+#ifdef WOLFMQTT_V5
+    #define BROKER_MSG_TMPL_CNT 4
+#else
+    #define BROKER_MSG_TMPL_CNT 2
+#endif
+
+/* An application message as forwarded to subscribers. One PUBLISH fanned
+ * out to many subscribers, online or offline, is copied once and every
+ * out_q entry holds a reference, as does a write queue segment sending
+ * its payload (BrokerClient.wq_ref). The last release frees it. Fields
+ * are read-only once it has been queued. */
+typedef struct BrokerMsg {
+    int     refs;
+    char*   topic;          /* NUL-terminated, same allocation */
+    byte*   payload;        /* same allocation, NULL when payload_len == 0 */
     word32  payload_len;
+#ifdef WOLFMQTT_V5
+    /* Deep copy (BrokerProps_Clone) of the originating PUBLISH's v5
+     * Application Message properties (Payload Format Indicator, Content
+     * Type, Response Topic, Correlation Data, User Property, etc.), or
+     * NULL if none. Freed with the message via BrokerProps_FreeClone -
+     * never via MqttProps_Free().
+     * Not serialized by the persist layer: a queued message replayed after a
+     * broker restart is delivered without these properties. */
+    MqttProp* props;
+#endif
+    /* Everything before the payload of the PUBLISH, encoded on the first
+     * send of each variant (BrokerMsg_Tmpl). Later sends copy it and patch
+     * the flags and packet identifier, so the topic and properties are
+     * encoded once per message rather than once per subscriber. */
+    byte*   tmpl[BROKER_MSG_TMPL_CNT];
+    word32  tmpl_len[BROKER_MSG_TMPL_CNT];
+} BrokerMsg;
+
+typedef struct BrokerOutPub {
+    BrokerMsg* msg;         /* shared topic, payload and properties; NULL
+                             * marks a completed entry in the ring */
+    WOLFMQTT_BROKER_TIME_T enq_time;
+    word32  expiry_sec;     /* v5 Message Expiry Interval, 0 = no expiry */
     MqttQoS qos;
     word16  packet_id;      /* 0 for QoS 0 */
     byte    retain;
@@ -508,22 +1052,43 @@ typedef struct BrokerOutPub {
      * MqttPublish.duplicate=1 on first re-send, as required by
      * MQTT-4.4.0-1, then clears the flag. */
     byte    retransmit_dup; /* 0 or 1 */
-    WOLFMQTT_BROKER_TIME_T enq_time;
-    word32  expiry_sec;     /* v5 Message Expiry Interval, 0 = no expiry */
     byte    protocol_level; /* echoed back to subscriber on send */
-#ifdef WOLFMQTT_V5
-    /* Deep copy (BrokerProps_Clone) of the originating PUBLISH's v5
-     * Application Message properties (Payload Format Indicator, Content
-     * Type, Response Topic, Correlation Data, User Property, etc.), or
-     * NULL if none. Owned by this entry; freed once by BrokerOutPub_Free
-     * via BrokerProps_FreeClone - never via MqttProps_Free().
-     * Not serialized by the persist layer: a queued message replayed after a
-     * broker restart is delivered without these properties. */
-    MqttProp* props;
-#endif
-    struct BrokerOutPub* next;
 } BrokerOutPub;
 
+/* Packet identifiers of one session's QoS 1/2 out_q entries. Identifiers
+ * are handed out per session, skipping any whose slot (packet_id modulo
+ * BROKER_PACKET_ID_SLOTS) is taken, so every entry sits in its own slot
+ * and an ack finds it with one lookup. Allocated on the first QoS 1/2
+ * entry and moved by pointer between a BrokerClient and its
+ * BrokerOrphanSession along with the queue. Slots point into the queue's
+ * ring and are re-pointed whenever the ring is rebuilt. */
+typedef struct BrokerPacketIds {
+    word16        next_id;
+    int           count;
+    BrokerOutPub* slot[BROKER_PACKET_ID_SLOTS];
+} BrokerPacketIds;
+
+/* A session's outbound queue: a ring of entries in publish order,
+ * addressed by free-running positions (index = position & (cap - 1)).
+ * head is the oldest entry and tail one past the newest. An entry that
+ * completes out of order (an ack overtaking an earlier one) leaves a hole
+ * (msg == NULL) that is reclaimed once head passes it, or when a full ring
+ * is compacted. unsent is the drain's cursor: no entry before it is still
+ * waiting to be sent, so a drain starts there instead of stepping over the
+ * inflight window again. The ring doubles when more than half of it is in
+ * use and drops back to BROKER_OUTQ_INIT_SLOTS once it empties; a session
+ * move copies the structure. */
+typedef struct BrokerOutQ {
+    BrokerOutPub* ring;
+    word32        cap;      /* 0 or a power of two */
+    word32        head;
+    word32        tail;
+    word32        unsent;   /* head <= unsent <= tail */
+} BrokerOutQ;
+
+/* Entry at queue position pos (head <= pos < tail) */
+#define BROKER_OUTQ_AT(q, pos) (&(q)->ring[(word32)(pos) & ((q)->cap - 1)])
+
 /* -------------------------------------------------------------------------- */
 /* Orphan session (dynamic memory only).                                       */
 /*                                                                            */
@@ -539,23 +1104,55 @@ typedef struct BrokerOrphanSession {
     byte        protocol_level;
     word32      session_expiry_sec;  /* v5 Session Expiry; 0xFFFFFFFF=never */
     WOLFMQTT_BROKER_TIME_T orphan_since;
-    BrokerOutPub* out_q_head;
-    BrokerOutPub* out_q_tail;
+    BrokerTimer expiry_timer;        /* Session Expiry deadline */
+    BrokerOutQ    out_q;
     int           out_q_count;
     int           out_q_inflight;
+    BrokerPacketIds* packet_ids;
+    struct BrokerSub* subs;      /* the session's subs, moved from the
+                                  * client (BrokerClient.subs) */
 #if WOLFMQTT_MAX_QOS >= 2
     /* Inbound QoS 2 dedup state (see BrokerClient.qos2_pending), moved
      * here on disconnect so a retransmitted PUBLISH after reconnect is
      * still recognized as a duplicate instead of being re-fanned-out.
-     * Ownership transfers by pointer reassignment, mirroring out_q_head
-     * above - see BrokerOrphan_Take / BrokerOrphan_Reclaim. */
-    BrokerInboundQos2* qos2_pending;
-    int                qos2_pending_count;
+     * Copied in and out by value - see BrokerOrphan_Take /
+     * BrokerOrphan_Reclaim. */
+    BrokerInboundQos2 qos2_pending;
 #endif
     struct BrokerOrphanSession* next;
 } BrokerOrphanSession;
 #endif
 
+/* -------------------------------------------------------------------------- */
+/* v5 Topic Alias tables                                                       */
+/* -------------------------------------------------------------------------- */
+/* One alias slot: index i holds alias i + 1. An empty topic marks a free
+ * slot. Outbound slots also carry the topic hash (so a lookup compares
+ * strings only on a hash match) and a clock stamp of their last use, for
+ * LRU replacement. */
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+typedef struct BrokerTopicAlias {
+#ifdef WOLFMQTT_STATIC_MEMORY
+    char    topic[BROKER_MAX_TOPIC_LEN];
+#else
+    char*   topic;           /* slab string, NULL when free */
+#endif
+    word32  hash;
+    word32  used;
+} BrokerTopicAlias;
+#endif
+
+#ifdef WOLFMQTT_BROKER_PERSIST
+/* A PUBACK or PUBREC held back in durable-ack mode until the persistence
+ * batch numbered batch has committed. */
+typedef struct BrokerHeldAck {
+    word32  batch;
+    word16  packet_id;
+    byte    type;       /* MQTT_PACKET_TYPE_PUBLISH_ACK or _REC */
+    byte    reason;     /* v5 reason code */
+} BrokerHeldAck;
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* Broker client tracking                                                      */
 /* -------------------------------------------------------------------------- */
@@ -569,6 +1166,10 @@ typedef struct BrokerClient {
 #endif
     byte    tx_buf[BROKER_TX_BUF_SZ];
     byte    rx_buf[BROKER_RX_BUF_SZ];
+#if BROKER_READ_AHEAD_SZ > 0
+    byte    rd_buf[BROKER_READ_AHEAD_SZ];
+#endif
+    byte    wq_buf[BROKER_WQ_BUF_SZ];
 #ifdef WOLFMQTT_BROKER_WILL
     char    will_topic[BROKER_MAX_TOPIC_LEN];
     byte    will_payload[BROKER_MAX_WILL_PAYLOAD_LEN];
@@ -581,21 +1182,41 @@ typedef struct BrokerClient {
 #endif
     byte*   tx_buf;
     byte*   rx_buf;
+    byte*   rd_buf;          /* read-ahead, NULL for WebSocket clients */
     int     tx_buf_len;
     int     rx_buf_len;
 #ifdef WOLFMQTT_BROKER_WILL
     char*   will_topic;
     byte*   will_payload;
 #endif
+    /* Client list links. A removed client is unlinked at once but its
+     * memory is reclaimed at the end of the Step (MqttBroker.clients_reap,
+     * chained through prev), so a walk holding it can still follow next. */
     struct BrokerClient* next;
+    struct BrokerClient* prev;
+    byte    unlinked;        /* removed, awaiting reclamation */
+    /* Ready list links (MqttBroker.ready): Step only visits clients with
+     * readiness events or work the backend cannot report. ready_step is
+     * the Step that queued the client, so one requeued while being
+     * serviced waits for the next Step. */
+    struct BrokerClient* ready_next;
+    struct BrokerClient* ready_prev;
+    word32  ready_step;
+    byte    on_ready;
 #endif
     BROKER_SOCKET_T sock;
+    byte    poll_registered; /* sock is registered with net.poll_add */
+    byte    poll_ready;      /* BROKER_NET_EV_* reported this Step */
     byte    protocol_level;
     word16  keep_alive_sec;
     WOLFMQTT_BROKER_TIME_T last_rx;
+    BrokerTimer timeout_timer; /* keep-alive or pre-CONNECT deadline */
     byte    clean_session;
     byte    connected;       /* set after successful CONNECT handshake */
     int     sub_count;       /* active subscriptions owned by this client */
+#ifndef WOLFMQTT_STATIC_MEMORY
+    struct BrokerSub* subs;  /* those subscriptions, see BrokerSub.sess_head */
+#endif
 #ifdef WOLFMQTT_BROKER_WILL
     byte    has_will;
     word16  will_payload_len;
@@ -625,25 +1246,22 @@ typedef struct BrokerClient {
      * client that exceeds it is disconnected with malformed-packet error.
      * Compiled out for capped-QoS builds (WOLFMQTT_MAX_QOS < 2). */
 #if WOLFMQTT_MAX_QOS >= 2
-#ifdef WOLFMQTT_STATIC_MEMORY
-    word16  qos2_pending[BROKER_MAX_INBOUND_QOS2]; /* 0 = empty slot */
-#else
-    BrokerInboundQos2* qos2_pending;
-    int                qos2_pending_count;
+    BrokerInboundQos2 qos2_pending;
 #endif
-#endif /* WOLFMQTT_MAX_QOS >= 2 */
 #ifndef WOLFMQTT_STATIC_MEMORY
     /* Per-subscriber outbound publish queue. FIFO from head to tail;
-     * drain pulls from head. out_q_inflight is the number of entries in
-     * state PUBLISH_SENT or PUBREL_SENT (QoS 1/2 awaiting an ack);
-     * BROKER_MAX_INFLIGHT_PER_SUB and client_receive_max together bound
-     * how many of those may exist at once. out_q_count is total entries
-     * including not-yet-sent QUEUED ones. Used for fan-out at every
-     * QoS level (QoS 0 forwards transit the queue too). */
-    BrokerOutPub* out_q_head;
-    BrokerOutPub* out_q_tail;
+     * drain sends from the unsent cursor. out_q_inflight is the number of
+     * entries in state PUBLISH_SENT or PUBREL_SENT (QoS 1/2 awaiting an
+     * ack); BROKER_MAX_INFLIGHT_PER_SUB and client_receive_max together
+     * bound how many of those may exist at once. out_q_count is total
+     * entries including not-yet-sent QUEUED ones. Used for fan-out at
+     * every QoS level (QoS 0 forwards transit the queue too). packet_ids
+     * indexes its QoS 1/2 entries, so an ack finds and removes its entry
+     * without walking the queue. */
+    BrokerOutQ    out_q;
     int           out_q_count;
     int           out_q_inflight;
+    BrokerPacketIds* packet_ids;
     /* v5 Receive Maximum advertised by this client in CONNECT, or 65535
      * (per MQTT v5 sec 3.1.2.11.3) when the client did not include the
      * property. For v3.1.1 clients this is left at 65535 - the cap
@@ -653,14 +1271,60 @@ typedef struct BrokerClient {
     word32        session_expiry_sec;
 #ifdef WOLFMQTT_STATIC_MEMORY
     word16        static_client_receive_max;
+    /* Packet identifiers for PUBLISHes sent straight to this client. A
+     * persistent session's QoS 1/2 deliveries use its carrier's instead. */
+    word16        next_packet_id;
+#endif
+#ifdef WOLFMQTT_BROKER_TOPIC_ALIAS
+    /* Topic aliases this client set on its PUBLISHes (alias_in) and the
+     * ones the broker assigned on PUBLISHes to it (alias_out). alias_out_max
+     * is the client's CONNECT Topic Alias Maximum capped at
+     * BROKER_TOPIC_ALIAS_MAX; 0 (the v5 default) means the client accepts
+     * none. alias_clock stamps alias_out uses for LRU replacement. */
+    BrokerTopicAlias alias_in[BROKER_TOPIC_ALIAS_MAX];
+    BrokerTopicAlias alias_out[BROKER_TOPIC_ALIAS_MAX];
+    word16        alias_out_max;
+    word32        alias_clock;
 #endif
     byte          session_established;
+#ifdef WOLFMQTT_BROKER_PERSIST
+    /* Acks held in durable-ack mode, oldest first, in a ring of
+     * BROKER_PERSIST_ACK_MAX. held_ack_failed marks a client whose held
+     * acks lost their batch; the Step disconnects it. A client holding
+     * acks is linked on MqttBroker.persist_held. */
+    BrokerHeldAck held_ack[BROKER_PERSIST_ACK_MAX];
+    word16        held_ack_head;
+    word16        held_ack_count;
+    byte          held_ack_failed;
+    struct BrokerClient* held_next;
+    struct BrokerClient* held_prev;
+#endif
 #ifndef WOLFMQTT_STATIC_MEMORY
     /* Length of an accepted CONNACK still being written (0 = none). While
      * nonzero, tx_buf is owned by that write and no other packet may be
      * read from or written to this client. */
     int           connack_pending_len;
 #endif
+    /* Write queue: everything produced for this client during a Step, sent
+     * with one gather write when the Step ends. Packets are copied into
+     * wq_buf; with dynamic memory a forwarded PUBLISH payload is sent in
+     * place from its shared message, which wq_ref pins until it is sent.
+     * WebSocket clients bypass the queue (NULL wq_buf with dynamic memory).
+     * Clients with output waiting for the end of the Step are linked on
+     * MqttBroker.wq_dirty; wq_blocked marks output the socket would not
+     * take, which is resumed once the socket reports writable. Blocked
+     * clients are linked on MqttBroker.wq_stalled instead. */
+#ifndef WOLFMQTT_STATIC_MEMORY
+    byte*         wq_buf;
+    word32        wq_cap;    /* BROKER_WQ_BUF_SZ, more while stalled */
+    BrokerMsg*    wq_ref[BROKER_WQ_IOV_MAX]; /* payload owner or NULL */
+#endif
+    word32        wq_len;
+    int           wq_iov_cnt;
+    byte          wq_blocked;
+    MqttBrokerIoVec wq_iov[BROKER_WQ_IOV_MAX];
+    struct BrokerClient* wq_next;
+    struct BrokerClient* wq_prev;
 } BrokerClient;
 
 /* -------------------------------------------------------------------------- */
@@ -675,11 +1339,74 @@ typedef struct BrokerSub {
     char*   filter;
     char*   client_id; /* For session persistence */
     struct BrokerSub* next;
+    /* Chain of the subs of one session, so it can be listed without a
+     * walk of broker->subs. sess_head is the slot holding the chain,
+     * BrokerClient.subs or BrokerOrphanSession.subs, NULL when the sub
+     * is on none. */
+    struct BrokerSub* sess_next;
+    struct BrokerSub* sess_prev;
+    struct BrokerSub** sess_head;
 #endif
     struct BrokerClient* client; /* NULL if client disconnected (session persisted) */
     MqttQoS qos;
+    /* Topic tree links: the node the filter ends at, or NULL while the
+     * filter is on the tree's loose list */
+    struct BrokerSubNode* node;
+    struct BrokerSub* node_next;
+    struct BrokerSub* node_prev;
 } BrokerSub;
 
+/* Subscription index: a topic tree with one node per filter level. A
+ * PUBLISH walks it level by level, following the exact child for each
+ * topic level and the '+' child, and collects the subscriptions of every
+ * '#' child it passes, so matching costs the topic depth and the number of
+ * matches rather than a scan of every subscription. Exact children of all
+ * nodes share one hash table keyed by (parent, level). Filters the tree
+ * cannot hold (static arena full, a level of BROKER_MAX_SUB_LEVEL_LEN or
+ * more, out of memory) stay on the loose list and are matched one by one,
+ * so an index limit never refuses a SUBSCRIBE. */
+typedef struct BrokerSubNode {
+    struct BrokerSubNode* parent;
+    struct BrokerSubNode* bucket_next; /* hash chain, exact children only */
+    struct BrokerSubNode* plus;        /* '+' child */
+    struct BrokerSubNode* pound;       /* '#' child */
+    BrokerSub* subs;                   /* filters ending at this node */
+    word32  key;                       /* hash of (parent, level) */
+    word32  children;
+    word16  level_len;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    byte    in_use;
+    char    level[BROKER_MAX_SUB_LEVEL_LEN];
+#else
+    char*   level;                     /* stored after the node */
+#endif
+} BrokerSubNode;
+
+typedef struct BrokerSubTree {
+    BrokerSubNode root;
+    BrokerSub*    loose;
+    /* A fan-out delivers from match[base..match_len) while the subscribers
+     * it writes to may close and drop subscriptions; nested fan-outs (a
+     * Will published from such a close) stack above it. */
+    word32        match_len;
+    int           walk;
+#ifdef WOLFMQTT_STATIC_MEMORY
+    BrokerSubNode  nodes[BROKER_MAX_SUB_NODES];
+    BrokerSubNode* buckets[BROKER_MAX_SUB_NODES];
+    BrokerSubNode* frontier[BROKER_MAX_SUB_NODES + 1];
+    BrokerSub*     match[BROKER_MAX_SUBS * 2];
+#else
+    BrokerSubNode** buckets;
+    word32          bucket_cnt;
+    word32          node_cnt;
+    BrokerSubNode** frontier;   /* node_cnt + 1 entries at least */
+    word32          frontier_cap;
+    BrokerSub**     match;
+    word32          match_cap;
+    BrokerSub*      reap;       /* released during a walk, freed after */
+#endif
+} BrokerSubTree;
+
 /* -------------------------------------------------------------------------- */
 /* Retained message store                                                      */
 /* -------------------------------------------------------------------------- */
@@ -693,13 +1420,54 @@ typedef struct BrokerRetainedMsg {
     char*   topic;
     byte*   payload;
     struct BrokerRetainedMsg* next;
+    struct BrokerRetainedMsg* prev;
+    struct BrokerRetainedNode* node;    /* topic tree node holding it */
+    struct BrokerRetainedMsg* reap_next;
+    byte    on_reap;
 #endif
     word32  payload_len;
     WOLFMQTT_BROKER_TIME_T store_time;  /* when stored (seconds) */
     word32  expiry_sec;                 /* v5 message expiry (0=none) */
     MqttQoS qos;                        /* [MQTT-3.3.1-5] stored QoS */
     byte    pending_delete;             /* deferred free during delivery */
+    BrokerTimer expiry_timer;           /* armed when expiry_sec != 0 */
 } BrokerRetainedMsg;
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Retained index: a topic tree with one node per topic level, holding the
+ * message retained on the topic it spells. Store and delete follow the
+ * exact child per level through one hash table keyed by (parent, level),
+ * like BrokerSubTree. A SUBSCRIBE walks the filter: exact levels use the
+ * hash, '+' visits each child and '#' the whole subtree below, so a
+ * filter costs the retained topics it matches rather than a scan of every
+ * one. The static store is bounded by BROKER_MAX_RETAINED and scanned. */
+typedef struct BrokerRetainedNode {
+    struct BrokerRetainedNode* parent;
+    struct BrokerRetainedNode* bucket_next; /* hash chain */
+    struct BrokerRetainedNode* child;       /* first child */
+    struct BrokerRetainedNode* sibling_next;
+    struct BrokerRetainedNode* sibling_prev;
+    BrokerRetainedMsg* msg;                 /* retained on this topic */
+    word32  key;                            /* hash of (parent, level) */
+    word16  level_len;
+    char*   level;                          /* stored after the node */
+} BrokerRetainedNode;
+
+typedef struct BrokerRetainedTree {
+    BrokerRetainedNode   root;
+    BrokerRetainedNode** buckets;
+    word32               bucket_cnt;
+    word32               node_cnt;
+    BrokerRetainedNode** frontier;     /* node_cnt + 1 entries at least */
+    word32               frontier_cap;
+    /* Deliveries send from match[base..match_len); a nested one stacks
+     * above. Messages deleted meanwhile are reaped after the outermost. */
+    BrokerRetainedMsg**  match;
+    word32               match_len;
+    word32               match_cap;
+    BrokerRetainedMsg*   reap;
+} BrokerRetainedTree;
+#endif
 #endif /* WOLFMQTT_BROKER_RETAINED */
 
 /* -------------------------------------------------------------------------- */
@@ -722,9 +1490,187 @@ typedef struct BrokerPendingWill {
     MqttQoS qos;
     byte    retain;
     WOLFMQTT_BROKER_TIME_T publish_time; /* absolute time to publish */
+    BrokerTimer publish_timer;
 } BrokerPendingWill;
 #endif /* WOLFMQTT_BROKER_WILL */
 
+/* -------------------------------------------------------------------------- */
+/* Sharded event loops                                                         */
+/* -------------------------------------------------------------------------- */
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Cross-shard message kinds */
+#define BROKER_SHARD_MSG_PUBLISH  1 /* fan out to local subscribers */
+#define BROKER_SHARD_MSG_WILL     2 /* fan out a Will to local subscribers */
+#define BROKER_SHARD_MSG_RETAIN   3 /* update the local retained replica */
+#define BROKER_SHARD_MSG_CONNECT  4 /* adopt a socket and its CONNECT */
+
+/* Per-delivery flags */
+#define BROKER_SHARD_F_RELAY      0x01 /* RETAIN sent to the topic's owner */
+
+/* One message may be delivered to several shards; each delivery holds a
+ * reference and the last release frees it. Fields are read-only once the
+ * message has been sent. */
+typedef struct BrokerShardMsg {
+    int     refs;
+    byte    kind;                   /* BROKER_SHARD_MSG_* */
+    MqttQoS qos;
+    word32  expiry_sec;             /* retained Message Expiry */
+    BROKER_SOCKET_T sock;           /* CONNECT: socket being handed off */
+    char*   topic;
+    byte*   payload;                /* CONNECT: the packet as read, then
+                                     * any bytes read ahead past it */
+    word32  payload_len;
+    word32  connect_len;            /* CONNECT: packet length in payload */
+#ifdef WOLFMQTT_V5
+    MqttProp* props;                /* PUBLISH properties, cloned */
+#endif
+} BrokerShardMsg;
+
+typedef struct BrokerShardSlot {
+    BrokerShardMsg* msg;
+    byte            flags;          /* BROKER_SHARD_F_* */
+} BrokerShardSlot;
+
+/* Lock-free single-producer / single-consumer ring. The producer owns tail,
+ * the consumer owns head; each is on its own cache line. */
+typedef struct BrokerShardRing {
+    word32  head;
+    byte    pad0[BROKER_CACHE_LINE_SZ - sizeof(word32)];
+    word32  tail;
+    byte    pad1[BROKER_CACHE_LINE_SZ - sizeof(word32)];
+    BrokerShardSlot slots[BROKER_SHARD_RING_SZ];
+} BrokerShardRing;
+
+/* Messages a blocked producer moved off its inbound rings so peers waiting
+ * on it can progress; applied ahead of the rings by the next drain. */
+typedef struct BrokerShardStash {
+    BrokerShardSlot slot;
+    struct BrokerShardStash* next;
+} BrokerShardStash;
+
+struct MqttBrokerShards;
+
+typedef struct BrokerShard {
+    struct MqttBroker*       broker;
+    struct MqttBrokerShards* group;
+    int     index;
+    int     next_src;       /* round-robin start for the next drain */
+    int     sleeping;       /* set while blocked in MqttBroker_Wait */
+    int     wake_fd[2];     /* pipe written to end a sleep */
+    BrokerShardStash* stash_head;
+    BrokerShardStash* stash_tail;
+} BrokerShard;
+#endif /* WOLFMQTT_BROKER_SHARDS */
+
+/* -------------------------------------------------------------------------- */
+/* Client ID index                                                             */
+/* -------------------------------------------------------------------------- */
+/* Open-addressing (linear probing) table from client ID to every live
+ * client that has one and every persistent session carrier (orphan), so
+ * the takeover check on CONNECT and the offline-subscriber lookup in
+ * fan-out do not scan. The ID is not copied: an entry points at its
+ * object and caches the ID's hash, and the object removes its entry
+ * before the ID changes or is freed. One ID can have several entries
+ * (a new client and the one it is taking over, or a client and its
+ * session carrier). Static builds use BROKER_ID_INDEX_SZ fixed slots,
+ * which always has room; dynamic builds double the table at half full. */
+#define BROKER_ID_CLIENT 1  /* BrokerClient */
+#define BROKER_ID_ORPHAN 2  /* Broker(Static)OrphanSession */
+#define BROKER_ID_SUBS_LOG 3  /* BrokerSubsLog */
+
+typedef struct BrokerIdEntry {
+    void*   obj;    /* NULL for an empty slot */
+    word32  hash;
+    byte    kind;   /* BROKER_ID_* */
+} BrokerIdEntry;
+
+typedef struct BrokerIdIndex {
+#ifdef WOLFMQTT_STATIC_MEMORY
+    BrokerIdEntry  slots[BROKER_ID_INDEX_SZ];
+#else
+    BrokerIdEntry* slots;
+    word32         cap;
+#endif
+    word32         count;
+} BrokerIdIndex;
+
+#if defined(WOLFMQTT_BROKER_PERSIST) && !defined(WOLFMQTT_STATIC_MEMORY)
+/* Where one persisted session's subscriptions stand in NS_SUBS: the
+ * snapshot of generation gen and the deltas 1..deltas written on top of
+ * it. Generation 0 is a single whole-list record keyed by the bare client
+ * ID, as written before the log existed. Indexed by client ID. The
+ * restore_* fields hold records read by BrokerPersist_Restore until it
+ * has seen them all. */
+struct BrokerSubsRec;
+typedef struct BrokerSubsLog {
+    char*   client_id;      /* heap-owned, NUL-terminated */
+    word32  gen;
+    word16  deltas;
+    struct BrokerSubsRec* restore_recs;
+    struct BrokerSubsLog* restore_next;
+} BrokerSubsLog;
+#endif
+
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* -------------------------------------------------------------------------- */
+/* Slab allocator (dynamic memory only)                                        */
+/* -------------------------------------------------------------------------- */
+/* Broker-owned free lists for what the publish path allocates and frees at
+ * message rate: queue rings, messages and their topic copies, property
+ * clones, subscriptions and offline sessions. Blocks are carved from
+ * BROKER_SLAB_CHUNK_SZ chunks and go back on their class's free list when
+ * freed; chunks return to BROKER_SLAB_FREE only in MqttBroker_Free. Each
+ * block is preceded by a header naming its class, so a free needs neither
+ * the broker nor the size. Typed classes hold one structure each; other
+ * requests take the smallest size class that fits, or go straight to the
+ * backing allocator above the largest (still counted). Define
+ * WOLFMQTT_BROKER_NO_SLAB to pass every request through, for example under
+ * a memory checker. */
+enum BrokerSlabClass {
+    BROKER_SLAB_SUB = 0,        /* BrokerSub */
+    BROKER_SLAB_ORPHAN,         /* BrokerOrphanSession */
+    BROKER_SLAB_PROP,           /* MqttProp clone */
+    BROKER_SLAB_32,             /* size classes, 32 to 2048 bytes */
+    BROKER_SLAB_64,
+    BROKER_SLAB_128,
+    BROKER_SLAB_256,
+    BROKER_SLAB_512,
+    BROKER_SLAB_1024,
+    BROKER_SLAB_2048,
+    BROKER_SLAB_LARGE,          /* anything bigger, backing allocator */
+    BROKER_SLAB_CLASS_CNT
+};
+/* Class argument for BrokerSlab_Alloc: choose by size */
+#define BROKER_SLAB_SIZED (-1)
+
+typedef union BrokerSlabHdr {
+    struct BrokerSlabPool* pool; /* allocated: its class, NULL if unpooled */
+    union BrokerSlabHdr*   next; /* free: next block; chunk: next chunk */
+    double                 align; /* 8-byte alignment for the block after */
+} BrokerSlabHdr;
+
+typedef struct BrokerSlabPool {
+    BrokerSlabHdr* free_list;
+    word32         block_sz;    /* 0 = always the backing allocator */
+    word32         in_use;
+    word32         free;
+    word32         chunks;
+} BrokerSlabPool;
+
+typedef struct BrokerSlab {
+    BrokerSlabPool pools[BROKER_SLAB_CLASS_CNT];
+    BrokerSlabHdr* chunks;
+} BrokerSlab;
+
+/* Occupancy of one class, from MqttBroker_SlabStats */
+typedef struct MqttBrokerSlabStats {
+    word32 block_sz;    /* 0 for BROKER_SLAB_LARGE */
+    word32 in_use;      /* blocks allocated */
+    word32 free;        /* blocks on the free list */
+    word32 chunks;      /* chunks taken from the backing allocator */
+} MqttBrokerSlabStats;
+#endif /* !WOLFMQTT_STATIC_MEMORY */
+
 /* -------------------------------------------------------------------------- */
 /* Broker context                                                              */
 /* -------------------------------------------------------------------------- */
@@ -743,7 +1689,6 @@ typedef struct MqttBroker {
     const char* auth_pass;
 #endif
     MqttBrokerNet net;
-    word16  next_packet_id;
     word32  next_auto_id; /* monotonically increasing counter for
                            * server-assigned ClientIds (empty-ID accepts) */
 #ifdef ENABLE_MQTT_TLS
@@ -767,12 +1712,18 @@ typedef struct MqttBroker {
     BrokerPendingWill pending_wills[BROKER_MAX_PENDING_WILLS];
 #endif
 #else
-    BrokerClient* clients;
+    BrokerClient* clients;      /* in accept order */
+    BrokerClient* clients_tail;
+    BrokerClient* clients_reap; /* removed, freed at the end of the Step */
+    BrokerClient* ready;        /* clients the next Step services */
+    BrokerClient* ready_tail;
+    word32        ready_step;   /* counts Steps, see BrokerClient.ready_step */
     BrokerSub*    subs;
 #ifdef WOLFMQTT_BROKER_RETAINED
     BrokerRetainedMsg* retained;
     int                retained_count;
     int                retained_delivering; /* re-entrancy guard for delete */
+    BrokerRetainedTree retained_tree;
 #endif
 #ifdef WOLFMQTT_BROKER_WILL
     BrokerPendingWill* pending_wills;
@@ -813,17 +1764,98 @@ typedef struct MqttBroker {
      * branches on that to look up the orphan by client_id. */
     BrokerOrphanSession* orphan_sessions;
     int                  orphan_session_count;
-#endif
-    /* Rate-limits the orphan expiry sweep in MqttBroker_Step. */
-    WOLFMQTT_BROKER_TIME_T orphan_last_expire_check;
+    /* Backs the hot-path objects above; released last by MqttBroker_Free */
+    BrokerSlab           slab;
+#endif
+    /* Clients with queued output, flushed at the end of each Step */
+    BrokerClient*        wq_dirty;
+    /* Clients whose output the socket would not take (wq_blocked) */
+    BrokerClient*        wq_stalled;
+    /* Index over subs used by PUBLISH and Will fan-out */
+    BrokerSubTree        sub_tree;
+    /* Live clients and orphan sessions by client ID */
+    BrokerIdIndex        ids;
+    /* All broker deadlines, and the time sampled once per Step that they
+     * and every timestamp taken during the Step are measured against. */
+    BrokerTimerWheel       timers;
+    WOLFMQTT_BROKER_TIME_T now;
 #ifdef WOLFMQTT_STATIC_MEMORY
     BrokerStaticOrphanSession static_orphans[BROKER_MAX_STATIC_ORPHAN_SESSIONS];
 #endif
 #ifdef WOLFMQTT_BROKER_PERSIST
+    /* Longest time in milliseconds a batch of shadow writes may stay
+     * uncommitted, BROKER_PERSIST_COMMIT_MS by default. 0 commits every
+     * batch before the output of the Step that wrote it. */
+    word32 persist_commit_ms;
+    word32 persist_batch_since; /* ms clock at the batch's first write */
+    /* Batches are numbered as they open. The last one committed and the
+     * last one lost (a failed write or commit) decide which held acks are
+     * sent and which publishers are disconnected. */
+    word32 persist_batch_id;
+    word32 persist_committed_id;
+    word32 persist_failed_id;
     byte persist_restored;
+    byte persist_batching;      /* writes join a batch instead of syncing */
+    byte persist_batch_open;    /* a batch holds uncommitted writes */
+    byte persist_batch_failed;  /* a write to the open batch failed */
+    /* Hold QoS 1/2 acks until their batch commits, see
+     * BROKER_PERSIST_DURABLE_ACK */
+    byte persist_durable_ack;
+    /* Clients holding acks, the only ones visited after a commit */
+    BrokerClient* persist_held;
+    #ifndef WOLFMQTT_STATIC_MEMORY
+    /* Newest subscription snapshot generation handed out (BrokerSubsLog) */
+    word32 persist_subs_gen;
+    #endif
+    #ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+    /* Hand shadow writes to a worker thread from the next MqttBroker_Start,
+     * BROKER_PERSIST_WORKER by default. persist_worker is the running one;
+     * while it runs it publishes persist_committed_id / persist_failed_id
+     * and every hook is called on its thread. */
+    byte persist_use_worker;
+    struct BrokerPersistWorker* persist_worker;
+    #endif
+#endif
+#ifdef WOLFMQTT_BROKER_SHARDS
+    /* Shard this broker runs as, NULL outside a MqttBrokerShards group */
+    BrokerShard* shard;
+#endif
+    /* Readiness harvested by MqttBroker_Wait and consumed by the next
+     * Step, so a wakeup is not paid for twice. */
+    byte    poll_pending;
+    byte    poll_listen_ready;
+    byte    poll_listen_tls_ready;
+#ifdef WOLFMQTT_BROKER_POSIX_POLL
+    /* Readiness state owned by the default POSIX backend's poll_*
+     * callbacks (net.ctx is this broker). */
+#ifdef WOLFMQTT_BROKER_EPOLL
+    int     poll_fd;    /* epoll instance, -1 until the first poll_add */
+#else
+    int     poll_nfds;  /* one past the highest registered descriptor */
+    byte    poll_ev[FD_SETSIZE];      /* BROKER_NET_EV_* interest, 0 = free */
+    void*   poll_owner[FD_SETSIZE];
+#endif
+#ifdef WOLFMQTT_BROKER_IO_URING
+    void*   uring;      /* io_uring backend state, NULL until first use */
+#endif
 #endif
 } MqttBroker;
 
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* A group of event-loop shards. brokers[0] is the broker passed to
+ * MqttBrokerShards_Init; the others are allocated and configured like it. */
+typedef struct MqttBrokerShards {
+    int              count;
+    int              running;
+    MqttBroker**     brokers;
+    BrokerShard*     shards;
+    BrokerShardRing* rings;     /* rings[src * count + dst] */
+    void*            threads;   /* pthread_t per shard, [0] unused */
+    int              nthreads;  /* threads created by Start, to join */
+    byte             started;
+} MqttBrokerShards;
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* Public API                                                                  */
 /* -------------------------------------------------------------------------- */
@@ -837,6 +1869,11 @@ WOLFMQTT_API int MqttBroker_Run(MqttBroker* broker);
 /* Execute a single iteration of the broker loop (for embedded main loops) */
 WOLFMQTT_API int MqttBroker_Step(MqttBroker* broker);
 
+/* Block until a socket is ready or the nearest broker deadline (keep-alive,
+ * CONNECT timeout, Will Delay, session expiry) is due. Call when Step
+ * returns MQTT_CODE_CONTINUE. Sleeps briefly without a readiness backend. */
+WOLFMQTT_API int MqttBroker_Wait(MqttBroker* broker);
+
 /* Signal the broker loop to stop */
 WOLFMQTT_API int MqttBroker_Stop(MqttBroker* broker);
 
@@ -847,6 +1884,42 @@ WOLFMQTT_API int MqttBroker_Free(MqttBroker* broker);
  * For embedded systems that use a cooperative main loop with Step(). */
 WOLFMQTT_API int MqttBroker_Start(MqttBroker* broker);
 
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Fill stats with the occupancy of slab class cls (enum BrokerSlabClass) */
+WOLFMQTT_API int MqttBroker_SlabStats(MqttBroker* broker, int cls,
+    MqttBrokerSlabStats* stats);
+#endif
+
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+/* Fill stats with the persistence worker's queue counters. Zeroes when no
+ * worker is running. */
+WOLFMQTT_API int MqttBroker_PersistWorkerStats(MqttBroker* broker,
+    MqttBrokerPersistWorkerStats* stats);
+#endif
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Build a group of count shards from an initialized, configured but not
+ * started broker, which becomes shard 0. Port, log level and credentials are
+ * copied to the other shards. TLS, WebSocket and persistence hooks are not
+ * supported in sharded mode. */
+WOLFMQTT_API int MqttBrokerShards_Init(MqttBrokerShards* group,
+    MqttBroker* config, int count);
+
+/* Start every shard and a thread for each of shards 1..count-1. The caller
+ * drives shard 0 with MqttBroker_Step / MqttBroker_Wait. */
+WOLFMQTT_API int MqttBrokerShards_Start(MqttBrokerShards* group);
+
+/* Start the group and run shard 0 on the calling thread until stopped. */
+WOLFMQTT_API int MqttBrokerShards_Run(MqttBrokerShards* group);
+
+/* Signal every shard to stop. Safe to call from any thread. */
+WOLFMQTT_API int MqttBrokerShards_Stop(MqttBrokerShards* group);
+
+/* Join the shard threads and free shards 1..count-1. Shard 0 is released
+ * from the group and is freed by the caller with MqttBroker_Free. */
+WOLFMQTT_API int MqttBrokerShards_Free(MqttBrokerShards* group);
+#endif
+
 #ifdef WOLFMQTT_BROKER_AUTH
 /* Internal: copy a CLI -P password into broker-owned storage, clearing any
  * prior residue and wiping the source argv slot. Returns
@@ -869,6 +1942,15 @@ WOLFMQTT_API int MqttBrokerNet_wolfIP_Init(MqttBrokerNet* net,
 WOLFMQTT_API int MqttBrokerNet_Init(MqttBrokerNet* net);
 #endif
 
+#ifdef WOLFMQTT_BROKER_IO_URING
+/* io_uring backend initializer. Fills net like MqttBrokerNet_Init with the
+ * completion-based callbacks. Returns MQTT_CODE_ERROR_SYSTEM when the
+ * kernel lacks the io_uring features it needs (or io_uring is disabled), so
+ * the caller can fall back to MqttBrokerNet_Init. Not supported with
+ * MqttBrokerShards. */
+WOLFMQTT_API int MqttBrokerNet_IoUring_Init(MqttBrokerNet* net);
+#endif
+
 #ifdef WOLFMQTT_BROKER_PERSIST
 /* Install non-NULL persistence hooks after MqttBroker_Init and before the
  * first MqttBroker_Start, or after MqttBroker_Free. Passing NULL may detach
@@ -889,6 +1971,19 @@ WOLFMQTT_API int MqttBrokerNet_PersistPosix_Init(
 WOLFMQTT_API void MqttBrokerNet_PersistPosix_Free(
     MqttBrokerPersistHooks* hooks);
 
+/* Initialize the append-only log backend. Records are appended to
+ * segment files under dir (defaults to BROKER_PERSIST_DIR_DEFAULT when
+ * dir is NULL) and indexed in memory; the existing log is replayed here,
+ * so a bad directory fails this call rather than the first write. sync
+ * is the only fsync per commit. */
+WOLFMQTT_API int MqttBrokerNet_PersistWal_Init(
+    MqttBrokerPersistHooks* hooks, const char* dir);
+
+/* Tear down the log backend: syncs, closes the segments and frees the
+ * index. Does not delete persisted files. */
+WOLFMQTT_API void MqttBrokerNet_PersistWal_Free(
+    MqttBrokerPersistHooks* hooks);
+
 /* -------------------------------------------------------------------------- */
 /* Internal shadow-write helpers (linked from mqtt_broker.c into the
  * mqtt_broker binary). All are no-ops when broker->persist is NULL so
@@ -911,10 +2006,27 @@ WOLFMQTT_LOCAL int BrokerPersist_PutOrphanSession(MqttBroker* broker,
 WOLFMQTT_LOCAL int BrokerPersist_DelSession(MqttBroker* broker,
     const char* client_id);
 
+/* One filter of a SUBSCRIBE or UNSUBSCRIBE, for PutSubsDelta. filter
+ * points into the packet and is not NUL-terminated. */
+#define BROKER_SUB_DELTA_ADD     1  /* subscribe, or change the QoS */
+#define BROKER_SUB_DELTA_REMOVE  2
+typedef struct BrokerSubDelta {
+    const char* filter;
+    word16      filter_len;
+    byte        qos;
+    byte        op;     /* BROKER_SUB_DELTA_* */
+} BrokerSubDelta;
+
+/* PutSubs writes every subscription of bc's session; PutSubsDelta
+ * records only the given changes when the session has a subscription
+ * log, and falls back to PutSubs otherwise. */
 WOLFMQTT_LOCAL int BrokerPersist_PutSubs(MqttBroker* broker,
-    const char* client_id);
+    const BrokerClient* bc);
+WOLFMQTT_LOCAL int BrokerPersist_PutSubsDelta(MqttBroker* broker,
+    const BrokerClient* bc, const BrokerSubDelta* d, int count);
 WOLFMQTT_LOCAL int BrokerPersist_DelSubs(MqttBroker* broker,
     const char* client_id);
+WOLFMQTT_LOCAL void BrokerPersist_FreeSubsLogs(MqttBroker* broker);
 
 WOLFMQTT_LOCAL int BrokerPersist_PutRetained(MqttBroker* broker,
     const struct BrokerRetainedMsg* rm);
@@ -932,14 +2044,68 @@ WOLFMQTT_LOCAL int BrokerPersist_DelOutQueue(MqttBroker* broker,
  * in-memory tables before the first MqttBroker_Start accepts clients. Wipes
  * and re-stamps META when the persisted schema version does not match. */
 WOLFMQTT_LOCAL int BrokerPersist_Restore(MqttBroker* broker);
+/* Group commit (BROKER_PERSIST_COMMIT_MS). BatchCommit commits the open
+ * batch once it is due (BROKER_PERSIST_COMMIT_DUE) or right away
+ * (BROKER_PERSIST_COMMIT_NOW); BROKER_PERSIST_COMMIT_FINAL also stops
+ * grouping until the next MqttBroker_Start. BatchDueMs returns the
+ * milliseconds until the open batch is due, or -1 without one. */
+#define BROKER_PERSIST_COMMIT_DUE    0
+#define BROKER_PERSIST_COMMIT_NOW    1
+#define BROKER_PERSIST_COMMIT_FINAL  2
+WOLFMQTT_LOCAL int BrokerPersist_BatchCommit(MqttBroker* broker, int mode);
+WOLFMQTT_LOCAL int BrokerPersist_BatchDueMs(MqttBroker* broker);
 /* Discard state loaded by a failed startup restore. Defined in
  * mqtt_broker.c because it uses the broker's shared teardown helpers. */
 WOLFMQTT_LOCAL void BrokerPersist_RestoreRollback(MqttBroker* broker);
+/* Wait until every write made so far has reached the backend. A no-op
+ * without a persistence worker. */
+WOLFMQTT_LOCAL void BrokerPersist_Barrier(MqttBroker* broker);
+
+#ifdef WOLFMQTT_BROKER_PERSIST_WORKER
+/* Persistence worker (mqtt_broker_persist_worker.c). Entries are applied
+ * in the order they are pushed; each PUT / DEL / DELQ copies its key and
+ * blob, so the caller's buffers may be reused at once. COMMIT publishes
+ * its batch as persist_committed_id, COMMIT_LOST (a batch that already
+ * lost a write) or a failed commit as persist_failed_id. */
+#define BROKER_PERSIST_OP_BEGIN        1
+#define BROKER_PERSIST_OP_PUT          2
+#define BROKER_PERSIST_OP_DEL          3
+#define BROKER_PERSIST_OP_DELQ         4   /* key: client ID of an out queue */
+#define BROKER_PERSIST_OP_SYNC         5
+#define BROKER_PERSIST_OP_COMMIT       6
+#define BROKER_PERSIST_OP_COMMIT_LOST  7
+WOLFMQTT_LOCAL int BrokerPersistWorker_Start(MqttBroker* broker);
+WOLFMQTT_LOCAL int BrokerPersistWorker_Push(MqttBroker* broker, byte kind,
+    byte ns, const byte* key, word16 key_len, const byte* blob,
+    word32 blob_len, word32 batch);
+WOLFMQTT_LOCAL void BrokerPersistWorker_Barrier(MqttBroker* broker);
+/* Drain the queue, then stop and free the worker */
+WOLFMQTT_LOCAL void BrokerPersistWorker_Stop(MqttBroker* broker);
+/* Consume the wake pipe the worker writes after each commit */
+WOLFMQTT_LOCAL void BrokerPersistWorker_Awake(MqttBroker* broker);
+/* The backend side of PUT and DELQ, run on the worker thread */
+WOLFMQTT_LOCAL int BrokerPersist_ApplyPut(MqttBroker* broker, byte ns,
+    const byte* key, word16 key_len, const byte* blob, word32 blob_len);
+WOLFMQTT_LOCAL int BrokerPersist_ApplyDelQueue(MqttBroker* broker,
+    const byte* cid, word16 cid_len);
+#endif
 #endif /* WOLFMQTT_BROKER_PERSIST */
 
+/* Add a subscription to the topic tree once its filter is set. Used by
+ * SUBSCRIBE and by persist restore. */
+WOLFMQTT_LOCAL void BrokerSubTree_Insert(MqttBroker* broker, BrokerSub* sub);
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Add a subscription to a session's chain (BrokerSub.sess_head) */
+WOLFMQTT_LOCAL void BrokerSub_SessLink(BrokerSub** head, BrokerSub* sub);
+#endif
+
 #ifdef WOLFMQTT_STATIC_MEMORY
 WOLFMQTT_LOCAL void BrokerStaticOrphan_DropFull(MqttBroker* broker,
     BrokerStaticOrphanSession* orphan);
+/* (Re)arm the Session Expiry timer from orphan_since/session_expiry_sec.
+ * Called wherever those fields are stamped, including persist restore. */
+WOLFMQTT_LOCAL void BrokerStaticOrphan_ArmExpiry(MqttBroker* broker,
+    BrokerStaticOrphanSession* orphan);
 #else
 /* Full orphan teardown: delete persisted records (no-op without
  * WOLFMQTT_BROKER_PERSIST), drop any orphan-bound subs
@@ -948,6 +2114,83 @@ WOLFMQTT_LOCAL void BrokerStaticOrphan_DropFull(MqttBroker* broker,
  * and restore-time expiry sweep so the two paths can't drift. */
 WOLFMQTT_LOCAL void BrokerOrphan_DropFull(MqttBroker* broker,
     BrokerOrphanSession* o);
+/* (Re)arm the Session Expiry timer from orphan_since/session_expiry_sec.
+ * Called wherever those fields are stamped, including persist restore. */
+WOLFMQTT_LOCAL void BrokerOrphan_ArmExpiry(MqttBroker* broker,
+    BrokerOrphanSession* o);
+/* Slab block of class cls (BROKER_SLAB_SIZED to choose by size) holding
+ * size bytes. A NULL broker takes it from the backing allocator, for
+ * memory that outlives or leaves the broker's thread. Free with
+ * BrokerSlab_Free, never WOLFMQTT_FREE. */
+WOLFMQTT_LOCAL void* BrokerSlab_Alloc(MqttBroker* broker, int cls,
+    size_t size);
+WOLFMQTT_LOCAL void BrokerSlab_Free(void* p);
+/* New message holding copies of the topic_len bytes at topic and of the
+ * payload; the caller holds the only reference. */
+WOLFMQTT_LOCAL BrokerMsg* BrokerMsg_New(MqttBroker* broker,
+    const char* topic, word32 topic_len, const byte* payload,
+    word32 payload_len);
+WOLFMQTT_LOCAL void BrokerMsg_Release(BrokerMsg* msg);
+/* Copy e into q at ring position head + n (n <= tail - head, holes
+ * included), taking a reference to its message, and index the packet
+ * identifier it already carries in *ids, which is allocated on first use;
+ * a zero identifier is replaced by the session's next free one. When q is
+ * full and making room packs out its holes, the position is recomputed so
+ * e still lands after the same live entries. On success *out, when given,
+ * is the new entry. Fails, leaving q unchanged, when the identifier's
+ * slot is taken (or no slot is free) or memory runs out. */
+WOLFMQTT_LOCAL int BrokerOutQ_Insert(MqttBroker* broker, BrokerOutQ* q,
+    BrokerPacketIds** ids, const BrokerOutPub* e, word32 n,
+    BrokerOutPub** out);
+#endif
+/* Client ID index (see BrokerIdIndex). Add fails only when a dynamic table
+ * cannot grow; Find returns the first object of kind whose ID is the len
+ * bytes at id, skipping exclude. */
+WOLFMQTT_LOCAL int BrokerIdIndex_Add(MqttBroker* broker, byte kind,
+    void* obj);
+WOLFMQTT_LOCAL void BrokerIdIndex_Del(MqttBroker* broker, byte kind,
+    void* obj);
+WOLFMQTT_LOCAL void* BrokerIdIndex_Find(MqttBroker* broker, byte kind,
+    const char* id, word32 len, const void* exclude);
+#ifdef WOLFMQTT_BROKER_RETAINED
+/* (Re)arm the Message Expiry timer from store_time/expiry_sec; cancels it
+ * when expiry_sec is 0. */
+WOLFMQTT_LOCAL void BrokerRetained_ArmExpiry(MqttBroker* broker,
+    BrokerRetainedMsg* rm);
+#ifndef WOLFMQTT_STATIC_MEMORY
+/* Add a new message to broker->retained and the topic tree. Fails, leaving
+ * rm to the caller, when no tree node can be allocated. */
+WOLFMQTT_LOCAL int BrokerRetained_Link(MqttBroker* broker,
+    BrokerRetainedMsg* rm);
+#endif
+#endif
+
+#ifdef WOLFMQTT_BROKER_SHARDS
+/* Shard plumbing in mqtt_broker_shard.c. Send and Broadcast take a
+ * reference per delivery; Send blocks while the ring is full. */
+WOLFMQTT_LOCAL int BrokerShard_Owner(const BrokerShard* shard,
+    const char* key, word32 len);
+WOLFMQTT_LOCAL int BrokerShard_Send(BrokerShard* shard, int dst,
+    BrokerShardMsg* msg, byte flags);
+WOLFMQTT_LOCAL int BrokerShard_Broadcast(BrokerShard* shard,
+    BrokerShardMsg* msg, byte flags);
+WOLFMQTT_LOCAL int BrokerShard_Recv(BrokerShard* shard,
+    BrokerShardMsg** msg, byte* flags);
+/* Returns 1 when the shard may block: nothing is queued for it and a
+ * producer will write the wake pipe. Pair with BrokerShard_Awake. */
+WOLFMQTT_LOCAL int BrokerShard_Sleep(BrokerShard* shard);
+WOLFMQTT_LOCAL void BrokerShard_Awake(BrokerShard* shard);
+/* Message lifetime and application, in mqtt_broker.c */
+WOLFMQTT_LOCAL void BrokerShardMsg_Release(BrokerShardMsg* msg);
+WOLFMQTT_LOCAL int BrokerShard_Drain(MqttBroker* broker);
+#endif
+
+#ifdef WOLFMQTT_BROKER_IO_URING
+/* Sockets backend listen, shared with mqtt_broker_uring.c */
+WOLFMQTT_LOCAL int BrokerPosix_Listen(void* ctx, BROKER_SOCKET_T* sock,
+    word16 port, int backlog);
+/* Returns 1 when net holds the io_uring backend's callbacks */
+WOLFMQTT_LOCAL int BrokerUring_IsNet(const MqttBrokerNet* net);
 #endif
 
 /* CLI wrapper interface */
@@ -294,6 +294,13 @@ typedef struct _MqttClient {
     /* Max Topic Alias value; absent CONNACK means 0 [3.1.2.11.8]. */
     word16 topic_alias_max;
 #endif
+
+    /* Optional read-ahead (see MqttClient_SetReadAhead) - protected by
+     * read lock. Kept last so earlier fields keep their offsets. */
+    byte        *rd_buf;
+    int          rd_buf_len;
+    int          rd_pos;    /* next unconsumed byte in rd_buf */
+    int          rd_len;    /* bytes held in rd_buf */
 } MqttClient;
 
 #ifdef WOLFMQTT_SN
@@ -360,6 +367,37 @@ WOLFMQTT_API int MqttClient_SetPropertyCallback(
     void* ctx);
 #endif
 
+/*! \brief      Sets a read-ahead buffer. Each network read then asks for
+                up to buf_len bytes and later packets are framed from what
+                is left over, so a peer that sends several small packets
+                back to back costs one MqttNet.read instead of three or more
+                per packet. The MqttNet.read callback must return as soon
+                as any data is available, as it already must for TLS and
+                non-blocking use; a callback that waits to fill the whole
+                request blocks until its timeout. Not for MQTT-SN.
+ *  \note An application that waits on the socket itself before calling
+          MqttClient_WaitMessage must check MqttClient_ReadPending first:
+          bytes already in the read-ahead buffer do not make the socket
+          readable.
+ *  \param      client      Pointer to MqttClient structure
+ *  \param      buf         Read-ahead buffer, or NULL to disable
+ *  \param      buf_len     Length of buf
+ *  \return     MQTT_CODE_SUCCESS or MQTT_CODE_ERROR_BAD_ARG
+                (see enum MqttPacketResponseCodes)
+ */
+WOLFMQTT_API int MqttClient_SetReadAhead(
+    MqttClient *client,
+    byte *buf,
+    int buf_len);
+
+/*! \brief      Returns the number of received bytes held in the read-ahead
+                buffer and not yet consumed
+ *  \param      client      Pointer to MqttClient structure
+ *  \return     Byte count, 0 when none or read-ahead is not set
+ */
+WOLFMQTT_API int MqttClient_ReadPending(
+    MqttClient *client);
+
 /*! \brief      Encodes and sends the MQTT Connect packet and waits for the
                 Connect Acknowledgment packet
  *  \note This is a blocking function that will wait for MqttNet.read